@@ -3,7 +3,10 @@
 #include <sys/time.h>
 #include <string.h>
 #include "ioutil.h"
+#include "perf_counters.h"
+#include "memory_usage.h"
 #include "ann_benchmark.h"
+#include "a2a_eval.h"
 
 
 // Function to set terminal color
@@ -24,8 +27,22 @@ int ann_benchmark(const char *filename, int *nthreads, int *num_clusters,
     struct timeval tstart, tend;
     int aa, bb, cc, dd;
 
+    a2a_stats_t stats;
+    a2a_ann_options_t options;
+    a2a_ann_options_init(&options);
+    options.stats = &stats;
+
+    a2a_eval_options_t eval;
+    a2a_eval_result_t accuracy;
+    a2a_eval_options_init(&eval);
+    eval.par_type = parallelization_mode;
+
     float execution_time[THREAD_CASES][CLUSTER_CASES];
     float recall[THREAD_CASES][CLUSTER_CASES];
+    float distance_ratio[THREAD_CASES][CLUSTER_CASES];
+    float peak_rss_mb[THREAD_CASES][CLUSTER_CASES];
+    float peak_memory_mb[THREAD_CASES][CLUSTER_CASES];
+    float budget_usage[THREAD_CASES][CLUSTER_CASES];
     float queries_per_sec[THREAD_CASES][CLUSTER_CASES];
 
     train = (float *)load_hdf5(filename, "/train", &aa, &bb); if (!train) goto cleanup;
@@ -53,6 +70,11 @@ int ann_benchmark(const char *filename, int *nthreads, int *num_clusters,
     }
     const int K = bb;
 
+    // The distance ratio compares the distances to the neighbors found and to the exact ones
+    eval.Q = eval.C = train_test;
+    eval.N = N;
+    eval.L = L;
+
     // memory allocation for the estimated distance matrix
     my_all_to_all_distances = (float *)malloc(N * K * sizeof(float)); if (!my_all_to_all_distances) goto cleanup;
 
@@ -76,29 +98,24 @@ int ann_benchmark(const char *filename, int *nthreads, int *num_clusters,
             printf("\nRunning ANN benchmark for %d threads and %d clusters...\n", nthreads[t], num_clusters[c]);
             setColor(DEFAULT);
             
+            peak_rss_reset();
             gettimeofday(&tstart, NULL);
-            if (a2a_annsearch(train_test, N, L, K, num_clusters[c], my_all_to_all_neighbors, 
-                my_all_to_all_distances, nthreads[t], MAX_MEMORY_USAGE_RATIO, parallelization_mode)) goto cleanup;
+            if (a2a_annsearch_ex(train_test, N, L, K, num_clusters[c], my_all_to_all_neighbors, 
+                my_all_to_all_distances, nthreads[t], MAX_MEMORY_USAGE_RATIO, parallelization_mode, &options)) goto cleanup;
             gettimeofday(&tend, NULL);
             long execution_time_usec = (tend.tv_sec - tstart.tv_sec) * 1000000L + (tend.tv_usec - tstart.tv_usec);
             execution_time[t][c] = execution_time_usec / 1e6f;  // Convert to seconds
             queries_per_sec[t][c] = ((float) N) / execution_time[t][c];
 
-            int found = 0;
-
-            for (int i = 0; i < N; i++) {
-                for (int j = 0; j < K; j++) {
-                    const int index = all_to_all_neighbors[i * K + j];
-                    for (int k = 0; k < K; k++) {
-                        if (index == my_all_to_all_neighbors[i * K + k]) {
-                            found++;
-                            break;
-                        }
-                    }
-                }
-            }
+            // Peak memory of the process and of the library, and the share of the budget used
+            peak_rss_mb[t][c] = peak_rss_bytes() / 1048576.0f;
+            peak_memory_mb[t][c] = stats.peak_bytes / 1048576.0f;
+            budget_usage[t][c] = (float)stats.budget_usage;
 
-            recall[t][c] = ((float) found) / (N * K) * 100.0;
+            eval.nthreads = nthreads[t];
+            if (a2a_eval_recall(my_all_to_all_neighbors, K, all_to_all_neighbors, K, N, &eval, &accuracy)) goto cleanup;
+            recall[t][c] = accuracy.recall * 100.0;
+            distance_ratio[t][c] = accuracy.distance_ratio;
 
             printf("\n\n===================\n");
             printf("ANN Benchmark\n");
@@ -107,8 +124,12 @@ int ann_benchmark(const char *filename, int *nthreads, int *num_clusters,
             printf("Number of threads: %d\n", nthreads[t]);
             printf("Number of clusters: %d\n", num_clusters[c]);
             printf("Execution time: %f sec\n", execution_time[t][c]);
-            printf("Recall: %.4f%%\n", recall[t][c]);
+            printf("Recall: %.4f%% (10th percentile %.1f%%, median %.1f%%, minimum %.1f%%)\n", recall[t][c],
+                   accuracy.p10_recall * 100.0, accuracy.median_recall * 100.0, accuracy.min_recall * 100.0);
+            printf("Distance ratio: %.4f (%ld incomplete queries left out)\n", distance_ratio[t][c], accuracy.incomplete);
             printf("Queries per sec: %.4f\n", queries_per_sec[t][c]);
+            printf("Peak RSS: %.1f MB, library peak: %.1f MB (%.1f%% of the memory budget)\n", peak_rss_mb[t][c],
+                   peak_memory_mb[t][c], budget_usage[t][c] * 100.0f);
 
             if (store_hdf5(queries_per_sec, "queries_per_sec", t + 1, c + 1, output_file, FLOAT_TYPE, 'a')) {
                 fprintf(stderr, "Error storing queries_per_sec data.\n");
@@ -118,6 +139,19 @@ int ann_benchmark(const char *filename, int *nthreads, int *num_clusters,
                 fprintf(stderr, "Error storing recall data.\n");
                 goto cleanup;
             }
+            if (store_hdf5(distance_ratio, "distance_ratio", t + 1, c + 1, output_file, FLOAT_TYPE, 'a')) {
+                fprintf(stderr, "Error storing distance_ratio data.\n");
+                goto cleanup;
+            }
+            if (store_hdf5(peak_rss_mb, "peak_rss_mb", t + 1, c + 1, output_file, FLOAT_TYPE, 'a') ||
+                store_hdf5(peak_memory_mb, "peak_memory_mb", t + 1, c + 1, output_file, FLOAT_TYPE, 'a') ||
+                store_hdf5(budget_usage, "budget_usage", t + 1, c + 1, output_file, FLOAT_TYPE, 'a')) {
+                fprintf(stderr, "Error storing memory data.\n");
+                goto cleanup;
+            }
+            if (perf_counters_enabled() && perf_counters_store(t * CLUSTER_CASES + c, "", output_file)) {
+                goto cleanup;
+            }
         }
     }
 
@@ -148,8 +182,23 @@ int ann_recall_vs_throughput(const char *filename, int nthreads, int *num_cluste
     struct timeval tstart, tend;
     int aa, bb, cc, dd;
 
+    a2a_stats_t stats;
+    a2a_ann_options_t options;
+    a2a_ann_options_init(&options);
+    options.stats = &stats;
+
+    a2a_eval_options_t eval;
+    a2a_eval_result_t accuracy;
+    a2a_eval_options_init(&eval);
+    eval.nthreads = nthreads;
+    eval.par_type = parallelization_mode;
+
     float execution_time[CLUSTER_CASES];
     float recall[CLUSTER_CASES];
+    float distance_ratio[CLUSTER_CASES];
+    float peak_rss_mb[CLUSTER_CASES];
+    float peak_memory_mb[CLUSTER_CASES];
+    float budget_usage[CLUSTER_CASES];
     float queries_per_sec[CLUSTER_CASES];
 
     train = (float *)load_hdf5(filename, "/train", &aa, &bb); if (!train) goto cleanup;
@@ -177,6 +226,11 @@ int ann_recall_vs_throughput(const char *filename, int nthreads, int *num_cluste
     }
     const int K = bb;
 
+    // The distance ratio compares the distances to the neighbors found and to the exact ones
+    eval.Q = eval.C = train_test;
+    eval.N = N;
+    eval.L = L;
+
     // memory allocation for the estimated distance matrix
     my_all_to_all_distances = (float *)malloc(N * K * sizeof(float)); if (!my_all_to_all_distances) goto cleanup;
 
@@ -198,46 +252,48 @@ int ann_recall_vs_throughput(const char *filename, int nthreads, int *num_cluste
             break;
     }
 
-    char qps_name[64], recall_name[64];
+    char qps_name[64], recall_name[64], ratio_name[64], rss_name[64], memory_name[64], budget_name[64];
     snprintf(qps_name, sizeof(qps_name), "queries_per_sec_%s", suffix);
     snprintf(recall_name, sizeof(recall_name), "recall_%s", suffix);
+    snprintf(ratio_name, sizeof(ratio_name), "distance_ratio_%s", suffix);
+    snprintf(rss_name, sizeof(rss_name), "peak_rss_mb_%s", suffix);
+    snprintf(memory_name, sizeof(memory_name), "peak_memory_mb_%s", suffix);
+    snprintf(budget_name, sizeof(budget_name), "budget_usage_%s", suffix);
 
     for (int c = 0; c < CLUSTER_CASES; c++) {
         setColor(BOLD_BLUE);
         printf("\nRunning recall vs throughput  benchmark for %d clusters (parallelization mode: %s) ...\n", num_clusters[c], suffix);
         setColor(DEFAULT);
         
+        peak_rss_reset();
         gettimeofday(&tstart, NULL);
-        if (a2a_annsearch(train_test, N, L, K, num_clusters[c], my_all_to_all_neighbors, 
-            my_all_to_all_distances, nthreads, MAX_MEMORY_USAGE_RATIO, parallelization_mode)) goto cleanup;
+        if (a2a_annsearch_ex(train_test, N, L, K, num_clusters[c], my_all_to_all_neighbors, 
+            my_all_to_all_distances, nthreads, MAX_MEMORY_USAGE_RATIO, parallelization_mode, &options)) goto cleanup;
         gettimeofday(&tend, NULL);
         long execution_time_usec = (tend.tv_sec - tstart.tv_sec) * 1000000L + (tend.tv_usec - tstart.tv_usec);
         execution_time[c] = execution_time_usec / 1e6f;  // Convert to seconds
         queries_per_sec[c] = ((float) N) / execution_time[c];
 
-        int found = 0;
-
-        for (int i = 0; i < N; i++) {
-            for (int j = 0; j < K; j++) {
-                const int index = all_to_all_neighbors[i * K + j];
-                for (int k = 0; k < K; k++) {
-                    if (index == my_all_to_all_neighbors[i * K + k]) {
-                        found++;
-                        break;
-                    }
-                }
-            }
-        }
+        // Peak memory of the process and of the library, and the share of the budget used
+        peak_rss_mb[c] = peak_rss_bytes() / 1048576.0f;
+        peak_memory_mb[c] = stats.peak_bytes / 1048576.0f;
+        budget_usage[c] = (float)stats.budget_usage;
 
-        recall[c] = ((float) found) / (N * K) * 100.0;
+        if (a2a_eval_recall(my_all_to_all_neighbors, K, all_to_all_neighbors, K, N, &eval, &accuracy)) goto cleanup;
+        recall[c] = accuracy.recall * 100.0;
+        distance_ratio[c] = accuracy.distance_ratio;
 
         printf("\n\n===================\n");
         printf("ANN Benchmark\n");
         printf("Number of threads: %d\n", nthreads);
         printf("Number of clusters: %d\n", num_clusters[c]);
         printf("Execution time: %f sec\n", execution_time[c]);
-        printf("Recall: %.4f%%\n", recall[c]);
+        printf("Recall: %.4f%% (10th percentile %.1f%%, median %.1f%%, minimum %.1f%%)\n", recall[c],
+               accuracy.p10_recall * 100.0, accuracy.median_recall * 100.0, accuracy.min_recall * 100.0);
+        printf("Distance ratio: %.4f (%ld incomplete queries left out)\n", distance_ratio[c], accuracy.incomplete);
         printf("Queries per sec: %.4f\n", queries_per_sec[c]);
+        printf("Peak RSS: %.1f MB, library peak: %.1f MB (%.1f%% of the memory budget)\n", peak_rss_mb[c],
+               peak_memory_mb[c], budget_usage[c] * 100.0f);
 
         // Save data on every iteration
         if (store_hdf5(queries_per_sec, qps_name, 1, c + 1, output_file, FLOAT_TYPE, 'a')) {
@@ -248,6 +304,17 @@ int ann_recall_vs_throughput(const char *filename, int nthreads, int *num_cluste
             fprintf(stderr, "Error storing recall data.\n");
             goto cleanup;
         }
+        if (store_hdf5(distance_ratio, ratio_name, 1, c + 1, output_file, FLOAT_TYPE, 'a')) {
+            fprintf(stderr, "Error storing distance_ratio data.\n");
+            goto cleanup;
+        }
+        if (store_hdf5(peak_rss_mb, rss_name, 1, c + 1, output_file, FLOAT_TYPE, 'a') ||
+            store_hdf5(peak_memory_mb, memory_name, 1, c + 1, output_file, FLOAT_TYPE, 'a') ||
+            store_hdf5(budget_usage, budget_name, 1, c + 1, output_file, FLOAT_TYPE, 'a')) {
+            fprintf(stderr, "Error storing memory data.\n");
+            goto cleanup;
+        }
+        if (perf_counters_enabled() && perf_counters_store(c, suffix, output_file)) goto cleanup;
     }
 
     status = EXIT_SUCCESS;
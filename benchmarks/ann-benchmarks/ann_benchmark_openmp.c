@@ -1,14 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "perf_counters.h"
 #include "ann_benchmark.h"
 
 
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <dataset> <benchmark_output>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <dataset> <benchmark_output> [--perf]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
+    // Hardware counters per phase, the benchmark runs without them if they are unavailable
+    if (argc > 3 && strcmp(argv[3], "--perf") == 0) perf_counters_start();
+
     int ann_nthreads[THREAD_CASES] = {1, 2, 4, 8, 16};
     int num_clusters[CLUSTER_CASES] = {5, 10, 20, 50, 100};
     parallelization_type_t parallelization_mode = PAR_PTHREADS;
@@ -31,5 +36,6 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    perf_counters_stop();
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "ioutil.h"
+#include "a2a_knn.h"
+
+
+#define DEFAULT_BLOCK_ROWS 16384       // Points whose neighbors are searched and written at a time
+#define CHUNK_ROWS 1000                // Rows of each chunk of the output dataset
+#define GROUND_TRUTH_MEMORY_RATIO 0.5  // Share of the available memory used by the distance blocks
+
+
+/**
+ * Computes the exact all-to-all neighbors of the concatenation of /train and /test, excluding
+ * each point itself, with K the number of columns of /neighbors, and writes them block by
+ * block to /all_to_all_neighbors in the same file. Replaces compute_all_to_all_knn.py.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <hdf5_file> [nthreads] [block_rows]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *filename = argv[1];
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    const int nthreads = argc > 2 ? atoi(argv[2]) : (online > 0 ? (int)online : 1);
+    const int block_rows = argc > 3 ? atoi(argv[3]) : DEFAULT_BLOCK_ROWS;
+    if (nthreads < 1 || block_rows < 1) {
+        fprintf(stderr, "Invalid number of threads (%d) or block rows (%d).\n", nthreads, block_rows);
+        return EXIT_FAILURE;
+    }
+
+    if (exists_hdf5(filename, "/all_to_all_neighbors")) {
+        printf("Dataset \"all_to_all_neighbors\" already exists. Exiting.\n");
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_FAILURE;
+    float *train = NULL, *test = NULL, *train_test = NULL, *distances = NULL;
+    int *neighbors = NULL, *indices = NULL, *block = NULL;
+    int N_train, N_test, L, L_test, M, K;
+    struct timeval tstart, tend;
+
+    train = (float *)load_hdf5(filename, "/train", &N_train, &L); if (!train) goto cleanup;
+    test = (float *)load_hdf5(filename, "/test", &N_test, &L_test); if (!test) goto cleanup;
+    neighbors = (int *)load_hdf5(filename, "/neighbors", &M, &K); if (!neighbors) goto cleanup;
+    if (L != L_test) {
+        fprintf(stderr, "Error: The number of columns in train (%d) and test (%d) matrices do not match.\n", L, L_test);
+        goto cleanup;
+    }
+
+    const int N = N_train + N_test;
+    if (K >= N) {
+        fprintf(stderr, "Error: K (%d) must be smaller than the number of points (%d).\n", K, N);
+        goto cleanup;
+    }
+
+    // Concatenate train and test
+    train_test = (float *)malloc((size_t)N * L * sizeof(float)); if (!train_test) goto cleanup;
+    memcpy(train_test, train, (size_t)N_train * L * sizeof(float));
+    memcpy(train_test + (size_t)N_train * L, test, (size_t)N_test * L * sizeof(float));
+    free(train);
+    free(test);
+    train = test = NULL;
+
+    // K + 1 neighbors per point, one of which is the point itself
+    const int rows = block_rows < N ? block_rows : N;
+    indices = (int *)malloc((size_t)rows * (K + 1) * sizeof(int)); if (!indices) goto cleanup;
+    distances = (float *)malloc((size_t)rows * (K + 1) * sizeof(float)); if (!distances) goto cleanup;
+    block = (int *)malloc((size_t)rows * K * sizeof(int)); if (!block) goto cleanup;
+
+    printf("Creating dataset \"all_to_all_neighbors\" (%d x %d) in %s with %d threads\n", N, K, filename, nthreads);
+    if (create_hdf5("/all_to_all_neighbors", N, K, CHUNK_ROWS, filename, INT_TYPE)) goto cleanup;
+
+    gettimeofday(&tstart, NULL);
+    for (int begin = 0; begin < N; begin += rows) {
+        const int count = begin + rows <= N ? rows : N - begin;
+        if (a2a_knnsearch(train_test + (size_t)begin * L, train_test, indices, distances, count, N, L, K + 1, 1,
+            nthreads, 1, GROUND_TRUTH_MEMORY_RATIO, PAR_PTHREADS)) goto cleanup;
+
+        // Drop the point itself, or the farthest neighbor if duplicates pushed the point out
+        for (int i = 0; i < count; i++) {
+            int k = 0;
+            for (int j = 0; j <= K && k < K; j++) {
+                const int index = indices[(size_t)i * (K + 1) + j];
+                if (index != begin + i) block[(size_t)i * K + k++] = index;
+            }
+        }
+
+        if (write_hdf5_rows(block, "/all_to_all_neighbors", begin, count, K, filename, INT_TYPE)) goto cleanup;
+        printf("Processed %d/%d points\n", begin + count, N);
+    }
+    gettimeofday(&tend, NULL);
+
+    printf("Done in %.2f s\n", (tend.tv_sec - tstart.tv_sec) + (tend.tv_usec - tstart.tv_usec) / 1e6);
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(train);
+    free(test);
+    free(train_test);
+    free(neighbors);
+    free(indices);
+    free(distances);
+    free(block);
+    return status;
+}
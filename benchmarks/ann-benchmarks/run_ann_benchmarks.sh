@@ -12,6 +12,8 @@ DATASET_PATH="$1"
 SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
 BENCHMARK_OUTPUT="$SCRIPT_DIR/ann_benchmark_output.hdf5"
 
+GROUND_TRUTH="$SCRIPT_DIR/../../build_openmp/compute_all_to_all_knn"
+
 declare -A EXECUTABLES=(
     [OpenMP]="$SCRIPT_DIR/../../build_openmp/ann_benchmark_openmp"
     [OpenCilk]="$SCRIPT_DIR/../../build_opencilk/ann_benchmark_opencilk"
@@ -32,8 +34,12 @@ for NAME in "${!EXECUTABLES[@]}"; do
     fi
 done
 
-# Step 1: Compute ground truth
-python3 compute_all_to_all_knn.py "$DATASET_PATH"
+# Step 1: Compute ground truth, with the Python script if the native tool is not built
+if [ -f "$GROUND_TRUTH" ]; then
+    "$GROUND_TRUTH" "$DATASET_PATH"
+else
+    python3 "$SCRIPT_DIR/compute_all_to_all_knn.py" "$DATASET_PATH"
+fi
 
 # Step 2: Run benchmarks
 for NAME in "${!EXECUTABLES[@]}"; do
@@ -3,6 +3,8 @@
 #include <sys/time.h>
 #include <string.h>
 #include "ioutil.h"
+#include "perf_counters.h"
+#include "memory_usage.h"
 #include "a2a_knn.h"
 #include "knn_benchmark.h"
 
@@ -25,9 +27,13 @@ int knn_benchmark(const char *filename, int *nthreads, int *cblas_threads, const
     struct timeval tstart, tend;
     int aa, bb;
 
+    a2a_stats_t stats;
     float execution_time[THREAD_CASES];
     float recall[THREAD_CASES];
     float queries_per_sec[THREAD_CASES];
+    float peak_rss_mb[THREAD_CASES];
+    float peak_memory_mb[THREAD_CASES];
+    float budget_usage[THREAD_CASES];
 
     // load corpus matrix from file
     train = (float *)load_hdf5(filename, "/train", &N, &aa); if (!train) goto cleanup;
@@ -68,25 +74,41 @@ int knn_benchmark(const char *filename, int *nthreads, int *cblas_threads, const
             break;
     }
 
-    char qps_name[64], recall_name[64];
+    char qps_name[64], recall_name[64], rss_name[64], memory_name[64], budget_name[64];
 
     snprintf(qps_name, sizeof(qps_name), "queries_per_sec_%s", suffix);
     snprintf(recall_name, sizeof(recall_name), "recall_%s", suffix);
+    snprintf(rss_name, sizeof(rss_name), "peak_rss_mb_%s", suffix);
+    snprintf(memory_name, sizeof(memory_name), "peak_memory_mb_%s", suffix);
+    snprintf(budget_name, sizeof(budget_name), "budget_usage_%s", suffix);
 
 
     for (int t = 0; t < THREAD_CASES; t++) {
         setColor(BOLD_BLUE);
         printf("\nRunning KNN benchmark with %d threads (parallelization mode: %s) ...\n", nthreads[t], suffix);
         setColor(DEFAULT);
+
+        // The threads of OpenBLAS predate the counters, so the GEMMs run on the calling thread
+        int blas_threads = cblas_threads[t];
+        if (perf_counters_enabled() && blas_threads > 1) {
+            printf("Using 1 BLAS thread instead of %d to count the GEMMs\n", blas_threads);
+            blas_threads = 1;
+        }
         
+        peak_rss_reset();
         gettimeofday(&tstart, NULL);
-        if (a2a_knnsearch(test, train, my_neighbors, my_distances, M, N, L, K, 0, nthreads[t], cblas_threads[t],
-            MAX_MEMORY_USAGE_RATIO, parallelization_mode)) goto cleanup;
+        if (a2a_knnsearch_ex(test, train, my_neighbors, my_distances, M, N, L, K, 0, nthreads[t], blas_threads,
+            MAX_MEMORY_USAGE_RATIO, parallelization_mode, &stats)) goto cleanup;
         gettimeofday(&tend, NULL);
         long execution_time_usec = (tend.tv_sec - tstart.tv_sec) * 1000000L + (tend.tv_usec - tstart.tv_usec);
         execution_time[t] = execution_time_usec / 1e6f;  // Convert to seconds
         queries_per_sec[t] = ((float) M) / execution_time[t];
 
+        // Peak memory of the process and of the library, and the share of the budget used
+        peak_rss_mb[t] = peak_rss_bytes() / 1048576.0f;
+        peak_memory_mb[t] = stats.peak_bytes / 1048576.0f;
+        budget_usage[t] = (float)stats.budget_usage;
+
         int found = 0;
 
         for (int i = 0; i < M; i++) {
@@ -116,6 +138,13 @@ int knn_benchmark(const char *filename, int *nthreads, int *cblas_threads, const
             fprintf(stderr, "Error storing recall data.\n");
             goto cleanup;
         }
+        if (store_hdf5(peak_rss_mb, rss_name, 1, t + 1, output_file, FLOAT_TYPE, 'a') ||
+            store_hdf5(peak_memory_mb, memory_name, 1, t + 1, output_file, FLOAT_TYPE, 'a') ||
+            store_hdf5(budget_usage, budget_name, 1, t + 1, output_file, FLOAT_TYPE, 'a')) {
+            fprintf(stderr, "Error storing memory data.\n");
+            goto cleanup;
+        }
+        if (perf_counters_enabled() && perf_counters_store(t, suffix, output_file)) goto cleanup;
 
         printf("\n\n===================\n");
         printf("KNN Benchmark\n");
@@ -124,6 +153,8 @@ int knn_benchmark(const char *filename, int *nthreads, int *cblas_threads, const
         printf("Execution time: %f sec\n", execution_time[t]);
         printf("Recall: %.4f%%\n", recall[t]);
         printf("Queries per sec: %.4f\n", queries_per_sec[t]);
+        printf("Peak RSS: %.1f MB, library peak: %.1f MB (%.1f%% of the memory budget)\n", peak_rss_mb[t],
+               peak_memory_mb[t], budget_usage[t] * 100.0f);
 
     }
 
@@ -1,15 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "perf_counters.h"
 #include "knn_benchmark.h"
 
 
 int main(int argc, char *argv[])
 {
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <dataset> <benchmark_output>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <dataset> <benchmark_output> [--perf]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
+    // Hardware counters per phase, the benchmark runs without them if they are unavailable
+    if (argc > 3 && strcmp(argv[3], "--perf") == 0) perf_counters_start();
+
     int nthreads[THREAD_CASES] = {1, 1, 2, 4, 8, 16, 32};
     int cblas_threads[THREAD_CASES] = {4, 1, 1, 1, 1, 1, 1};
 
@@ -19,5 +24,6 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    perf_counters_stop();
     return EXIT_SUCCESS;
 }
\ No newline at end of file
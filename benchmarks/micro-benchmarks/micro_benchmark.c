@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "a2a_config.h"
+#include "a2a_queue.h"
+#include "a2a_kernels.h"
+#include "a2a_distance.h"
+
+
+#define DEFAULT_WARMUP 3          // Untimed runs of each case
+#define DEFAULT_REPETITIONS 25    // Timed runs of each case
+#define QUEUE_ELEMENT_BYTES 96    // About the size of a task of the kNN pool
+#define SELECT_K 10               // Neighbors selected per row, as in the searches
+
+
+typedef enum {
+    KERNEL_QSELECT,
+    KERNEL_QSORT,
+    KERNEL_NORM_ADD,
+    KERNEL_GEMM,
+    KERNEL_QUEUE,
+    KERNEL_GATHER,
+    KERNEL_DISTANCE_SQUARED,
+    KERNEL_SQUARED_DISTANCE
+} KERNEL;
+
+
+// A kernel at one problem size
+typedef struct {
+    KERNEL kernel;
+    int rows;                     // Rows processed per run (queries, gathered rows, ...)
+    int N;                        // Columns of each row, or points compared with
+    int L;                        // Dimension of the points
+} BenchCase;
+
+
+// Inputs of a case, allocated once and reset before every run when the kernel modifies them
+typedef struct {
+    DTYPE *values;
+    DTYPE *source;
+    int *idx;
+    DTYPE *A;
+    DTYPE *B;
+    DTYPE *sqrmag_Q;
+    DTYPE *sqrmag_C;
+    int *indices;
+    unsigned char *element;
+    a2a_Queue queue;
+} BenchData;
+
+
+static const char *kernel_names[] = {
+    "qselect", "qsort", "norm_add", "gemm", "queue", "gather", "distance_squared", "a2a_squared_distance"
+};
+
+static const char *kernel_units[] = {
+    "Melem/s", "Melem/s", "Melem/s", "GFLOP/s", "Mops/s", "GB/s", "Melem/s", "Melem/s"
+};
+
+static const BenchCase cases[] = {
+    { KERNEL_QSELECT, 1024, 1024, 0 },
+    { KERNEL_QSELECT, 64, 16384, 0 },
+    { KERNEL_QSELECT, 8, 131072, 0 },
+    { KERNEL_QSORT, 16384, SELECT_K, 0 },
+    { KERNEL_QSORT, 4096, 100, 0 },
+    { KERNEL_NORM_ADD, 64, 16384, 0 },
+    { KERNEL_NORM_ADD, 256, 4096, 0 },
+    { KERNEL_GEMM, 16, 65536, 32 },
+    { KERNEL_GEMM, 64, 16384, 128 },
+    { KERNEL_GEMM, 256, 4096, 784 },
+    { KERNEL_GEMM, 1024, 1024, 64 },
+    { KERNEL_QUEUE, 65536, 0, 0 },
+    { KERNEL_GATHER, 4096, 0, 32 },
+    { KERNEL_GATHER, 4096, 0, 128 },
+    { KERNEL_GATHER, 1024, 0, 784 },
+    { KERNEL_DISTANCE_SQUARED, 1, 65536, 16 },
+    { KERNEL_DISTANCE_SQUARED, 1, 16384, 128 },
+    { KERNEL_DISTANCE_SQUARED, 1, 2048, 784 },
+    { KERNEL_SQUARED_DISTANCE, 1, 65536, 16 },
+    { KERNEL_SQUARED_DISTANCE, 1, 16384, 128 },
+    { KERNEL_SQUARED_DISTANCE, 1, 2048, 784 },
+};
+
+#define NUM_CASES ((int)(sizeof(cases) / sizeof(cases[0])))
+
+
+static volatile double sink;      // Keeps the results of the kernels alive
+
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void fill_random(DTYPE *x, const size_t n) {
+    for (size_t i = 0; i < n; i++) x[i] = (DTYPE)rand() / (DTYPE)RAND_MAX;
+}
+
+
+// Rows of the source matrix of the gather, so that the gathered rows are scattered
+static int gather_source_rows(const BenchCase *c) {
+    return c->rows * 8;
+}
+
+
+static void free_data(BenchData *data) {
+    free(data->values);
+    free(data->source);
+    free(data->idx);
+    free(data->A);
+    free(data->B);
+    free(data->sqrmag_Q);
+    free(data->sqrmag_C);
+    free(data->indices);
+    free(data->element);
+    memset(data, 0, sizeof(BenchData));
+}
+
+
+static int setup_case(const BenchCase *c, BenchData *data) {
+    const size_t cells = (size_t)c->rows * c->N;
+    memset(data, 0, sizeof(BenchData));
+    srand(1);
+
+    switch (c->kernel) {
+        case KERNEL_QSELECT:
+        case KERNEL_QSORT:
+            data->values = (DTYPE *)malloc(sizeof(DTYPE) * cells);
+            data->source = (DTYPE *)malloc(sizeof(DTYPE) * cells);
+            data->idx = (int *)malloc(sizeof(int) * cells);
+            if (!data->values || !data->source || !data->idx) goto fail;
+            fill_random(data->source, cells);
+            break;
+        case KERNEL_NORM_ADD:
+            data->values = (DTYPE *)malloc(sizeof(DTYPE) * cells);
+            data->sqrmag_Q = (DTYPE *)malloc(sizeof(DTYPE) * c->rows);
+            data->sqrmag_C = (DTYPE *)malloc(sizeof(DTYPE) * c->N);
+            if (!data->values || !data->sqrmag_Q || !data->sqrmag_C) goto fail;
+            fill_random(data->values, cells);
+            fill_random(data->sqrmag_Q, c->rows);
+            fill_random(data->sqrmag_C, c->N);
+            break;
+        case KERNEL_GEMM:
+            data->values = (DTYPE *)malloc(sizeof(DTYPE) * cells);
+            data->A = (DTYPE *)malloc(sizeof(DTYPE) * c->rows * c->L);
+            data->B = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)c->N * c->L);
+            if (!data->values || !data->A || !data->B) goto fail;
+            fill_random(data->A, (size_t)c->rows * c->L);
+            fill_random(data->B, (size_t)c->N * c->L);
+            break;
+        case KERNEL_QUEUE:
+            data->element = (unsigned char *)calloc(1, QUEUE_ELEMENT_BYTES);
+            if (!data->element) goto fail;
+            break;
+        case KERNEL_GATHER: {
+            const int source_rows = gather_source_rows(c);
+            data->source = (DTYPE *)malloc(sizeof(DTYPE) * source_rows * c->L);
+            data->values = (DTYPE *)malloc(sizeof(DTYPE) * c->rows * c->L);
+            data->indices = (int *)malloc(sizeof(int) * c->rows);
+            if (!data->source || !data->values || !data->indices) goto fail;
+            fill_random(data->source, (size_t)source_rows * c->L);
+            for (int i = 0; i < c->rows; i++) data->indices[i] = rand() % source_rows;
+            break;
+        }
+        case KERNEL_DISTANCE_SQUARED:
+        case KERNEL_SQUARED_DISTANCE:
+            data->A = (DTYPE *)malloc(sizeof(DTYPE) * c->L);
+            data->B = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)c->N * c->L);
+            if (!data->A || !data->B) goto fail;
+            fill_random(data->A, c->L);
+            fill_random(data->B, (size_t)c->N * c->L);
+            break;
+    }
+
+    return EXIT_SUCCESS;
+
+fail:
+    fprintf(stderr, "Error allocating memory for %s\n", kernel_names[c->kernel]);
+    free_data(data);
+    return EXIT_FAILURE;
+}
+
+
+// Untimed reset of the inputs the kernel modifies
+static void prepare_run(const BenchCase *c, BenchData *data) {
+    if (c->kernel != KERNEL_QSELECT && c->kernel != KERNEL_QSORT) return;
+    const size_t cells = (size_t)c->rows * c->N;
+    memcpy(data->values, data->source, sizeof(DTYPE) * cells);
+    for (int i = 0; i < c->rows; i++) {
+        for (int j = 0; j < c->N; j++) data->idx[(size_t)i * c->N + j] = j;
+    }
+}
+
+
+static int run_case(const BenchCase *c, BenchData *data) {
+    double checksum = 0.0;
+
+    switch (c->kernel) {
+        case KERNEL_QSELECT:
+            for (int i = 0; i < c->rows; i++) {
+                a2a_QuickSelect(data->values + (size_t)i * c->N, data->idx + (size_t)i * c->N, 0, c->N - 1, SELECT_K);
+            }
+            checksum = data->values[0];
+            break;
+        case KERNEL_QSORT:
+            for (int i = 0; i < c->rows; i++) {
+                a2a_QuickSort(data->values + (size_t)i * c->N, data->idx + (size_t)i * c->N, 0, c->N - 1);
+            }
+            checksum = data->values[0];
+            break;
+        case KERNEL_NORM_ADD:
+            a2a_AddSquaredNorms(data->values, data->sqrmag_Q, data->sqrmag_C, c->rows, c->N);
+            checksum = data->values[0];
+            break;
+        case KERNEL_GEMM:
+            GEMM(CblasRowMajor, CblasNoTrans, CblasTrans, c->rows, c->N, c->L, SUFFIX(-2.0), data->A, c->L,
+                data->B, c->L, SUFFIX(0.0), data->values, c->N);
+            checksum = data->values[0];
+            break;
+        case KERNEL_QUEUE:
+            a2a_QueueInit(&data->queue, QUEUE_ELEMENT_BYTES);
+            for (int i = 0; i < c->rows; i++) {
+                if (!a2a_QueueEnqueue(&data->queue, data->element)) {
+                    a2a_QueueDestroy(&data->queue);
+                    return EXIT_FAILURE;
+                }
+            }
+            for (int i = 0; i < c->rows; i++) {
+                a2a_QueueDequeue(&data->queue, data->element);
+                checksum += data->element[0];
+            }
+            a2a_QueueDestroy(&data->queue);
+            break;
+        case KERNEL_GATHER:
+            a2a_GatherRows(data->source, c->L, data->indices, c->rows, data->values);
+            checksum = data->values[0];
+            break;
+        case KERNEL_DISTANCE_SQUARED:
+            for (int j = 0; j < c->N; j++) checksum += a2a_DistanceSquared(data->A, data->B + (size_t)j * c->L, c->L);
+            break;
+        case KERNEL_SQUARED_DISTANCE:
+            for (int j = 0; j < c->N; j++) checksum += a2a_squared_distance(data->A, data->B + (size_t)j * c->L, c->L);
+            break;
+    }
+
+    sink += checksum;
+    return EXIT_SUCCESS;
+}
+
+
+// Work of one run in the unit of the kernel
+static double case_work(const BenchCase *c) {
+    switch (c->kernel) {
+        case KERNEL_GEMM: return 2.0 * c->rows * c->N * c->L * 1e-9;
+        case KERNEL_QUEUE: return 2.0 * c->rows * 1e-6;
+        case KERNEL_GATHER: return 2.0 * c->rows * c->L * sizeof(DTYPE) * 1e-9;
+        case KERNEL_DISTANCE_SQUARED:
+        case KERNEL_SQUARED_DISTANCE: return (double)c->N * c->L * 1e-6;
+        default: return (double)c->rows * c->N * 1e-6;
+    }
+}
+
+
+static void case_shape(const BenchCase *c, char *shape, const size_t size) {
+    switch (c->kernel) {
+        case KERNEL_QSELECT: snprintf(shape, size, "%dx%d k=%d", c->rows, c->N, SELECT_K); break;
+        case KERNEL_QSORT:
+        case KERNEL_NORM_ADD: snprintf(shape, size, "%dx%d", c->rows, c->N); break;
+        case KERNEL_GEMM: snprintf(shape, size, "M=%d N=%d L=%d", c->rows, c->N, c->L); break;
+        case KERNEL_QUEUE: snprintf(shape, size, "%d x %dB", c->rows, QUEUE_ELEMENT_BYTES); break;
+        case KERNEL_GATHER: snprintf(shape, size, "%d of %d, L=%d", c->rows, gather_source_rows(c), c->L); break;
+        default: snprintf(shape, size, "1x%d L=%d", c->N, c->L); break;
+    }
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Runs a case warmup times untimed and repetitions times timed, and prints the minimum,
+ * median, mean and relative standard deviation of the run time and the throughput at the median.
+ */
+static int benchmark_case(const BenchCase *c, const int warmup, const int repetitions) {
+    BenchData data;
+    int status = EXIT_FAILURE;
+    double *samples = (double *)malloc(sizeof(double) * repetitions);
+    if (!samples) return EXIT_FAILURE;
+    if (setup_case(c, &data)) goto cleanup;
+
+    for (int r = 0; r < warmup + repetitions; r++) {
+        prepare_run(c, &data);
+        const double start = now_seconds();
+        if (run_case(c, &data)) goto cleanup;
+        const double elapsed = now_seconds() - start;
+        if (r >= warmup) samples[r - warmup] = elapsed;
+    }
+
+    double mean = 0.0, variance = 0.0;
+    for (int r = 0; r < repetitions; r++) mean += samples[r];
+    mean /= repetitions;
+    for (int r = 0; r < repetitions; r++) variance += (samples[r] - mean) * (samples[r] - mean);
+    variance = repetitions > 1 ? variance / (repetitions - 1) : 0.0;
+
+    qsort(samples, repetitions, sizeof(double), compare_doubles);
+    const double median = repetitions % 2 ? samples[repetitions / 2] :
+        0.5 * (samples[repetitions / 2 - 1] + samples[repetitions / 2]);
+
+    char shape[64];
+    case_shape(c, shape, sizeof(shape));
+    printf("%-22s %-24s %12.2f %12.2f %12.2f %8.2f %12.3f %s\n", kernel_names[c->kernel], shape,
+        samples[0] * 1e6, median * 1e6, mean * 1e6, mean > 0.0 ? 100.0 * sqrt(variance) / mean : 0.0,
+        case_work(c) / median, kernel_units[c->kernel]);
+    fflush(stdout);
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free_data(&data);
+    free(samples);
+    return status;
+}
+
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--warmup <runs>] [--repetitions <runs>] [filter]\n", program);
+    fprintf(stderr, "Runs the cases whose kernel name contains filter, or all cases. Kernels:");
+    for (int k = 0; k <= KERNEL_SQUARED_DISTANCE; k++) fprintf(stderr, " %s", kernel_names[k]);
+    fprintf(stderr, "\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    int warmup = DEFAULT_WARMUP;
+    int repetitions = DEFAULT_REPETITIONS;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) repetitions = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !filter) filter = argv[i];
+        else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (warmup < 0 || repetitions < 1) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Single threaded GEMM, so that the kernels are compared on one core
+    openblas_set_num_threads(1);
+
+#ifdef SINGLE_PRECISION
+    printf("Single precision, %d warmup and %d timed runs per case\n\n", warmup, repetitions);
+#else
+    printf("Double precision, %d warmup and %d timed runs per case\n\n", warmup, repetitions);
+#endif
+    printf("%-22s %-24s %12s %12s %12s %8s %12s\n", "kernel", "shape", "min(us)", "median(us)", "mean(us)",
+        "rsd(%)", "throughput");
+
+    for (int i = 0; i < NUM_CASES; i++) {
+        if (filter && !strstr(kernel_names[cases[i].kernel], filter)) continue;
+        if (benchmark_case(&cases[i], warmup, repetitions)) {
+            fprintf(stderr, "Microbenchmark failed for %s.\n", kernel_names[cases[i].kernel]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
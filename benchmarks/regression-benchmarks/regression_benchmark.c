@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "a2a_config.h"
+#include "a2a_knn.h"
+#include "a2a_ann.h"
+#include "synthetic.h"
+#include "memory_usage.h"
+
+
+#define MAX_CASES 64                   // Maximum number of results in a baseline
+#define MAX_REPETITIONS 32
+#define RECALL_SAMPLE 200              // Queries whose exact neighbors measure the recall
+#define DISTANCE_TOLERANCE 1e-5        // Relative tolerance of the distance based recall
+#define SUITE_K 10
+#define SUITE_SEED 42
+#define MAX_MEMORY_USAGE_RATIO 0.5
+
+
+typedef enum { CASE_KNN, CASE_ANN } CASE_TYPE;
+
+
+// A search of the fixed suite. kNN cases search M queries among N points, ANN cases the
+// all-to-all neighbors of N points with Kc clusters.
+typedef struct {
+    CASE_TYPE type;
+    int M;
+    int N;
+    int L;
+    int Kc;
+    int threads;
+} SuiteCase;
+
+
+typedef struct {
+    char name[64];
+    double queries_per_sec;            // Median over the repetitions
+    double recall;
+    double seconds;
+    double peak_rss_mb;                // Peak resident set size of the process during the searches
+} CaseResult;
+
+
+static const SuiteCase suite[] = {
+    { CASE_KNN, 1000, 20000, 32, 0, 1 },
+    { CASE_KNN, 1000, 20000, 32, 0, 4 },
+    { CASE_KNN, 500, 10000, 128, 0, 4 },
+    { CASE_KNN, 200, 5000, 784, 0, 4 },
+    { CASE_ANN, 0, 20000, 32, 20, 1 },
+    { CASE_ANN, 0, 20000, 32, 20, 4 },
+    { CASE_ANN, 0, 20000, 32, 200, 1 },
+    { CASE_ANN, 0, 20000, 32, 200, 4 },
+};
+
+#define SUITE_CASES ((int)(sizeof(suite) / sizeof(suite[0])))
+
+static const char *backend_names[] = { "pthreads", "openmp", "opencilk" };
+
+
+static double elapsed_seconds(const struct timeval *start, const struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double squared_distance(const DTYPE *a, const DTYPE *b, const int L) {
+    double d = 0.0;
+    for (int l = 0; l < L; l++) d += ((double)a[l] - b[l]) * ((double)a[l] - b[l]);
+    return d;
+}
+
+
+// Share of the K neighbors of a query that are at most as far as its exact K-th neighbor,
+// found by brute force. self is the index of the query among the points, or -1.
+static int count_found(const DTYPE *q, const DTYPE *C, const int N, const int L, const int *row,
+    const int row_K, const int K, const int self, double *best) {
+
+    // Smallest K distances in increasing order
+    int count = 0;
+    for (int j = 0; j < N; j++) {
+        if (j == self) continue;
+        const double d = squared_distance(q, C + (size_t)j * L, L);
+        if (count == K && d >= best[K - 1]) continue;
+        int p = count < K ? count++ : K - 1;
+        while (p > 0 && best[p - 1] > d) {
+            best[p] = best[p - 1];
+            p--;
+        }
+        best[p] = d;
+    }
+
+    const double limit = best[count - 1] * (1.0 + DISTANCE_TOLERANCE) + 1e-12;
+    int found = 0;
+    for (int k = 0; k < row_K && found < K; k++) {
+        if (row[k] < 0 || row[k] == self) continue;
+        if (squared_distance(q, C + (size_t)row[k] * L, L) <= limit) found++;
+    }
+    return found;
+}
+
+
+static int run_case(const SuiteCase *c, const int repetitions, const parallelization_type_t backend,
+    CaseResult *result) {
+
+    const int K = SUITE_K;
+    const int M = c->type == CASE_KNN ? c->M : c->N;
+    const int sample = RECALL_SAMPLE < M ? RECALL_SAMPLE : M;
+    int status = EXIT_FAILURE;
+    double times[MAX_REPETITIONS];
+    double best[SUITE_K];
+    int *IDX = NULL;
+    DTYPE *C = NULL, *D = NULL;
+    struct timeval tstart, tend;
+
+    if (c->type == CASE_KNN) {
+        snprintf(result->name, sizeof(result->name), "knn_M%d_N%d_L%d_K%d_t%d", c->M, c->N, c->L, K, c->threads);
+    }
+    else {
+        snprintf(result->name, sizeof(result->name), "ann_N%d_L%d_K%d_Kc%d_t%d", c->N, c->L, K, c->Kc, c->threads);
+    }
+
+    // The queries of the kNN cases follow the N points
+    synthetic_params_t params;
+    synthetic_params_init(&params);
+    params.L = c->L;
+    params.seed = SUITE_SEED;
+    C = generate_synthetic(&params, c->type == CASE_KNN ? (long)c->N + c->M : c->N);
+    IDX = (int *)malloc(sizeof(int) * (size_t)M * K);
+    D = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)M * K);
+    if (!C || !IDX || !D) goto cleanup;
+    const DTYPE *Q = c->type == CASE_KNN ? C + (size_t)c->N * c->L : C;
+
+    peak_rss_reset();
+    for (int r = 0; r < repetitions; r++) {
+        gettimeofday(&tstart, NULL);
+        if (c->type == CASE_KNN) {
+            if (a2a_knnsearch(Q, C, IDX, D, M, c->N, c->L, K, 0, c->threads, 1, MAX_MEMORY_USAGE_RATIO,
+                backend)) goto cleanup;
+        }
+        else {
+            if (a2a_annsearch(C, c->N, c->L, K, c->Kc, IDX, D, c->threads, MAX_MEMORY_USAGE_RATIO,
+                backend)) goto cleanup;
+        }
+        gettimeofday(&tend, NULL);
+        times[r] = elapsed_seconds(&tstart, &tend);
+    }
+    result->peak_rss_mb = peak_rss_bytes() / 1048576.0;
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    result->seconds = repetitions % 2 ? times[repetitions / 2] :
+        0.5 * (times[repetitions / 2 - 1] + times[repetitions / 2]);
+    result->queries_per_sec = M / result->seconds;
+
+    // Evenly spaced sample of the queries
+    long found = 0;
+    for (int s = 0; s < sample; s++) {
+        const int q = (int)((long)s * M / sample);
+        found += count_found(Q + (size_t)q * c->L, C, c->N, c->L, IDX + (size_t)q * K, K, K,
+            c->type == CASE_KNN ? -1 : q, best);
+    }
+    result->recall = (double)found / ((double)sample * K);
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) fprintf(stderr, "Regression case %s failed.\n", result->name);
+    free(C);
+    free(IDX);
+    free(D);
+    return status;
+}
+
+
+// Model name of the first CPU, "unknown" if /proc/cpuinfo cannot be read
+static void cpu_model(char *model, const size_t size) {
+    char line[512];
+    snprintf(model, size, "unknown");
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (!file) return;
+    while (fgets(line, sizeof(line), file)) {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || !value) continue;
+        value += 1 + strspn(value + 1, " \t");
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(model, size, "%s", value);
+        break;
+    }
+    fclose(file);
+}
+
+
+// Copies text without the characters that would break a JSON string
+static void json_escape(const char *text, char *out, const size_t size) {
+    size_t n = 0;
+    for (; *text && n + 1 < size; text++) {
+        if (*text != '"' && *text != '\\' && (unsigned char)*text >= 0x20) out[n++] = *text;
+    }
+    out[n] = '\0';
+}
+
+
+static int write_results(const char *path, const CaseResult *results, const int count,
+    const parallelization_type_t backend, const int repetitions) {
+
+    char cpu[256], blas[256], escaped[256];
+    cpu_model(cpu, sizeof(cpu));
+    const time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    FILE *file = path ? fopen(path, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Error opening %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    json_escape(cpu, escaped, sizeof(escaped));
+    fprintf(file, "{\"environment\":{\"cpu\":\"%s\",\"cores\":%ld,", escaped, sysconf(_SC_NPROCESSORS_ONLN));
+    json_escape(openblas_get_config(), blas, sizeof(blas));
+    fprintf(file, "\"blas\":\"%s\",", blas);
+    json_escape(openblas_get_corename(), blas, sizeof(blas));
+    fprintf(file, "\"blas_core\":\"%s\",\"precision\":\"%s\",\"backend\":\"%s\",\"repetitions\":%d,\"date\":\"%s\"},\n",
+        blas, sizeof(DTYPE) == sizeof(float) ? "single" : "double", backend_names[backend], repetitions, date);
+
+    // One result per line, which is what read_baseline expects
+    fprintf(file, "\"results\":[\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "{\"name\":\"%s\",\"queries_per_sec\":%.3f,\"recall\":%.6f,\"seconds\":%.6f,"
+            "\"peak_rss_mb\":%.1f}%s\n", results[i].name, results[i].queries_per_sec, results[i].recall,
+            results[i].seconds, results[i].peak_rss_mb, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    if (file != stdout && fclose(file)) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// Reads a line without its newline. Returns 0 at the end of the file or if the line is too long.
+static int next_line(FILE *file, char *line, const int size, int *number) {
+    if (!fgets(line, size, file)) return 0;
+    (*number)++;
+    const size_t length = strcspn(line, "\n");
+    if (line[length] != '\n') return 0;
+    line[length] = '\0';
+    return 1;
+}
+
+
+// Reads the results of a file written by write_results, and its CPU model. The file must follow
+// the layout of write_results exactly: the environment, then one result per line.
+static int read_baseline(const char *path, CaseResult *results, int *count, char *cpu, const size_t cpu_size) {
+    char line[1024] = "", model[256];
+    int number = 0, end = 0, more = 1, closed = 0;
+    int status = EXIT_FAILURE;
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error opening baseline %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    *count = 0;
+    const size_t length = next_line(file, line, sizeof(line), &number) ? strlen(line) : 0;
+    if (sscanf(line, "{\"environment\":{\"cpu\":\"%255[^\"]\",%n", model, &end) != 1 || end == 0 ||
+        length < 2 || strcmp(line + length - 2, "},") != 0) goto cleanup;
+    if (!next_line(file, line, sizeof(line), &number) || strcmp(line, "\"results\":[") != 0) goto cleanup;
+
+    // Every result but the last is followed by a comma
+    while (next_line(file, line, sizeof(line), &number)) {
+        if (strcmp(line, "]}") == 0) {
+            closed = 1;
+            break;
+        }
+        if (!more || *count == MAX_CASES) goto cleanup;
+
+        CaseResult *result = &results[*count];
+        end = 0;
+        if (sscanf(line, "{\"name\":\"%63[^\"]\",\"queries_per_sec\":%lf,\"recall\":%lf,\"seconds\":%lf,"
+            "\"peak_rss_mb\":%lf}%n", result->name, &result->queries_per_sec, &result->recall, &result->seconds,
+            &result->peak_rss_mb, &end) != 5 || end == 0) goto cleanup;
+        if (line[end] != '\0' && strcmp(line + end, ",") != 0) goto cleanup;
+        if (!(result->queries_per_sec > 0.0) || !(result->recall >= 0.0 && result->recall <= 1.0)) goto cleanup;
+        for (int b = 0; b < *count; b++) {
+            if (strcmp(results[b].name, result->name) == 0) goto cleanup;
+        }
+        more = line[end] == ',';
+        (*count)++;
+    }
+    if (!closed || more || fgetc(file) != EOF) goto cleanup;
+
+    snprintf(cpu, cpu_size, "%s", model);
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "Error: Baseline %s is not a file written by --output (line %d)\n", path, number);
+    }
+    fclose(file);
+    return status;
+}
+
+
+/**
+ * Compares the results with the baseline. A case regresses if its queries per second drop by
+ * more than qps_tolerance (relative) or its recall by more than recall_tolerance (absolute).
+ * Gains beyond the tolerances are reported but do not fail. Baseline cases that the results
+ * miss fail, since a case that stopped running would hide its regressions.
+ *
+ * @return the number of regressions and of missing cases
+ */
+static int compare_baseline(const CaseResult *results, const int count, const CaseResult *baseline,
+    const int baseline_count, const double qps_tolerance, const double recall_tolerance) {
+
+    int regressions = 0;
+    printf("\n%-32s %14s %14s %9s %9s %9s  %s\n", "case", "baseline q/s", "q/s", "change", "b.recall", "recall",
+        "status");
+    for (int i = 0; i < count; i++) {
+        const CaseResult *base = NULL;
+        for (int b = 0; b < baseline_count; b++) {
+            if (strcmp(baseline[b].name, results[i].name) == 0) base = &baseline[b];
+        }
+        if (!base) {
+            printf("%-32s %14s %14.1f %9s %9s %9.4f  new\n", results[i].name, "-", results[i].queries_per_sec, "-",
+                "-", results[i].recall);
+            continue;
+        }
+
+        const double change = base->queries_per_sec > 0.0 ? results[i].queries_per_sec / base->queries_per_sec - 1.0 : 0.0;
+        const double recall_change = results[i].recall - base->recall;
+        const int slower = change < -qps_tolerance;
+        const int less_accurate = recall_change < -recall_tolerance;
+        const char *status = "ok";
+        if (slower && less_accurate) status = "REGRESSION (throughput, recall)";
+        else if (slower) status = "REGRESSION (throughput)";
+        else if (less_accurate) status = "REGRESSION (recall)";
+        else if (change > qps_tolerance || recall_change > recall_tolerance) status = "improved";
+        regressions += slower || less_accurate;
+
+        printf("%-32s %14.1f %14.1f %8.1f%% %9.4f %9.4f  %s\n", results[i].name, base->queries_per_sec,
+            results[i].queries_per_sec, 100.0 * change, base->recall, results[i].recall, status);
+    }
+
+    for (int b = 0; b < baseline_count; b++) {
+        int found = 0;
+        for (int i = 0; i < count && !found; i++) found = strcmp(baseline[b].name, results[i].name) == 0;
+        if (found) continue;
+        printf("%-32s %14.1f %14s %9s %9.4f %9s  MISSING\n", baseline[b].name, baseline[b].queries_per_sec, "-",
+            "-", baseline[b].recall, "-");
+        regressions++;
+    }
+
+    return regressions;
+}
+
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --output <file>             results as JSON (default standard output)\n"
+        "  --baseline <file>           results of a previous run to compare with\n"
+        "  --qps-tolerance <ratio>     relative drop of queries per second that fails (default 0.10)\n"
+        "  --recall-tolerance <value>  absolute drop of recall that fails (default 0.01)\n"
+        "  --repetitions <runs>        runs per case, the median is kept (default 3)\n"
+        "  --backend <name>            pthreads, openmp or opencilk (default pthreads)\n", program);
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL, *baseline_path = NULL;
+    double qps_tolerance = 0.10, recall_tolerance = 0.01;
+    int repetitions = 3;
+    parallelization_type_t backend = PAR_PTHREADS;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        const char *option = argv[i], *value = argv[++i];
+        if (strcmp(option, "--output") == 0) output = value;
+        else if (strcmp(option, "--baseline") == 0) baseline_path = value;
+        else if (strcmp(option, "--qps-tolerance") == 0) qps_tolerance = atof(value);
+        else if (strcmp(option, "--recall-tolerance") == 0) recall_tolerance = atof(value);
+        else if (strcmp(option, "--repetitions") == 0) repetitions = atoi(value);
+        else if (strcmp(option, "--backend") == 0 && strcmp(value, "pthreads") == 0) backend = PAR_PTHREADS;
+        else if (strcmp(option, "--backend") == 0 && strcmp(value, "openmp") == 0) backend = PAR_OPENMP;
+        else if (strcmp(option, "--backend") == 0 && strcmp(value, "opencilk") == 0) backend = PAR_OPENCILK;
+        else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (repetitions < 1 || repetitions > MAX_REPETITIONS || qps_tolerance < 0.0 || recall_tolerance < 0.0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Read the baseline first, so that a bad path fails before the suite runs
+    CaseResult baseline[MAX_CASES];
+    int baseline_count = 0;
+    char baseline_cpu[256], cpu[256];
+    if (baseline_path && read_baseline(baseline_path, baseline, &baseline_count, baseline_cpu, sizeof(baseline_cpu))) {
+        return EXIT_FAILURE;
+    }
+
+    CaseResult results[SUITE_CASES];
+    for (int i = 0; i < SUITE_CASES; i++) {
+        if (run_case(&suite[i], repetitions, backend, &results[i])) return EXIT_FAILURE;
+        fprintf(stderr, "%-32s %12.1f q/s  recall %.4f  peak RSS %.1f MB\n", results[i].name,
+            results[i].queries_per_sec, results[i].recall, results[i].peak_rss_mb);
+    }
+
+    if (write_results(output, results, SUITE_CASES, backend, repetitions)) return EXIT_FAILURE;
+    if (!baseline_path) return EXIT_SUCCESS;
+
+    cpu_model(cpu, sizeof(cpu));
+    if (strcmp(cpu, baseline_cpu) != 0) {
+        fprintf(stderr, "Warning: The baseline was recorded on a different CPU (%s).\n", baseline_cpu);
+    }
+    const int regressions = compare_baseline(results, SUITE_CASES, baseline, baseline_count, qps_tolerance,
+        recall_tolerance);
+    if (regressions > 0) {
+        printf("\n%d %s regressed beyond the tolerances or missing.\n", regressions, regressions == 1 ? "case" : "cases");
+        return EXIT_FAILURE;
+    }
+    printf("\nNo regression beyond the tolerances.\n");
+
+    return EXIT_SUCCESS;
+}
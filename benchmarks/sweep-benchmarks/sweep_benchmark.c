@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "a2a_config.h"
+#include "a2a_knn.h"
+#include "a2a_ann.h"
+#include "synthetic.h"
+
+
+#define MAX_SWEEP_VALUES 32           // Maximum number of values of a swept parameter
+#define DISTANCE_TOLERANCE 1e-5       // Relative tolerance of the distance based recall
+
+
+typedef enum { SCALING_STRONG, SCALING_WEAK } SCALING_TYPE;
+typedef enum { FORMAT_CSV, FORMAT_JSON } OUTPUT_FORMAT;
+
+
+typedef struct {
+    SYNTHETIC_TYPE data;
+    long N;                           // Points of the strong sweep, or at the smallest thread count of the weak sweep
+    int L;
+    int K;
+    int centers;                      // Centers of the Gaussian mixture
+    double spread;                    // Standard deviation of the Gaussian clusters, relative to the range of the centers
+    int duplicates;                   // Average number of copies of each point of the duplicate-heavy data
+    unsigned int seed;
+    SCALING_TYPE scaling;
+    int threads[MAX_SWEEP_VALUES];
+    int num_threads;
+    int kc[MAX_SWEEP_VALUES];         // 0 runs the exact all-to-all search
+    int num_kc;
+    parallelization_type_t backends[MAX_SWEEP_VALUES];
+    int num_backends;
+    int repetitions;
+    int sample_size;                  // Points whose exact neighbors measure the recall, 0 disables it
+    double memory_ratio;
+    OUTPUT_FORMAT format;
+    const char *output;               // Output file, NULL for the standard output
+} SweepConfig;
+
+
+// One search of the sweep
+typedef struct {
+    parallelization_type_t backend;
+    int threads;
+    long N;
+    int Kc;
+    double seconds;                   // Median over the repetitions
+    double min_seconds;
+    double recall;                    // -1 without sample
+    double speedup;                   // Relative to the smallest thread count of the same backend and Kc
+    double efficiency;
+} SweepResult;
+
+
+// Exact neighbors of the sample of one dataset size
+typedef struct {
+    long N;
+    int *sample;
+    DTYPE *kth_distance;              // Squared distance of the K-th neighbor of each sampled point, self excluded
+} RecallSample;
+
+
+static const char *backend_names[] = { "pthreads", "openmp", "opencilk" };
+
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Generates the points 0 to N - 1. Every size of the sweep uses a prefix of the same points.
+static DTYPE *generate_data(const SweepConfig *config, const long N) {
+    synthetic_params_t params;
+    synthetic_params_init(&params);
+    params.type = config->data;
+    params.L = config->L;
+    params.centers = config->centers;
+    params.spread = config->spread;
+    params.duplicates = config->duplicates;
+    params.seed = config->seed;
+    return generate_synthetic(&params, N);
+}
+
+
+static DTYPE squared_distance(const DTYPE *a, const DTYPE *b, const int L) {
+    DTYPE d = SUFFIX(0.0);
+    for (int l = 0; l < L; l++) d += (a[l] - b[l]) * (a[l] - b[l]);
+    return d;
+}
+
+
+static void free_recall_sample(RecallSample *sample) {
+    free(sample->sample);
+    free(sample->kth_distance);
+    sample->sample = NULL;
+    sample->kth_distance = NULL;
+    sample->N = 0;
+}
+
+
+// Finds the exact K-th neighbor distance of a random sample of the first N points
+static int build_recall_sample(const SweepConfig *config, const DTYPE *C, const long N, RecallSample *sample) {
+    const int S = config->sample_size < N ? config->sample_size : (int)N;
+    const int L = config->L;
+    const int exact_K = config->K + 1 < N ? config->K + 1 : (int)N;
+    int status = EXIT_FAILURE;
+    int *idx = (int *)malloc(sizeof(int) * (size_t)S * exact_K);
+    DTYPE *dist = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)S * exact_K);
+    DTYPE *queries = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)S * L);
+    sample->N = N;
+    sample->sample = (int *)malloc(sizeof(int) * S);
+    sample->kth_distance = (DTYPE *)malloc(sizeof(DTYPE) * S);
+    if (!idx || !dist || !queries || !sample->sample || !sample->kth_distance) {
+        fprintf(stderr, "Error allocating memory for the recall sample\n");
+        goto cleanup;
+    }
+
+    unsigned int seed = config->seed;
+    for (int s = 0; s < S; s++) {
+        sample->sample[s] = (int)(((long)rand_r(&seed) * (RAND_MAX + 1L) + rand_r(&seed)) % N);
+        memcpy(queries + (size_t)s * L, C + (size_t)sample->sample[s] * L, sizeof(DTYPE) * L);
+    }
+    if (a2a_knnsearch(queries, C, idx, dist, S, (int)N, L, exact_K, 1, 1, 1, config->memory_ratio,
+        PAR_PTHREADS)) goto cleanup;
+
+    // The point itself is one of its nearest neighbors at distance 0. The distances are computed
+    // again directly, since those of the search lose precision, or are NaN, near 0.
+    for (int s = 0; s < S; s++) {
+        DTYPE kth = SUFFIX(0.0);
+        for (int k = 0; k < exact_K; k++) {
+            const DTYPE d = squared_distance(C + (size_t)sample->sample[s] * L,
+                C + (size_t)idx[(size_t)s * exact_K + k] * L, L);
+            if (d > kth) kth = d;
+        }
+        sample->kth_distance[s] = kth;
+    }
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(idx);
+    free(dist);
+    free(queries);
+    if (status != EXIT_SUCCESS) free_recall_sample(sample);
+    return status;
+}
+
+
+// Share of the returned neighbors of the sampled points that are at most as far as their exact
+// K-th neighbor, which counts ties and duplicates as found
+static double measure_recall(const SweepConfig *config, const DTYPE *C, const int *IDX, const int K,
+    const RecallSample *sample) {
+
+    const int S = config->sample_size < sample->N ? config->sample_size : (int)sample->N;
+    const int L = config->L;
+    long found = 0;
+    for (int s = 0; s < S; s++) {
+        const int point = sample->sample[s];
+        const DTYPE limit = sample->kth_distance[s] * (DTYPE)(1.0 + DISTANCE_TOLERANCE) + (DTYPE)1e-12;
+        int hits = 0;
+        for (int k = 0; k < K; k++) {
+            const int j = IDX[(size_t)point * K + k];
+            if (j < 0 || j == point) continue;
+            if (squared_distance(C + (size_t)point * L, C + (size_t)j * L, L) <= limit) hits++;
+        }
+        found += hits < config->K ? hits : config->K;
+    }
+
+    return S > 0 ? (double)found / ((double)S * config->K) : -1.0;
+}
+
+
+static int backend_available(const parallelization_type_t backend) {
+#ifdef USE_OPENCILK
+    return backend != PAR_OPENMP;
+#else
+    return backend != PAR_OPENCILK;
+#endif
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+// Runs one configuration of the sweep repetitions times
+static int run_search(const SweepConfig *config, const DTYPE *C, SweepResult *result, int *IDX, DTYPE *D,
+    const RecallSample *sample) {
+
+    const int N = (int)result->N;
+    const int K = config->K;
+    double times[MAX_SWEEP_VALUES];
+    int result_K = K;
+
+    for (int r = 0; r < config->repetitions; r++) {
+        const double start = now_seconds();
+        if (result->Kc == 0) {
+            // Exact all-to-all search, whose neighbors include the point itself
+            result_K = K + 1 < N ? K + 1 : N;
+            if (a2a_knnsearch(C, C, IDX, D, N, N, config->L, result_K, 0, result->threads, 1, config->memory_ratio,
+                result->backend)) return EXIT_FAILURE;
+        }
+        else {
+            a2a_ann_options_t options;
+            a2a_ann_options_init(&options);
+            if (a2a_annsearch_ex(C, N, config->L, K, result->Kc, IDX, D, result->threads, config->memory_ratio,
+                result->backend, &options)) return EXIT_FAILURE;
+        }
+        times[r] = now_seconds() - start;
+    }
+
+    qsort(times, config->repetitions, sizeof(double), compare_doubles);
+    const int R = config->repetitions;
+    result->min_seconds = times[0];
+    result->seconds = R % 2 ? times[R / 2] : 0.5 * (times[R / 2 - 1] + times[R / 2]);
+    result->recall = sample ? measure_recall(config, C, IDX, result_K, sample) : -1.0;
+
+    return EXIT_SUCCESS;
+}
+
+
+static void write_csv(FILE *file, const SweepConfig *config, const SweepResult *results, const int count) {
+    fprintf(file, "data,scaling,backend,threads,N,L,K,Kc,seconds,min_seconds,points_per_sec,speedup,efficiency,recall\n");
+    for (int i = 0; i < count; i++) {
+        const SweepResult *r = &results[i];
+        fprintf(file, "%s,%s,%s,%d,%ld,%d,%d,%d,%.6f,%.6f,%.1f,%.4f,%.4f,%.4f\n", synthetic_type_name(config->data),
+            config->scaling == SCALING_STRONG ? "strong" : "weak", backend_names[r->backend], r->threads, r->N,
+            config->L, config->K, r->Kc, r->seconds, r->min_seconds, r->N / r->seconds, r->speedup,
+            r->efficiency, r->recall);
+    }
+}
+
+
+static void write_json(FILE *file, const SweepConfig *config, const SweepResult *results, const int count) {
+    fprintf(file, "{\"config\":{\"data\":\"%s\",\"scaling\":\"%s\",\"N\":%ld,\"L\":%d,\"K\":%d,\"seed\":%u,"
+        "\"repetitions\":%d,\"sample_size\":%d,\"precision\":\"%s\"},\n\"results\":[", synthetic_type_name(config->data),
+        config->scaling == SCALING_STRONG ? "strong" : "weak", config->N, config->L, config->K, config->seed,
+        config->repetitions, config->sample_size, sizeof(DTYPE) == sizeof(float) ? "single" : "double");
+    for (int i = 0; i < count; i++) {
+        const SweepResult *r = &results[i];
+        fprintf(file, "%s\n{\"backend\":\"%s\",\"threads\":%d,\"N\":%ld,\"Kc\":%d,\"seconds\":%.6f,"
+            "\"min_seconds\":%.6f,\"points_per_sec\":%.1f,\"speedup\":%.4f,\"efficiency\":%.4f,\"recall\":%.4f}",
+            i ? "," : "", backend_names[r->backend], r->threads, r->N, r->Kc, r->seconds, r->min_seconds,
+            r->N / r->seconds, r->speedup, r->efficiency, r->recall);
+    }
+    fprintf(file, "\n]}\n");
+}
+
+
+// Parses a comma separated list of non-negative integers
+static int parse_list(const char *text, int *values, int *count) {
+    char *end;
+    *count = 0;
+    while (*text) {
+        if (*count == MAX_SWEEP_VALUES) return EXIT_FAILURE;
+        const long value = strtol(text, &end, 10);
+        if (end == text || value < 0 || value > 1L << 30) return EXIT_FAILURE;
+        values[(*count)++] = (int)value;
+        text = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return EXIT_FAILURE;
+    }
+    return *count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static int parse_backends(const char *text, SweepConfig *config) {
+    config->num_backends = 0;
+    while (*text) {
+        const size_t length = strcspn(text, ",");
+        int found = 0;
+        for (int b = PAR_PTHREADS; b <= PAR_OPENCILK; b++) {
+            if (strlen(backend_names[b]) == length && strncmp(text, backend_names[b], length) == 0) {
+                if (config->num_backends == MAX_SWEEP_VALUES) return EXIT_FAILURE;
+                config->backends[config->num_backends++] = (parallelization_type_t)b;
+                found = 1;
+            }
+        }
+        if (!found) return EXIT_FAILURE;
+        text += length;
+        if (*text == ',') text++;
+    }
+    return config->num_backends > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --data gaussian|uniform|duplicates  synthetic data (default gaussian)\n"
+        "  --N <points>                        points, at the smallest thread count for weak scaling (default 100000)\n"
+        "  --L <dimension>                     dimension of the points (default 32)\n"
+        "  --K <neighbors>                     neighbors per point (default 10)\n"
+        "  --centers <count>                   centers of the Gaussian clusters (default 100)\n"
+        "  --spread <stddev>                   standard deviation of the Gaussian clusters (default 0.05)\n"
+        "  --duplicates <copies>               average copies per point of the duplicate data (default 10)\n"
+        "  --seed <seed>                       seed of the data and of the recall sample (default 1)\n"
+        "  --scaling strong|weak               fixed N, or N and Kc proportional to the threads (default strong)\n"
+        "  --threads <list>                    thread counts, e.g. 1,2,4,8 (default 1,2,4)\n"
+        "  --kc <list>                         clusters of the ANN search, 0 for the exact search (default 100)\n"
+        "  --backends <list>                   pthreads, openmp and/or opencilk (default pthreads)\n"
+        "  --repetitions <runs>                runs per configuration, the median is reported (default 3)\n"
+        "  --sample <points>                   points whose exact neighbors measure the recall, 0 disables it (default 1000)\n"
+        "  --memory-ratio <ratio>              maximum share of the available memory (default 0.5)\n"
+        "  --format csv|json                   output format (default csv)\n"
+        "  --output <file>                     output file (default standard output)\n", program);
+}
+
+
+static int parse_args(int argc, char *argv[], SweepConfig *config) {
+    memset(config, 0, sizeof(SweepConfig));
+    config->data = SYNTHETIC_GAUSSIAN;
+    config->N = 100000;
+    config->L = 32;
+    config->K = 10;
+    config->centers = 100;
+    config->spread = 0.05;
+    config->duplicates = 10;
+    config->seed = 1;
+    config->scaling = SCALING_STRONG;
+    parse_list("1,2,4", config->threads, &config->num_threads);
+    parse_list("100", config->kc, &config->num_kc);
+    config->backends[0] = PAR_PTHREADS;
+    config->num_backends = 1;
+    config->repetitions = 3;
+    config->sample_size = 1000;
+    config->memory_ratio = 0.5;
+    config->format = FORMAT_CSV;
+
+    for (int i = 1; i < argc; i++) {
+        const char *option = argv[i];
+        if (i + 1 >= argc) return EXIT_FAILURE;
+        const char *value = argv[++i];
+        int ok = 1;
+
+        if (strcmp(option, "--data") == 0) {
+            if (strcmp(value, "gaussian") == 0) config->data = SYNTHETIC_GAUSSIAN;
+            else if (strcmp(value, "uniform") == 0) config->data = SYNTHETIC_UNIFORM;
+            else if (strcmp(value, "duplicates") == 0) config->data = SYNTHETIC_DUPLICATES;
+            else ok = 0;
+        }
+        else if (strcmp(option, "--N") == 0) config->N = atol(value);
+        else if (strcmp(option, "--L") == 0) config->L = atoi(value);
+        else if (strcmp(option, "--K") == 0) config->K = atoi(value);
+        else if (strcmp(option, "--centers") == 0) config->centers = atoi(value);
+        else if (strcmp(option, "--spread") == 0) config->spread = atof(value);
+        else if (strcmp(option, "--duplicates") == 0) config->duplicates = atoi(value);
+        else if (strcmp(option, "--seed") == 0) config->seed = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(option, "--scaling") == 0) {
+            if (strcmp(value, "strong") == 0) config->scaling = SCALING_STRONG;
+            else if (strcmp(value, "weak") == 0) config->scaling = SCALING_WEAK;
+            else ok = 0;
+        }
+        else if (strcmp(option, "--threads") == 0) ok = !parse_list(value, config->threads, &config->num_threads);
+        else if (strcmp(option, "--kc") == 0) ok = !parse_list(value, config->kc, &config->num_kc);
+        else if (strcmp(option, "--backends") == 0) ok = !parse_backends(value, config);
+        else if (strcmp(option, "--repetitions") == 0) config->repetitions = atoi(value);
+        else if (strcmp(option, "--sample") == 0) config->sample_size = atoi(value);
+        else if (strcmp(option, "--memory-ratio") == 0) config->memory_ratio = atof(value);
+        else if (strcmp(option, "--format") == 0) {
+            if (strcmp(value, "csv") == 0) config->format = FORMAT_CSV;
+            else if (strcmp(value, "json") == 0) config->format = FORMAT_JSON;
+            else ok = 0;
+        }
+        else if (strcmp(option, "--output") == 0) config->output = value;
+        else ok = 0;
+
+        if (!ok) {
+            fprintf(stderr, "Invalid option %s %s\n", option, value);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int t = 0; t < config->num_threads; t++) {
+        if (config->threads[t] < 1) return EXIT_FAILURE;
+    }
+    if (config->N < 2 || config->L < 1 || config->K < 1 || config->K >= config->N || config->centers < 1 ||
+        config->spread < 0.0 || config->duplicates < 1 || config->repetitions < 1 ||
+        config->repetitions > MAX_SWEEP_VALUES || config->sample_size < 0 || config->memory_ratio <= 0.0 ||
+        config->memory_ratio > 1.0) return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+// Points of a thread count. Weak scaling keeps the points per thread, and main scales Kc with them.
+static long sweep_points(const SweepConfig *config, const int min_threads, const int threads) {
+    return config->scaling == SCALING_WEAK ? config->N * threads / min_threads : config->N;
+}
+
+
+int main(int argc, char *argv[]) {
+    SweepConfig config;
+    if (parse_args(argc, argv, &config)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int min_threads = config.threads[0];
+    int max_threads = config.threads[0];
+    for (int t = 1; t < config.num_threads; t++) {
+        if (config.threads[t] < min_threads) min_threads = config.threads[t];
+        if (config.threads[t] > max_threads) max_threads = config.threads[t];
+    }
+    const long max_N = sweep_points(&config, min_threads, max_threads);
+    if (max_N > 0x7FFFFFFF) {
+        fprintf(stderr, "Error: %ld points exceed the range of the point indices\n", max_N);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    int *IDX = NULL;
+    DTYPE *C = NULL, *D = NULL;
+    FILE *file = NULL;
+    const int num_results = config.num_backends * config.num_kc * config.num_threads;
+    SweepResult *results = (SweepResult *)calloc(num_results, sizeof(SweepResult));
+    RecallSample samples[MAX_SWEEP_VALUES];
+    memset(samples, 0, sizeof(samples));
+
+    fprintf(stderr, "Generating %ld %s points of dimension %d...\n", max_N, synthetic_type_name(config.data), config.L);
+    C = generate_data(&config, max_N);
+    IDX = (int *)malloc(sizeof(int) * (size_t)max_N * (config.K + 1));
+    D = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)max_N * (config.K + 1));
+    if (!results || !C || !IDX || !D) {
+        fprintf(stderr, "Error allocating memory for the sweep\n");
+        goto cleanup;
+    }
+
+    // Exact neighbors of the sample, once per dataset size
+    if (config.sample_size > 0) {
+        for (int t = 0; t < config.num_threads; t++) {
+            const long N = sweep_points(&config, min_threads, config.threads[t]);
+            if (build_recall_sample(&config, C, N, &samples[t])) goto cleanup;
+        }
+    }
+
+    int count = 0;
+    for (int b = 0; b < config.num_backends; b++) {
+        if (!backend_available(config.backends[b])) {
+            fprintf(stderr, "Skipping %s, which is not enabled in this build\n", backend_names[config.backends[b]]);
+            continue;
+        }
+        for (int c = 0; c < config.num_kc; c++) {
+            const int first = count;
+            for (int t = 0; t < config.num_threads; t++) {
+                SweepResult *result = &results[count];
+                result->backend = config.backends[b];
+                result->threads = config.threads[t];
+                result->N = sweep_points(&config, min_threads, config.threads[t]);
+                result->Kc = (int)((long)config.kc[c] * result->N / config.N);
+                if (config.kc[c] > 0 && result->Kc < 1) result->Kc = 1;
+
+                fprintf(stderr, "%s: %d threads, N = %ld, Kc = %d\n", backend_names[result->backend],
+                    result->threads, result->N, result->Kc);
+                if (run_search(&config, C, result, IDX, D, config.sample_size > 0 ? &samples[t] : NULL)) {
+                    fprintf(stderr, "Search failed for %s with %d threads and Kc = %d\n",
+                        backend_names[result->backend], result->threads, result->Kc);
+                    goto cleanup;
+                }
+                count++;
+            }
+
+            // Speedup and efficiency against the smallest thread count
+            const SweepResult *base = &results[first];
+            for (int i = first + 1; i < count; i++) {
+                if (results[i].threads < base->threads) base = &results[i];
+            }
+            for (int i = first; i < count; i++) {
+                SweepResult *r = &results[i];
+                const double scale = (double)r->threads / base->threads;
+                if (config.scaling == SCALING_STRONG) {
+                    r->speedup = base->seconds / r->seconds;
+                    r->efficiency = r->speedup / scale;
+                }
+                else {
+                    r->efficiency = base->seconds / r->seconds;
+                    r->speedup = r->efficiency * scale;
+                }
+            }
+        }
+    }
+
+    file = config.output ? fopen(config.output, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Error opening %s\n", config.output);
+        goto cleanup;
+    }
+    if (config.format == FORMAT_CSV) write_csv(file, &config, results, count);
+    else write_json(file, &config, results, count);
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (file && file != stdout && fclose(file)) {
+        fprintf(stderr, "Error writing %s\n", config.output);
+        status = EXIT_FAILURE;
+    }
+    for (int t = 0; t < config.num_threads; t++) free_recall_sample(&samples[t]);
+    free(results);
+    free(C);
+    free(IDX);
+    free(D);
+    return status;
+}
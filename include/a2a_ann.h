@@ -2,6 +2,69 @@
 #define A2A_ANN_H
 
 #include "a2a_config.h"
+#include "a2a_stats.h"
+
+#define A2A_CLUSTER_SIZE_AUTO -1          // Derive the maximum cluster size from the cache size
+#define A2A_COARSE_CLUSTERS_AUTO -1       // Use about sqrt(Kc) coarse clusters in the two-level k-means
+#define A2A_PQ_RERANK_AUTO -1             // Re-rank 4 * K candidates per point, 16 * K with the coarser 4-bit codes
+
+
+// Ways of partitioning the points before the exact search within each part
+typedef enum {
+    A2A_ENGINE_KMEANS,                    // Clusters of a k-means
+    A2A_ENGINE_RP_FOREST                  // Leaves of a forest of random projection trees
+} a2a_ann_engine_t;
+
+
+/**
+ * Optional settings of the ANN search. Always initialize the structure with 
+ * a2a_ann_options_init before overriding individual fields.
+ */
+typedef struct {
+    int max_cluster_size;       // Maximum number of points per cluster. Oversized clusters are split
+                                // into balanced parts. 0 disables the limit and A2A_CLUSTER_SIZE_AUTO
+                                // derives it from the size of the last level cache.
+    int permute_data;           // If non-zero, a copy of the data and its squared norms is stored in
+                                // cluster order, so that each cluster is searched in place instead of
+                                // being gathered. Costs N * L extra elements of memory, off by default.
+    int coarse_clusters;        // Number of coarse clusters of a two-level k-means. The points are
+                                // assigned to the coarse clusters first and then to the fine clusters
+                                // of their coarse cluster only, which makes very large Kc affordable.
+                                // 0 or 1 runs the flat k-means, A2A_COARSE_CLUSTERS_AUTO uses sqrt(Kc).
+    int refine_iterations;      // Maximum number of NN-descent iterations run on the result to recover
+                                // neighbors across cluster boundaries (see a2a_nndescent_refine).
+                                // 0 disables the refinement.
+    a2a_ann_engine_t engine;    // Partitioning of the points. A2A_ENGINE_RP_FOREST builds num_trees random
+                                // projection trees whose leaves hold at most max_cluster_size points, or
+                                // about N / Kc points if max_cluster_size is 0, searches the leaves of every
+                                // tree and merges the results. It skips the k-means passes over the data,
+                                // and coarse_clusters is ignored.
+    int num_trees;              // Number of trees of A2A_ENGINE_RP_FOREST
+    int pq_subspaces;           // If non-zero, the points are encoded with a product quantizer of pq_subspaces
+                                // subspaces (a divisor of L, see a2a_pq_t) and the clusters are searched on
+                                // the codes with asymmetric distances, without gathering or permuting the
+                                // data. The distances are then approximate unless pq_rerank re-ranks them.
+                                // The scan reads code_size bytes per point instead of L elements, but
+                                // the lookup table of each point and the re-ranking still read C, which
+                                // therefore stays in memory: PQ saves bandwidth, not resident memory.
+    int pq_bits;                // Bits per subspace code, 4 (scanned with in-register table lookups) or 8
+    int pq_rerank;              // Number of candidates per point kept by the scan of the codes and re-ranked
+                                // with exact distances (raised to K if smaller), A2A_PQ_RERANK_AUTO by
+                                // default. 0 disables the re-ranking and reports the distances of the codes,
+                                // whose neighbors are coarse: 4-bit codes then recall only a fraction of them.
+    a2a_stats_t *stats;         // If set, filled with the time spent in each phase, the busy and idle time
+                                // of the threads and the cluster sizes of the search (see a2a_stats_t).
+                                // NULL disables the collection.
+} a2a_ann_options_t;
+
+
+/**
+ * Fills the options with their default values, which reproduce the behavior of
+ * a2a_annsearch.
+ * 
+ * @param opts the options to initialize
+ */
+void a2a_ann_options_init(a2a_ann_options_t *opts);
 
 
 /**
@@ -21,7 +84,10 @@
  * @param IDX                     Output array (size N * K) to store indices of nearest neighbors.
  * @param D                       Output array (size N * K) to store distances to nearest neighbors.
  * @param nthreads                Number of threads to use for parallel computation.
- * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1).
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1). The working
+ *                                buffers, the per-point arrays of the clustering and the PQ codes count
+ *                                in it, C and the output matrices do not. Concurrent searches must
+ *                                pass the same ratio (see a2a_knnsearch).
  * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
  * 
  * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
@@ -31,4 +97,16 @@ int a2a_annsearch(const DTYPE* C, const int N, const int L, const int K, int Kc,
     parallelization_type_t par_type);
 
 
+/**
+ * Same as a2a_annsearch, with additional settings.
+ * 
+ * @param opts                    The search options, or NULL for the defaults (see a2a_ann_options_t).
+ * 
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_annsearch_ex(const DTYPE* C, const int N, const int L, const int K, int Kc, 
+    int* IDX, DTYPE* D, const int nthreads, const double max_memory_usage_ratio, 
+    parallelization_type_t par_type, const a2a_ann_options_t *opts);
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef A2A_EVAL_H
+#define A2A_EVAL_H
+
+#include "a2a_config.h"
+
+#define A2A_EVAL_BINS 10                  // Bins of the recall histogram, each 1 / A2A_EVAL_BINS wide
+
+
+/**
+ * Optional settings of the evaluation. Always initialize the structure with
+ * a2a_eval_options_init before overriding individual fields.
+ */
+typedef struct {
+    int k;                      // Number of neighbors evaluated per query (recall@k). 0 uses the smaller
+                                // of the numbers of columns of the result and of the ground truth.
+    const DTYPE *Q;             // Queries (M x L). With C, enables the distance ratio. NULL skips it.
+    const DTYPE *C;             // Points the indices refer to (N x L), C = Q for an all-to-all search
+    int N;                      // Number of points of C. Indices outside [0, N) never match. 0 only
+                                // rejects negative indices (without data).
+    int L;                      // Dimensionality of the queries and the points
+    double *per_query;          // If set, output array (size M) of the recall of every query
+    int nthreads;               // Number of threads
+    parallelization_type_t par_type;  // Type of parallelization (PTHREADS, OpenMP or OpenCilk)
+} a2a_eval_options_t;
+
+
+/**
+ * Accuracy of a search against the exact neighbors, as computed by a2a_eval_recall.
+ */
+typedef struct {
+    int k;                      // Number of neighbors evaluated per query
+    double recall;              // Mean recall@k over the queries (between 0 and 1)
+    double min_recall;          // Recall of the worst query
+    double p10_recall;          // 10th percentile of the recall of the queries
+    double median_recall;       // Median recall of the queries
+    long perfect;               // Number of queries whose k exact neighbors were all found
+    long histogram[A2A_EVAL_BINS];  // Number of queries per recall bin, the last bin includes recall 1
+    double distance_ratio;      // Mean over the complete queries of the sum of the distances to the k neighbors
+                                // found divided by the sum of the distances to the k exact neighbors (1 is
+                                // exact). 0 if the options have no data.
+    long incomplete;            // Number of queries with fewer valid neighbors than exact ones (-1 or out of
+                                // range entries), left out of the distance ratio
+} a2a_eval_result_t;
+
+
+/**
+ * Fills the options with their default values: all common columns, no distance ratio, no
+ * per-query output and a single thread.
+ *
+ * @param opts the options to initialize
+ */
+void a2a_eval_options_init(a2a_eval_options_t *opts);
+
+
+/**
+ * Computes the recall@k of a search result against the exact neighbors, together with the
+ * distribution of the recall over the queries and the distance ratio. A neighbor counts as
+ * found if its index appears among the first k exact neighbors of the query, whatever its
+ * position. Each query sorts its two index lists and intersects them, which costs
+ * O(k log k) instead of the O(k^2) of comparing every pair, and the queries are split among
+ * the threads.
+ *
+ * @param IDX                     The indices found by the search (M x K_idx).
+ * @param K_idx                   Number of columns of IDX.
+ * @param truth                   The exact neighbors, sorted by distance (M x K_truth).
+ * @param K_truth                 Number of columns of truth.
+ * @param M                       Number of queries.
+ * @param opts                    Evaluation options, or NULL for the defaults.
+ * @param result                  Output, the accuracy of the search.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_eval_recall(const int *IDX, const int K_idx, const int *truth, const int K_truth, const int M,
+    const a2a_eval_options_t *opts, a2a_eval_result_t *result);
+
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef A2A_GRAPH_H
+#define A2A_GRAPH_H
+
+#include "a2a_config.h"
+#include "a2a_ann.h"
+
+
+/**
+ * All-to-all kNN graph that can be updated in place. The points are partitioned with the
+ * k-means of a2a_annsearch and every point keeps the clusters it searched ("probes"), so
+ * that inserting or deleting points only touches the clusters around them.
+ *
+ * Points are identified by the order of insertion, starting with the points given to
+ * a2a_graph_build. Identifiers of deleted points are not reused. Created with
+ * a2a_graph_build and released with a2a_graph_free.
+ */
+typedef struct a2a_graph a2a_graph_t;
+
+
+/**
+ * Builds the kNN graph of a dataset. The data is copied into the graph.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param K                       Number of neighbors per point.
+ * @param Kc                      Number of clusters to partition the data into.
+ * @param nprobe                  Number of clusters searched per point, its own and the nprobe - 1
+ *                                next nearest (capped to the number of clusters).
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1).
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ * @param opts                    Clustering options (coarse_clusters and max_cluster_size), or NULL
+ *                                for the defaults.
+ * @param graph                   Output, the new graph.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_graph_build(const DTYPE* C, const int N, const int L, const int K, int Kc, const int nprobe,
+    const int nthreads, const double max_memory_usage_ratio, parallelization_type_t par_type,
+    const a2a_ann_options_t *opts, a2a_graph_t **graph);
+
+
+/**
+ * Inserts points into the graph. Each new point joins the cluster with the nearest centroid,
+ * finds its neighbors in the nprobe nearest clusters, and enters the neighbor lists of the
+ * points of those clusters it is closer to than their current K-th neighbor. The centroids
+ * are not updated. Each new point is compared with all the Kc centroids, which costs
+ * O(n * Kc * L) on top of the searches of the clusters.
+ *
+ * @param graph                   The graph.
+ * @param X                       Pointer to the new points, an array of n points each with L dimensions.
+ * @param n                       Number of new points.
+ * @param ids                     Output array (size n) with the identifiers of the new points, or NULL.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_graph_insert(a2a_graph_t *graph, const DTYPE* X, const int n, int* ids, const int nthreads,
+    parallelization_type_t par_type);
+
+
+/**
+ * Deletes points from the graph. The points are marked as deleted and the neighbor lists
+ * that referenced them are searched again in their clusters, keeping their live neighbors
+ * from other clusters. Deleting a point twice has no effect.
+ *
+ * @param graph                   The graph.
+ * @param ids                     Identifiers of the points to delete (n elements).
+ * @param n                       Number of points to delete.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_graph_delete(a2a_graph_t *graph, const int* ids, const int n, const int nthreads,
+    parallelization_type_t par_type);
+
+
+/**
+ * Returns the number of identifiers handed out, deleted points included.
+ *
+ * @param graph                   The graph.
+ *
+ * @return                        The number of rows of the graph.
+ */
+int a2a_graph_size(const a2a_graph_t *graph);
+
+
+/**
+ * Returns non-zero if a point has been deleted.
+ *
+ * @param graph                   The graph.
+ * @param id                      Identifier of the point.
+ *
+ * @return                        Non-zero if the point is deleted, 0 otherwise.
+ */
+int a2a_graph_is_deleted(const a2a_graph_t *graph, const int id);
+
+
+/**
+ * Gives access to the neighbor lists, a2a_graph_size(graph) rows of K entries sorted by
+ * distance. Missing neighbors are set to -1 and INF, the rows of deleted points hold only
+ * missing neighbors. The pointers are invalidated by a2a_graph_insert.
+ *
+ * @param graph                   The graph.
+ * @param IDX                     Output, the indices of the neighbors.
+ * @param D                       Output, the distances to the neighbors.
+ */
+void a2a_graph_rows(const a2a_graph_t *graph, const int** IDX, const DTYPE** D);
+
+
+/**
+ * Releases a graph created by a2a_graph_build.
+ *
+ * @param graph                   The graph (may be NULL).
+ */
+void a2a_graph_free(a2a_graph_t *graph);
+
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef A2A_HNSW_H
+#define A2A_HNSW_H
+
+#include "a2a_config.h"
+
+
+/**
+ * Settings of the HNSW graph construction. Always initialize the structure with
+ * a2a_hnsw_options_init before overriding individual fields.
+ */
+typedef struct {
+    int M;                      // Maximum number of neighbors of a point on the upper levels,
+                                // the bottom level keeps up to 2 * M
+    int ef_construction;        // Size of the candidate list when inserting a point
+    unsigned int seed;          // Seed of the random levels of the points
+} a2a_hnsw_options_t;
+
+
+/**
+ * Hierarchical navigable small world (HNSW) graph index. Created with a2a_hnsw_build and
+ * released with a2a_hnsw_free.
+ */
+typedef struct a2a_hnsw a2a_hnsw_t;
+
+
+/**
+ * Fills the options with their default values.
+ *
+ * @param opts the options to initialize
+ */
+void a2a_hnsw_options_init(a2a_hnsw_options_t *opts);
+
+
+/**
+ * Builds an HNSW graph over a dataset. The points are inserted in parallel, every
+ * neighbor list has its own lock. The index refers to the dataset without copying it,
+ * so C must stay valid and unchanged until the index is released.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ * @param opts                    The settings, or NULL for the defaults.
+ * @param index                   Output, the new index.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_hnsw_build(const DTYPE* C, const int N, const int L, const int nthreads,
+    parallelization_type_t par_type, const a2a_hnsw_options_t *opts, a2a_hnsw_t **index);
+
+
+/**
+ * Finds approximate K nearest neighbors of query points by a greedy descent through the
+ * levels of the graph followed by a best-first search of the bottom level. Queries taken
+ * from the indexed dataset find themselves at distance zero.
+ *
+ * @param index                   The index.
+ * @param Q                       Pointer to the queries, an array of M points each with L dimensions.
+ * @param M                       Number of queries.
+ * @param K                       Number of nearest neighbors to find per query.
+ * @param ef                      Size of the candidate list of the search (raised to K if smaller).
+ *                                Larger values give higher recall at a higher cost.
+ * @param IDX                     Output array (size M * K) with the indices of the neighbors, sorted
+ *                                by distance. Missing neighbors, when the index holds fewer than K
+ *                                points, are set to -1.
+ * @param D                       Output array (size M * K) with the distances to the neighbors.
+ *                                Missing neighbors are set to INF.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_hnsw_search(const a2a_hnsw_t *index, const DTYPE* Q, const int M, const int K, const int ef,
+    int* IDX, DTYPE* D, const int nthreads, parallelization_type_t par_type);
+
+
+/**
+ * Computes an approximate all-to-all kNN graph of the indexed dataset by searching the
+ * index with every one of its points. Points are never their own neighbors.
+ *
+ * @param index                   The index.
+ * @param K                       Number of neighbors per point (less than the number of indexed points).
+ * @param ef                      Size of the candidate list of the search (raised to K + 1 if smaller).
+ * @param IDX                     Output array (size N * K) with the indices of the neighbors, sorted
+ *                                by distance.
+ * @param D                       Output array (size N * K) with the distances to the neighbors.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_hnsw_all_to_all(const a2a_hnsw_t *index, const int K, const int ef, int* IDX, DTYPE* D,
+    const int nthreads, parallelization_type_t par_type);
+
+
+/**
+ * Releases an HNSW index created by a2a_hnsw_build.
+ *
+ * @param index                   The index (may be NULL).
+ */
+void a2a_hnsw_free(a2a_hnsw_t *index);
+
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef A2A_IVF_H
+#define A2A_IVF_H
+
+#include <stddef.h>
+#include "a2a_config.h"
+#include "a2a_ann.h"
+
+#define A2A_IVF_VERSION 1                 // Version of the file format written by a2a_ivf_save
+
+
+/**
+ * Inverted file (IVF) index: the k-means centroids of a dataset and its points stored in
+ * cluster order, so that the points of a cluster are contiguous. Created with a2a_ivf_build
+ * or a2a_ivf_load and released with a2a_ivf_free. All fields are read-only.
+ */
+typedef struct {
+    int N;                          // Number of indexed points
+    int L;                          // Dimension of the points
+    int Kc;                         // Number of clusters
+    const DTYPE* centroids;         // Centroids of the clusters (Kc x L)
+    const DTYPE* sqrmag_centroids;  // Squared magnitudes of the centroids (Kc elements)
+    const DTYPE* data;              // Points in cluster order (N x L)
+    const DTYPE* sqrmag;            // Squared magnitudes of the rows of data (N elements)
+    const int* ids;                 // Original index of each row of data (N elements)
+    const int* offsets;             // Cluster k owns the rows [offsets[k], offsets[k + 1]) (Kc + 1 elements)
+    void* image;                    // Memory holding the header and all the arrays, laid out as the file
+    size_t size;                    // Size of the image in bytes
+    int mapped;                     // Non-zero if the image is a memory mapped file
+} a2a_ivf_t;
+
+
+/**
+ * Builds an IVF index by clustering the dataset with the k-means of a2a_annsearch.
+ * Empty clusters are dropped, so the index may hold fewer than Kc clusters.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param Kc                      Number of clusters to partition the data into (less than N).
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1).
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ * @param opts                    Clustering options (coarse_clusters and max_cluster_size), or NULL
+ *                                for the defaults.
+ * @param index                   Output, the new index.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_ivf_build(const DTYPE* C, const int N, const int L, const int Kc, const int nthreads,
+    const double max_memory_usage_ratio, parallelization_type_t par_type,
+    const a2a_ann_options_t *opts, a2a_ivf_t **index);
+
+
+/**
+ * Writes an IVF index to a file. The file stores the image of the index as is, in the
+ * byte order and precision of the library that built it.
+ *
+ * @param index                   The index.
+ * @param path                    Path of the file.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_ivf_save(const a2a_ivf_t *index, const char *path);
+
+
+/**
+ * Loads an IVF index written by a2a_ivf_save by memory mapping the file, so the cost of
+ * loading does not depend on the size of the index. The file must have been written by
+ * a library with the same precision and byte order.
+ *
+ * @param path                    Path of the file.
+ * @param index                   Output, the loaded index.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_ivf_load(const char *path, a2a_ivf_t **index);
+
+
+/**
+ * Finds approximate K nearest neighbors of new query points by searching the nprobe
+ * clusters with the nearest centroids to each query. Queries taken from the indexed
+ * dataset find themselves at distance zero.
+ *
+ * @param index                   The index.
+ * @param Q                       Pointer to the queries, an array of M points each with L dimensions.
+ * @param M                       Number of queries.
+ * @param K                       Number of nearest neighbors to find per query.
+ * @param nprobe                  Number of clusters searched per query (capped to the number of clusters).
+ * @param IDX                     Output array (size M * K) with the original indices of the neighbors,
+ *                                sorted by distance. Missing neighbors, when the probed clusters hold
+ *                                fewer than K points, are set to -1.
+ * @param D                       Output array (size M * K) with the distances to the neighbors.
+ *                                Missing neighbors are set to INF.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1). Concurrent
+ *                                searches must pass the same ratio (see a2a_knnsearch).
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_ivf_search(const a2a_ivf_t *index, const DTYPE* Q, const int M, const int K,
+    const int nprobe, int* IDX, DTYPE* D, const int nthreads, const double max_memory_usage_ratio,
+    parallelization_type_t par_type);
+
+
+/**
+ * Releases an IVF index created by a2a_ivf_build or a2a_ivf_load.
+ *
+ * @param index                   The index (may be NULL).
+ */
+void a2a_ivf_free(a2a_ivf_t *index);
+
+
+#endif
@@ -2,6 +2,7 @@
 #define A2A_KNN_H
 
 #include "a2a_config.h"
+#include "a2a_stats.h"
 
 #define MIN_QUERIES_PER_BLOCK 1           // Minimum number of queries per block
 
@@ -38,6 +39,9 @@
  *   ||Q - C||^2 = ||Q||^2 + ||C||^2 - 2 * Q * C^T.
  * - The function splits work into memory-friendly blocks automatically based on
  *   max_memory_usage_ratio.
+ * - Concurrent searches of the process (kNN, ANN and IVF) share the budget of the first one to
+ *   start and must pass the same max_memory_usage_ratio: a search with another ratio fails
+ *   while they run.
  * - Multi-threading is supported via pthreads, and matrix multiplications are accelerated via BLAS.
  * - IDX and D must be allocated by the caller before the function is called.
  */
@@ -45,4 +49,87 @@ int a2a_knnsearch(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int
     const int N, const int L, const int K, const int sorted, const int nthreads,
     const int cblas_nthreads, const double max_memory_usage_ratio, parallelization_type_t par_type);
 
+
+/**
+ * Same as a2a_knnsearch, and fills stats with the time spent in each phase, the bytes of
+ * the distance blocks, the busy and idle time of the threads and the time the tasks waited
+ * in the queue of the pthread pool.
+ *
+ * @param stats The stats to fill (see a2a_stats_t), or NULL to skip the collection.
+ *
+ * @return 0 (EXIT_SUCCESS) if the computation was successful; 1 (EXIT_FAILURE) otherwise.
+ */
+int a2a_knnsearch_ex(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
+    const int N, const int L, const int K, const int sorted, const int nthreads,
+    const int cblas_nthreads, const double max_memory_usage_ratio, parallelization_type_t par_type,
+    a2a_stats_t* stats);
+
+
+/**
+ * Reusable buffers of a single-threaded k-NN search. The buffers grow on demand up to
+ * a memory limit and are kept between searches, so repeated searches of similar size
+ * perform no allocation. Inside a search, their bytes are reserved in the memory budget
+ * the threads of the process share, and the blocks shrink when the budget runs short.
+ */
+typedef struct a2a_KnnWorkspace {
+    DTYPE *D_block;              // Distance matrix of a block of queries
+    int *IDX_block;              // Index matrix of a block of queries
+    DTYPE *sqrmag_Q_block;       // Squared magnitudes of the queries of a block
+    DTYPE *sqrmag_C;             // Squared magnitudes of the corpus vectors
+    size_t block_capacity;       // Number of elements of D_block and IDX_block
+    int queries_capacity;        // Number of elements of sqrmag_Q_block
+    int corpus_capacity;         // Number of elements of sqrmag_C
+    size_t max_bytes;            // Memory limit of the buffers
+    size_t reserved_bytes;       // Bytes of the buffers reserved in the memory budget
+} a2a_KnnWorkspace;
+
+
+/**
+ * Initializes an empty workspace.
+ * 
+ * @param ws the workspace
+ * @param max_memory_usage_ratio Fraction of the available memory the buffers may use (value between 0 and 1], 
+ *        measured when the search in progress started or, outside of a search, now.
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE if the ratio is invalid
+ */
+int a2a_KnnWorkspaceInit(a2a_KnnWorkspace *ws, const double max_memory_usage_ratio);
+
+
+/**
+ * Grows the buffers of the workspace so that a search of M queries against N corpus
+ * vectors needs no further allocation.
+ * 
+ * @param ws the workspace
+ * @param M the number of queries
+ * @param N the number of corpus vectors
+ * @param queries_per_block stores the number of queries processed per block (may be NULL)
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE if the memory limit or the allocation fails
+ */
+int a2a_KnnWorkspaceReserve(a2a_KnnWorkspace *ws, const int M, const int N, int *queries_per_block);
+
+
+/**
+ * Frees the buffers of the workspace and returns their bytes to the memory budget.
+ * 
+ * @param ws the workspace
+ */
+void a2a_KnnWorkspaceDestroy(a2a_KnnWorkspace *ws);
+
+
+/**
+ * Single-threaded version of a2a_knnsearch that keeps its buffers in a caller-provided
+ * workspace. It does not touch any global state, so independent threads may call it
+ * concurrently with their own workspaces.
+ * 
+ * The parameters Q, C, IDX, D, M, N, L, K and sorted are the same as in a2a_knnsearch.
+ * @param sqrmag_Q Precomputed squared magnitudes of the rows of Q (M elements), or NULL to compute them.
+ * @param sqrmag_C Precomputed squared magnitudes of the rows of C (N elements), or NULL to compute them.
+ * @param ws The workspace, initialized with a2a_KnnWorkspaceInit.
+ *
+ * @return 0 (EXIT_SUCCESS) if the computation was successful; 1 (EXIT_FAILURE) otherwise.
+ */
+int a2a_knnsearch_ws(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
+    const int N, const int L, const int K, const int sorted, const DTYPE* sqrmag_Q, 
+    const DTYPE* sqrmag_C, a2a_KnnWorkspace *ws);
+
 #endif // KNNSEARCH_H
@@ -0,0 +1,74 @@
+#ifndef A2A_NNDESCENT_H
+#define A2A_NNDESCENT_H
+
+#include "a2a_config.h"
+
+#define A2A_NNDESCENT_AUTO -1             // Let NN-descent choose the value of a setting
+
+
+/**
+ * Settings of NN-descent. Always initialize the structure with a2a_nndescent_options_init
+ * before overriding individual fields.
+ */
+typedef struct {
+    int max_iterations;         // Maximum number of local join iterations
+    double sample_rate;         // Share of the K neighbors sampled per node and iteration (0, 1]
+    double delta;               // Stop when an iteration improves fewer than delta * N * K entries
+    int random_candidates;      // Random points joined with the neighbors of each point per iteration,
+                                // which lets separate parts of the graph find each other.
+                                // A2A_NNDESCENT_AUTO uses none from a random graph and the sample
+                                // size (sample_rate * K) when refining.
+    unsigned int seed;          // Seed of the random initial graph and of the sampling
+} a2a_nndescent_options_t;
+
+
+/**
+ * Fills the options with their default values.
+ *
+ * @param opts the options to initialize
+ */
+void a2a_nndescent_options_init(a2a_nndescent_options_t *opts);
+
+
+/**
+ * Improves an approximate all-to-all kNN graph with NN-descent: in every iteration each
+ * point compares the sampled neighbors and reverse neighbors it has not joined yet with
+ * each other and with its older neighbors, since the neighbors of neighbors are likely
+ * to be neighbors.
+ *
+ * IDX and D hold the initial graph on entry, e.g. the output of a2a_annsearch. Points
+ * are never their own neighbors. Entries set to -1 are treated as missing and filled by
+ * the refinement. On return each row is sorted by distance.
+ *
+ * The initial neighbors are taken as already joined with each other, as in a graph made
+ * of exactly solved clusters. Improvements start from the random candidates and spread
+ * through the graph over the following iterations, so random_candidates must not be 0.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param K                       Number of neighbors per point (less than N).
+ * @param IDX                     Input and output array (size N * K) with the indices of the neighbors.
+ * @param D                       Input and output array (size N * K) with the distances to the neighbors.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ * @param opts                    The settings, or NULL for the defaults.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_nndescent_refine(const DTYPE* C, const int N, const int L, const int K, int* IDX,
+    DTYPE* D, const int nthreads, parallelization_type_t par_type,
+    const a2a_nndescent_options_t *opts);
+
+
+/**
+ * Computes an approximate all-to-all kNN graph with NN-descent, starting from a random
+ * graph. Same parameters as a2a_nndescent_refine, with IDX and D as outputs only.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_nndescent(const DTYPE* C, const int N, const int L, const int K, int* IDX, DTYPE* D,
+    const int nthreads, parallelization_type_t par_type, const a2a_nndescent_options_t *opts);
+
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef A2A_PARALLEL_H
+#define A2A_PARALLEL_H
+
+#include <stddef.h>
+#include "a2a_config.h"
+
+
+/**
+ * Function executed by a worker
+ * 
+ * @param arg the argument of the worker
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE otherwise
+ */
+typedef int (*a2a_WorkerFunc)(void *arg);
+
+
+/**
+ * Runs a group of workers in parallel and waits for all of them to finish.
+ * Worker i receives the argument (char *)args + i * arg_size.
+ * 
+ * With PAR_PTHREADS every worker gets its own thread. With OpenMP and OpenCilk the
+ * workers are the iterations of a parallel loop, so all of them run even if the
+ * runtime grants fewer threads, but some may run one after the other. Workers
+ * must therefore never wait for a worker that has not started yet.
+ * 
+ * OpenBLAS is limited to one thread while several workers run, so that the GEMM calls of
+ * the workers do not oversubscribe the cores, and its thread count is restored afterwards.
+ * 
+ * @param func the function executed by the workers
+ * @param args the array of worker arguments
+ * @param arg_size the size of each worker argument in bytes
+ * @param nworkers the number of workers
+ * @param par_type the type of parallelization (PTHREADS, OpenMP or OpenCilk)
+ * @return EXIT_SUCCESS if all workers succeeded and EXIT_FAILURE otherwise
+ */
+int a2a_ParallelRun(a2a_WorkerFunc func, void *args, size_t arg_size, int nworkers, 
+    parallelization_type_t par_type);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef A2A_PQ_H
+#define A2A_PQ_H
+
+#include "a2a_config.h"
+
+
+/**
+ * Product quantizer: the vectors are split into m subspaces of L / m dimensions, and each
+ * subvector is replaced by the index of its nearest centroid in that subspace. A vector is
+ * then stored in code_size bytes instead of L elements.
+ *
+ * Codes are stored one vector after the other. With 8 bits the byte j of a code is the
+ * centroid of subspace j. With 4 bits the byte j holds subspace 2j in its low nibble and
+ * subspace 2j + 1 in its high nibble.
+ *
+ * Created with a2a_pq_train and released with a2a_pq_free. All fields are read-only.
+ */
+typedef struct {
+    int L;                          // Dimension of the vectors
+    int m;                          // Number of subspaces
+    int nbits;                      // Bits per subspace code (4 or 8)
+    int ksub;                       // Number of centroids per subspace (2^nbits)
+    int dsub;                       // Dimension of a subspace (L / m)
+    int code_size;                  // Bytes per encoded vector
+    DTYPE* centroids;               // Centroids of the subspaces (m x ksub x dsub)
+} a2a_pq_t;
+
+
+/**
+ * Trains a product quantizer with a k-means in each subspace, on an evenly spaced sample
+ * of the dataset.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param m                       Number of subspaces (a divisor of L).
+ * @param nbits                   Bits per subspace code, 4 or 8.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1).
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ * @param pq                      Output, the new quantizer.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_pq_train(const DTYPE* C, const int N, const int L, const int m, const int nbits,
+    const int nthreads, const double max_memory_usage_ratio, parallelization_type_t par_type,
+    a2a_pq_t **pq);
+
+
+/**
+ * Encodes vectors with a product quantizer.
+ *
+ * @param pq                      The quantizer.
+ * @param X                       Pointer to the vectors, an array of n points each with pq->L dimensions.
+ * @param n                       Number of vectors.
+ * @param codes                   Output array (size n * pq->code_size) with the codes.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_pq_encode(const a2a_pq_t *pq, const DTYPE* X, const int n, unsigned char* codes,
+    const int nthreads, parallelization_type_t par_type);
+
+
+/**
+ * Releases a product quantizer created by a2a_pq_train.
+ *
+ * @param pq                      The quantizer (may be NULL).
+ */
+void a2a_pq_free(a2a_pq_t *pq);
+
+
+#endif
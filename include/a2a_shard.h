@@ -0,0 +1,67 @@
+#ifndef A2A_SHARD_H
+#define A2A_SHARD_H
+
+#include "a2a_config.h"
+
+
+/**
+ * Optional settings of the sharded ANN search. Always initialize the structure with
+ * a2a_shard_options_init before overriding individual fields.
+ */
+typedef struct {
+    int nprocs;                 // Number of worker processes (ranks)
+    int nprobe;                 // Number of clusters searched per point, its own and the nprobe - 1 next
+                                // nearest (capped to the number of clusters)
+    int max_iterations;         // Maximum number of k-means iterations, which stop early once no point
+                                // changes cluster. 1 leaves the centroids one update away from the
+                                // random seeds, like the single assignment pass of a2a_annsearch.
+    unsigned int seed;          // Seed of the initial centroids
+} a2a_shard_options_t;
+
+
+/**
+ * Fills the options with their default values: 2 processes, 1 probe and up to 10 k-means
+ * iterations.
+ *
+ * @param opts the options to initialize
+ */
+void a2a_shard_options_init(a2a_shard_options_t *opts);
+
+
+/**
+ * Performs the all-to-all ANN search of a2a_annsearch with several worker processes that
+ * exchange data through a shared memory mapping, so that the search scales past the cores
+ * one process can use well and the steps can be tested on one machine.
+ *
+ * Each rank owns a contiguous range of points. The ranks compute the k-means centroids
+ * collectively: every rank assigns its points and sums them per cluster, and every rank
+ * reduces the sums of a range of clusters. The clusters are then distributed to the ranks
+ * by cost, each rank routes each of its points to the owners of the clusters it probes, the
+ * owners search their clusters for the points routed to them, and the rank of each point
+ * merges the top K lists of its probes. Points are not their own neighbors.
+ *
+ * The ranks are forked from the calling process and use pthreads, since the OpenMP and
+ * OpenCilk runtimes of the caller cannot be used in a forked child.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param K                       Number of nearest neighbors to find per point.
+ * @param Kc                      Number of clusters to partition the data into.
+ * @param IDX                     Output array (size N * K) to store indices of nearest neighbors, sorted
+ *                                by distance. Missing neighbors are set to -1.
+ * @param D                       Output array (size N * K) to store distances to nearest neighbors.
+ *                                Missing neighbors are set to INF.
+ * @param nthreads                Number of threads of each process.
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1), shared by the processes.
+ *                                The shared mapping of the candidates (N * nprobe * K neighbors) counts in it.
+ * @param opts                    The options, or NULL for the defaults (see a2a_shard_options_t).
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ */
+int a2a_sharded_annsearch(const DTYPE* C, const int N, const int L, const int K, const int Kc,
+    int* IDX, DTYPE* D, const int nthreads, const double max_memory_usage_ratio,
+    const a2a_shard_options_t *opts);
+
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef A2A_STATS_H
+#define A2A_STATS_H
+
+#include <stdio.h>
+
+#define A2A_STATS_MAX_THREADS 256         // Threads with their own busy and idle times, the others share the last slot
+#define A2A_STATS_HISTOGRAM_BINS 32       // Bins of the cluster size histogram, bin b counts the sizes in [2^b, 2^(b+1))
+
+
+/**
+ * Phases of the searches. The kernel phases (GEMM, SELECTION and COPY_OUT) run inside the
+ * other phases and are counted in both, as are the phases of the k-means run by the training
+ * of the product quantizer.
+ */
+typedef enum {
+    A2A_PHASE_SEEDING,                    // Choice of the initial centroids
+    A2A_PHASE_ASSIGNMENT,                 // Assignment of the points to centroids or tree leaves
+    A2A_PHASE_CENTROID_UPDATE,            // Averaging of the assigned points
+    A2A_PHASE_MERGE,                      // Merging of undersized and splitting of oversized clusters
+    A2A_PHASE_CLUSTER_INDEX,              // Point index of the clusters and copy of the data in cluster order
+    A2A_PHASE_QUANTIZATION,               // Training of the product quantizer and encoding of the points
+    A2A_PHASE_CLUSTER_SEARCH,             // Search of the clusters
+    A2A_PHASE_GEMM,                       // Distance matrices of the k-NN kernel
+    A2A_PHASE_SELECTION,                  // Selection of the K nearest of each query
+    A2A_PHASE_COPY_OUT,                   // Copy of the neighbors to the output matrices
+    A2A_PHASE_REFINE,                     // NN-descent refinement of the result
+    A2A_PHASE_COUNT
+} a2a_phase_t;
+
+
+/**
+ * Time spent in a phase. Phases run by several threads at once add up the time of every
+ * thread, so their wall time may exceed the wall time of the search.
+ */
+typedef struct {
+    double wall_seconds;        // Elapsed time
+    double cpu_seconds;         // CPU time of the threads running the phase
+    long long calls;            // Number of times the phase ran
+} a2a_phase_stats_t;
+
+
+/**
+ * Counters of a search, filled by a2a_knnsearch_ex and by a2a_annsearch_ex when the
+ * stats field of the options is set. The counters are reset at the start of the search.
+ * Collection takes a few clock reads per phase and per task, so it may be left enabled.
+ * The memory counters cover every allocation of the library during the search, but not
+ * the inputs and outputs of the caller nor the buffers of OpenBLAS.
+ */
+typedef struct {
+    double wall_seconds;                                  // Elapsed time of the search
+    double cpu_seconds;                                   // CPU time of the process during the search
+    a2a_phase_stats_t phases[A2A_PHASE_COUNT];            // Time spent in each phase
+    long long bytes_allocated;                            // Bytes allocated by the search, freed or not
+    long long peak_bytes;                                 // Peak of the bytes allocated by the search and not
+                                                          // yet freed
+    long long phase_peak_bytes[A2A_PHASE_COUNT];          // Peak of the bytes in use while any thread ran the
+                                                          // phase
+    int memory_threads;                                   // Number of threads that allocated
+    long long thread_peak_bytes[A2A_STATS_MAX_THREADS];   // Peak of the bytes allocated and not yet freed by each
+                                                          // thread, in the order of their first allocation
+    long long memory_budget_bytes;                        // max_memory_usage_ratio times the memory available
+                                                          // when the first of the searches in progress started
+    double budget_usage;                                  // peak_bytes over memory_budget_bytes, above 1 when
+                                                          // the search exceeded its budget
+    int nthreads;                                         // Number of threads that ran parallel work
+    double busy_seconds[A2A_STATS_MAX_THREADS];           // Time each thread spent running work
+    double idle_seconds[A2A_STATS_MAX_THREADS];           // Time each thread spent waiting for work or for the
+                                                          // other threads to finish
+    double load_imbalance;                                // Busy time of the busiest thread over the mean busy
+                                                          // time (1 is perfectly balanced, 0 without threads)
+    long long cluster_size_histogram[A2A_STATS_HISTOGRAM_BINS]; // Number of clusters per size bin
+    int num_clusters;                                     // Number of clusters searched, over all trees
+    int min_cluster_size;                                 // Size of the smallest cluster
+    int max_cluster_size;                                 // Size of the largest cluster
+    double queue_wait_seconds;                            // Time tasks spent in the queue of the pthread pool
+                                                          // of a2a_knnsearch_ex before a thread took them
+    long long queue_tasks;                                // Number of tasks that went through the queue
+} a2a_stats_t;
+
+
+/**
+ * Function called by a thread when it enters (begin non-zero) and leaves a phase, e.g. to
+ * read hardware counters. It runs on the thread of the phase, concurrently with the other
+ * threads, and phases of different kinds nest.
+ */
+typedef void (*a2a_phase_hook_t)(a2a_phase_t phase, int begin, void *arg);
+
+
+/**
+ * Clears all the counters.
+ *
+ * @param stats the stats to clear
+ */
+void a2a_stats_reset(a2a_stats_t *stats);
+
+
+/**
+ * Returns the name of a phase, e.g. "gemm".
+ *
+ * @param phase the phase
+ * @return the name of the phase, or "unknown"
+ */
+const char *a2a_stats_phase_name(a2a_phase_t phase);
+
+
+/**
+ * Prints the counters in a human readable form.
+ *
+ * @param stats the stats to print
+ * @param stream the output stream
+ */
+void a2a_stats_print(const a2a_stats_t *stats, FILE *stream);
+
+
+/**
+ * Installs a function called at the start and the end of every phase of every search,
+ * whether or not the search collects stats. Must not be called while a search runs.
+ *
+ * @param hook the function, or NULL to remove it
+ * @param arg the argument passed to the function
+ */
+void a2a_stats_set_phase_hook(a2a_phase_hook_t hook, void *arg);
+
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef A2A_TRACE_H
+#define A2A_TRACE_H
+
+#define A2A_TRACE_DEFAULT_EVENTS 65536    // Events kept per thread when a2a_trace_start gets 0
+
+
+/**
+ * Starts recording the timelines of the searches: the phases, the workers of every parallel
+ * region and their joins, the blocks and tasks of the k-NN search with the waits for their
+ * completion, and the clusters of the ANN search. Each thread records into its own ring buffer
+ * without locks, and keeps its latest events once the buffer is full. The events recorded
+ * before are discarded and the buffers kept from them take the new capacity.
+ *
+ * Must not be called while a search runs.
+ *
+ * @param events_per_thread the capacity of the buffer of each thread, 0 for A2A_TRACE_DEFAULT_EVENTS
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE if the capacity is negative or the buffers
+ *         cannot be allocated
+ */
+int a2a_trace_start(int events_per_thread);
+
+
+/**
+ * Stops recording. The events are kept until the next a2a_trace_start.
+ */
+void a2a_trace_stop(void);
+
+
+/**
+ * Writes the recorded events in the Chrome trace event format, which Perfetto and
+ * chrome://tracing open. Each thread is a track, with the cluster id or the first query of a
+ * block in the arguments of the events. Threads created one after the other, like the workers
+ * of successive parallel regions, may share a track.
+ *
+ * Must not be called while a search runs.
+ *
+ * @param path the path of the JSON file
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE if the file cannot be written
+ */
+int a2a_trace_write(const char *path);
+
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef A2A_TUNE_H
+#define A2A_TUNE_H
+
+#include "a2a_config.h"
+#include "a2a_ann.h"
+
+#define A2A_TUNE_CANDIDATES 48            // Values of Kc compared by the models, evenly spaced in log scale
+
+
+/**
+ * Goals and budget of the tuning of the ANN search. Always initialize the structure with
+ * a2a_tune_options_init before overriding individual fields.
+ */
+typedef struct {
+    double target_recall;       // Minimum recall of the chosen configuration (between 0 and 1). The fastest
+                                // configuration that reaches it is chosen. 0 disables the target.
+    double time_budget;         // Maximum time in seconds of the chosen search. Without a recall target, the
+                                // configuration with the highest recall within the budget is chosen.
+                                // 0 disables the budget.
+    int sample_size;            // Number of random points whose exact neighbors measure the recall
+    int max_probes;             // Maximum number of searches run to fit the models (at least 2)
+    int cache_multiple;         // Clusters hold at most cache_multiple times the number of points whose
+                                // self-join fits in the last level cache. 1 keeps the clusters in the cache,
+                                // larger values trade cache misses for recall.
+    unsigned int seed;          // Seed of the sample
+} a2a_tune_options_t;
+
+
+/**
+ * Configuration chosen by a2a_tune_annsearch, with its predicted performance.
+ */
+typedef struct {
+    int Kc;                     // Number of clusters to pass to a2a_annsearch_ex
+    a2a_ann_options_t options;  // Options to pass to a2a_annsearch_ex
+    double recall;              // Predicted recall
+    double seconds;             // Predicted time of the search
+    double throughput;          // Predicted number of points per second
+    int goal_met;               // Non-zero if the predictions meet the recall target and the time budget
+    int probes;                 // Number of searches run
+} a2a_tune_result_t;
+
+
+/**
+ * Fills the tuning options with their default values: a recall target of 0.9, no time
+ * budget, 1000 sample points, 6 probe searches and clusters that fit in the cache.
+ *
+ * @param opts the options to initialize
+ */
+void a2a_tune_options_init(a2a_tune_options_t *opts);
+
+
+/**
+ * Chooses the number of clusters of a2a_annsearch_ex for a dataset. The recall is measured on
+ * a random sample of points, against their exact neighbors found with a2a_knnsearch. A few
+ * probe searches on the whole dataset fit a model of the recall, interpolated in log(Kc), and
+ * a cost model of the time, a * Kc + b / Kc + c for the clustering and the searches of the
+ * clusters. Each probe is placed where the models predict the best configuration, or, when
+ * that configuration was probed and misses the goals, in the middle in log(Kc) of a gap between
+ * the probes next to it, since the recall need not fall as Kc grows.
+ *
+ * A maximum cluster size of 0 in the base options is replaced by cache_multiple times the
+ * number of points whose self-join fits in the last level cache, and the number of clusters
+ * starts at N over the maximum cluster size, so that the clusters of the chosen configuration
+ * respect the cache. The time budget applies to the chosen search, not to the tuning.
+ *
+ * @param C                       Pointer to the dataset, an array of N points each with L dimensions.
+ * @param N                       Number of data points.
+ * @param L                       Dimensionality of each data point.
+ * @param K                       Number of nearest neighbors to find per point.
+ * @param nthreads                Number of threads to use for parallel computation.
+ * @param max_memory_usage_ratio  Maximum allowed memory usage ratio (between 0 and 1).
+ * @param par_type                Type of parallelization (PTHREADS, OpenMP or OpenCilk).
+ * @param base                    Search options kept in the chosen configuration, or NULL for the defaults.
+ * @param opts                    Tuning options, or NULL for the defaults.
+ * @param result                  Output, the chosen configuration.
+ *
+ * @return                        EXIT_SUCCESS (0) on success, or EXIT_FAILURE (non-zero) on error.
+ *                                A configuration that misses the goals is not an error (see goal_met).
+ */
+int a2a_tune_annsearch(const DTYPE* C, const int N, const int L, const int K, const int nthreads,
+    const double max_memory_usage_ratio, parallelization_type_t par_type, const a2a_ann_options_t *base,
+    const a2a_tune_options_t *opts, a2a_tune_result_t *result);
+
+
+#endif
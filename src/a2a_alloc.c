@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "a2a_alloc.h"
+#include "a2a_collector.h"
+#include "a2a_memory.h"
+
+
+// Header in front of every block. The union keeps the blocks aligned like those of malloc.
+typedef union {
+    struct {
+        size_t bytes;                    // Size requested by the caller
+        size_t offset;                   // Distance from the start of the underlying block to the header
+        long long search;                // Id of the search that allocated the block, 0 without stats
+        int charged;                     // Whether the block is counted in the memory budget
+    } info;
+    max_align_t align;
+} AllocHeader;
+
+
+// Memory of the calling thread in the search with id thread_search, see record_alloc
+static _Thread_local long long thread_search = 0;
+static _Thread_local long long thread_bytes = 0;
+static _Thread_local int thread_slot = 0;
+
+
+static void atomic_max_llong(atomic_llong *target, const long long value) {
+    long long current = atomic_load_explicit(target, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak(target, &current, value));
+}
+
+
+// Counts a new block in the collector of the calling thread: the total, the bytes in use and
+// their peak overall, in the phases running on any thread and for the thread itself
+static void record_alloc(AllocHeader *header, const size_t bytes, const size_t offset) {
+    a2a_StatsCollector *collector = a2a_collector;
+    header->info.bytes = bytes;
+    header->info.offset = offset;
+    header->info.search = collector ? collector->id : 0;
+    header->info.charged = 0;
+    if (!collector) return;
+
+    atomic_fetch_add_explicit(&collector->bytes, (long long)bytes, memory_order_relaxed);
+    const long long live = atomic_fetch_add_explicit(&collector->live_bytes, (long long)bytes,
+        memory_order_relaxed) + (long long)bytes;
+    atomic_max_llong(&collector->peak_bytes, live);
+    for (int p = 0; p < A2A_PHASE_COUNT; p++) {
+        if (atomic_load_explicit(&collector->active[p], memory_order_relaxed) > 0) {
+            atomic_max_llong(&collector->phase_peak_bytes[p], live);
+        }
+    }
+
+    // Threads get a slot at their first allocation of the search
+    if (thread_search != collector->id) {
+        thread_search = collector->id;
+        thread_bytes = 0;
+        thread_slot = atomic_fetch_add(&collector->memory_threads, 1);
+    }
+    thread_bytes += (long long)bytes;
+    const int slot = thread_slot < A2A_STATS_MAX_THREADS ? thread_slot : A2A_STATS_MAX_THREADS - 1;
+    atomic_max_llong(&collector->thread_peak_bytes[slot], thread_bytes);
+}
+
+
+// Blocks of another search, or allocated without stats, were never counted
+static void record_free(const AllocHeader *header) {
+    a2a_StatsCollector *collector = a2a_collector;
+    if (!collector || header->info.search != collector->id) return;
+
+    atomic_fetch_sub_explicit(&collector->live_bytes, (long long)header->info.bytes, memory_order_relaxed);
+    if (thread_search == collector->id) thread_bytes -= (long long)header->info.bytes;
+}
+
+
+void *a2a_Malloc(size_t bytes) {
+    if (bytes > SIZE_MAX - sizeof(AllocHeader)) return NULL;
+    AllocHeader *header = (AllocHeader *)malloc(sizeof(AllocHeader) + bytes);
+    if (!header) return NULL;
+    record_alloc(header, bytes, 0);
+    return header + 1;
+}
+
+
+void *a2a_Calloc(size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - sizeof(AllocHeader)) / size) return NULL;
+    const size_t bytes = count * size;
+    AllocHeader *header = (AllocHeader *)calloc(1, sizeof(AllocHeader) + bytes);
+    if (!header) return NULL;
+    record_alloc(header, bytes, 0);
+    return header + 1;
+}
+
+
+void *a2a_MallocCharged(size_t bytes) {
+    if (a2a_MemoryCharge(bytes)) return NULL;
+    void *ptr = a2a_Malloc(bytes);
+    if (!ptr) {
+        a2a_MemoryUncharge(bytes);
+        return NULL;
+    }
+    ((AllocHeader *)ptr - 1)->info.charged = 1;
+    return ptr;
+}
+
+
+void *a2a_Realloc(void *ptr, size_t bytes) {
+    if (!ptr) return a2a_Malloc(bytes);
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+
+    // Aligned blocks are copied, as realloc does not keep their alignment
+    if (header->info.offset != 0) {
+        void *resized = a2a_Malloc(bytes);
+        if (!resized) return NULL;
+        memcpy(resized, ptr, header->info.bytes < bytes ? header->info.bytes : bytes);
+        a2a_Free(ptr);
+        return resized;
+    }
+
+    if (bytes > SIZE_MAX - sizeof(AllocHeader)) return NULL;
+    const AllocHeader old = *header;
+    AllocHeader *resized = (AllocHeader *)realloc(header, sizeof(AllocHeader) + bytes);
+    if (!resized) return NULL;
+    record_free(&old);
+    record_alloc(resized, bytes, 0);
+    return resized + 1;
+}
+
+
+void *a2a_AlignedAlloc(size_t alignment, size_t bytes) {
+    if (alignment < sizeof(AllocHeader)) alignment = sizeof(AllocHeader);
+    if (bytes > SIZE_MAX - sizeof(AllocHeader) - alignment) return NULL;
+    char *block = (char *)malloc(sizeof(AllocHeader) + alignment + bytes);
+    if (!block) return NULL;
+
+    // First aligned address with room for the header in front of it
+    const uintptr_t start = (uintptr_t)(block + sizeof(AllocHeader));
+    char *aligned = block + sizeof(AllocHeader) + ((alignment - start % alignment) % alignment);
+    AllocHeader *header = (AllocHeader *)aligned - 1;
+    record_alloc(header, bytes, (size_t)((char *)header - block));
+    return aligned;
+}
+
+
+void a2a_Free(void *ptr) {
+    if (!ptr) return;
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+    record_free(header);
+    if (header->info.charged) a2a_MemoryUncharge(header->info.bytes);
+    free((char *)header - header->info.offset);
+}
+
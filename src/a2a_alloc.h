@@ -0,0 +1,70 @@
+#ifndef A2A_ALLOC_H
+#define A2A_ALLOC_H
+
+#include <stddef.h>
+
+// Allocator of the library. Every allocation of the searches goes through these functions,
+// which count the bytes in the stats of the search (see a2a_stats_t). Blocks carry a small
+// header, so they must be released with a2a_Free and never with free. Not part of the public API.
+
+
+/**
+ * Same as malloc, with accounting.
+ *
+ * @param bytes the size of the block
+ * @return the block, or NULL on failure
+ */
+void *a2a_Malloc(size_t bytes);
+
+
+/**
+ * Same as calloc, with accounting.
+ *
+ * @param count the number of elements
+ * @param size the size of each element
+ * @return the zeroed block, or NULL on failure or overflow
+ */
+void *a2a_Calloc(size_t count, size_t size);
+
+
+/**
+ * Same as malloc, with the block counted in the memory budget of the searches in progress (see
+ * a2a_MemoryCharge) until it is freed. For blocks of a search that are freed before it ends.
+ *
+ * @param bytes the size of the block
+ * @return the block, or NULL if it does not fit in the budget or on failure
+ */
+void *a2a_MallocCharged(size_t bytes);
+
+
+/**
+ * Same as realloc, with accounting. ptr must come from a2a_Malloc, a2a_Calloc or a2a_Realloc,
+ * blocks of a2a_MallocCharged cannot be resized.
+ *
+ * @param ptr the block to resize, or NULL
+ * @param bytes the new size
+ * @return the resized block, or NULL on failure, in which case ptr is left untouched
+ */
+void *a2a_Realloc(void *ptr, size_t bytes);
+
+
+/**
+ * Same as aligned_alloc, with accounting. The block is resized with a2a_Realloc only at the
+ * cost of losing its alignment, so it should not be.
+ *
+ * @param alignment the alignment, a power of two
+ * @param bytes the size of the block
+ * @return the block, or NULL on failure
+ */
+void *a2a_AlignedAlloc(size_t alignment, size_t bytes);
+
+
+/**
+ * Releases a block of the functions above. NULL is ignored.
+ *
+ * @param ptr the block
+ */
+void a2a_Free(void *ptr);
+
+
+#endif
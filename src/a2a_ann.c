@@ -1,40 +1,134 @@
 #include <stdlib.h>
 #include <string.h>
 #include "a2a_knn.h"
-#include <pthread.h>
+#include "a2a_parallel.h"
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <stdatomic.h>
+#include <pthread.h>
 #include "a2a_ann.h"
+#include "a2a_clustering.h"
+#include "a2a_nndescent.h"
+#include "a2a_pq.h"
+#include "a2a_pq_scan.h"
+#include "a2a_distance.h"
+#include "a2a_collector.h"
+#include "a2a_kernels.h"
+#include "a2a_alloc.h"
+#include "a2a_memory.h"
 
 
 typedef struct {
-    int* indices;
-    int count;
+    int* indices;                        // Original indices of the points of the cluster
+    int count;                           // Number of points of the cluster
+    int offset;                          // Position of the first point of the cluster in cluster order
+    size_t code_offset;                  // Position of the PQ codes of the cluster in the layout
 } ClusterIndex;
 
-// Structure to sort clusters by size
+
+// Points of all clusters stored contiguously in cluster order
+typedef struct {
+    int* perm;                           // perm[pos] is the original index of the point at position pos
+    DTYPE* data;                         // Rows of C in cluster order (NULL if the data is not permuted)
+    DTYPE* sqrmag;                       // Squared magnitudes of the rows of data (NULL if not permuted)
+    unsigned char* codes;                // PQ codes in cluster order, in blocks of A2A_PQ_BLOCK codes
+                                         // per cluster for 4-bit codes (NULL without PQ)
+} ClusterLayout;
+
+
+// Product quantization of the points (see a2a_ann_options_t.pq_subspaces)
+typedef struct {
+    const a2a_pq_t* pq;                  // The quantizer
+    const unsigned char* codes;          // Codes of the points in their original order
+    int candidates;                      // Candidates per point kept by the scan of the codes
+    int rerank;                          // Re-rank the candidates with exact distances
+} PqSearch;
+
+
+// Entry used to order points by a key, e.g. their projection on a split direction
 typedef struct {
+    DTYPE key;
     int id;
-    int size;
-} ClusterSizeEntry;
+} ProjectionEntry;
+
+
+// A unit of work: the query rows [row_begin, row_end) of a cluster searched against the whole cluster
+typedef struct {
+    int cluster_id;
+    int row_begin;
+    int row_end;
+    double cost;
+} WorkItem;
+
+
+// States of the submatrix of a cluster that is shared by several tiles
+enum { SUBMATRIX_EMPTY, SUBMATRIX_LOADING, SUBMATRIX_READY };
+
+
+// Submatrix of a giant cluster, gathered by the first of its tiles and freed by the last one
+typedef struct {
+    DTYPE* C_sub;                        // Rows of C that belong to the cluster
+    size_t charged_bytes;                // Bytes of C_sub counted in the memory budget
+    atomic_int state;                    // SUBMATRIX_EMPTY, SUBMATRIX_LOADING or SUBMATRIX_READY
+    atomic_int pending_tiles;            // Number of tiles that have not finished with C_sub
+} SharedSubmatrix;
+
+
+// Work items shared by all the workers, ordered by descending cost
+typedef struct {
+    WorkItem* items;                     // Work items in the order they are handed out
+    int num_items;                       // Number of items in the queue
+    atomic_int next;                     // Position of the next item to hand out
+    SharedSubmatrix* shared;             // Shared submatrices indexed by cluster (NULL if no cluster is tiled)
+    pthread_mutex_t lock;                // Guards the states of the shared submatrices (only with shared)
+    pthread_cond_t loaded;               // Signaled when a shared submatrix becomes ready (only with shared)
+} WorkQueue;
+
+
+// Scratch buffers of a worker. They grow to the largest work item the worker is handed
+// and are reused for the following items, which are cheaper since the queue is ordered by cost.
+typedef struct {
+    DTYPE* C_sub;                        // Gathered submatrix of the current cluster
+    int points_capacity;                 // Number of rows C_sub can hold
+    DTYPE* dist_sub;                     // Distances of the current rows to their K + 1 neighbors
+    int* idx_sub;                        // Local indices of the K + 1 neighbors of the current rows
+    int rows_capacity;                   // Number of rows dist_sub and idx_sub can hold
+    size_t reserved_bytes;               // Bytes of C_sub, dist_sub and idx_sub reserved in the memory budget
+    a2a_KnnWorkspace knn;                // Buffers of the nested k-NN search
+    int* seen;                           // Row that last listed each point, when merging (N elements, NULL
+                                         // if they do not fit in the memory budget)
+    int* merge_idx;                      // Neighbors of the current row and their merge (2 * K elements)
+    DTYPE* merge_dist;                   // Distances of merge_idx (2 * K elements)
+    DTYPE* lut;                          // PQ lookup table of the current row
+    uint8_t* qlut;                       // Quantized lookup table for 4-bit codes
+    DTYPE* adc_dist;                     // PQ distances of the current row to the codes of the cluster
+    uint16_t* adc_scores;                // Scores of the 4-bit codes of the cluster
+    int codes_capacity;                  // Number of codes adc_dist and adc_scores can hold
+    ProjectionEntry* candidates;         // Max-heap of the nearest codes of the current row
+    int candidates_capacity;             // Number of entries candidates can hold
+} WorkerArena;
 
 
 typedef struct annTask {
-    int* cluster_ids;                    // Cluster indices assigned to this task
-    int num_clusters;                    // Number of clusters in this task
+    WorkQueue* queue;                    // Queue the worker takes work items from
+    int worker_id;                       // Index of the worker
     ClusterIndex* cluster_index;         // Cluster index for this task
+    const ClusterLayout* layout;         // Points in cluster order
+    int N;                               // Number of data points
     int L;                               // Dimension of the data points
     int K;                               // Number of nearest neighbors to find
     const DTYPE* C;                      // Original data matrix
     DTYPE* D;                            // Output distance matrix
     int* IDX;                            // Output index matrix
-    int N;                               // Total number of data points
-    double max_memory_usage_ratio;       // Maximum memory usage ratio
+    int sorted;                          // Sort the neighbors of each row by distance
+    int merge;                           // Merge the results into the sorted rows of IDX and D instead of overwriting them
+    const PqSearch* pq;                  // Product quantization of the points, or NULL to search the full vectors
+    double max_memory_usage_ratio;       // Memory usage ratio of each cluster search
+    WorkerArena arena;                   // Scratch buffers of the worker
 } annTask;
 
 
-static DTYPE distance_squared(const DTYPE* a, const DTYPE* b, int L) {
+DTYPE a2a_DistanceSquared(const DTYPE* a, const DTYPE* b, const int L) {
     DTYPE dist = SUFFIX(0.0);
     for (int i = 0; i < L; ++i) {
         DTYPE diff = a[i] - b[i];
@@ -44,23 +138,329 @@ static DTYPE distance_squared(const DTYPE* a, const DTYPE* b, int L) {
 }
 
 
-static int build_cluster_index(const int* assignments, const int* counts, const int N, 
-    const int Kc, ClusterIndex* cluster_index) {
+void a2a_GatherRows(const DTYPE* C, const int L, const int* indices, const int count, 
+    DTYPE* C_sub) {
 
-    for (int k = 0; k < Kc; ++k) {
-        cluster_index[k].indices = malloc(sizeof(int) * counts[k]);
-        if (!cluster_index[k].indices) return EXIT_FAILURE;
-        cluster_index[k].count = 0;
+    for (int i = 0; i < count; ++i) {
+        int orig_idx = indices[i];
+        for (int l = 0; l < L; ++l)
+            C_sub[i * L + l] = C[orig_idx * L + l];
     }
-    for (int i = 0; i < N; ++i) {
-        int cid = assignments[i];
-        cluster_index[cid].indices[cluster_index[cid].count++] = i;
+}
+
+
+// Points per worker below which the permutation is not worth splitting
+#define MIN_POINTS_PER_PERMUTE_TASK 4096
+
+
+// Worker of the counting sort that stores the points in cluster order
+typedef struct {
+    const DTYPE* C;                      // Original data matrix
+    const int* assignments;              // Cluster of each point
+    int L;                               // Dimension of the data points
+    int Kc;                              // Number of clusters
+    int begin;                           // First point handled by the worker
+    int end;                             // One past the last point handled by the worker
+    int* cursor;                         // Per cluster counters of the worker, then its next write positions
+    int* perm;                           // Output original index of each position
+    DTYPE* data;                         // Output rows in cluster order (may be NULL)
+    DTYPE* sqrmag;                       // Output squared magnitudes of the rows of data
+} PermuteTask;
+
+
+static int permuteCountExec(void* arg) {
+    PermuteTask* task = (PermuteTask *)arg;
+    memset(task->cursor, 0, task->Kc * sizeof(int));
+    for (int i = task->begin; i < task->end; ++i) {
+        task->cursor[task->assignments[i]]++;
     }
+    return EXIT_SUCCESS;
+}
+
 
+static int permuteScatterExec(void* arg) {
+    PermuteTask* task = (PermuteTask *)arg;
+    const int L = task->L;
+    int* perm = task->perm;
+    DTYPE* data = task->data;
+    DTYPE* sqrmag = task->sqrmag;
+
+    for (int i = task->begin; i < task->end; ++i) {
+        const int pos = task->cursor[task->assignments[i]]++;
+        perm[pos] = i;
+        if (data) {
+            const DTYPE* x = task->C + (size_t)i * L;
+            memcpy(data + (size_t)pos * L, x, L * sizeof(DTYPE));
+            sqrmag[pos] = DOT(L, x, 1, x, 1);
+        }
+    }
     return EXIT_SUCCESS;
 }
 
 
+// Stores the points in cluster order with a parallel counting sort. Each worker counts the
+// clusters of a range of points, the counts give every worker a private write position per 
+// cluster, and the workers scatter their points. The points of each cluster keep their original order.
+int a2a_order_by_cluster(const DTYPE* C, const int* assignments, const int* counts, const int N, 
+    const int L, const int Kc, const int nthreads, const parallelization_type_t par_type, 
+    int* perm, DTYPE* data, DTYPE* sqrmag) {
+
+    PermuteTask* tasks = NULL;
+    int* cursors = NULL;
+    int status = EXIT_FAILURE;
+
+    int ntasks = N / MIN_POINTS_PER_PERMUTE_TASK;
+    if (ntasks > nthreads) ntasks = nthreads;
+    if (ntasks < 1) ntasks = 1;
+
+    tasks = (PermuteTask *)a2a_Malloc(sizeof(PermuteTask) * ntasks);
+    cursors = (int *)a2a_Malloc(sizeof(int) * (size_t)ntasks * Kc);
+    if (!tasks || !cursors) goto cleanup;
+
+    for (int t = 0; t < ntasks; ++t) {
+        tasks[t].C = C;
+        tasks[t].assignments = assignments;
+        tasks[t].L = L;
+        tasks[t].Kc = Kc;
+        tasks[t].begin = (int)((long long)N * t / ntasks);
+        tasks[t].end = (int)((long long)N * (t + 1) / ntasks);
+        tasks[t].cursor = cursors + (size_t)t * Kc;
+        tasks[t].perm = perm;
+        tasks[t].data = data;
+        tasks[t].sqrmag = sqrmag;
+    }
+
+    if (a2a_ParallelRun(permuteCountExec, tasks, sizeof(PermuteTask), ntasks, par_type)) goto cleanup;
+
+    // Turn the counts into write positions: cluster offset plus the points of the previous workers
+    int offset = 0;
+    for (int k = 0; k < Kc; ++k) {
+        int pos = offset;
+        for (int t = 0; t < ntasks; ++t) {
+            const int count = tasks[t].cursor[k];
+            tasks[t].cursor[k] = pos;
+            pos += count;
+        }
+        offset += counts[k];
+    }
+
+    if (a2a_ParallelRun(permuteScatterExec, tasks, sizeof(PermuteTask), ntasks, par_type)) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(tasks);
+    a2a_Free(cursors);
+    return status;
+}
+
+
+static int build_cluster_index(const DTYPE* C, const int* assignments, const int* counts, const int N, 
+    const int L, const int K, const int Kc, const int permute_data, const int nthreads, 
+    const parallelization_type_t par_type, ClusterIndex* cluster_index, ClusterLayout* layout) {
+
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_CLUSTER_INDEX);
+
+    layout->perm = (int *)a2a_MallocCharged(sizeof(int) * N);
+    if (!layout->perm) {
+        fprintf(stderr, "Error allocating memory for the cluster index\n");
+        return EXIT_FAILURE;
+    }
+    // The permuted data stays until the clusters are solved, and only if it fits in the budget
+    // with room left for a worker to search the largest cluster in place: its results and the
+    // smallest block of the k-NN search
+    if (permute_data) {
+        int largest = 0;
+        for (int k = 0; k < Kc; ++k) {
+            if (counts[k] > largest) largest = counts[k];
+        }
+        const size_t headroom = (size_t)largest * ((sizeof(DTYPE) + sizeof(int)) * (K + 2) + sizeof(DTYPE)) + 
+            sizeof(DTYPE);
+        if (a2a_MemoryCharge(headroom) == EXIT_SUCCESS) {
+            layout->data = (DTYPE *)a2a_MallocCharged(sizeof(DTYPE) * (size_t)N * L);
+            layout->sqrmag = (DTYPE *)a2a_MallocCharged(sizeof(DTYPE) * N);
+            a2a_MemoryUncharge(headroom);
+        }
+        if (!layout->data || !layout->sqrmag) {
+            // The searches can still gather the clusters from the original data
+            DEBUG_PRINT("ANN: Memory budget too small to permute the data, clusters will be gathered\n");
+            a2a_Free(layout->data);
+            a2a_Free(layout->sqrmag);
+            layout->data = NULL;
+            layout->sqrmag = NULL;
+        }
+    }
+
+    int offset = 0;
+    for (int k = 0; k < Kc; ++k) {
+        cluster_index[k].indices = layout->perm + offset;
+        cluster_index[k].count = counts[k];
+        cluster_index[k].offset = offset;
+        offset += counts[k];
+    }
+
+    const int status = a2a_order_by_cluster(C, assignments, counts, N, L, Kc, nthreads, par_type, 
+        layout->perm, layout->data, layout->sqrmag);
+    a2a_PhaseEnd(&timer, A2A_PHASE_CLUSTER_INDEX);
+
+    return status;
+}
+
+
+// Pairs every undersized cluster (size < K) among the clusters ids[0..n) with the closest valid
+// cluster of the same list, in a single batched search. The search runs on the workspace ws if
+// given and on the thread pool of a2a_knnsearch otherwise. The undersized clusters are stored
+// in src and their targets in dst. If the list has no valid cluster, dst is left untouched.
+static int pair_undersized_clusters(const DTYPE* centroids, const int* counts, const int* ids, 
+    const int n, const int L, const int K, int* src, int* dst, int* num_small, int* num_valid, 
+    a2a_KnnWorkspace* ws, const int nthreads, const double max_memory_usage_ratio, 
+    const parallelization_type_t par_type) {
+
+    DTYPE *small_centroids = NULL, *valid_centroids = NULL, *D = NULL;
+    int *valid_ids = NULL, *nearest = NULL;
+    int status = EXIT_FAILURE;
+
+    int s = 0, v = 0;
+    for (int i = 0; i < n; i++) {
+        if (counts[ids[i]] < K) src[s++] = ids[i];
+    }
+    *num_small = s;
+    *num_valid = n - s;
+    if (*num_small == 0 || *num_valid == 0) return EXIT_SUCCESS;
+
+    small_centroids = (DTYPE *)a2a_Malloc((size_t)(*num_small) * L * sizeof(DTYPE));
+    valid_centroids = (DTYPE *)a2a_Malloc((size_t)(*num_valid) * L * sizeof(DTYPE));
+    D = (DTYPE *)a2a_Malloc((*num_small) * sizeof(DTYPE));
+    valid_ids = (int *)a2a_Malloc((*num_valid) * sizeof(int));
+    nearest = (int *)a2a_Malloc((*num_small) * sizeof(int));
+
+    if (!small_centroids || !valid_centroids || !D || !valid_ids || !nearest) {
+        fprintf(stderr, "Error allocating memory for cluster merging\n");
+        goto cleanup;
+    }
+
+    for (s = 0; s < *num_small; s++) {
+        memcpy(small_centroids + (size_t)s * L, centroids + (size_t)src[s] * L, L * sizeof(DTYPE));
+    }
+    for (int i = 0; i < n; i++) {
+        if (counts[ids[i]] >= K) {
+            memcpy(valid_centroids + (size_t)v * L, centroids + (size_t)ids[i] * L, L * sizeof(DTYPE));
+            valid_ids[v++] = ids[i];
+        }
+    }
+
+    if (ws) {
+        if (a2a_knnsearch_ws(small_centroids, valid_centroids, nearest, D, *num_small, *num_valid, 
+            L, 1, 0, NULL, NULL, ws)) goto cleanup;
+    }
+    else if (a2a_knnsearch(small_centroids, valid_centroids, nearest, D, *num_small, *num_valid, 
+        L, 1, 0, nthreads, 1, max_memory_usage_ratio, par_type)) goto cleanup;
+
+    for (s = 0; s < *num_small; s++) dst[s] = valid_ids[nearest[s]];
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(small_centroids);
+    a2a_Free(valid_centroids);
+    a2a_Free(D);
+    a2a_Free(valid_ids);
+    a2a_Free(nearest);
+
+    return status;
+}
+
+
+// Folds each cluster src[s] into dst[s]. The centroid of a target is kept as a weighted sum
+// while merging and normalized once at the end, so no point is revisited. The flags in scaled
+// must be clear for all targets and are cleared again on return.
+static void fold_clusters(DTYPE* centroids, int* counts, const int L, const int* src, 
+    const int* dst, const int n, int* scaled) {
+
+    for (int s = 0; s < n; s++) {
+        DEBUG_PRINT("ANN: Merging cluster %d -> %d\n", src[s], dst[s]);
+
+        DTYPE *c_dst = centroids + (size_t)dst[s] * L;
+        const DTYPE *c_src = centroids + (size_t)src[s] * L;
+        if (!scaled[dst[s]]) {
+            for (int j = 0; j < L; j++) c_dst[j] *= counts[dst[s]];
+            scaled[dst[s]] = 1;
+        }
+        for (int j = 0; j < L; j++) c_dst[j] += c_src[j] * counts[src[s]];
+
+        counts[dst[s]] += counts[src[s]];
+    }
+
+    for (int s = 0; s < n; s++) {
+        const int id = dst[s];
+        if (scaled[id]) {
+            for (int j = 0; j < L; j++) centroids[(size_t)id * L + j] /= counts[id];
+            scaled[id] = 0;
+        }
+    }
+}
+
+
+static int merge_undersized_clusters(DTYPE* centroids, int* counts, const int Kc, const int L, 
+    const int K, int* remap, int* Kc_new, const int nthreads, const double max_memory_usage_ratio,
+    const parallelization_type_t par_type) {
+
+    int *ids = NULL, *src = NULL, *dst = NULL, *scaled = NULL;
+    int status = EXIT_FAILURE;
+
+    ids = (int *)a2a_Malloc(Kc * sizeof(int));
+    src = (int *)a2a_Malloc(Kc * sizeof(int));
+    dst = (int *)a2a_Malloc(Kc * sizeof(int));
+    scaled = (int *)a2a_Calloc(Kc, sizeof(int));
+
+    if (!ids || !src || !dst || !scaled) {
+        fprintf(stderr, "Error allocating memory for cluster merging\n");
+        goto cleanup;
+    }
+
+    for (int i = 0; i < Kc; i++) ids[i] = i;
+
+    // Find the closest valid centroid of every undersized cluster
+    int num_small, num_valid;
+    if (pair_undersized_clusters(centroids, counts, ids, Kc, L, K, src, dst, &num_small, &num_valid, 
+        NULL, nthreads, max_memory_usage_ratio, par_type)) goto cleanup;
+
+    // This should never happen since I check if N / Kc > K
+    // Thus there will always be at least one valid cluster
+    if (num_small > 0 && num_valid == 0) {
+        DEBUG_PRINT("ANN: No valid cluster found to merge with");
+        goto cleanup;
+    }
+
+    fold_clusters(centroids, counts, L, src, dst, num_small, scaled);
+
+    // Compact the surviving centroids and counts so that cluster v is stored at position v
+    int v = 0;
+    for (int i = 0; i < Kc; i++) {
+        if (counts[i] >= K) {
+            if (i != v) {
+                memcpy(centroids + (size_t)v * L, centroids + (size_t)i * L, L * sizeof(DTYPE));
+                counts[v] = counts[i];
+            }
+            remap[i] = v++;
+        }
+    }
+    for (int s = 0; s < num_small; s++) remap[src[s]] = remap[dst[s]];
+
+    *Kc_new = num_valid;
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(ids);
+    a2a_Free(src);
+    a2a_Free(dst);
+    a2a_Free(scaled);
+
+    return status;
+}
+
+
 static int kmeans(const DTYPE* data, const int N, const int L, const int K, int *Kc, 
     int **assignments, int **counts, const int nthreads, const double max_memory_usage_ratio,
     const parallelization_type_t par_type) {
@@ -68,66 +468,79 @@ static int kmeans(const DTYPE* data, const int N, const int L, const int K, int
     *assignments = NULL;
     *counts = NULL;
 
-    DTYPE *centroids = NULL, *queries = NULL, *D = NULL;
-    int *chosen = NULL, *IDX, *queries_map = NULL, *valid_clusters = NULL;
+    DTYPE *centroids = NULL, *D = NULL;
+    int *IDX = NULL, *remap = NULL;
     int *tmp_assignments = NULL, *tmp_counts = NULL;
     int status = EXIT_FAILURE;
 
-    centroids = (DTYPE *)malloc((*Kc) * L * sizeof(DTYPE));
-    queries = (DTYPE *)malloc((N - (*Kc)) * L * sizeof(DTYPE));
-    chosen = (int *)calloc(N, sizeof(int));
-    queries_map = (int *)malloc((N - (*Kc)) * sizeof(int));
-    IDX = (int *)malloc((N - (*Kc)) * sizeof(int));
-    D = (DTYPE *)malloc((N - (*Kc)) * (*Kc) * sizeof(DTYPE));
-    valid_clusters = (int *)malloc((*Kc) * sizeof(int));
-    tmp_assignments = (int *)malloc(N * sizeof(int));
-    tmp_counts = (int *)malloc((*Kc) * sizeof(int));
-
-    if (!chosen || !centroids || !queries || !queries_map || !IDX || 
-        !valid_clusters || !tmp_assignments || !tmp_counts || !D) {
+    // The assignments are counted in the memory budget, which leaves less to the k-NN blocks
+    centroids = (DTYPE *)a2a_Malloc((*Kc) * L * sizeof(DTYPE));
+    remap = (int *)a2a_Malloc((*Kc) * sizeof(int));
+    tmp_assignments = (int *)a2a_MallocCharged(N * sizeof(int));
+    tmp_counts = (int *)a2a_Malloc((*Kc) * sizeof(int));
+
+    if (!centroids || !remap || !tmp_assignments || !tmp_counts) {
         fprintf(stderr, "Error allocating memory for k-means clustering\n");
         goto cleanup;
     }
 
+    // The nearest centroids are found for as many points at a time as the budget allows
+    int chunk_rows = N;
+    while (chunk_rows > 0) {
+        IDX = (int *)a2a_MallocCharged(chunk_rows * sizeof(int));
+        D = (DTYPE *)a2a_MallocCharged(chunk_rows * sizeof(DTYPE));
+        if (IDX && D) break;
+        a2a_Free(IDX); IDX = NULL;
+        a2a_Free(D); D = NULL;
+        chunk_rows /= 2;
+    }
+    if (chunk_rows == 0) {
+        fprintf(stderr, "Error: Memory budget too small for k-means clustering\n");
+        goto cleanup;
+    }
+
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_SEEDING);
+
     srand(0);  // Seed for reproducibility
 
-    // Initialize centroids by randomly selecting K points from data
+    // Initialize centroids by randomly selecting K points from data, the others are unassigned (-1)
     int centroid_idx = 0;
     memset(tmp_counts, 0, (*Kc) * sizeof(int));  // Set counts to zero
+    for (int i = 0; i < N; i++) tmp_assignments[i] = -1;
     while (centroid_idx < *Kc) {
         int r = rand() % N;
-        if (!chosen[r]) {
+        if (tmp_assignments[r] < 0) {
             memcpy(centroids + centroid_idx * L, data + r * L, L * sizeof(DTYPE));
-            chosen[r] = 1;
             tmp_counts[centroid_idx]++;
             tmp_assignments[r] = centroid_idx++;
         }
     }
 
-    // Initialize queries by copying the non-chosen points
-    int query_idx = 0;
-    for (int i = 0; i < N; i++) {
-        if (!chosen[i]) {
-            memcpy(queries + query_idx * L, data + i * L, L * sizeof(DTYPE));
-            queries_map[query_idx++] = i;  // map query index to original index
+    a2a_PhaseEnd(&timer, A2A_PHASE_SEEDING);
+
+    // Assign each point to the nearest centroid. The points are searched in place rather than a
+    // copy of the non-chosen ones, which would take N * L elements from the memory budget.
+    a2a_PhaseBegin(&timer, A2A_PHASE_ASSIGNMENT);
+    for (int first = 0; first < N; first += chunk_rows) {
+        const int rows = N - first < chunk_rows ? N - first : chunk_rows;
+        if (a2a_knnsearch(data + (size_t)first * L, centroids, IDX, D, rows, *Kc, L, 1, 0, 
+        nthreads, 1, max_memory_usage_ratio, par_type)) goto cleanup;
+
+        // The chosen points keep the centroid they seeded
+        for (int i = 0; i < rows; i++) {
+            if (tmp_assignments[first + i] >= 0) continue;
+            int cluster_index = IDX[i];
+            tmp_counts[cluster_index]++;
+            tmp_assignments[first + i] = cluster_index;
         }
     }
-    free(chosen); chosen = NULL;
-
-    // Assign each query to the nearest centroid
-    if (a2a_knnsearch(queries, centroids, IDX, D, N - (*Kc), *Kc, L, 1, 0, 
-    nthreads, 1, max_memory_usage_ratio, par_type)) goto cleanup;
-
-    // Map the indices back to the original data points
-    for (int i = 0; i < N - (*Kc); i++) {
-        int query_original_idx = queries_map[i];
-        int cluster_index = IDX[i];
-        tmp_counts[cluster_index]++;
-        tmp_assignments[query_original_idx] = cluster_index;
-    }
-    free(IDX); IDX = NULL;
+    a2a_Free(IDX); IDX = NULL;
+    a2a_Free(D); D = NULL;
+    a2a_PhaseEnd(&timer, A2A_PHASE_ASSIGNMENT);
 
     // Compute the new centroids by averaging the assigned points
+    a2a_PhaseBegin(&timer, A2A_PHASE_CENTROID_UPDATE);
     memset(centroids, 0, (*Kc) * L * sizeof(DTYPE));
     for (int i = 0; i < N; i++) {
         for (int j = 0; j < L; j++) {
@@ -140,106 +553,43 @@ static int kmeans(const DTYPE* data, const int N, const int L, const int K, int
             centroids[i * L + j] /= tmp_counts[i];
         }
     }
+    a2a_PhaseEnd(&timer, A2A_PHASE_CENTROID_UPDATE);
 
-    // Merge clusters that have size smaller than K to the closest centroid to them
-    memset(valid_clusters, 1, (*Kc) * sizeof(int));  // Set all clusters as valid initially
+    // Merge clusters that have size smaller than K to the closest valid centroid to them
     int Kc_new = *Kc;
-    while (1) {
-        int invalid_cluster_index = -1;
-        // Find the first invalid cluster (size < K)
-        for (int i = 0; i < *Kc; i++) {
-            if (tmp_counts[i] < K && valid_clusters[i]) {
-                invalid_cluster_index = i;
-                break;
-            }
-        }
-
-        if (invalid_cluster_index == -1) break;
-        valid_clusters[invalid_cluster_index] = 0;  // Mark as invalid
-
-        int closest_cluster_index = -1;  // Index of the closest valid cluster
-        DTYPE min_dist = INF;
-
-        // Find the closest valid cluster to the invalid one
-        for (int i = 0; i < *Kc; i++) {
-            if (valid_clusters[i] && i != invalid_cluster_index) {
-                DTYPE dist = distance_squared(centroids + invalid_cluster_index * L, centroids + i * L, L);
-                if (dist < min_dist) {  // If the distance is very small, merge
-                    closest_cluster_index = i;
-                    min_dist = dist;
-                }
-            }
-        }
-
-        // This should never happen since I check if N / Kc > K
-        // Thus there will always be at least one valid cluster
-        if (closest_cluster_index == -1) {
-            DEBUG_PRINT("ANN: No valid cluster found to merge with");
-            goto cleanup;
-        }
-        DEBUG_PRINT("ANN: Merging cluster %d -> %d\n", invalid_cluster_index, closest_cluster_index);
-
-        tmp_counts[closest_cluster_index] += tmp_counts[invalid_cluster_index];
-
-        // Recompute the centroid of the closest cluster
-        memset(centroids + closest_cluster_index * L, 0, L * sizeof(DTYPE));  // Reset the closest centroid
-        for (int i = 0; i < N; i++) {
-            if (tmp_assignments[i] == invalid_cluster_index) {
-                tmp_assignments[i] = closest_cluster_index;
-            }
-
-            // now add all points that are assigned to the closest cluster
-            if (tmp_assignments[i] == closest_cluster_index) {
-                for (int j = 0; j < L; j++) {
-                    centroids[closest_cluster_index * L + j] += data[i * L + j];
-                }
-            }
-        }
+    a2a_PhaseBegin(&timer, A2A_PHASE_MERGE);
+    if (merge_undersized_clusters(centroids, tmp_counts, *Kc, L, K, remap, &Kc_new, 
+        nthreads, max_memory_usage_ratio, par_type)) goto cleanup;
+    a2a_PhaseEnd(&timer, A2A_PHASE_MERGE);
 
-        for (int j = 0; j < L; j++) {
-            centroids[closest_cluster_index * L + j] /= tmp_counts[closest_cluster_index];
-        }
-
-        Kc_new--;  // Reduce the number of clusters
-    }
-
-    *assignments = (int *)malloc(N * sizeof(int));
-    *counts = (int *)malloc(Kc_new * sizeof(int));
-    if (!(*assignments) || !(*counts)) {
+    *counts = (int *)a2a_Malloc(Kc_new * sizeof(int));
+    if (!(*counts)) {
         fprintf(stderr, "Error allocating memory for k-means clustering\n");
         goto cleanup;
     }
 
-    // Reassign the assignments to the new clusters
-    int cluster_index = 0;
-    for (int i = 0; i < *Kc; i++) {
-        if (valid_clusters[i]) {
-            for (int j = 0; j < N; j++) {
-                if (tmp_assignments[j] == i) {
-                    (*assignments)[j] = cluster_index;
-                }
-            }
-            (*counts)[cluster_index++] = tmp_counts[i];
-        }
+    // Relabel the points through the remap table of the merged clusters, in place
+    for (int i = 0; i < N; i++) {
+        tmp_assignments[i] = remap[tmp_assignments[i]];
     }
+    *assignments = tmp_assignments;
+    tmp_assignments = NULL;
+    memcpy(*counts, tmp_counts, Kc_new * sizeof(int));
     *Kc = Kc_new;
     DEBUG_PRINT("ANN: K-means clustering completed with %d clusters\n", *Kc);
 
     status = EXIT_SUCCESS;
 
 cleanup:
-    if (queries) free(queries);
-    if (queries_map) free(queries_map);
-    if (IDX) free(IDX);
-    if (D) free(D);
-    if (chosen) free(chosen);
-    if (centroids) free(centroids);
-    if (valid_clusters) free(valid_clusters);
-    if (tmp_assignments) free(tmp_assignments);
-    if (tmp_counts) free(tmp_counts);
+    if (IDX) a2a_Free(IDX);
+    if (D) a2a_Free(D);
+    if (centroids) a2a_Free(centroids);
+    if (remap) a2a_Free(remap);
+    if (tmp_assignments) a2a_Free(tmp_assignments);
+    if (tmp_counts) a2a_Free(tmp_counts);
     if (status != EXIT_SUCCESS) {
-        if (*assignments) free(*assignments);
-        if (*counts) free(*counts);
+        if (*assignments) a2a_Free(*assignments);
+        if (*counts) a2a_Free(*counts);
         *assignments = NULL;
         *counts = NULL;
     }
@@ -248,371 +598,1554 @@ cleanup:
 }
 
 
-static void *annTaskExec(void *arg) {
-
-    annTask * task = (annTask *)arg;
-    const int num_clusters = task->num_clusters;
-    int *cluster_ids = task->cluster_ids;
-    ClusterIndex* cluster_index = task->cluster_index;
-    int* IDX = task->IDX;
-    DTYPE* D = task->D;
-    const DTYPE* C = task->C;
-    const int L = task->L;
-    const int K = task->K;
-    const int N = task->N;
-    const double max_memory_usage_ratio = task->max_memory_usage_ratio;
-
-    DTYPE *C_sub = NULL, *dist_sub = NULL;
-    int *idx_sub = NULL;
-
-    // Compute the total number of points across all clusters for the current thread
-    int total_thread_points = 0;
-    for (int c = 0; c < num_clusters; ++c) {
-        const int cid = cluster_ids[c];
-        total_thread_points += cluster_index[cid].count;
-    }
-
-    int *retval = (int *)malloc(sizeof(int));
-    if (!retval) return NULL;
-    *retval = EXIT_SUCCESS;
-
-    DEBUG_PRINT("\nANN: Running thread %lu with %d assigned clusters and %d points in total \n", pthread_self(), num_clusters, total_thread_points);
-
-    for (int c = 0; c < num_clusters; ++c) {
-        const int cid = cluster_ids[c];
-        int cluster_size = cluster_index[cid].count;
-        DEBUG_PRINT("\nANN: Solving cluster %d with %d points\n", cid, cluster_size);
-        
-        // This should never happen
-        DEBUG_ASSERT(cluster_size > 0, "ANN: Cluster size must be greater than 0\n");
-
-        int* indices = cluster_index[cid].indices;
-
-        // Allocate memory for the submatrix and indices
-        C_sub = (DTYPE *)malloc(sizeof(DTYPE) * cluster_size * L);
-        dist_sub = (DTYPE *)malloc(sizeof(DTYPE) * cluster_size * (K + 1));
-        idx_sub = (int *)malloc(sizeof(int) * cluster_size * (K + 1));
-        if (!C_sub || !idx_sub || !dist_sub) {
-            if (C_sub) free(C_sub);
-            if (idx_sub) free(idx_sub);
-            if (dist_sub) free(dist_sub);
-            free(retval);
-            return NULL;
-        }
-
-        // Construct a submatrix of C for the current cluster
-        for (int i = 0; i < cluster_size; ++i) {
-            int orig_idx = indices[i];
-            for (int l = 0; l < L; ++l)
-                C_sub[i * L + l] = C[orig_idx * L + l];
-        }
-
-        // Find K nearest neighbors in the submatrix
-        const double memory_usage_ratio = max_memory_usage_ratio * (double)total_thread_points / (double)N;
-        if (a2a_knnsearch(C_sub, C_sub, idx_sub, dist_sub, cluster_size, cluster_size, 
-            L, K + 1, 0, 1, 1, memory_usage_ratio, PAR_PTHREADS)) {
-            free(C_sub);
-            free(idx_sub);
-            free(dist_sub);
-            free(retval);
-            return NULL;
-        }
-
-        // Fill the output matrices IDX and D
-        for (int i = 0; i < cluster_size; ++i) {
-            int orig_i = indices[i];
-            int out_k = 0;
-            for (int k = 0; k < K + 1; ++k) {
-                int local_j = idx_sub[i * (K + 1) + k];
-                if (local_j == i) continue; // skip self
-                IDX[orig_i * K + out_k] = indices[local_j];
-                D[orig_i * K + out_k] = dist_sub[i * (K + 1) + k];
-                if (++out_k >= K) break;
-            }
-        }
-
-        free(C_sub);
-        free(idx_sub);
-        free(dist_sub);
-    }
-
-    return (void *)retval;
-}
-
-
-// Comparator for sorting clusters by descending size
-static int compare_cluster_sizes(const void* a, const void* b) {
-    const ClusterSizeEntry* ca = (const ClusterSizeEntry*)a;
-    const ClusterSizeEntry* cb = (const ClusterSizeEntry*)b;
-    return cb->size - ca->size; // descending
-}
+// Points of a coarse cell that are assigned to its fine centroids at a time
+#define CELL_CHUNK_ROWS 1024
 
-static int distribute_clusters_by_size(int Kc, int nthreads, ClusterIndex* cluster_index, annTask* tasks) {
-    int* thread_load = calloc(nthreads, sizeof(int));
-    if (!thread_load) return EXIT_FAILURE;
 
-    ClusterSizeEntry* entries = (ClusterSizeEntry *)malloc(sizeof(ClusterSizeEntry) * Kc);
-    if (!entries) {
-        free(thread_load);
-        return EXIT_FAILURE;
-    }
+// Coarse cell and its number of points, used to cluster the largest cells first
+typedef struct {
+    int cell;
+    int count;
+} CellEntry;
 
-    // Fill cluster ID + size entries
-    for (int i = 0; i < Kc; ++i) {
-        entries[i].id = i;
-        entries[i].size = cluster_index[i].count;
-    }
 
-    // Sort clusters by size descending
-    qsort(entries, Kc, sizeof(ClusterSizeEntry), compare_cluster_sizes);
+// Worker of the two-level k-means. Takes coarse cells from a shared counter, clusters the 
+// points of each cell around its own fine centroids and merges the undersized fine clusters
+// with the closest valid fine cluster of the same cell.
+typedef struct {
+    const DTYPE* data;                   // Data matrix
+    int L;                               // Dimension of the data points
+    int K;                               // Minimum size of a cluster
+    ClusterIndex* cells;                 // Points of each coarse cell
+    const CellEntry* order;              // Coarse cells by descending size
+    const int* fine_offset;              // First fine cluster of each coarse cell
+    int num_cells;                       // Number of coarse cells
+    int max_fine;                        // Maximum number of fine clusters of a cell
+    atomic_int* next;                    // Position in order of the next cell to cluster
+    DTYPE* centroids;                    // Fine centroids
+    int* counts;                         // Sizes of the fine clusters
+    int* assignments;                    // Fine cluster of each point
+    int* merged_into;                    // Target of each merged fine cluster, itself otherwise
+    int* scaled;                         // Flags of fold_clusters
+    double max_memory_usage_ratio;       // Share of the available memory for this worker
+} CellTask;
+
+
+static int cluster_cell(const CellTask* task, const int c, a2a_KnnWorkspace* ws, DTYPE* rows, 
+    int* nearest, DTYPE* D, int* scratch) {
 
-    // Initialize tasks
-    for (int i = 0; i < nthreads; ++i) {
-        tasks[i].cluster_ids = (int *)malloc(sizeof(int) * Kc); // max size
-        if (!tasks[i].cluster_ids) {
-            for (int j = 0; j < i; ++j) free(tasks[j].cluster_ids);
-            free(thread_load);
-            free(entries);
-            return EXIT_FAILURE;
-        }
-        tasks[i].num_clusters = 0;
+    const int L = task->L;
+    int* indices = task->cells[c].indices;
+    const int n = task->cells[c].count;
+    const int first = task->fine_offset[c];
+    const int kc = task->fine_offset[c + 1] - first;
+    DTYPE* centroids = task->centroids + (size_t)first * L;
+    int* counts = task->counts + first;
+
+    if (kc == 0) return EXIT_SUCCESS;
+
+    const long long trace_start = a2a_TraceBegin();
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_SEEDING);
+
+    // Seed the fine centroids with distinct random points of the cell (partial Fisher-Yates shuffle)
+    unsigned int seed = (unsigned int)c;
+    for (int i = 0; i < kc; i++) {
+        const int j = i + rand_r(&seed) % (n - i);
+        const int tmp = indices[i];
+        indices[i] = indices[j];
+        indices[j] = tmp;
+        memcpy(centroids + (size_t)i * L, task->data + (size_t)indices[i] * L, L * sizeof(DTYPE));
+        counts[i] = 0;
     }
-
-    // Greedy bin-packing
-    for (int i = 0; i < Kc; ++i) {
-        int cid = entries[i].id;
-        int min_thread = 0;
-        for (int t = 1; t < nthreads; ++t) {
-            if (thread_load[t] < thread_load[min_thread])
-                min_thread = t;
+    a2a_PhaseEnd(&timer, A2A_PHASE_SEEDING);
+
+    // Assign the points of the cell to the nearest fine centroid
+    a2a_PhaseBegin(&timer, A2A_PHASE_ASSIGNMENT);
+    for (int r = 0; r < n; r += CELL_CHUNK_ROWS) {
+        const int m = (n - r) < CELL_CHUNK_ROWS ? (n - r) : CELL_CHUNK_ROWS;
+        a2a_GatherRows(task->data, L, indices + r, m, rows);
+        if (a2a_knnsearch_ws(rows, centroids, nearest, D, m, kc, L, 1, 0, NULL, NULL, ws)) return EXIT_FAILURE;
+        for (int i = 0; i < m; i++) {
+            task->assignments[indices[r + i]] = first + nearest[i];
+            counts[nearest[i]]++;
         }
-        tasks[min_thread].cluster_ids[tasks[min_thread].num_clusters++] = cid;
-        thread_load[min_thread] += entries[i].size;
     }
+    a2a_PhaseEnd(&timer, A2A_PHASE_ASSIGNMENT);
 
-    free(thread_load);
-    free(entries);
-    return EXIT_SUCCESS;
-}
-
-
-static int check_input_args_ann(const DTYPE* C, const int N, const int L, const int K, 
-    int Kc, int* IDX, DTYPE* D, const int nthreads, 
-    const double max_memory_usage_ratio) {
-
-    if (!C || N <= 0 || L <= 0 || K <= 0 || Kc <= 0 || !IDX || !D) {
-        fprintf(stderr, "Invalid input parameters for ANN search\n");
-        return EXIT_FAILURE;
-    }
-    if (Kc > N) {
-        fprintf(stderr, "Number of clusters cannot exceed number of data points\n");
-        return EXIT_FAILURE;
+    // Compute the new centroids by averaging the assigned points, empty clusters keep their seed
+    a2a_PhaseBegin(&timer, A2A_PHASE_CENTROID_UPDATE);
+    for (int k = 0; k < kc; k++) {
+        if (counts[k] > 0) memset(centroids + (size_t)k * L, 0, L * sizeof(DTYPE));
     }
-    if (N / Kc <= K) {
-        fprintf(stderr, "Number of clusters is too small for the given K\n");
-        return EXIT_FAILURE;
+    for (int i = 0; i < n; i++) {
+        const DTYPE* x = task->data + (size_t)indices[i] * L;
+        DTYPE* centroid = centroids + (size_t)(task->assignments[indices[i]] - first) * L;
+        for (int j = 0; j < L; j++) centroid[j] += x[j];
     }
-    if (nthreads < 1) {
-        fprintf(stderr, "Number of threads must be at least 1\n");
-        return EXIT_FAILURE;
+    for (int k = 0; k < kc; k++) {
+        if (counts[k] > 0) {
+            for (int j = 0; j < L; j++) centroids[(size_t)k * L + j] /= counts[k];
+        }
     }
-    if (max_memory_usage_ratio <= 0.0 || max_memory_usage_ratio > 1.0) {
-        fprintf(stderr, "Invalid memory usage ratio: %f\n", max_memory_usage_ratio);
-        return EXIT_FAILURE;
+    a2a_PhaseEnd(&timer, A2A_PHASE_CENTROID_UPDATE);
+
+    // Merge the undersized clusters inside the cell. If the cell has no valid cluster, 
+    // its clusters are merged across cells afterwards.
+    a2a_PhaseBegin(&timer, A2A_PHASE_MERGE);
+    int *ids = scratch, *src = scratch + task->max_fine, *dst = scratch + 2 * task->max_fine;
+    for (int k = 0; k < kc; k++) ids[k] = first + k;
+
+    int num_small, num_valid;
+    if (pair_undersized_clusters(task->centroids, task->counts, ids, kc, L, task->K, src, dst, 
+        &num_small, &num_valid, ws, 1, task->max_memory_usage_ratio, PAR_PTHREADS)) return EXIT_FAILURE;
+    if (num_valid > 0) {
+        fold_clusters(task->centroids, task->counts, L, src, dst, num_small, task->scaled);
+        for (int s = 0; s < num_small; s++) task->merged_into[src[s]] = dst[s];
     }
+    a2a_PhaseEnd(&timer, A2A_PHASE_MERGE);
+    a2a_TraceEnd("cell", trace_start, c, n);
 
     return EXIT_SUCCESS;
 }
 
 
-static int pthreads_parallelization(annTask* tasks, int nthreads) {
+static int cellTaskExec(void* arg) {
 
+    CellTask* task = (CellTask *)arg;
+    a2a_KnnWorkspace ws;
+    DTYPE *rows = NULL, *D = NULL;
+    int *nearest = NULL, *scratch = NULL;
     int status = EXIT_FAILURE;
-    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
-    if (!threads) return EXIT_FAILURE;
 
-    for (int i = 0; i < nthreads; ++i) {
-        
-        if (pthread_create(&threads[i], NULL, annTaskExec, (void *)&tasks[i])) {
-            fprintf(stderr, "Error creating thread %d\n", i);
-            for (int j = 0; j < i; ++j) {
-                pthread_join(threads[j], NULL);
-            }
-            goto cleanup;
-        }
-    }
+    if (a2a_KnnWorkspaceInit(&ws, task->max_memory_usage_ratio)) goto cleanup;
 
-    for (int i = 0; i < nthreads; ++i) {
-        void *retval = NULL;
-        if (pthread_join(threads[i], &retval)) {
-            fprintf(stderr, "Error joining thread %d\n", i);
-            goto cleanup;
-        }
+    rows = (DTYPE *)a2a_Malloc((size_t)CELL_CHUNK_ROWS * task->L * sizeof(DTYPE));
+    D = (DTYPE *)a2a_Malloc(CELL_CHUNK_ROWS * sizeof(DTYPE));
+    nearest = (int *)a2a_Malloc(CELL_CHUNK_ROWS * sizeof(int));
+    scratch = (int *)a2a_Malloc(3 * (size_t)task->max_fine * sizeof(int));
+    if (!rows || !D || !nearest || !scratch) {
+        fprintf(stderr, "Error allocating memory for k-means clustering\n");
+        goto cleanup;
+    }
 
-        if (retval == NULL) {
-            fprintf(stderr, "Thread %d returned NULL\n", i);
-            goto cleanup;
-        }
-        int *thread_status = (int *)retval;
-        if (*thread_status != EXIT_SUCCESS) {
-            fprintf(stderr, "Thread %d failed with status %d\n", i, *thread_status);
-            free(retval);
-            goto cleanup;
-        }
-        free(retval);
+    int pos;
+    while ((pos = atomic_fetch_add(task->next, 1)) < task->num_cells) {
+        if (cluster_cell(task, task->order[pos].cell, &ws, rows, nearest, D, scratch)) goto cleanup;
     }
 
     status = EXIT_SUCCESS;
 
-    cleanup:
-    free(threads);
+cleanup:
+    if (status != EXIT_SUCCESS) atomic_store(task->next, task->num_cells);  // Stop the other workers
+    a2a_KnnWorkspaceDestroy(&ws);
+    a2a_Free(rows);
+    a2a_Free(D);
+    a2a_Free(nearest);
+    a2a_Free(scratch);
     return status;
 }
 
 
-static int openmp_parallelization(annTask* tasks, int nthreads) {
-    #ifndef USE_OPENCILK
-        int status = EXIT_SUCCESS;
-        #pragma omp parallel num_threads(nthreads)
-        {
-            int tid = omp_get_thread_num();
-            annTask *task = &tasks[tid];
-            void *retval = annTaskExec((void *)task);
-
-            if (retval == NULL) {
-                #pragma omp critical
-                {
-                    fprintf(stderr, "Error executing task in OpenMP thread %d\n", tid);
-                    status = EXIT_FAILURE;
-                }
-            } else {
-                int *thread_status = (int *)retval;
-                if (*thread_status != EXIT_SUCCESS) {
-                    #pragma omp critical
-                    {
-                        fprintf(stderr, "Task in OpenMP thread %d failed with status %d\n", tid, *thread_status);
-                        status = EXIT_FAILURE;
-                    }
-                }
-                free(retval);
-            }
-        }
-
-        return status;
-    #else
-        fprintf(stderr, "OpenMP is not enabled in this build\n");
-        return EXIT_FAILURE;
-    #endif
+// Comparator for sorting coarse cells by descending size
+static int compare_cells(const void* a, const void* b) {
+    const int ca = ((const CellEntry *)a)->count;
+    const int cb = ((const CellEntry *)b)->count;
+    return (ca < cb) - (ca > cb);
 }
 
 
-static int opencilk_parallelization(annTask* tasks, int nthreads) {
-    #ifdef USE_OPENCILK
-        atomic_int status = ATOMIC_VAR_INIT(EXIT_SUCCESS);
+// Two-level k-means. The points are first assigned to num_cells coarse centroids, then the 
+// points of each coarse cell are clustered around fine centroids of that cell only, with the
+// Kc fine clusters shared among the cells in proportion to their size. With num_cells close 
+// to sqrt(Kc), every point is compared with about 2 * sqrt(Kc) centroids instead of Kc, and 
+// undersized clusters look for a merge target among the clusters of their own cell.
+// Same outputs as kmeans.
+static int hierarchical_kmeans(const DTYPE* data, const int N, const int L, const int K, int *Kc, 
+    const int num_cells, int **assignments, int **counts, const int nthreads, 
+    const double max_memory_usage_ratio, const parallelization_type_t par_type) {
 
-        cilk_for (int i = 0; i < nthreads; ++i) {
-            annTask *task = &tasks[i];
-            void *retval = annTaskExec((void *)task);
+    *assignments = NULL;
+    *counts = NULL;
 
-            if (retval == NULL) {
-                fprintf(stderr, "Error executing task in OpenCilk thread %d\n", i);
-                atomic_store(&status, EXIT_FAILURE);
-            } else {
-                int *thread_status = (int *)retval;
-                if (*thread_status != EXIT_SUCCESS) {
-                    fprintf(stderr, "Task in OpenCilk thread %d failed with status %d\n", i, *thread_status);
-                    atomic_store(&status, EXIT_FAILURE);
-                }
-                free(retval);
-            }
-        }
+    DTYPE *coarse = NULL, *D = NULL, *centroids = NULL;
+    int *cell_of = NULL, *cell_counts = NULL, *fine_offset = NULL, *fine_assignments = NULL;
+    int *fine_counts = NULL, *merged_into = NULL, *scaled = NULL, *ids = NULL, *src = NULL;
+    int *dst = NULL, *remap = NULL;
+    ClusterIndex* cells = NULL;
+    ClusterLayout layout = { .perm = NULL, .data = NULL, .sqrmag = NULL };
+    CellEntry* order = NULL;
+    CellTask* tasks = NULL;
+    int status = EXIT_FAILURE;
 
-        return atomic_load(&status);
-    #else
-        fprintf(stderr, "OpenCilk is not enabled in this build\n");
-        return EXIT_FAILURE;
-    #endif
-}
+    coarse = (DTYPE *)a2a_Malloc((size_t)num_cells * L * sizeof(DTYPE));
+    D = (DTYPE *)a2a_MallocCharged(N * sizeof(DTYPE));
+    cell_of = (int *)a2a_MallocCharged(N * sizeof(int));
+    cell_counts = (int *)a2a_Calloc(num_cells, sizeof(int));
+    cells = (ClusterIndex *)a2a_Malloc(num_cells * sizeof(ClusterIndex));
+    order = (CellEntry *)a2a_Malloc(num_cells * sizeof(CellEntry));
+    fine_offset = (int *)a2a_Malloc((num_cells + 1) * sizeof(int));
 
+    if (!coarse || !D || !cell_of || !cell_counts || !cells || !order || !fine_offset) {
+        fprintf(stderr, "Error allocating memory for k-means clustering\n");
+        goto cleanup;
+    }
+    memset(cell_of, 0, N * sizeof(int));
+
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_SEEDING);
+
+    srand(0);  // Seed for reproducibility
+
+    // Initialize the coarse centroids by randomly selecting points from data,
+    // cell_of marks the chosen points until it receives the coarse assignments
+    int centroid_idx = 0;
+    while (centroid_idx < num_cells) {
+        int r = rand() % N;
+        if (!cell_of[r]) {
+            memcpy(coarse + (size_t)centroid_idx * L, data + (size_t)r * L, L * sizeof(DTYPE));
+            cell_of[r] = 1;
+            centroid_idx++;
+        }
+    }
+    a2a_PhaseEnd(&timer, A2A_PHASE_SEEDING);
+
+    // Level 1: assign each point to the nearest coarse centroid
+    a2a_PhaseBegin(&timer, A2A_PHASE_ASSIGNMENT);
+    if (a2a_knnsearch(data, coarse, cell_of, D, N, num_cells, L, 1, 0, 
+        nthreads, 1, max_memory_usage_ratio, par_type)) goto cleanup;
+    a2a_PhaseEnd(&timer, A2A_PHASE_ASSIGNMENT);
+    a2a_Free(D); D = NULL;
+    a2a_Free(coarse); coarse = NULL;
+
+    for (int i = 0; i < N; i++) cell_counts[cell_of[i]]++;
+    if (build_cluster_index(data, cell_of, cell_counts, N, L, 0, num_cells, 0, nthreads, par_type, 
+        cells, &layout)) goto cleanup;
+
+    // Share the fine clusters among the cells in proportion to their size
+    int max_fine = 0;
+    fine_offset[0] = 0;
+    for (int c = 0; c < num_cells; c++) {
+        int kc = 0;
+        if (cell_counts[c] > 0) {
+            kc = (int)llround((double)(*Kc) * cell_counts[c] / N);
+            if (kc < 1) kc = 1;
+            if (kc > cell_counts[c]) kc = cell_counts[c];
+        }
+        fine_offset[c + 1] = fine_offset[c] + kc;
+        if (kc > max_fine) max_fine = kc;
+        order[c].cell = c;
+        order[c].count = cell_counts[c];
+    }
+    const int num_fine = fine_offset[num_cells];
+    qsort(order, num_cells, sizeof(CellEntry), compare_cells);
+
+    centroids = (DTYPE *)a2a_Malloc((size_t)num_fine * L * sizeof(DTYPE));
+    fine_counts = (int *)a2a_Malloc(num_fine * sizeof(int));
+    fine_assignments = (int *)a2a_MallocCharged(N * sizeof(int));
+    merged_into = (int *)a2a_Malloc(num_fine * sizeof(int));
+    scaled = (int *)a2a_Calloc(num_fine, sizeof(int));
+    tasks = (CellTask *)a2a_Malloc(nthreads * sizeof(CellTask));
+
+    if (!centroids || !fine_counts || !fine_assignments || !merged_into || !scaled || !tasks) {
+        fprintf(stderr, "Error allocating memory for k-means clustering\n");
+        goto cleanup;
+    }
+    for (int f = 0; f < num_fine; f++) merged_into[f] = f;
+
+    // Level 2: cluster the cells in parallel, the largest ones first
+    atomic_int next = 0;
+    for (int i = 0; i < nthreads; i++) {
+        tasks[i] = (CellTask){
+            .data = data, .L = L, .K = K, .cells = cells, .order = order, .fine_offset = fine_offset,
+            .num_cells = num_cells, .max_fine = max_fine, .next = &next, .centroids = centroids,
+            .counts = fine_counts, .assignments = fine_assignments, .merged_into = merged_into,
+            .scaled = scaled, .max_memory_usage_ratio = max_memory_usage_ratio / nthreads
+        };
+    }
+    if (a2a_ParallelRun(cellTaskExec, tasks, sizeof(CellTask), nthreads, par_type)) goto cleanup;
+
+    ids = (int *)a2a_Malloc(num_fine * sizeof(int));
+    src = (int *)a2a_Malloc(num_fine * sizeof(int));
+    dst = (int *)a2a_Malloc(num_fine * sizeof(int));
+    remap = (int *)a2a_Malloc(num_fine * sizeof(int));
+    if (!ids || !src || !dst || !remap) {
+        fprintf(stderr, "Error allocating memory for k-means clustering\n");
+        goto cleanup;
+    }
+
+    // Merge the undersized clusters of cells without any valid cluster 
+    // with the closest valid cluster of any cell
+    a2a_PhaseBegin(&timer, A2A_PHASE_MERGE);
+    int num_ids = 0;
+    for (int f = 0; f < num_fine; f++) {
+        if (merged_into[f] == f) ids[num_ids++] = f;
+    }
+    int num_small, num_valid;
+    if (pair_undersized_clusters(centroids, fine_counts, ids, num_ids, L, K, src, dst, &num_small, 
+        &num_valid, NULL, nthreads, max_memory_usage_ratio, par_type)) goto cleanup;
+    if (num_small > 0 && num_valid == 0) {
+        DEBUG_PRINT("ANN: No valid cluster found to merge with");
+        goto cleanup;
+    }
+    fold_clusters(centroids, fine_counts, L, src, dst, num_small, scaled);
+    for (int s = 0; s < num_small; s++) merged_into[src[s]] = dst[s];
+    a2a_PhaseEnd(&timer, A2A_PHASE_MERGE);
+
+    // Number the surviving clusters, merged clusters take the number of their target
+    int Kc_new = 0;
+    for (int f = 0; f < num_fine; f++) {
+        if (merged_into[f] == f) remap[f] = Kc_new++;
+    }
+    for (int f = 0; f < num_fine; f++) remap[f] = remap[merged_into[f]];
+
+    *counts = (int *)a2a_Malloc(Kc_new * sizeof(int));
+    if (!(*counts)) {
+        fprintf(stderr, "Error allocating memory for k-means clustering\n");
+        goto cleanup;
+    }
+    for (int f = 0; f < num_fine; f++) {
+        if (merged_into[f] == f) (*counts)[remap[f]] = fine_counts[f];
+    }
+
+    // Relabel the points in place and hand over the assignments
+    for (int i = 0; i < N; i++) {
+        fine_assignments[i] = remap[fine_assignments[i]];
+    }
+    *assignments = fine_assignments;
+    fine_assignments = NULL;
+    *Kc = Kc_new;
+    DEBUG_PRINT("ANN: Two-level k-means clustering completed with %d coarse cells and %d clusters\n", 
+        num_cells, *Kc);
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(coarse);
+    a2a_Free(D);
+    a2a_Free(cell_of);
+    a2a_Free(cell_counts);
+    a2a_Free(cells);
+    a2a_Free(layout.perm);
+    a2a_Free(order);
+    a2a_Free(fine_offset);
+    a2a_Free(centroids);
+    a2a_Free(fine_counts);
+    a2a_Free(fine_assignments);
+    a2a_Free(merged_into);
+    a2a_Free(scaled);
+    a2a_Free(tasks);
+    a2a_Free(ids);
+    a2a_Free(src);
+    a2a_Free(dst);
+    a2a_Free(remap);
+    if (status != EXIT_SUCCESS) {
+        a2a_Free(*counts);
+        *counts = NULL;
+    }
+
+    return status;
+}
+
+
+static int compare_projections(const void* a, const void* b) {
+    const DTYPE ka = ((const ProjectionEntry*)a)->key;
+    const DTYPE kb = ((const ProjectionEntry*)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+
+// Cache size assumed when it cannot be queried (8 MiB)
+#define DEFAULT_CACHE_SIZE_BYTES 8388608
+
+
+int a2a_cluster_size_from_cache(const int L) {
+    long cache_size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    cache_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    if (cache_size <= 0) cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (cache_size <= 0) cache_size = DEFAULT_CACHE_SIZE_BYTES;
+
+    // The self-join of a cluster with n points works on the n x L submatrix and
+    // the n x n distance and index matrices. Solve a * n^2 + b * n = cache_size for n.
+    const double a = (double)(sizeof(DTYPE) + sizeof(int));
+    const double b = (double)L * sizeof(DTYPE);
+    return (int)((-b + sqrt(b * b + 4.0 * a * (double)cache_size)) / (2.0 * a));
+}
+
+
+static int farthest_point(const DTYPE* data, const int L, const ProjectionEntry* entries, 
+    const int n, const DTYPE* from) {
+
+    int farthest = entries[0].id;
+    DTYPE max_dist = SUFFIX(-1.0);
+    for (int i = 0; i < n; i++) {
+        DTYPE dist = a2a_DistanceSquared(data + (size_t)entries[i].id * L, from, L);
+        if (dist > max_dist) {
+            max_dist = dist;
+            farthest = entries[i].id;
+        }
+    }
+    return farthest;
+}
+
+
+// Halves the points of entries at the median of their projection on the line through 
+// two distant members, until every part holds at most max_size points. On return the
+// parts are stored contiguously in entries and their sizes are appended to part_sizes.
+static void bisect_cluster(const DTYPE* data, const int L, ProjectionEntry* entries, const int n, 
+    const int max_size, int* part_sizes, int* num_parts) {
+
+    if (n <= max_size) {
+        part_sizes[(*num_parts)++] = n;
+        return;
+    }
+
+    // a is the farthest member from an arbitrary member and b is the farthest from a,
+    // which approximates the direction of largest spread
+    const int a = farthest_point(data, L, entries, n, data + (size_t)entries[0].id * L);
+    const int b = farthest_point(data, L, entries, n, data + (size_t)a * L);
+    const DTYPE* xa = data + (size_t)a * L;
+    const DTYPE* xb = data + (size_t)b * L;
+
+    for (int i = 0; i < n; i++) {
+        const DTYPE* x = data + (size_t)entries[i].id * L;
+        DTYPE key = SUFFIX(0.0);
+        for (int l = 0; l < L; l++) key += x[l] * (xb[l] - xa[l]);
+        entries[i].key = key;
+    }
+    qsort(entries, n, sizeof(ProjectionEntry), compare_projections);
+
+    const int half = n / 2;
+    bisect_cluster(data, L, entries, half, max_size, part_sizes, num_parts);
+    bisect_cluster(data, L, entries + half, n - half, max_size, part_sizes, num_parts);
+}
+
+
+static int split_oversized_clusters(const DTYPE* data, const int N, const int L, int* assignments, 
+    int** counts, int* Kc, const int max_size) {
+
+    ProjectionEntry* entries = NULL;
+    int *cursor = NULL, *part_sizes = NULL, *new_counts = NULL;
+    int status = EXIT_FAILURE;
+
+    // Count the points of the oversized clusters and bound the number of parts they produce.
+    // Every part has at least (max_size + 1) / 2 points since only clusters larger than 
+    // max_size are halved.
+    int oversized_points = 0, max_parts = 0, total_parts = 0;
+    for (int c = 0; c < *Kc; c++) {
+        if ((*counts)[c] > max_size) {
+            const int parts = (*counts)[c] / ((max_size + 1) / 2) + 1;
+            oversized_points += (*counts)[c];
+            total_parts += parts;
+            if (parts > max_parts) max_parts = parts;
+        }
+    }
+    if (oversized_points == 0) return EXIT_SUCCESS;
+
+    entries = (ProjectionEntry *)a2a_MallocCharged(oversized_points * sizeof(ProjectionEntry));
+    cursor = (int *)a2a_Malloc((*Kc) * sizeof(int));
+    part_sizes = (int *)a2a_Malloc(max_parts * sizeof(int));
+    new_counts = (int *)a2a_Malloc(((*Kc) + total_parts) * sizeof(int));
+    if (!entries || !cursor || !part_sizes || !new_counts) {
+        fprintf(stderr, "Error allocating memory for cluster splitting\n");
+        goto cleanup;
+    }
+
+    // Gather the members of the oversized clusters in consecutive segments of entries
+    int offset = 0;
+    for (int c = 0; c < *Kc; c++) {
+        cursor[c] = -1;
+        if ((*counts)[c] > max_size) {
+            cursor[c] = offset;
+            offset += (*counts)[c];
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        const int c = assignments[i];
+        if (cursor[c] >= 0) entries[cursor[c]++].id = i;
+    }
+
+    // Split each oversized cluster. The first part keeps the original cluster id
+    // and the rest are appended after the existing clusters.
+    memcpy(new_counts, *counts, (*Kc) * sizeof(int));
+    int Kc_new = *Kc;
+    offset = 0;
+    for (int c = 0; c < *Kc; c++) {
+        const int n = (*counts)[c];
+        if (n <= max_size) continue;
+
+        int num_parts = 0;
+        ProjectionEntry* segment = entries + offset;
+        bisect_cluster(data, L, segment, n, max_size, part_sizes, &num_parts);
+        DEBUG_PRINT("ANN: Splitting cluster %d with %d points into %d parts\n", c, n, num_parts);
+
+        new_counts[c] = part_sizes[0];
+        int start = part_sizes[0];
+        for (int p = 1; p < num_parts; p++) {
+            for (int i = start; i < start + part_sizes[p]; i++) {
+                assignments[segment[i].id] = Kc_new;
+            }
+            new_counts[Kc_new++] = part_sizes[p];
+            start += part_sizes[p];
+        }
+        offset += n;
+    }
+
+    a2a_Free(*counts);
+    *counts = new_counts;
+    new_counts = NULL;
+    *Kc = Kc_new;
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(entries);
+    a2a_Free(cursor);
+    a2a_Free(part_sizes);
+    a2a_Free(new_counts);
+
+    return status;
+}
+
+
+// A random projection tree: the leaves partition the points like the clusters of the k-means
+typedef struct {
+    int* assignments;                    // Leaf of each point (N elements)
+    int* counts;                         // Size of each leaf
+    int num_leaves;                      // Number of leaves
+    unsigned int seed;                   // Seed of the split directions
+} RpTree;
+
+
+typedef struct {
+    const DTYPE* C;                      // Data matrix
+    int N;                               // Number of points
+    int L;                               // Dimension of the points
+    int max_size;                        // Maximum number of points per leaf
+    RpTree* trees;                       // Trees of the forest
+    int num_trees;                       // Number of trees
+    atomic_int* next;                    // Next tree to build
+} rpForestTask;
+
+
+// Halves the points of entries at the median of their projection on the line through two
+// random members, until every part holds at most max_size points. Each part becomes a leaf.
+static void split_rp_node(const rpForestTask* task, RpTree* tree, ProjectionEntry* entries, 
+    const int n, unsigned int* seed) {
+
+    const int L = task->L;
+    if (n <= task->max_size) {
+        const int leaf = tree->num_leaves++;
+        tree->counts[leaf] = n;
+        for (int i = 0; i < n; i++) tree->assignments[entries[i].id] = leaf;
+        return;
+    }
+
+    const int ia = rand_r(seed) % n;
+    int ib = rand_r(seed) % (n - 1);
+    if (ib >= ia) ib++;
+    const DTYPE* xa = task->C + (size_t)entries[ia].id * L;
+    const DTYPE* xb = task->C + (size_t)entries[ib].id * L;
+
+    for (int i = 0; i < n; i++) {
+        const DTYPE* x = task->C + (size_t)entries[i].id * L;
+        DTYPE key = SUFFIX(0.0);
+        for (int l = 0; l < L; l++) key += x[l] * (xb[l] - xa[l]);
+        entries[i].key = key;
+    }
+    qsort(entries, n, sizeof(ProjectionEntry), compare_projections);
+
+    const int half = n / 2;
+    split_rp_node(task, tree, entries, half, seed);
+    split_rp_node(task, tree, entries + half, n - half, seed);
+}
 
-int a2a_annsearch(const DTYPE* C, const int N, const int L, const int K, 
-    int Kc, int* IDX, DTYPE* D, const int nthreads,
-    const double max_memory_usage_ratio, parallelization_type_t par_type) {
 
-    if (check_input_args_ann(C, N, L, K, Kc, IDX, D, nthreads, max_memory_usage_ratio)) {
+static int rpForestTaskExec(void* arg) {
+    rpForestTask* task = (rpForestTask *)arg;
+
+    ProjectionEntry* entries = (ProjectionEntry *)a2a_MallocCharged(sizeof(ProjectionEntry) * task->N);
+    if (!entries) {
+        fprintf(stderr, "Error allocating memory for the random projection trees\n");
         return EXIT_FAILURE;
     }
 
+    int t;
+    while ((t = atomic_fetch_add(task->next, 1)) < task->num_trees) {
+        RpTree* tree = &task->trees[t];
+        for (int i = 0; i < task->N; i++) entries[i].id = i;
+        tree->num_leaves = 0;
+        split_rp_node(task, tree, entries, task->N, &tree->seed);
+        DEBUG_PRINT("ANN: Random projection tree %d has %d leaves\n", t, tree->num_leaves);
+    }
+
+    a2a_Free(entries);
+    return EXIT_SUCCESS;
+}
+
+
+// Builds the trees of a random projection forest in parallel, one tree per worker at a time
+static int build_rp_forest(const DTYPE* C, const int N, const int L, const int max_size, 
+    RpTree* trees, const int num_trees, const int nthreads, const parallelization_type_t par_type) {
+
+    // Every leaf holds at least (max_size + 1) / 2 points since only parts larger than max_size are halved
+    const int max_leaves = N / ((max_size + 1) / 2) + 1;
+    for (int t = 0; t < num_trees; t++) {
+        trees[t].assignments = (int *)a2a_MallocCharged(sizeof(int) * N);
+        trees[t].counts = (int *)a2a_Malloc(sizeof(int) * max_leaves);
+        trees[t].num_leaves = 0;
+        trees[t].seed = 2654435761u * (unsigned int)(t + 1);
+        if (!trees[t].assignments || !trees[t].counts) {
+            fprintf(stderr, "Error allocating memory for the random projection trees\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    const int nworkers = nthreads < num_trees ? nthreads : num_trees;
+    rpForestTask* tasks = (rpForestTask *)a2a_Malloc(sizeof(rpForestTask) * nworkers);
+    if (!tasks) return EXIT_FAILURE;
+
+    atomic_int next = 0;
+    for (int i = 0; i < nworkers; i++) {
+        tasks[i].C = C;
+        tasks[i].N = N;
+        tasks[i].L = L;
+        tasks[i].max_size = max_size;
+        tasks[i].trees = trees;
+        tasks[i].num_trees = num_trees;
+        tasks[i].next = &next;
+    }
+
+    const int status = a2a_ParallelRun(rpForestTaskExec, tasks, sizeof(rpForestTask), nworkers, par_type);
+    a2a_Free(tasks);
+
+    return status;
+}
+
+
+// Returns the submatrix of a tiled cluster. The first tile to arrive gathers it while 
+// the others sleep until it is ready, since gathering is much cheaper than searching a tile.
+// Returns NULL if the submatrix does not fit in the memory budget or cannot be allocated.
+static DTYPE* acquire_shared_submatrix(const annTask* task, SharedSubmatrix* shared, const int cid) {
+    WorkQueue* queue = task->queue;
+    const int cluster_size = task->cluster_index[cid].count;
+    int expected = SUBMATRIX_EMPTY;
+
+    if (atomic_compare_exchange_strong(&shared->state, &expected, SUBMATRIX_LOADING)) {
+        // The loader cannot wait for the budget while the other tiles wait for it
+        const size_t bytes = sizeof(DTYPE) * (size_t)cluster_size * task->L;
+        if (a2a_MemoryCharge(bytes)) {
+            DEBUG_PRINT("ANN: Memory budget short, the tiles of cluster %d will gather it\n", cid);
+        }
+        else {
+            shared->charged_bytes = bytes;
+            shared->C_sub = (DTYPE *)a2a_Malloc(bytes);
+        }
+        if (shared->C_sub) {
+            a2a_GatherRows(task->C, task->L, task->cluster_index[cid].indices, cluster_size, shared->C_sub);
+        }
+        pthread_mutex_lock(&queue->lock);
+        atomic_store(&shared->state, SUBMATRIX_READY);
+        pthread_cond_broadcast(&queue->loaded);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    else if (atomic_load(&shared->state) != SUBMATRIX_READY) {
+        pthread_mutex_lock(&queue->lock);
+        while (atomic_load(&shared->state) != SUBMATRIX_READY) pthread_cond_wait(&queue->loaded, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return shared->C_sub;
+}
+
+
+static void release_shared_submatrix(SharedSubmatrix* shared) {
+    if (atomic_fetch_sub(&shared->pending_tiles, 1) == 1) {
+        a2a_Free(shared->C_sub);
+        shared->C_sub = NULL;
+        a2a_MemoryUncharge(shared->charged_bytes);
+        shared->charged_bytes = 0;
+    }
+}
+
+
+static void init_arena(WorkerArena* arena) {
+    arena->C_sub = NULL;
+    arena->points_capacity = 0;
+    arena->dist_sub = NULL;
+    arena->idx_sub = NULL;
+    arena->rows_capacity = 0;
+    arena->reserved_bytes = 0;
+    arena->seen = NULL;
+    arena->merge_idx = NULL;
+    arena->merge_dist = NULL;
+    arena->lut = NULL;
+    arena->qlut = NULL;
+    arena->adc_dist = NULL;
+    arena->adc_scores = NULL;
+    arena->codes_capacity = 0;
+    arena->candidates = NULL;
+    arena->candidates_capacity = 0;
+}
+
+
+// Grows the arena to hold a submatrix of num_points rows and the results of num_rows queries
+static int reserve_arena(WorkerArena* arena, const int num_points, const int num_rows, 
+    const int L, const int K) {
+
+    // The buffers grow within the memory budget shared with the other workers
+    const size_t points_growth = num_points > arena->points_capacity ? 
+        sizeof(DTYPE) * (size_t)(num_points - arena->points_capacity) * L : 0;
+    const size_t rows_growth = num_rows > arena->rows_capacity ? 
+        (sizeof(DTYPE) + sizeof(int)) * (size_t)(num_rows - arena->rows_capacity) * (K + 1) : 0;
+    if (points_growth + rows_growth > 0) {
+        // The workspace of the k-NN search is idle between items, return it to the budget first
+        a2a_KnnWorkspaceDestroy(&arena->knn);
+        size_t granted = 0;
+        if (a2a_MemoryReserve(points_growth + rows_growth, points_growth + rows_growth, &granted)) {
+            fprintf(stderr, "Error: Memory budget too small for the buffers of a cluster\n");
+            return EXIT_FAILURE;
+        }
+        arena->reserved_bytes += granted;
+    }
+
+    if (num_points > arena->points_capacity) {
+        DTYPE* C_sub = (DTYPE *)a2a_Realloc(arena->C_sub, sizeof(DTYPE) * num_points * L);
+        if (!C_sub) return EXIT_FAILURE;
+        arena->C_sub = C_sub;
+        arena->points_capacity = num_points;
+    }
+    if (num_rows > arena->rows_capacity) {
+        DTYPE* dist_sub = (DTYPE *)a2a_Realloc(arena->dist_sub, sizeof(DTYPE) * num_rows * (K + 1));
+        if (!dist_sub) return EXIT_FAILURE;
+        arena->dist_sub = dist_sub;
+        int* idx_sub = (int *)a2a_Realloc(arena->idx_sub, sizeof(int) * num_rows * (K + 1));
+        if (!idx_sub) return EXIT_FAILURE;
+        arena->idx_sub = idx_sub;
+        arena->rows_capacity = num_rows;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+static void destroy_arena(WorkerArena* arena) {
+    a2a_Free(arena->C_sub);
+    a2a_Free(arena->dist_sub);
+    a2a_Free(arena->idx_sub);
+    a2a_Free(arena->seen);
+    a2a_Free(arena->merge_idx);
+    a2a_Free(arena->merge_dist);
+    a2a_Free(arena->lut);
+    a2a_Free(arena->qlut);
+    a2a_Free(arena->adc_dist);
+    a2a_Free(arena->adc_scores);
+    a2a_Free(arena->candidates);
+    a2a_KnnWorkspaceDestroy(&arena->knn);
+    a2a_MemoryRelease(arena->reserved_bytes);
+    init_arena(arena);
+}
+
+
+// Whether a neighbor is listed in a row, from the marks of seen or by scanning the row without them
+static int listed(const WorkerArena* arena, const int row, const int* row_idx, const int K, const int j) {
+    if (arena->seen) return arena->seen[j] == row;
+    for (int k = 0; k < K; ++k) {
+        if (row_idx[k] == j) return 1;
+    }
+    return 0;
+}
+
+
+// Merges the K neighbors a point found in its cluster into its row of IDX and D from a
+// previous partition. Both lists are sorted, neighbors listed in the row are skipped.
+static void merge_row(WorkerArena* arena, const int row, int* row_idx, DTYPE* row_dist, const int K) {
+    const int* new_idx = arena->merge_idx;
+    const DTYPE* new_dist = arena->merge_dist;
+    int* out_idx = arena->merge_idx + K;
+    DTYPE* out_dist = arena->merge_dist + K;
+
+    if (arena->seen) {
+        for (int k = 0; k < K; ++k) arena->seen[row_idx[k]] = row;
+    }
+
+    int a = 0, b = 0, n = 0;
+    while (n < K) {
+        if (b < K && listed(arena, row, row_idx, K, new_idx[b])) {
+            b++;
+            continue;
+        }
+        if (b >= K || row_dist[a] <= new_dist[b]) {
+            out_idx[n] = row_idx[a];
+            out_dist[n] = row_dist[a++];
+        }
+        else {
+            out_idx[n] = new_idx[b];
+            out_dist[n] = new_dist[b++];
+        }
+        n++;
+    }
+
+    memcpy(row_idx, out_idx, sizeof(int) * K);
+    memcpy(row_dist, out_dist, sizeof(DTYPE) * K);
+}
+
+
+// Grows the PQ buffers of the arena to scan num_codes codes and keep num_candidates candidates
+static int reserve_pq_arena(WorkerArena* arena, const a2a_pq_t* pq, const int num_codes, 
+    const int num_candidates) {
+
+    // The buffers grow within the memory budget shared with the other workers
+    const int capacity = (num_codes + A2A_PQ_BLOCK - 1) / A2A_PQ_BLOCK * A2A_PQ_BLOCK;
+    size_t growth = arena->lut ? 0 : sizeof(DTYPE) * pq->m * pq->ksub + sizeof(uint8_t) * pq->m * 16;
+    if (num_codes > arena->codes_capacity) {
+        growth += (sizeof(DTYPE) + sizeof(uint16_t)) * (size_t)(capacity - arena->codes_capacity);
+    }
+    if (num_candidates > arena->candidates_capacity) {
+        growth += sizeof(ProjectionEntry) * (size_t)(num_candidates - arena->candidates_capacity);
+    }
+    if (growth > 0) {
+        size_t granted = 0;
+        if (a2a_MemoryReserve(growth, growth, &granted)) {
+            fprintf(stderr, "Error: Memory budget too small for the PQ buffers of a cluster\n");
+            return EXIT_FAILURE;
+        }
+        arena->reserved_bytes += granted;
+    }
+
+    if (!arena->lut) {
+        arena->lut = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * pq->m * pq->ksub);
+        arena->qlut = (uint8_t *)a2a_Malloc(sizeof(uint8_t) * pq->m * 16);
+        if (!arena->lut || !arena->qlut) return EXIT_FAILURE;
+    }
+    if (num_codes > arena->codes_capacity) {
+        // The fast scan writes the scores of whole blocks
+        DTYPE* adc_dist = (DTYPE *)a2a_Realloc(arena->adc_dist, sizeof(DTYPE) * capacity);
+        if (!adc_dist) return EXIT_FAILURE;
+        arena->adc_dist = adc_dist;
+        uint16_t* adc_scores = (uint16_t *)a2a_Realloc(arena->adc_scores, sizeof(uint16_t) * capacity);
+        if (!adc_scores) return EXIT_FAILURE;
+        arena->adc_scores = adc_scores;
+        arena->codes_capacity = capacity;
+    }
+    if (num_candidates > arena->candidates_capacity) {
+        ProjectionEntry* candidates = (ProjectionEntry *)a2a_Realloc(arena->candidates, 
+            sizeof(ProjectionEntry) * num_candidates);
+        if (!candidates) return EXIT_FAILURE;
+        arena->candidates = candidates;
+        arena->candidates_capacity = num_candidates;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// Offers a candidate to a max-heap of at most capacity entries with the smallest keys
+static void offer_candidate(ProjectionEntry* heap, int* size, const int capacity, const DTYPE key, 
+    const int id) {
+
+    int i;
+    if (*size < capacity) {
+        // Sift the new entry up from the end
+        i = (*size)++;
+        while (i > 0 && heap[(i - 1) / 2].key < key) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    else {
+        if (key >= heap[0].key) return;
+        // Replace the root and sift the new entry down
+        i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= *size) break;
+            if (child + 1 < *size && heap[child + 1].key > heap[child].key) child++;
+            if (heap[child].key <= key) break;
+            heap[i] = heap[child];
+            i = child;
+        }
+    }
+    heap[i].key = key;
+    heap[i].id = id;
+}
+
+
+// Searches the rows of a work item on the PQ codes of the cluster: the codes are scanned with
+// the lookup table of each row, and the nearest candidates are re-ranked with exact distances
+// or with the full precision table
+static int solve_work_item_pq(annTask* task, const WorkItem* item) {
+    const PqSearch* search = task->pq;
+    const a2a_pq_t* pq = search->pq;
+    WorkerArena* arena = &task->arena;
+    const ClusterIndex* cluster = &task->cluster_index[item->cluster_id];
+    const unsigned char* codes = task->layout->codes + cluster->code_offset;
+    const int* indices = cluster->indices;
+    const int n = cluster->count;
+    const int L = task->L;
+    const int K = task->K;
+    const int num_candidates = search->candidates < n - 1 ? search->candidates : n - 1;
+
+    if (reserve_pq_arena(arena, pq, n, num_candidates)) return EXIT_FAILURE;
+    ProjectionEntry* candidates = arena->candidates;
+
+    for (int i = item->row_begin; i < item->row_end; ++i) {
+        const int orig_i = indices[i];
+        const DTYPE* x = task->C + (size_t)orig_i * L;
+
+        a2a_pq_compute_lut(pq, x, arena->lut);
+        if (pq->nbits == 4) {
+            DTYPE scale, bias;
+            a2a_pq_quantize_lut(pq, arena->lut, arena->qlut, &scale, &bias);
+            a2a_pq_fast_scan(pq, arena->qlut, codes, n, arena->adc_scores);
+            for (int j = 0; j < n; ++j) arena->adc_dist[j] = (DTYPE)arena->adc_scores[j];
+        }
+        else {
+            a2a_pq_adc_scan(pq, arena->lut, codes, n, arena->adc_dist);
+        }
+
+        int count = 0;
+        for (int j = 0; j < n; ++j) {
+            if (j != i) offer_candidate(candidates, &count, num_candidates, arena->adc_dist[j], j);
+        }
+
+        for (int c = 0; c < count; ++c) {
+            const int orig_j = indices[candidates[c].id];
+            candidates[c].id = orig_j;
+            candidates[c].key = search->rerank ? 
+                a2a_squared_distance(x, task->C + (size_t)orig_j * L, L) :
+                a2a_pq_adc_distance(pq, arena->lut, search->codes + (size_t)orig_j * pq->code_size);
+        }
+        qsort(candidates, count, sizeof(ProjectionEntry), compare_projections);
+
+        int* out_idx = task->merge ? arena->merge_idx : task->IDX + (size_t)orig_i * K;
+        DTYPE* out_dist = task->merge ? arena->merge_dist : task->D + (size_t)orig_i * K;
+        for (int k = 0; k < K; ++k) {
+            out_idx[k] = candidates[k].id;
+            out_dist[k] = SQRT(candidates[k].key);
+        }
+        if (task->merge) merge_row(arena, orig_i, task->IDX + (size_t)orig_i * K, task->D + (size_t)orig_i * K, K);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int solve_work_item_exact(annTask* task, const WorkItem* item) {
+    const int cid = item->cluster_id;
+    WorkerArena* arena = &task->arena;
+    ClusterIndex* cluster_index = task->cluster_index;
+    SharedSubmatrix* shared = task->queue->shared ? &task->queue->shared[cid] : NULL;
+    int* IDX = task->IDX;
+    DTYPE* D = task->D;
+    const int L = task->L;
+    const int K = task->K;
+    const int cluster_size = cluster_index[cid].count;
+    const int num_rows = item->row_end - item->row_begin;
+    const int* indices = cluster_index[cid].indices;
+    const int tiled = num_rows < cluster_size;
+    const int permuted = task->layout->data != NULL;
+    int status = EXIT_FAILURE;
+
+    DEBUG_PRINT("\nANN: Solving rows %d-%d of cluster %d with %d points\n", item->row_begin, item->row_end, cid, cluster_size);
+    
+    // This should never happen
+    DEBUG_ASSERT(cluster_size > 0, "ANN: Cluster size must be greater than 0\n");
+
+    // Make room for the item in the arena of the worker (no-op once the arena is large enough)
+    if (reserve_arena(arena, tiled || permuted ? 0 : cluster_size, num_rows, L, K)) goto cleanup;
+    DTYPE* dist_sub = arena->dist_sub;
+    int* idx_sub = arena->idx_sub;
+    const DTYPE* C_sub = NULL;
+    const DTYPE* sqrmag_sub = NULL;
+    if (permuted) {
+        // The cluster is a contiguous slice of the permuted data
+        C_sub = task->layout->data + (size_t)cluster_index[cid].offset * L;
+        sqrmag_sub = task->layout->sqrmag + cluster_index[cid].offset;
+    }
+    else if (tiled) {
+        C_sub = acquire_shared_submatrix(task, shared, cid);
+    }
+    if (!C_sub) {
+        // Without a shared submatrix, the tiles gather their own, waiting for the budget if needed
+        if (tiled && reserve_arena(arena, cluster_size, num_rows, L, K)) goto cleanup;
+        a2a_GatherRows(task->C, L, indices, cluster_size, arena->C_sub);
+        C_sub = arena->C_sub;
+    }
+
+    // Find K nearest neighbors of the rows of the item in the submatrix
+    if (a2a_knnsearch_ws(C_sub + (size_t)item->row_begin * L, C_sub, idx_sub, dist_sub, num_rows, cluster_size, 
+        L, K + 1, task->sorted, sqrmag_sub ? sqrmag_sub + (size_t)item->row_begin : NULL, sqrmag_sub, 
+        &arena->knn)) goto cleanup;
+
+    // Fill the output matrices IDX and D, or merge into them
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_COPY_OUT);
+    for (int r = 0; r < num_rows; ++r) {
+        int i = item->row_begin + r;
+        int orig_i = indices[i];
+        int* out_idx = task->merge ? arena->merge_idx : IDX + (size_t)orig_i * K;
+        DTYPE* out_dist = task->merge ? arena->merge_dist : D + (size_t)orig_i * K;
+        int out_k = 0;
+        for (int k = 0; k < K + 1; ++k) {
+            int local_j = idx_sub[r * (K + 1) + k];
+            if (local_j == i) continue; // skip self
+            out_idx[out_k] = indices[local_j];
+            out_dist[out_k] = dist_sub[r * (K + 1) + k];
+            if (++out_k >= K) break;
+        }
+        if (task->merge) merge_row(arena, orig_i, IDX + (size_t)orig_i * K, D + (size_t)orig_i * K, K);
+    }
+    a2a_PhaseEnd(&timer, A2A_PHASE_COPY_OUT);
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (tiled && !permuted) release_shared_submatrix(shared);
+    return status;
+}
+
+
+// Searches the rows of a work item and traces it as an event of its cluster
+static int solve_work_item(annTask* task, const WorkItem* item) {
+    const long long trace_start = a2a_TraceBegin();
+    const int status = task->pq ? solve_work_item_pq(task, item) : solve_work_item_exact(task, item);
+    a2a_TraceEnd("cluster", trace_start, item->cluster_id, item->row_end - item->row_begin);
+    return status;
+}
+
+
+static int annTaskExec(void *arg) {
+
+    annTask * task = (annTask *)arg;
+    WorkQueue* queue = task->queue;
+
+    init_arena(&task->arena);
+    if (a2a_KnnWorkspaceInit(&task->arena.knn, task->max_memory_usage_ratio)) {
+        atomic_store(&queue->next, queue->num_items);  // Stop the other workers
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+
+    if (task->merge) {
+        // The marks of the listed neighbors save scanning the row for every new neighbor
+        task->arena.seen = (int *)a2a_MallocCharged(sizeof(int) * (size_t)task->N);
+        task->arena.merge_idx = (int *)a2a_Malloc(sizeof(int) * 2 * task->K);
+        task->arena.merge_dist = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * 2 * task->K);
+        if (!task->arena.merge_idx || !task->arena.merge_dist) {
+            atomic_store(&queue->next, queue->num_items);  // Stop the other workers
+            destroy_arena(&task->arena);
+            return EXIT_FAILURE;
+        }
+        if (task->arena.seen) {
+            for (int i = 0; i < task->N; ++i) task->arena.seen[i] = -1;
+        }
+    }
+
+    // Keep taking the most expensive item left until the queue is drained
+    int solved_items = 0;
+    int pos;
+    while ((pos = atomic_fetch_add(&queue->next, 1)) < queue->num_items) {
+        if (solve_work_item(task, &queue->items[pos])) {
+            atomic_store(&queue->next, queue->num_items);  // Stop the other workers
+            status = EXIT_FAILURE;
+            break;
+        }
+        solved_items++;
+    }
+
+    DEBUG_PRINT("\nANN: Worker %d solved %d work items\n", task->worker_id, solved_items);
+    destroy_arena(&task->arena);
+
+    return status;
+}
+
+
+// Comparator for sorting work items by descending cost
+static int compare_work_items(const void* a, const void* b) {
+    const WorkItem* wa = (const WorkItem*)a;
+    const WorkItem* wb = (const WorkItem*)b;
+    return (wb->cost > wa->cost) - (wb->cost < wa->cost); // descending
+}
+
+
+// Clusters costing more than 1 / (GIANT_CLUSTER_SHARE * nthreads) of the total work are split
+// into tiles of query rows, about TILES_PER_THREAD per thread for the work of all clusters and
+// of at least MIN_ROWS_PER_TILE rows
+#define GIANT_CLUSTER_SHARE 2
+#define TILES_PER_THREAD 4
+#define MIN_ROWS_PER_TILE 32
+
+
+// Number of query rows per tile of a cluster (count if the cluster is not split)
+static int tile_rows(const int count, const int L, const int nthreads, const double giant_cost, 
+    const double tile_cost) {
+
+    const double cost = (double)count * count * L;
+    if (nthreads == 1 || cost <= giant_cost) return count;
+
+    int rows = (int)ceil(tile_cost / ((double)count * L));
+    if (rows < MIN_ROWS_PER_TILE) rows = MIN_ROWS_PER_TILE;
+    return rows < count ? rows : count;
+}
+
+
+static int build_work_queue(const int Kc, const int L, const int nthreads, 
+    const ClusterIndex* cluster_index, WorkQueue* queue) {
+
+    queue->items = NULL;
+    queue->shared = NULL;
+    queue->num_items = 0;
+    atomic_init(&queue->next, 0);
+
+    // The search of r query rows of a cluster costs about r * count * L operations
+    double total_cost = 0.0;
+    for (int i = 0; i < Kc; ++i) {
+        total_cost += (double)cluster_index[i].count * cluster_index[i].count * L;
+    }
+
+    // Clusters that would keep one worker busy for a large part of the run are split
+    // into tiles of query rows, so that all the workers can share them
+    const double giant_cost = total_cost / (GIANT_CLUSTER_SHARE * nthreads);
+    const double tile_cost = total_cost / (TILES_PER_THREAD * nthreads);
+    int num_items = 0, num_tiled = 0;
+    for (int i = 0; i < Kc; ++i) {
+        const int count = cluster_index[i].count;
+        const int rows_per_tile = tile_rows(count, L, nthreads, giant_cost, tile_cost);
+        const int num_tiles = (count + rows_per_tile - 1) / rows_per_tile;
+        if (num_tiles > 1) num_tiled++;
+        num_items += num_tiles;
+    }
+
+    queue->items = (WorkItem *)a2a_Malloc(sizeof(WorkItem) * num_items);
+    if (!queue->items) return EXIT_FAILURE;
+    if (num_tiled > 0) {
+        queue->shared = (SharedSubmatrix *)a2a_Malloc(sizeof(SharedSubmatrix) * Kc);
+        if (!queue->shared) return EXIT_FAILURE;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->loaded, NULL);
+    }
+
+    int item = 0;
+    for (int i = 0; i < Kc; ++i) {
+        const int count = cluster_index[i].count;
+        const int rows_per_tile = tile_rows(count, L, nthreads, giant_cost, tile_cost);
+        const int num_tiles = (count + rows_per_tile - 1) / rows_per_tile;
+        if (queue->shared) {
+            queue->shared[i].C_sub = NULL;
+            queue->shared[i].charged_bytes = 0;
+            atomic_init(&queue->shared[i].state, SUBMATRIX_EMPTY);
+            atomic_init(&queue->shared[i].pending_tiles, num_tiles > 1 ? num_tiles : 0);
+        }
+        if (num_tiles > 1) {
+            DEBUG_PRINT("ANN: Splitting cluster %d with %d points into %d tiles\n", i, count, num_tiles);
+        }
+        for (int row = 0; row < count; row += rows_per_tile) {
+            queue->items[item].cluster_id = i;
+            queue->items[item].row_begin = row;
+            queue->items[item].row_end = row + rows_per_tile < count ? row + rows_per_tile : count;
+            queue->items[item].cost = (double)(queue->items[item].row_end - row) * count * L;
+            item++;
+        }
+    }
+
+    // Hand out the most expensive items first, so that the cheap ones fill the gaps at the end
+    qsort(queue->items, num_items, sizeof(WorkItem), compare_work_items);
+    queue->num_items = num_items;
+
+    return EXIT_SUCCESS;
+}
+
+
+static void destroy_work_queue(WorkQueue* queue, const int Kc) {
+    if (queue->shared) {
+        for (int i = 0; i < Kc; ++i) {
+            a2a_Free(queue->shared[i].C_sub);
+            a2a_MemoryUncharge(queue->shared[i].charged_bytes);
+        }
+        a2a_Free(queue->shared);
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->loaded);
+    }
+    a2a_Free(queue->items);
+    queue->items = NULL;
+    queue->shared = NULL;
+}
+
+
+// Stores the PQ codes of the points in cluster order, in blocks for the fast scan of 4-bit codes
+static int build_pq_codes(const PqSearch* search, const int Kc, ClusterIndex* cluster_index, 
+    ClusterLayout* layout) {
+
+    const a2a_pq_t* pq = search->pq;
+    const int code_size = pq->code_size;
+    const int blocked = pq->nbits == 4;
+
+    size_t size = 0;
+    int max_count = 0;
+    for (int k = 0; k < Kc; ++k) {
+        const int count = cluster_index[k].count;
+        cluster_index[k].code_offset = size;
+        size += blocked ? a2a_pq_blocks_size(pq, count) : (size_t)count * code_size;
+        if (count > max_count) max_count = count;
+    }
+
+    layout->codes = (unsigned char *)a2a_MallocCharged(size > 0 ? size : 1);
+    unsigned char* rows = blocked ? (unsigned char *)a2a_Malloc((size_t)max_count * code_size) : NULL;
+    if (!layout->codes || (blocked && !rows)) {
+        fprintf(stderr, "Error allocating memory for the PQ codes of the clusters\n");
+        a2a_Free(rows);
+        return EXIT_FAILURE;
+    }
+
+    for (int k = 0; k < Kc; ++k) {
+        const int count = cluster_index[k].count;
+        unsigned char* dst = blocked ? rows : layout->codes + cluster_index[k].code_offset;
+        for (int i = 0; i < count; ++i) {
+            memcpy(dst + (size_t)i * code_size, 
+                search->codes + (size_t)cluster_index[k].indices[i] * code_size, code_size);
+        }
+        if (blocked) a2a_pq_pack_blocks(pq, rows, count, layout->codes + cluster_index[k].code_offset);
+    }
+
+    a2a_Free(rows);
+    return EXIT_SUCCESS;
+}
+
+
+// Searches the K nearest neighbors of every point within its cluster, on the PQ codes if pq
+// is given. With merge set, the results are merged into the sorted rows of IDX and D, which 
+// hold the results of another partition, and the merged rows stay sorted.
+static int solve_clusters(const DTYPE* C, const int N, const int L, const int K, const int Kc, 
+    const int* assignments, const int* counts, const int permute_data, const PqSearch* pq, 
+    const int sorted, const int merge, int* IDX, DTYPE* D, const int nthreads, 
+    const double max_memory_usage_ratio, const parallelization_type_t par_type) {
+
     int status = EXIT_FAILURE;
-    int *assignments = NULL, *counts = NULL;
     ClusterIndex* cluster_index = NULL;
-    pthread_t *threads = NULL;
+    ClusterLayout layout = { .perm = NULL, .data = NULL, .sqrmag = NULL, .codes = NULL };
+    WorkQueue queue = { .items = NULL, .shared = NULL };
     annTask* tasks = NULL;
 
-    // Step 1: k-means clustering
-    if (kmeans(C, N, L, K + 1, &Kc, &assignments, &counts, nthreads, max_memory_usage_ratio, par_type)) goto cleanup;
-
-    // Step 2: build cluster point index
-    cluster_index = (ClusterIndex *)malloc(sizeof(ClusterIndex) * Kc);
+    // Build the cluster point index and store the points in cluster order
+    cluster_index = (ClusterIndex *)a2a_Malloc(sizeof(ClusterIndex) * Kc);
     if (!cluster_index) goto cleanup;
-    for (int k = 0; k < Kc; k++) cluster_index[k].indices = NULL;
 
-    if (build_cluster_index(assignments, counts, N, Kc, cluster_index)) goto cleanup;
+    // The PQ search reads the codes instead of the data
+    a2a_StatsRecordClusters(counts, Kc);
+    if (build_cluster_index(C, assignments, counts, N, L, K, Kc, permute_data && !pq, nthreads, 
+        par_type, cluster_index, &layout)) goto cleanup;
+    a2a_PhaseTimer timer;
+    if (pq) {
+        a2a_PhaseBegin(&timer, A2A_PHASE_CLUSTER_INDEX);
+        if (build_pq_codes(pq, Kc, cluster_index, &layout)) goto cleanup;
+        a2a_PhaseEnd(&timer, A2A_PHASE_CLUSTER_INDEX);
+    }
     
-    threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
-    if (!threads) goto cleanup;
-    tasks = (annTask *)malloc(sizeof(annTask) * nthreads);
+    tasks = (annTask *)a2a_Malloc(sizeof(annTask) * nthreads);
     if (!tasks) goto cleanup;
 
-    // Distribute clusters among threads
-    if (distribute_clusters_by_size(Kc, nthreads, cluster_index, tasks)) goto cleanup;
+    // Queue the clusters and the tiles of giant clusters by estimated cost,
+    // the workers take them dynamically
+    if (build_work_queue(Kc, L, nthreads, cluster_index, &queue)) goto cleanup;
 
     // Initialize tasks
     for (int i = 0; i < nthreads; ++i) {
+        tasks[i].queue = &queue;
+        tasks[i].worker_id = i;
         tasks[i].cluster_index = cluster_index;
+        tasks[i].layout = &layout;
+        tasks[i].N = N;
         tasks[i].L = L;
         tasks[i].K = K;
         tasks[i].C = C;
         tasks[i].D = D;
         tasks[i].IDX = IDX;
-        tasks[i].N = N;
-        tasks[i].max_memory_usage_ratio = max_memory_usage_ratio;
+        tasks[i].sorted = sorted || merge;
+        tasks[i].merge = merge;
+        tasks[i].pq = pq;
+        tasks[i].max_memory_usage_ratio = max_memory_usage_ratio / nthreads;
     }
 
-    switch(par_type) {
-        case PAR_PTHREADS:
-            if (pthreads_parallelization(tasks, nthreads)) goto cleanup;
-            break;
-        case PAR_OPENMP:
-            if (openmp_parallelization(tasks, nthreads)) goto cleanup;
-            break;
-        case PAR_OPENCILK:
-            if (opencilk_parallelization(tasks, nthreads)) goto cleanup;
-            break;
-        default:
-            fprintf(stderr, "Unknown parallelization type\n");
-            goto cleanup;
+    a2a_PhaseBegin(&timer, A2A_PHASE_CLUSTER_SEARCH);
+    if (a2a_ParallelRun(annTaskExec, tasks, sizeof(annTask), nthreads, par_type)) goto cleanup;
+    a2a_PhaseEnd(&timer, A2A_PHASE_CLUSTER_SEARCH);
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (cluster_index) a2a_Free(cluster_index);
+    if (layout.perm) a2a_Free(layout.perm);
+    if (layout.data) a2a_Free(layout.data);
+    if (layout.sqrmag) a2a_Free(layout.sqrmag);
+    if (layout.codes) a2a_Free(layout.codes);
+    if (tasks) a2a_Free(tasks);
+    destroy_work_queue(&queue, Kc);
+
+    return status;
+}
+
+
+// All-to-all search on the leaves of a random projection forest. The leaves of each tree
+// are searched like k-means clusters and every tree after the first merges its neighbors 
+// into the results of the previous ones.
+static int rp_forest_search(const DTYPE* C, const int N, const int L, const int K, const int Kc, 
+    const a2a_ann_options_t* opts, const PqSearch* pq, int* IDX, DTYPE* D, const int nthreads, 
+    const double max_memory_usage_ratio, const parallelization_type_t par_type) {
+
+    int max_size = opts->max_cluster_size;
+    if (max_size == A2A_CLUSTER_SIZE_AUTO) max_size = a2a_cluster_size_from_cache(L);
+    if (max_size == 0) max_size = (N + Kc - 1) / Kc;
+    // Halving a leaf must leave the K + 1 points of a self-join in each part
+    if (max_size < 2 * (K + 1)) max_size = 2 * (K + 1);
+    DEBUG_PRINT("ANN: %d random projection trees with at most %d points per leaf\n", opts->num_trees, max_size);
+
+    int status = EXIT_FAILURE;
+    RpTree* trees = (RpTree *)a2a_Calloc(opts->num_trees, sizeof(RpTree));
+    if (!trees) goto cleanup;
+
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_ASSIGNMENT);
+    if (build_rp_forest(C, N, L, max_size, trees, opts->num_trees, nthreads, par_type)) goto cleanup;
+    a2a_PhaseEnd(&timer, A2A_PHASE_ASSIGNMENT);
+
+    for (int t = 0; t < opts->num_trees; t++) {
+        if (solve_clusters(C, N, L, K, trees[t].num_leaves, trees[t].assignments, trees[t].counts, 
+            opts->permute_data, pq, 1, t > 0, IDX, D, nthreads, max_memory_usage_ratio, par_type)) goto cleanup;
     }
 
     status = EXIT_SUCCESS;
 
 cleanup:
+    if (trees) {
+        for (int t = 0; t < opts->num_trees; t++) {
+            a2a_Free(trees[t].assignments);
+            a2a_Free(trees[t].counts);
+        }
+        a2a_Free(trees);
+    }
+
+    return status;
+}
+
+
+static int check_input_args_ann(const DTYPE* C, const int N, const int L, const int K, 
+    int Kc, int* IDX, DTYPE* D, const int nthreads, 
+    const double max_memory_usage_ratio, const a2a_ann_options_t* opts) {
+
+    if (!C || N <= 0 || L <= 0 || K <= 0 || Kc <= 0 || !IDX || !D) {
+        fprintf(stderr, "Invalid input parameters for ANN search\n");
+        return EXIT_FAILURE;
+    }
+    if (Kc > N) {
+        fprintf(stderr, "Number of clusters cannot exceed number of data points\n");
+        return EXIT_FAILURE;
+    }
+    if (N / Kc <= K) {
+        fprintf(stderr, "Number of clusters is too small for the given K\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (max_memory_usage_ratio <= 0.0 || max_memory_usage_ratio > 1.0) {
+        fprintf(stderr, "Invalid memory usage ratio: %f\n", max_memory_usage_ratio);
+        return EXIT_FAILURE;
+    }
+    if (opts->max_cluster_size < 0 && opts->max_cluster_size != A2A_CLUSTER_SIZE_AUTO) {
+        fprintf(stderr, "Invalid maximum cluster size: %d\n", opts->max_cluster_size);
+        return EXIT_FAILURE;
+    }
+    if (opts->coarse_clusters < 0 && opts->coarse_clusters != A2A_COARSE_CLUSTERS_AUTO) {
+        fprintf(stderr, "Invalid number of coarse clusters: %d\n", opts->coarse_clusters);
+        return EXIT_FAILURE;
+    }
+    if (opts->refine_iterations < 0) {
+        fprintf(stderr, "Invalid number of refinement iterations: %d\n", opts->refine_iterations);
+        return EXIT_FAILURE;
+    }
+    if (opts->engine != A2A_ENGINE_KMEANS && opts->engine != A2A_ENGINE_RP_FOREST) {
+        fprintf(stderr, "Invalid ANN engine: %d\n", (int)opts->engine);
+        return EXIT_FAILURE;
+    }
+    if (opts->engine == A2A_ENGINE_RP_FOREST && opts->num_trees < 1) {
+        fprintf(stderr, "Invalid number of trees: %d\n", opts->num_trees);
+        return EXIT_FAILURE;
+    }
+    if (opts->pq_subspaces < 0 || (opts->pq_rerank < 0 && opts->pq_rerank != A2A_PQ_RERANK_AUTO)) {
+        fprintf(stderr, "Invalid product quantization options\n");
+        return EXIT_FAILURE;
+    }
+    if (opts->coarse_clusters > Kc) {
+        fprintf(stderr, "Number of coarse clusters cannot exceed number of clusters\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+int a2a_cluster_points(const DTYPE* C, const int N, const int L, const int min_size, int* Kc, 
+    const a2a_ann_options_t* opts, int** assignments, int** counts, const int nthreads, 
+    const double max_memory_usage_ratio, const parallelization_type_t par_type) {
+
+    // K-means clustering, in two levels if coarse clusters are requested
+    int coarse_clusters = opts->coarse_clusters;
+    if (coarse_clusters == A2A_COARSE_CLUSTERS_AUTO) {
+        coarse_clusters = (int)(sqrt((double)(*Kc)) + 0.5);
+    }
+    if (coarse_clusters > 1) {
+        if (hierarchical_kmeans(C, N, L, min_size, Kc, coarse_clusters, assignments, counts, 
+            nthreads, max_memory_usage_ratio, par_type)) return EXIT_FAILURE;
+    }
+    else if (kmeans(C, N, L, min_size, Kc, assignments, counts, nthreads, max_memory_usage_ratio, 
+        par_type)) return EXIT_FAILURE;
+
+    // Split the clusters that exceed the maximum cluster size
+    int max_cluster_size = opts->max_cluster_size;
+    if (max_cluster_size == A2A_CLUSTER_SIZE_AUTO) {
+        max_cluster_size = a2a_cluster_size_from_cache(L);
+    }
+    if (max_cluster_size > 0) {
+        // Halving a cluster must leave at least min_size points in each part
+        if (max_cluster_size < 2 * min_size) max_cluster_size = 2 * min_size;
+        DEBUG_PRINT("ANN: Maximum cluster size: %d\n", max_cluster_size);
+        a2a_PhaseTimer timer;
+        a2a_PhaseBegin(&timer, A2A_PHASE_MERGE);
+        if (split_oversized_clusters(C, N, L, *assignments, counts, Kc, max_cluster_size)) {
+            a2a_Free(*assignments);
+            a2a_Free(*counts);
+            *assignments = NULL;
+            *counts = NULL;
+            return EXIT_FAILURE;
+        }
+        a2a_PhaseEnd(&timer, A2A_PHASE_MERGE);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void a2a_ann_options_init(a2a_ann_options_t *opts) {
+    opts->max_cluster_size = 0;
+    opts->permute_data = 0;
+    opts->coarse_clusters = 0;
+    opts->refine_iterations = 0;
+    opts->engine = A2A_ENGINE_KMEANS;
+    opts->num_trees = 4;
+    opts->pq_subspaces = 0;
+    opts->pq_bits = 8;
+    opts->pq_rerank = A2A_PQ_RERANK_AUTO;
+    opts->stats = NULL;
+}
+
+
+int a2a_annsearch(const DTYPE* C, const int N, const int L, const int K, 
+    int Kc, int* IDX, DTYPE* D, const int nthreads,
+    const double max_memory_usage_ratio, parallelization_type_t par_type) {
+
+    return a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, nthreads, max_memory_usage_ratio, par_type, NULL);
+}
+
+
+int a2a_annsearch_ex(const DTYPE* C, const int N, const int L, const int K, 
+    int Kc, int* IDX, DTYPE* D, const int nthreads,
+    const double max_memory_usage_ratio, parallelization_type_t par_type, 
+    const a2a_ann_options_t *opts) {
 
-    // Cleanup
-    if (cluster_index) {
-        for (int i = 0; i < Kc; ++i) 
-            if (cluster_index[i].indices) free(cluster_index[i].indices);
-        free(cluster_index);
+    a2a_ann_options_t options;
+    if (opts) options = *opts;
+    else a2a_ann_options_init(&options);
+
+    if (check_input_args_ann(C, N, L, K, Kc, IDX, D, nthreads, max_memory_usage_ratio, &options)) {
+        return EXIT_FAILURE;
     }
-    if (tasks) {
-        for (int i = 0; i < nthreads; ++i) {
-            if (tasks[i].cluster_ids) free(tasks[i].cluster_ids);
+
+    a2a_StatsScope scope;
+    if (a2a_StatsOpen(&scope, options.stats)) return EXIT_FAILURE;
+    if (a2a_MemoryOpen(max_memory_usage_ratio)) {
+        a2a_StatsClose(&scope);
+        return EXIT_FAILURE;
+    }
+    a2a_StatsSetBudget(&scope, a2a_MemoryBudgetBytes());
+
+    int status = EXIT_FAILURE;
+    int *assignments = NULL, *counts = NULL;
+    a2a_pq_t* pq = NULL;
+    unsigned char* codes = NULL;
+    size_t pq_bytes = 0;
+    PqSearch pq_search;
+    a2a_PhaseTimer timer;
+
+    // Step 0: encode the points with product quantization if requested
+    if (options.pq_subspaces > 0) {
+        a2a_PhaseBegin(&timer, A2A_PHASE_QUANTIZATION);
+        // The codebooks (ksub x L elements) are allocated by the public a2a_pq_train, so they
+        // are charged here, before the k-means of the training fills the budget. Invalid
+        // numbers of bits are left to a2a_pq_train to reject.
+        const size_t codebook_bytes = options.pq_bits > 0 && options.pq_bits <= 8 ? 
+            sizeof(DTYPE) * ((size_t)1 << options.pq_bits) * L : 0;
+        if (a2a_MemoryCharge(codebook_bytes)) {
+            fprintf(stderr, "Error: Memory budget too small for the PQ codebooks\n");
+            goto cleanup;
+        }
+        pq_bytes = codebook_bytes;
+        if (a2a_pq_train(C, N, L, options.pq_subspaces, options.pq_bits, nthreads, 
+            max_memory_usage_ratio, par_type, &pq)) goto cleanup;
+        codes = (unsigned char *)a2a_MallocCharged((size_t)N * pq->code_size);
+        if (!codes) {
+            fprintf(stderr, "Error allocating memory for the PQ codes\n");
+            goto cleanup;
         }
-        free(tasks);
+        if (a2a_pq_encode(pq, C, N, codes, nthreads, par_type)) goto cleanup;
+        a2a_PhaseEnd(&timer, A2A_PHASE_QUANTIZATION);
+
+        pq_search.pq = pq;
+        pq_search.codes = codes;
+        const int rerank = options.pq_rerank != A2A_PQ_RERANK_AUTO ? options.pq_rerank : 
+            (options.pq_bits == 4 ? 16 : 4) * K;
+        pq_search.rerank = rerank > 0;
+        pq_search.candidates = rerank > K ? rerank : K;
+    }
+    const PqSearch* search = pq ? &pq_search : NULL;
+
+    if (options.engine == A2A_ENGINE_RP_FOREST) {
+        // Steps 1 to 3 for the leaves of each tree, merging the results of the trees
+        if (rp_forest_search(C, N, L, K, Kc, &options, search, IDX, D, nthreads, 
+            max_memory_usage_ratio, par_type)) goto cleanup;
+    }
+    else {
+        // Step 1: k-means clustering, splitting the clusters that exceed the maximum cluster size
+        if (a2a_cluster_points(C, N, L, K + 1, &Kc, &options, &assignments, &counts, nthreads, 
+            max_memory_usage_ratio, par_type)) goto cleanup;
+
+        // Steps 2 and 3: search every cluster
+        if (solve_clusters(C, N, L, K, Kc, assignments, counts, options.permute_data, search, 0, 0, IDX, D, 
+            nthreads, max_memory_usage_ratio, par_type)) goto cleanup;
     }
-    if (threads) free(threads);
-    if (assignments) free(assignments);
-    if (counts) free(counts);
+
+    // Step 4: recover the neighbors lost at the cluster boundaries with NN-descent
+    if (options.refine_iterations > 0) {
+        a2a_nndescent_options_t refine;
+        a2a_nndescent_options_init(&refine);
+        refine.max_iterations = options.refine_iterations;
+        a2a_PhaseBegin(&timer, A2A_PHASE_REFINE);
+        if (a2a_nndescent_refine(C, N, L, K, IDX, D, nthreads, par_type, &refine)) goto cleanup;
+        a2a_PhaseEnd(&timer, A2A_PHASE_REFINE);
+    }
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (assignments) a2a_Free(assignments);
+    if (counts) a2a_Free(counts);
+    a2a_pq_free(pq);
+    a2a_MemoryUncharge(pq_bytes);
+    a2a_Free(codes);
+    a2a_MemoryClose();
+    a2a_StatsClose(&scope);
 
     return status;
 }
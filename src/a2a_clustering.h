@@ -0,0 +1,65 @@
+#ifndef A2A_CLUSTERING_H
+#define A2A_CLUSTERING_H
+
+#include "a2a_config.h"
+#include "a2a_ann.h"
+
+// Clustering steps of the ANN search shared with the other index types of the library.
+// Not part of the public API.
+
+
+/**
+ * Partitions the points into clusters with the k-means of the ANN search (flat or two-level,
+ * as selected by opts) and splits the clusters that exceed opts->max_cluster_size.
+ *
+ * @param C the data matrix (N x L)
+ * @param N the number of points
+ * @param L the dimension of the points
+ * @param min_size the minimum size of a cluster, smaller clusters are merged into their neighbors
+ * @param Kc the requested number of clusters, updated with the final number of clusters
+ * @param opts the options of the clustering
+ * @param assignments output, the cluster of each point (N elements, owned by the caller)
+ * @param counts output, the size of each cluster (Kc elements, owned by the caller)
+ * @param nthreads the number of threads
+ * @param max_memory_usage_ratio the maximum share of the available memory to use
+ * @param par_type the type of parallelization (PTHREADS, OpenMP or OpenCilk)
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE otherwise
+ */
+int a2a_cluster_points(const DTYPE* C, const int N, const int L, const int min_size, int* Kc,
+    const a2a_ann_options_t* opts, int** assignments, int** counts, const int nthreads,
+    const double max_memory_usage_ratio, const parallelization_type_t par_type);
+
+
+/**
+ * Stores the points in cluster order with a parallel counting sort. The points of each
+ * cluster keep their original order.
+ *
+ * @param C the data matrix (N x L)
+ * @param assignments the cluster of each point
+ * @param counts the size of each cluster
+ * @param N the number of points
+ * @param L the dimension of the points
+ * @param Kc the number of clusters
+ * @param nthreads the number of threads
+ * @param par_type the type of parallelization (PTHREADS, OpenMP or OpenCilk)
+ * @param perm output, the original index of the point at each position (N elements)
+ * @param data output, the rows of C in cluster order (N x L), or NULL to skip the copy
+ * @param sqrmag output, the squared magnitudes of the rows of data (N elements),
+ *        ignored if data is NULL
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE otherwise
+ */
+int a2a_order_by_cluster(const DTYPE* C, const int* assignments, const int* counts, const int N,
+    const int L, const int Kc, const int nthreads, const parallelization_type_t par_type,
+    int* perm, DTYPE* data, DTYPE* sqrmag);
+
+
+/**
+ * Returns the largest number of points whose self-join fits in the last level cache, the
+ * cluster size used by A2A_CLUSTER_SIZE_AUTO.
+ *
+ * @param L the dimension of the points
+ * @return the number of points
+ */
+int a2a_cluster_size_from_cache(const int L);
+
+#endif
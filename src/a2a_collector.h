@@ -0,0 +1,163 @@
+#ifndef A2A_COLLECTOR_H
+#define A2A_COLLECTOR_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "a2a_stats.h"
+#include "a2a_tracer.h"
+
+
+/**
+ * Counters of a search in progress, updated concurrently by the threads of the search.
+ * Times are in nanoseconds.
+ */
+typedef struct a2a_StatsCollector {
+    atomic_llong wall_ns[A2A_PHASE_COUNT];
+    atomic_llong cpu_ns[A2A_PHASE_COUNT];
+    atomic_llong calls[A2A_PHASE_COUNT];
+    atomic_llong bytes;
+    atomic_llong busy_ns[A2A_STATS_MAX_THREADS];
+    atomic_llong idle_ns[A2A_STATS_MAX_THREADS];
+    atomic_int nthreads;                 // Number of thread slots used
+    atomic_llong histogram[A2A_STATS_HISTOGRAM_BINS];
+    atomic_int num_clusters;
+    atomic_int min_cluster_size;
+    atomic_int max_cluster_size;
+    atomic_llong queue_wait_ns;
+    atomic_llong queue_tasks;
+    long long id;                        // Unique among the searches of the process, never 0
+    long long budget_bytes;
+    atomic_llong live_bytes;             // Bytes of a2a_Malloc not yet freed
+    atomic_llong peak_bytes;
+    atomic_llong phase_peak_bytes[A2A_PHASE_COUNT];
+    atomic_int active[A2A_PHASE_COUNT];  // Number of threads running each phase
+    atomic_llong thread_peak_bytes[A2A_STATS_MAX_THREADS];
+    atomic_int memory_threads;           // Number of threads that allocated
+} a2a_StatsCollector;
+
+
+// Collector of the search run by the calling thread, NULL when the stats are disabled.
+// Parallel regions install the collector of their caller in their threads.
+extern _Thread_local a2a_StatsCollector *a2a_collector;
+
+
+// Start of a phase, see a2a_PhaseBegin
+typedef struct {
+    long long wall_ns;
+    long long cpu_ns;
+} a2a_PhaseTimer;
+
+
+// Collector of a public entry point, see a2a_StatsOpen
+typedef struct {
+    a2a_stats_t *stats;
+    a2a_StatsCollector *collector;
+    a2a_StatsCollector *previous;
+    long long wall_ns;
+    long long cpu_ns;
+} a2a_StatsScope;
+
+
+// Hook of a2a_stats_set_phase_hook, NULL if none
+extern a2a_phase_hook_t a2a_phase_hook;
+extern void *a2a_phase_hook_arg;
+
+
+/**
+ * Starts timing a phase in the calling thread. No-op when the stats, the tracing and the
+ * phase hook are disabled.
+ *
+ * @param timer the timer of the phase
+ * @param phase the phase
+ */
+static inline void a2a_PhaseBegin(a2a_PhaseTimer *timer, const a2a_phase_t phase) {
+    if (a2a_phase_hook) a2a_phase_hook(phase, 1, a2a_phase_hook_arg);
+    a2a_StatsCollector *collector = a2a_collector;
+    timer->wall_ns = collector ? a2a_ClockNs(CLOCK_MONOTONIC) : a2a_TraceBegin();
+    timer->cpu_ns = 0;
+    if (!collector) return;
+    timer->cpu_ns = a2a_ClockNs(CLOCK_THREAD_CPUTIME_ID);
+
+    // The memory in use when the phase starts counts in its peak
+    atomic_fetch_add_explicit(&collector->active[phase], 1, memory_order_relaxed);
+    const long long live = atomic_load_explicit(&collector->live_bytes, memory_order_relaxed);
+    long long peak = atomic_load_explicit(&collector->phase_peak_bytes[phase], memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak(&collector->phase_peak_bytes[phase], &peak, live));
+}
+
+
+/**
+ * Adds the time since a2a_PhaseBegin to a phase and traces it. No-op when the stats, the
+ * tracing and the phase hook are disabled.
+ *
+ * @param timer the timer passed to a2a_PhaseBegin
+ * @param phase the phase
+ */
+static inline void a2a_PhaseEnd(const a2a_PhaseTimer *timer, const a2a_phase_t phase) {
+    if (a2a_phase_hook) a2a_phase_hook(phase, 0, a2a_phase_hook_arg);
+    if (!timer->wall_ns) return;
+    const long long end_ns = a2a_ClockNs(CLOCK_MONOTONIC);
+    a2a_StatsCollector *collector = a2a_collector;
+    if (collector) {
+        atomic_fetch_add_explicit(&collector->wall_ns[phase], end_ns - timer->wall_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&collector->cpu_ns[phase], a2a_ClockNs(CLOCK_THREAD_CPUTIME_ID) - timer->cpu_ns,
+            memory_order_relaxed);
+        atomic_fetch_add_explicit(&collector->calls[phase], 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&collector->active[phase], 1, memory_order_relaxed);
+    }
+    if (atomic_load_explicit(&a2a_tracing, memory_order_relaxed)) {
+        a2a_TraceRecord(a2a_stats_phase_name(phase), timer->wall_ns, end_ns, -1, 0);
+    }
+}
+
+
+/**
+ * Starts collecting the counters of a public entry point. Without stats the calling thread
+ * keeps its collector, so that the searches run by another search count in its stats.
+ *
+ * @param scope the scope of the entry point
+ * @param stats the stats to fill, or NULL
+ * @return EXIT_SUCCESS on success and EXIT_FAILURE if the allocation fails
+ */
+int a2a_StatsOpen(a2a_StatsScope *scope, a2a_stats_t *stats);
+
+
+/**
+ * Stops collecting, fills the stats of the scope and restores the previous collector.
+ *
+ * @param scope the scope passed to a2a_StatsOpen
+ */
+void a2a_StatsClose(a2a_StatsScope *scope);
+
+
+/**
+ * Records the memory budget of the search of a scope. No-op when the scope collects no stats.
+ *
+ * @param scope the scope of the entry point
+ * @param budget_bytes the budget shared by the searches in progress (see a2a_MemoryOpen)
+ */
+void a2a_StatsSetBudget(a2a_StatsScope *scope, const size_t budget_bytes);
+
+
+/**
+ * Adds the busy and idle time of a thread.
+ *
+ * @param collector the collector
+ * @param slot the index of the thread
+ * @param busy_ns the time spent running work
+ * @param idle_ns the time spent waiting
+ */
+void a2a_StatsRecordThread(a2a_StatsCollector *collector, const int slot, const long long busy_ns,
+    const long long idle_ns);
+
+
+/**
+ * Adds the sizes of the clusters of a partition to the histogram. No-op when the stats are disabled.
+ *
+ * @param counts the sizes of the clusters
+ * @param Kc the number of clusters
+ */
+void a2a_StatsRecordClusters(const int *counts, const int Kc);
+
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef A2A_DISTANCE_H
+#define A2A_DISTANCE_H
+
+#include "a2a_config.h"
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// Distance kernels for the graph and tree searches, which compare single pairs of points
+// instead of blocks that go through GEMM. Not part of the public API.
+//
+// The vector width follows the instruction set the library is compiled for: AVX (with FMA
+// when available) if enabled, e.g. with -march=native, SSE2 on any x86-64 build, and an
+// unrolled scalar loop elsewhere.
+
+
+#if defined(SINGLE_PRECISION) && defined(__AVX__)
+
+static inline float a2a_squared_distance(const float* a, const float* b, const int L) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= L; i += 16) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+#if defined(__FMA__)
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+#else
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(d1, d1));
+#endif
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    float dist = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < L; ++i) {
+        const float d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+#elif defined(SINGLE_PRECISION) && defined(__SSE2__)
+
+static inline float a2a_squared_distance(const float* a, const float* b, const int L) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= L; i += 8) {
+        const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float dist = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < L; ++i) {
+        const float d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+#elif !defined(SINGLE_PRECISION) && defined(__AVX__)
+
+static inline double a2a_squared_distance(const double* a, const double* b, const int L) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= L; i += 8) {
+        const __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        const __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+#if defined(__FMA__)
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm256_fmadd_pd(d1, d1, acc1);
+#else
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(d0, d0));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(d1, d1));
+#endif
+    }
+    acc0 = _mm256_add_pd(acc0, acc1);
+    const __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    double dist = lanes[0] + lanes[1];
+    for (; i < L; ++i) {
+        const double d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+#elif !defined(SINGLE_PRECISION) && defined(__SSE2__)
+
+static inline double a2a_squared_distance(const double* a, const double* b, const int L) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= L; i += 4) {
+        const __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        const __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    double dist = lanes[0] + lanes[1];
+    for (; i < L; ++i) {
+        const double d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+#else
+
+static inline DTYPE a2a_squared_distance(const DTYPE* a, const DTYPE* b, const int L) {
+    // Four independent accumulators keep the loop from waiting on a single sum
+    DTYPE d0 = SUFFIX(0.0), d1 = SUFFIX(0.0), d2 = SUFFIX(0.0), d3 = SUFFIX(0.0);
+    int i = 0;
+    for (; i + 4 <= L; i += 4) {
+        const DTYPE x0 = a[i] - b[i];
+        const DTYPE x1 = a[i + 1] - b[i + 1];
+        const DTYPE x2 = a[i + 2] - b[i + 2];
+        const DTYPE x3 = a[i + 3] - b[i + 3];
+        d0 += x0 * x0;
+        d1 += x1 * x1;
+        d2 += x2 * x2;
+        d3 += x3 * x3;
+    }
+    for (; i < L; ++i) {
+        const DTYPE x = a[i] - b[i];
+        d0 += x * x;
+    }
+    return (d0 + d1) + (d2 + d3);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "a2a_eval.h"
+#include "a2a_parallel.h"
+#include "a2a_alloc.h"
+
+
+typedef struct {
+    const int *IDX;
+    int K_idx;
+    const int *truth;
+    int K_truth;
+    int k;
+    const a2a_eval_options_t *opts;
+} EvalContext;
+
+
+// Evaluates the queries [begin, end) and accumulates the number of queries per count of
+// neighbors found, which gives every statistic of the recall
+typedef struct {
+    const EvalContext *ctx;
+    int begin;
+    int end;
+    long *counts;                        // Queries per number of neighbors found (k + 1 elements)
+    double ratio_sum;
+    long ratio_queries;
+    long incomplete;
+} EvalTask;
+
+
+static int compare_ints(const void *a, const void *b) {
+    const int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double distance(const DTYPE *a, const DTYPE *b, const int L) {
+    double d = 0.0;
+    for (int l = 0; l < L; l++) d += ((double)a[l] - b[l]) * ((double)a[l] - b[l]);
+    return sqrt(d);
+}
+
+
+// Number of elements of the sorted list a found in the sorted list b. The -1 of missing entries
+// match nothing, not even a -1 of a short list of exact neighbors.
+static int count_common(const int *a, const int *b, const int k) {
+    int found = 0;
+    for (int i = 0, j = 0; i < k && j < k;) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else {
+            if (a[i] >= 0) found++;
+            i++;
+            j++;
+        }
+    }
+    return found;
+}
+
+
+static int evalTaskExec(void *arg) {
+    EvalTask *task = (EvalTask *)arg;
+    const EvalContext *ctx = task->ctx;
+    const a2a_eval_options_t *opts = ctx->opts;
+    const int k = ctx->k;
+    const int with_data = opts->Q && opts->C;
+
+    int *sorted = (int *)a2a_Malloc(sizeof(int) * 2 * (size_t)k);
+    if (!sorted) {
+        fprintf(stderr, "Error: Memory allocation failed in evalTaskExec\n");
+        return EXIT_FAILURE;
+    }
+    int *sorted_truth = sorted + k;
+
+    for (int q = task->begin; q < task->end; q++) {
+        const int *row = ctx->IDX + (size_t)q * ctx->K_idx;
+        const int *expected = ctx->truth + (size_t)q * ctx->K_truth;
+
+        // Indices outside the points are replaced by -1, in the result as in the exact neighbors
+        int missing = 0;
+        for (int j = 0; j < k; j++) {
+            sorted[j] = row[j] >= 0 && (opts->N <= 0 || row[j] < opts->N) ? row[j] : -1;
+            sorted_truth[j] = expected[j] >= 0 && (opts->N <= 0 || expected[j] < opts->N) ? expected[j] : -1;
+            missing += (sorted[j] < 0) - (sorted_truth[j] < 0);
+        }
+        qsort(sorted, k, sizeof(int), compare_ints);
+        qsort(sorted_truth, k, sizeof(int), compare_ints);
+
+        const int found = count_common(sorted, sorted_truth, k);
+        task->counts[found]++;
+        if (opts->per_query) opts->per_query[q] = (double)found / k;
+
+        // A result with fewer neighbors than the exact ones has no distance to compare
+        if (missing > 0) {
+            task->incomplete++;
+            continue;
+        }
+        if (!with_data) continue;
+        const DTYPE *query = opts->Q + (size_t)q * opts->L;
+        double found_sum = 0.0, exact_sum = 0.0;
+        for (int j = 0; j < k; j++) {
+            if (sorted[j] >= 0) found_sum += distance(query, opts->C + (size_t)sorted[j] * opts->L, opts->L);
+            if (sorted_truth[j] >= 0) exact_sum += distance(query, opts->C + (size_t)sorted_truth[j] * opts->L, opts->L);
+        }
+
+        // Exact neighbors all at distance 0 give a ratio only if the neighbors found are too
+        if (exact_sum > 0.0) {
+            task->ratio_sum += found_sum / exact_sum;
+            task->ratio_queries++;
+        }
+        else if (found_sum == 0.0) {
+            task->ratio_sum += 1.0;
+            task->ratio_queries++;
+        }
+    }
+
+    a2a_Free(sorted);
+    return EXIT_SUCCESS;
+}
+
+
+// Smallest recall such that more than share * (M - 1) queries have at most that recall
+static double recall_percentile(const long *counts, const int k, const int M, const double share) {
+    const long rank = (long)(share * (M - 1));
+    long cumulative = 0;
+    for (int c = 0; c <= k; c++) {
+        cumulative += counts[c];
+        if (cumulative > rank) return (double)c / k;
+    }
+    return 1.0;
+}
+
+
+void a2a_eval_options_init(a2a_eval_options_t *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->nthreads = 1;
+    opts->par_type = PAR_PTHREADS;
+}
+
+
+int a2a_eval_recall(const int *IDX, const int K_idx, const int *truth, const int K_truth, const int M,
+    const a2a_eval_options_t *opts, a2a_eval_result_t *result) {
+
+    a2a_eval_options_t defaults;
+    if (!opts) {
+        a2a_eval_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    const int common = K_idx < K_truth ? K_idx : K_truth;
+    const int k = opts->k > 0 ? opts->k : common;
+    if (!IDX || !truth || !result || M < 1 || k < 1 || k > common || opts->nthreads < 1) {
+        fprintf(stderr, "Error: Invalid arguments for a2a_eval_recall\n");
+        return EXIT_FAILURE;
+    }
+    if (opts->Q && opts->C && (opts->N < 1 || opts->L < 1)) {
+        fprintf(stderr, "Error: The distance ratio of a2a_eval_recall needs N and L\n");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    const int nworkers = opts->nthreads < M ? opts->nthreads : M;
+    EvalContext ctx = { IDX, K_idx, truth, K_truth, k, opts };
+    EvalTask *tasks = (EvalTask *)a2a_Calloc(nworkers, sizeof(EvalTask));
+    long *counts = (long *)a2a_Calloc((size_t)nworkers * (k + 1), sizeof(long));
+    if (!tasks || !counts) {
+        fprintf(stderr, "Error: Memory allocation failed in a2a_eval_recall\n");
+        goto cleanup;
+    }
+
+    for (int w = 0; w < nworkers; w++) {
+        tasks[w].ctx = &ctx;
+        tasks[w].begin = (int)((long)M * w / nworkers);
+        tasks[w].end = (int)((long)M * (w + 1) / nworkers);
+        tasks[w].counts = counts + (size_t)w * (k + 1);
+    }
+    if (a2a_ParallelRun(evalTaskExec, tasks, sizeof(EvalTask), nworkers, opts->par_type)) goto cleanup;
+
+    // Merge the counts of the workers into the first
+    double ratio_sum = 0.0;
+    long ratio_queries = 0, incomplete = 0;
+    for (int w = 0; w < nworkers; w++) {
+        if (w > 0) {
+            for (int c = 0; c <= k; c++) counts[c] += tasks[w].counts[c];
+        }
+        ratio_sum += tasks[w].ratio_sum;
+        ratio_queries += tasks[w].ratio_queries;
+        incomplete += tasks[w].incomplete;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->k = k;
+    long found = 0;
+    for (int c = 0; c <= k; c++) {
+        const int bin = c * A2A_EVAL_BINS / k;
+        result->histogram[bin < A2A_EVAL_BINS ? bin : A2A_EVAL_BINS - 1] += counts[c];
+        found += (long)c * counts[c];
+    }
+    result->recall = (double)found / ((double)M * k);
+    result->min_recall = recall_percentile(counts, k, M, 0.0);
+    result->p10_recall = recall_percentile(counts, k, M, 0.1);
+    result->median_recall = recall_percentile(counts, k, M, 0.5);
+    result->perfect = counts[k];
+    result->distance_ratio = ratio_queries > 0 ? ratio_sum / ratio_queries : 0.0;
+    result->incomplete = incomplete;
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(tasks);
+    a2a_Free(counts);
+    return status;
+}
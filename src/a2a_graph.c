@@ -0,0 +1,628 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "a2a_graph.h"
+#include "a2a_parallel.h"
+#include "a2a_distance.h"
+#include "a2a_clustering.h"
+#include "a2a_alloc.h"
+
+
+#define POINTS_PER_CHUNK 64               // Points handled by a worker at a time
+
+
+// Growable list of point identifiers
+typedef struct {
+    int* ids;
+    int count;
+    int capacity;
+} IdList;
+
+
+typedef struct {
+    DTYPE dist;                          // Squared distance
+    int id;                              // Identifier of the point
+} GraphEntry;
+
+
+struct a2a_graph {
+    int L;                               // Dimension of the points
+    int K;                               // Number of neighbors per point
+    int Kc;                              // Number of clusters
+    int nprobe;                          // Number of clusters searched per point
+    int size;                            // Number of identifiers handed out
+    int capacity;                        // Number of points the arrays below can hold
+    DTYPE* data;                         // Points (capacity x L)
+    int* IDX;                            // Neighbor lists sorted by distance (capacity x K)
+    DTYPE* D;                            // Distances to the neighbors (capacity x K)
+    unsigned char* deleted;              // Non-zero for the deleted points
+    int* cluster;                        // Cluster of each point
+    int* position;                       // Position of each point in the members of its cluster
+    int* probes;                         // Clusters searched by each point, its own first (capacity x nprobe)
+    unsigned int* tags;                  // Tag of the last update that marked each point
+    unsigned int tag;                    // Tag of the current update
+    atomic_flag* row_locks;              // Lock of the neighbor list of each point
+    DTYPE* centroids;                    // Centroids of the clusters (Kc x L)
+    IdList* members;                     // Points of each cluster
+    IdList* probers;                     // Points of other clusters whose lists may hold members of the
+                                         // cluster. May hold deleted points and repetitions.
+    atomic_flag* cluster_locks;          // Lock of the probers of each cluster
+    unsigned int* cluster_tags;          // Tag of the last update that marked each cluster
+};
+
+
+enum { PHASE_PROBE, PHASE_SEARCH, PHASE_REPAIR };
+
+
+typedef struct {
+    a2a_graph_t* graph;
+    int phase;                           // Phase run by the worker
+    const int* points;                   // Points of the phase, or NULL for the range [first, last)
+    int first;
+    int last;
+    int first_new;                       // Points from first_new on are new, the lists of older ones are patched
+    atomic_int* next;                    // Position of the next chunk
+    GraphEntry* heap;                    // Nearest points found for the current point (max(K, nprobe) entries)
+    int status;
+} graphTask;
+
+
+static int id_list_push(IdList* list, const int id) {
+    if (list->count == list->capacity) {
+        const int capacity = list->capacity > 0 ? 2 * list->capacity : 16;
+        int* ids = (int *)a2a_Realloc(list->ids, sizeof(int) * capacity);
+        if (!ids) return EXIT_FAILURE;
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = id;
+    return EXIT_SUCCESS;
+}
+
+
+static void lock_flag(atomic_flag* flag) {
+    while (atomic_flag_test_and_set_explicit(flag, memory_order_acquire)) sched_yield();
+}
+
+
+static void unlock_flag(atomic_flag* flag) {
+    atomic_flag_clear_explicit(flag, memory_order_release);
+}
+
+
+// Offers an entry to a max-heap of at most capacity entries with the smallest distances
+static void offer_entry(GraphEntry* heap, int* size, const int capacity, const DTYPE dist, const int id) {
+    int i;
+    if (*size < capacity) {
+        i = (*size)++;
+        while (i > 0 && heap[(i - 1) / 2].dist < dist) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    else {
+        if (dist >= heap[0].dist) return;
+        i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= *size) break;
+            if (child + 1 < *size && heap[child + 1].dist > heap[child].dist) child++;
+            if (heap[child].dist <= dist) break;
+            heap[i] = heap[child];
+            i = child;
+        }
+    }
+    heap[i].dist = dist;
+    heap[i].id = id;
+}
+
+
+static int compare_entries(const void* a, const void* b) {
+    const DTYPE da = ((const GraphEntry *)a)->dist;
+    const DTYPE db = ((const GraphEntry *)b)->dist;
+    return (da > db) - (da < db);
+}
+
+
+// Starts a new update, so that the marks of the previous ones are ignored
+static void next_tag(a2a_graph_t* graph) {
+    if (++graph->tag == 0) {
+        memset(graph->tags, 0, sizeof(unsigned int) * graph->capacity);
+        memset(graph->cluster_tags, 0, sizeof(unsigned int) * graph->Kc);
+        graph->tag = 1;
+    }
+}
+
+
+// Finds the nprobe nearest centroids of point a, nearest first. Built points keep their
+// k-means cluster as first probe, which is set before the call.
+static void probe_point(a2a_graph_t* graph, graphTask* task, const int a, const int keep_cluster) {
+    const int L = graph->L;
+    const DTYPE* x = graph->data + (size_t)a * L;
+    int* probes = graph->probes + (size_t)a * graph->nprobe;
+    const int own = keep_cluster ? graph->cluster[a] : -1;
+    const int wanted = keep_cluster ? graph->nprobe - 1 : graph->nprobe;
+
+    int count = 0;
+    for (int c = 0; c < graph->Kc; ++c) {
+        if (c == own) continue;
+        offer_entry(task->heap, &count, wanted, a2a_squared_distance(x, graph->centroids + (size_t)c * L, L), c);
+    }
+    qsort(task->heap, count, sizeof(GraphEntry), compare_entries);
+
+    int p = 0;
+    if (keep_cluster) probes[p++] = own;
+    for (int i = 0; i < count; ++i) probes[p++] = task->heap[i].id;
+    if (!keep_cluster) graph->cluster[a] = probes[0];
+}
+
+
+// Inserts point a into the list of point m if it is closer than the K-th neighbor of m
+static int patch_row(a2a_graph_t* graph, const int m, const int a, const DTYPE dist_sq) {
+    const int K = graph->K;
+    int* idx = graph->IDX + (size_t)m * K;
+    DTYPE* dist = graph->D + (size_t)m * K;
+    const DTYPE d = SQRT(dist_sq);
+    int patched = 0;
+
+    lock_flag(&graph->row_locks[m]);
+    if (d < dist[K - 1]) {
+        int k = K - 1;
+        while (k > 0 && dist[k - 1] > d) {
+            idx[k] = idx[k - 1];
+            dist[k] = dist[k - 1];
+            k--;
+        }
+        idx[k] = a;
+        dist[k] = d;
+        patched = 1;
+    }
+    unlock_flag(&graph->row_locks[m]);
+
+    return patched;
+}
+
+
+// Records that point m may list members of cluster c
+static int add_prober(a2a_graph_t* graph, const int c, const int m) {
+    lock_flag(&graph->cluster_locks[c]);
+    const int status = id_list_push(&graph->probers[c], m);
+    unlock_flag(&graph->cluster_locks[c]);
+    return status;
+}
+
+
+// Searches the neighbors of point a in its probes. Older points that are closer to a
+// than their K-th neighbor get a in their lists.
+static int search_point(a2a_graph_t* graph, graphTask* task, const int a) {
+    const int L = graph->L;
+    const int K = graph->K;
+    const DTYPE* x = graph->data + (size_t)a * L;
+    const int* probes = graph->probes + (size_t)a * graph->nprobe;
+
+    int count = 0;
+
+    // A repaired list keeps its live neighbors outside its probes, which were patched in by
+    // points of other clusters and would not be found again
+    if (task->phase == PHASE_REPAIR) {
+        const int* old = graph->IDX + (size_t)a * K;
+        for (int k = 0; k < K; ++k) {
+            const int m = old[k];
+            if (m < 0 || graph->deleted[m]) continue;
+            int probed = 0;
+            for (int p = 0; p < graph->nprobe && !probed; ++p) probed = probes[p] == graph->cluster[m];
+            if (probed) continue;
+            offer_entry(task->heap, &count, K, a2a_squared_distance(x, graph->data + (size_t)m * L, L), m);
+        }
+    }
+
+    for (int p = 0; p < graph->nprobe; ++p) {
+        const IdList* members = &graph->members[probes[p]];
+        for (int i = 0; i < members->count; ++i) {
+            const int m = members->ids[i];
+            if (m == a) continue;
+            const DTYPE dist = a2a_squared_distance(x, graph->data + (size_t)m * L, L);
+            offer_entry(task->heap, &count, K, dist, m);
+
+            if (m < task->first_new && patch_row(graph, m, a, dist)) {
+                // m now lists a member of the cluster of a, which must be able to find m
+                const int c = graph->cluster[a];
+                const int* probes_m = graph->probes + (size_t)m * graph->nprobe;
+                int probed = 0;
+                for (int q = 0; q < graph->nprobe && !probed; ++q) probed = probes_m[q] == c;
+                if (!probed && add_prober(graph, c, m)) return EXIT_FAILURE;
+            }
+        }
+    }
+    qsort(task->heap, count, sizeof(GraphEntry), compare_entries);
+
+    int* idx = graph->IDX + (size_t)a * K;
+    DTYPE* dist = graph->D + (size_t)a * K;
+    lock_flag(&graph->row_locks[a]);
+    for (int k = 0; k < K; ++k) {
+        idx[k] = k < count ? task->heap[k].id : -1;
+        dist[k] = k < count ? SQRT(task->heap[k].dist) : INF;
+    }
+    unlock_flag(&graph->row_locks[a]);
+
+    // a lists members of its other probes
+    for (int p = 1; p < graph->nprobe; ++p) {
+        if (task->phase == PHASE_SEARCH && add_prober(graph, probes[p], a)) return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int graphTaskExec(void* arg) {
+    graphTask* task = (graphTask *)arg;
+    a2a_graph_t* graph = task->graph;
+    const int total = task->last - task->first;
+    task->status = EXIT_SUCCESS;
+
+    int begin;
+    while ((begin = atomic_fetch_add(task->next, POINTS_PER_CHUNK)) < total) {
+        const int end = begin + POINTS_PER_CHUNK < total ? begin + POINTS_PER_CHUNK : total;
+        for (int i = begin; i < end; ++i) {
+            const int a = task->points ? task->points[i] : task->first + i;
+            switch (task->phase) {
+                case PHASE_PROBE: probe_point(graph, task, a, task->first_new == 0); break;
+                case PHASE_SEARCH:
+                case PHASE_REPAIR:
+                    if (search_point(graph, task, a)) task->status = EXIT_FAILURE;
+                    break;
+            }
+        }
+        if (task->status != EXIT_SUCCESS) {
+            atomic_store(task->next, total);  // Stop the other workers
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+// Runs a phase on the points [first, last), or on points[0 .. last - first) if points is given
+static int run_phase(a2a_graph_t* graph, const int phase, const int* points, const int first,
+    const int last, const int first_new, const int nthreads, const parallelization_type_t par_type) {
+
+    const int nchunks = (last - first + POINTS_PER_CHUNK - 1) / POINTS_PER_CHUNK;
+    const int nworkers = nthreads < nchunks ? nthreads : nchunks;
+    if (nworkers == 0) return EXIT_SUCCESS;
+
+    const int heap_size = graph->K > graph->nprobe ? graph->K : graph->nprobe;
+    graphTask* tasks = (graphTask *)a2a_Malloc(sizeof(graphTask) * nworkers);
+    GraphEntry* heaps = (GraphEntry *)a2a_Malloc(sizeof(GraphEntry) * heap_size * nworkers);
+    if (!tasks || !heaps) {
+        fprintf(stderr, "Error allocating memory for the kNN graph update\n");
+        a2a_Free(tasks);
+        a2a_Free(heaps);
+        return EXIT_FAILURE;
+    }
+
+    atomic_int next = 0;
+    for (int i = 0; i < nworkers; ++i) {
+        tasks[i].graph = graph;
+        tasks[i].phase = phase;
+        tasks[i].points = points;
+        tasks[i].first = first;
+        tasks[i].last = last;
+        tasks[i].first_new = first_new;
+        tasks[i].next = &next;
+        tasks[i].heap = heaps + (size_t)i * heap_size;
+    }
+
+    const int status = a2a_ParallelRun(graphTaskExec, tasks, sizeof(graphTask), nworkers, par_type);
+    a2a_Free(tasks);
+    a2a_Free(heaps);
+
+    return status;
+}
+
+
+// Grows the per-point arrays to hold at least capacity points
+static int reserve_points(a2a_graph_t* graph, int capacity) {
+    if (capacity <= graph->capacity) return EXIT_SUCCESS;
+    if (capacity < 2 * graph->capacity) capacity = 2 * graph->capacity;
+
+    const int L = graph->L, K = graph->K;
+    void* p;
+    if (!(p = a2a_Realloc(graph->data, sizeof(DTYPE) * (size_t)capacity * L))) return EXIT_FAILURE;
+    graph->data = (DTYPE *)p;
+    if (!(p = a2a_Realloc(graph->IDX, sizeof(int) * (size_t)capacity * K))) return EXIT_FAILURE;
+    graph->IDX = (int *)p;
+    if (!(p = a2a_Realloc(graph->D, sizeof(DTYPE) * (size_t)capacity * K))) return EXIT_FAILURE;
+    graph->D = (DTYPE *)p;
+    if (!(p = a2a_Realloc(graph->deleted, capacity))) return EXIT_FAILURE;
+    graph->deleted = (unsigned char *)p;
+    if (!(p = a2a_Realloc(graph->cluster, sizeof(int) * capacity))) return EXIT_FAILURE;
+    graph->cluster = (int *)p;
+    if (!(p = a2a_Realloc(graph->position, sizeof(int) * capacity))) return EXIT_FAILURE;
+    graph->position = (int *)p;
+    if (!(p = a2a_Realloc(graph->probes, sizeof(int) * (size_t)capacity * graph->nprobe))) return EXIT_FAILURE;
+    graph->probes = (int *)p;
+    if (!(p = a2a_Realloc(graph->tags, sizeof(unsigned int) * capacity))) return EXIT_FAILURE;
+    graph->tags = (unsigned int *)p;
+    memset(graph->tags + graph->capacity, 0, sizeof(unsigned int) * (capacity - graph->capacity));
+
+    // The locks are only held within a phase, so they can be moved between phases
+    a2a_Free(graph->row_locks);
+    graph->row_locks = (atomic_flag *)a2a_Malloc(sizeof(atomic_flag) * capacity);
+    if (!graph->row_locks) return EXIT_FAILURE;
+    for (int i = 0; i < capacity; ++i) atomic_flag_clear(&graph->row_locks[i]);
+
+    graph->capacity = capacity;
+    return EXIT_SUCCESS;
+}
+
+
+// Appends the points [first, last) to the members of their clusters
+static int add_members(a2a_graph_t* graph, const int first, const int last) {
+    for (int a = first; a < last; ++a) {
+        IdList* members = &graph->members[graph->cluster[a]];
+        graph->position[a] = members->count;
+        if (id_list_push(members, a)) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+int a2a_graph_build(const DTYPE* C, const int N, const int L, const int K, int Kc, const int nprobe,
+    const int nthreads, const double max_memory_usage_ratio, parallelization_type_t par_type,
+    const a2a_ann_options_t *opts, a2a_graph_t **graph) {
+
+    a2a_ann_options_t options;
+    if (opts) options = *opts;
+    else a2a_ann_options_init(&options);
+
+    if (!C || N <= 0 || L <= 0 || K <= 0 || Kc <= 0 || nprobe <= 0 || !graph) {
+        fprintf(stderr, "Invalid input parameters for the kNN graph\n");
+        return EXIT_FAILURE;
+    }
+    if (Kc > N || N / Kc <= K) {
+        fprintf(stderr, "Number of clusters is too large for the given N and K\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (max_memory_usage_ratio <= 0.0 || max_memory_usage_ratio > 1.0) {
+        fprintf(stderr, "Invalid memory usage ratio: %f\n", max_memory_usage_ratio);
+        return EXIT_FAILURE;
+    }
+
+    *graph = NULL;
+    int status = EXIT_FAILURE;
+    int *assignments = NULL, *counts = NULL;
+    a2a_graph_t* g = (a2a_graph_t *)a2a_Calloc(1, sizeof(a2a_graph_t));
+    if (!g) {
+        fprintf(stderr, "Error allocating memory for the kNN graph\n");
+        return EXIT_FAILURE;
+    }
+
+    if (a2a_cluster_points(C, N, L, K + 1, &Kc, &options, &assignments, &counts, nthreads,
+        max_memory_usage_ratio, par_type)) goto cleanup;
+
+    g->L = L;
+    g->K = K;
+    g->Kc = Kc;
+    g->nprobe = nprobe < Kc ? nprobe : Kc;
+    g->centroids = (DTYPE *)a2a_Calloc((size_t)Kc * L, sizeof(DTYPE));
+    g->members = (IdList *)a2a_Calloc(Kc, sizeof(IdList));
+    g->probers = (IdList *)a2a_Calloc(Kc, sizeof(IdList));
+    g->cluster_locks = (atomic_flag *)a2a_Malloc(sizeof(atomic_flag) * Kc);
+    g->cluster_tags = (unsigned int *)a2a_Calloc(Kc, sizeof(unsigned int));
+    if (!g->centroids || !g->members || !g->probers || !g->cluster_locks || !g->cluster_tags ||
+        reserve_points(g, N)) {
+        fprintf(stderr, "Error allocating memory for the kNN graph\n");
+        goto cleanup;
+    }
+    for (int c = 0; c < Kc; ++c) atomic_flag_clear(&g->cluster_locks[c]);
+
+    memcpy(g->data, C, sizeof(DTYPE) * (size_t)N * L);
+    memset(g->deleted, 0, N);
+    for (int i = 0; i < N; ++i) {
+        g->cluster[i] = assignments[i];
+        DTYPE* centroid = g->centroids + (size_t)assignments[i] * L;
+        for (int l = 0; l < L; ++l) centroid[l] += C[(size_t)i * L + l];
+    }
+    for (int c = 0; c < Kc; ++c) {
+        for (int l = 0; l < L; ++l) g->centroids[(size_t)c * L + l] /= counts[c];
+    }
+    g->size = N;
+    if (add_members(g, 0, N)) goto cleanup;
+
+    // All the points are new, so no list is patched
+    if (run_phase(g, PHASE_PROBE, NULL, 0, N, 0, nthreads, par_type)) goto cleanup;
+    if (run_phase(g, PHASE_SEARCH, NULL, 0, N, 0, nthreads, par_type)) goto cleanup;
+
+    *graph = g;
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(assignments);
+    a2a_Free(counts);
+    if (status != EXIT_SUCCESS) a2a_graph_free(g);
+
+    return status;
+}
+
+
+int a2a_graph_insert(a2a_graph_t *graph, const DTYPE* X, const int n, int* ids, const int nthreads,
+    parallelization_type_t par_type) {
+
+    if (!graph || (!X && n > 0) || n < 0) {
+        fprintf(stderr, "Invalid input parameters for the kNN graph insertion\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (n == 0) return EXIT_SUCCESS;
+
+    const int first = graph->size;
+    if (reserve_points(graph, first + n)) {
+        fprintf(stderr, "Error allocating memory for the kNN graph insertion\n");
+        return EXIT_FAILURE;
+    }
+
+    memcpy(graph->data + (size_t)first * graph->L, X, sizeof(DTYPE) * (size_t)n * graph->L);
+    memset(graph->deleted + first, 0, n);
+    for (int i = 0; i < n; ++i) {
+        graph->tags[first + i] = 0;
+        if (ids) ids[i] = first + i;
+    }
+
+    // The new points join their nearest clusters before any of them searches, so that
+    // points inserted together find each other
+    if (run_phase(graph, PHASE_PROBE, NULL, first, first + n, first, nthreads, par_type)) return EXIT_FAILURE;
+    if (add_members(graph, first, first + n)) {
+        fprintf(stderr, "Error allocating memory for the kNN graph insertion\n");
+        return EXIT_FAILURE;
+    }
+    graph->size = first + n;
+
+    return run_phase(graph, PHASE_SEARCH, NULL, first, first + n, first, nthreads, par_type);
+}
+
+
+// Returns non-zero if the list of point q holds a deleted point
+static int lists_deleted(const a2a_graph_t* graph, const int q) {
+    const int* idx = graph->IDX + (size_t)q * graph->K;
+    for (int k = 0; k < graph->K; ++k) {
+        if (idx[k] >= 0 && graph->deleted[idx[k]]) return 1;
+    }
+    return 0;
+}
+
+
+// Adds the live points of a list that reference a deleted point to the points to repair
+static int collect_repairs(a2a_graph_t* graph, const IdList* list, IdList* repairs) {
+    for (int i = 0; i < list->count; ++i) {
+        const int q = list->ids[i];
+        if (graph->deleted[q] || graph->tags[q] == graph->tag || !lists_deleted(graph, q)) continue;
+        graph->tags[q] = graph->tag;
+        if (id_list_push(repairs, q)) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+int a2a_graph_delete(a2a_graph_t *graph, const int* ids, const int n, const int nthreads,
+    parallelization_type_t par_type) {
+
+    if (!graph || (!ids && n > 0) || n < 0) {
+        fprintf(stderr, "Invalid input parameters for the kNN graph deletion\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (ids[i] < 0 || ids[i] >= graph->size) {
+            fprintf(stderr, "Invalid point identifier: %d\n", ids[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    IdList touched = { NULL, 0, 0 }, repairs = { NULL, 0, 0 };
+    int status = EXIT_FAILURE;
+    next_tag(graph);
+
+    // Mark the points and take them out of their clusters
+    for (int i = 0; i < n; ++i) {
+        const int p = ids[i];
+        if (graph->deleted[p]) continue;
+        graph->deleted[p] = 1;
+
+        IdList* members = &graph->members[graph->cluster[p]];
+        const int moved = members->ids[--members->count];
+        members->ids[graph->position[p]] = moved;
+        graph->position[moved] = graph->position[p];
+
+        for (int k = 0; k < graph->K; ++k) {
+            graph->IDX[(size_t)p * graph->K + k] = -1;
+            graph->D[(size_t)p * graph->K + k] = INF;
+        }
+        if (graph->cluster_tags[graph->cluster[p]] != graph->tag) {
+            graph->cluster_tags[graph->cluster[p]] = graph->tag;
+            if (id_list_push(&touched, graph->cluster[p])) goto cleanup;
+        }
+    }
+
+    // Only the members and the probers of the clusters of the deleted points can list them
+    for (int i = 0; i < touched.count; ++i) {
+        const int c = touched.ids[i];
+        if (collect_repairs(graph, &graph->members[c], &repairs)) goto cleanup;
+        if (collect_repairs(graph, &graph->probers[c], &repairs)) goto cleanup;
+
+        // Drop the deleted probers while the list is at hand
+        IdList* probers = &graph->probers[c];
+        int kept = 0;
+        for (int j = 0; j < probers->count; ++j) {
+            if (!graph->deleted[probers->ids[j]]) probers->ids[kept++] = probers->ids[j];
+        }
+        probers->count = kept;
+    }
+    DEBUG_PRINT("Graph: Deleting %d points repairs %d lists in %d clusters\n", n, repairs.count, touched.count);
+
+    // Search the affected lists again, the other lists are unchanged
+    if (run_phase(graph, PHASE_REPAIR, repairs.ids, 0, repairs.count, 0, nthreads, par_type)) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) fprintf(stderr, "Error repairing the kNN graph\n");
+    a2a_Free(touched.ids);
+    a2a_Free(repairs.ids);
+
+    return status;
+}
+
+
+int a2a_graph_size(const a2a_graph_t *graph) {
+    return graph->size;
+}
+
+
+int a2a_graph_is_deleted(const a2a_graph_t *graph, const int id) {
+    return id >= 0 && id < graph->size && graph->deleted[id];
+}
+
+
+void a2a_graph_rows(const a2a_graph_t *graph, const int** IDX, const DTYPE** D) {
+    *IDX = graph->IDX;
+    *D = graph->D;
+}
+
+
+void a2a_graph_free(a2a_graph_t *graph) {
+    if (!graph) return;
+    if (graph->members) {
+        for (int c = 0; c < graph->Kc; ++c) a2a_Free(graph->members[c].ids);
+    }
+    if (graph->probers) {
+        for (int c = 0; c < graph->Kc; ++c) a2a_Free(graph->probers[c].ids);
+    }
+    a2a_Free(graph->data);
+    a2a_Free(graph->IDX);
+    a2a_Free(graph->D);
+    a2a_Free(graph->deleted);
+    a2a_Free(graph->cluster);
+    a2a_Free(graph->position);
+    a2a_Free(graph->probes);
+    a2a_Free(graph->tags);
+    a2a_Free(graph->row_locks);
+    a2a_Free(graph->centroids);
+    a2a_Free(graph->members);
+    a2a_Free(graph->probers);
+    a2a_Free(graph->cluster_locks);
+    a2a_Free(graph->cluster_tags);
+    a2a_Free(graph);
+}
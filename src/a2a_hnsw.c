@@ -0,0 +1,647 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "a2a_hnsw.h"
+#include "a2a_parallel.h"
+#include "a2a_distance.h"
+#include "a2a_alloc.h"
+
+
+#define HNSW_MAX_LEVEL 16                 // Highest level a point can be assigned to
+#define NODES_PER_CHUNK 64                // Points inserted or queried by a worker at a time
+
+
+// The neighbor lists are stored as fixed size slots, a count followed by the neighbors, so
+// the lists of the bottom level, which every search spends most of its time in, form a
+// single array indexed by point. Only the few points above the bottom level have lists in
+// links_upper.
+struct a2a_hnsw {
+    const DTYPE* C;                      // Indexed dataset
+    int N;                               // Number of points
+    int L;                               // Dimension of the points
+    int M;                               // Maximum number of neighbors on the upper levels
+    int M0;                              // Maximum number of neighbors on the bottom level
+    int ef_construction;                 // Size of the candidate list when inserting a point
+    int* levels;                         // Top level of each point
+    int* links0;                         // Bottom level lists (1 + M0 entries per point)
+    size_t* upper_offset;                // Start of the upper level lists of each point in links_upper
+    int* links_upper;                    // Upper level lists (1 + M entries per point and level)
+    atomic_flag* locks;                  // Lock of the neighbor lists of each point during construction
+    atomic_flag entry_lock;              // Lock of the entry point during construction
+    int entry_point;                     // Point where every search starts
+    int max_level;                       // Top level of the entry point
+};
+
+
+typedef struct {
+    DTYPE dist;                          // Squared distance to the query
+    int id;                              // Index of the point
+} HeapItem;
+
+
+// Max-heap by distance that grows on demand
+typedef struct {
+    HeapItem* items;
+    int size;
+    int capacity;
+} Heap;
+
+
+// Buffers of a worker, reused for all the points it inserts or queries
+typedef struct {
+    unsigned int* visited;               // Tag of the last search that reached each point (N entries)
+    unsigned int tag;                    // Tag of the current search
+    Heap candidates;                     // Points left to expand, by negated distance
+    Heap results;                        // Nearest points found so far (at most ef entries)
+    HeapItem* sorted;                    // Results sorted by distance (ef + 1 entries)
+    HeapItem* pruned;                    // Candidates of a full neighbor list (M0 + 1 entries)
+    int* neighbors;                      // Copy of a neighbor list (M0 entries)
+    int* selected;                       // Neighbors chosen for a new point (M0 entries)
+} HnswScratch;
+
+
+typedef struct {
+    a2a_hnsw_t* index;
+    atomic_int* next;                    // First point of the next chunk
+    HnswScratch scratch;
+} hnswBuildTask;
+
+
+typedef struct {
+    const a2a_hnsw_t* index;
+    atomic_int* next;                    // First query of the next chunk
+    HnswScratch scratch;
+    const DTYPE* Q;                      // Queries, or NULL to query the indexed points
+    int M;                               // Number of queries
+    int K;                               // Number of neighbors per query
+    int ef;                              // Size of the candidate list
+    int* IDX;                            // Output indices
+    DTYPE* D;                            // Output distances
+} hnswSearchTask;
+
+
+static int heap_push(Heap* heap, const DTYPE dist, const int id) {
+    if (heap->size == heap->capacity) {
+        const int capacity = heap->capacity > 0 ? 2 * heap->capacity : 64;
+        HeapItem* items = (HeapItem *)a2a_Realloc(heap->items, capacity * sizeof(HeapItem));
+        if (!items) {
+            fprintf(stderr, "Error allocating memory for the HNSW search\n");
+            return EXIT_FAILURE;
+        }
+        heap->items = items;
+        heap->capacity = capacity;
+    }
+
+    int i = heap->size++;
+    while (i > 0) {
+        const int parent = (i - 1) / 2;
+        if (heap->items[parent].dist >= dist) break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i].dist = dist;
+    heap->items[i].id = id;
+
+    return EXIT_SUCCESS;
+}
+
+
+static HeapItem heap_pop(Heap* heap) {
+    const HeapItem top = heap->items[0];
+    const int size = --heap->size;
+    if (size == 0) return top;
+
+    const HeapItem last = heap->items[size];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= size) break;
+        if (child + 1 < size && heap->items[child + 1].dist > heap->items[child].dist) child++;
+        if (heap->items[child].dist <= last.dist) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    heap->items[i] = last;
+
+    return top;
+}
+
+
+static int compare_items(const void* a, const void* b) {
+    const DTYPE da = ((const HeapItem *)a)->dist;
+    const DTYPE db = ((const HeapItem *)b)->dist;
+    return (da > db) - (da < db);
+}
+
+
+static int init_scratch(HnswScratch* scratch, const int N, const int M0, const int ef) {
+    memset(scratch, 0, sizeof(HnswScratch));
+    scratch->visited = (unsigned int *)a2a_Calloc(N, sizeof(unsigned int));
+    scratch->sorted = (HeapItem *)a2a_Malloc((ef + 1) * sizeof(HeapItem));
+    scratch->pruned = (HeapItem *)a2a_Malloc((M0 + 1) * sizeof(HeapItem));
+    scratch->neighbors = (int *)a2a_Malloc(M0 * sizeof(int));
+    scratch->selected = (int *)a2a_Malloc(M0 * sizeof(int));
+    scratch->results.items = (HeapItem *)a2a_Malloc((ef + 1) * sizeof(HeapItem));
+    scratch->results.capacity = ef + 1;
+
+    if (!scratch->visited || !scratch->sorted || !scratch->pruned || !scratch->neighbors ||
+        !scratch->selected || !scratch->results.items) {
+        fprintf(stderr, "Error allocating memory for the HNSW workers\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static void free_scratch(HnswScratch* scratch) {
+    a2a_Free(scratch->visited);
+    a2a_Free(scratch->sorted);
+    a2a_Free(scratch->pruned);
+    a2a_Free(scratch->neighbors);
+    a2a_Free(scratch->selected);
+    a2a_Free(scratch->candidates.items);
+    a2a_Free(scratch->results.items);
+}
+
+
+static void next_visit(HnswScratch* scratch, const int N) {
+    if (++scratch->tag == 0) {
+        memset(scratch->visited, 0, N * sizeof(unsigned int));
+        scratch->tag = 1;
+    }
+}
+
+
+static int* links_of(const a2a_hnsw_t* index, const int v, const int level) {
+    if (level == 0) return index->links0 + (size_t)v * (1 + index->M0);
+    return index->links_upper + index->upper_offset[v] + (size_t)(level - 1) * (1 + index->M);
+}
+
+
+static void lock_node(const a2a_hnsw_t* index, const int v) {
+    while (atomic_flag_test_and_set_explicit(&index->locks[v], memory_order_acquire)) sched_yield();
+}
+
+
+static void unlock_node(const a2a_hnsw_t* index, const int v) {
+    atomic_flag_clear_explicit(&index->locks[v], memory_order_release);
+}
+
+
+// Copies a neighbor list, under the lock of its point while the graph is being built
+static int copy_links(const a2a_hnsw_t* index, const int v, const int level, int* out,
+    const int locked) {
+
+    const int* links = links_of(index, v, level);
+    if (locked) lock_node(index, v);
+    const int count = links[0];
+    memcpy(out, links + 1, count * sizeof(int));
+    if (locked) unlock_node(index, v);
+
+    return count;
+}
+
+
+// Moves greedily to the nearest neighbor on each level from from_level down to to_level + 1
+static void greedy_descend(const a2a_hnsw_t* index, HnswScratch* scratch, const DTYPE* q, int* cur,
+    DTYPE* cur_dist, const int from_level, const int to_level, const int locked) {
+
+    for (int level = from_level; level > to_level; --level) {
+        int changed = 1;
+        while (changed) {
+            changed = 0;
+            const int count = copy_links(index, *cur, level, scratch->neighbors, locked);
+            for (int j = 0; j < count; ++j) {
+                const int u = scratch->neighbors[j];
+                const DTYPE dist = a2a_squared_distance(q, index->C + (size_t)u * index->L, index->L);
+                if (dist < *cur_dist) {
+                    *cur = u;
+                    *cur_dist = dist;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+
+// Best-first search of one level. On entry the results hold the starting points, on
+// return the ef nearest points found.
+static int search_level(const a2a_hnsw_t* index, HnswScratch* scratch, const DTYPE* q,
+    const int level, const int ef, const int locked) {
+
+    const int L = index->L;
+    Heap* candidates = &scratch->candidates;
+    Heap* results = &scratch->results;
+
+    next_visit(scratch, index->N);
+    candidates->size = 0;
+    for (int i = 0; i < results->size; ++i) {
+        scratch->visited[results->items[i].id] = scratch->tag;
+        if (heap_push(candidates, -results->items[i].dist, results->items[i].id)) return EXIT_FAILURE;
+    }
+
+    while (candidates->size > 0) {
+        const HeapItem nearest = heap_pop(candidates);
+        if (results->size >= ef && -nearest.dist > results->items[0].dist) break;
+
+        const int count = copy_links(index, nearest.id, level, scratch->neighbors, locked);
+        for (int j = 0; j < count; ++j) {
+            const int u = scratch->neighbors[j];
+            if (j + 1 < count) __builtin_prefetch(index->C + (size_t)scratch->neighbors[j + 1] * L);
+            if (scratch->visited[u] == scratch->tag) continue;
+            scratch->visited[u] = scratch->tag;
+
+            const DTYPE dist = a2a_squared_distance(q, index->C + (size_t)u * L, L);
+            if (results->size < ef || dist < results->items[0].dist) {
+                if (heap_push(candidates, -dist, u) || heap_push(results, dist, u)) return EXIT_FAILURE;
+                if (results->size > ef) heap_pop(results);
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+// Empties the results into scratch->sorted by increasing distance
+static int drain_results(HnswScratch* scratch) {
+    const int count = scratch->results.size;
+    for (int i = count - 1; i >= 0; --i) scratch->sorted[i] = heap_pop(&scratch->results);
+    return count;
+}
+
+
+// Heuristic of the HNSW paper: a candidate, taken by increasing distance, is kept only if
+// it is closer to the point than to every neighbor kept so far. The links then spread in
+// all directions instead of piling up inside the nearest cluster.
+static int select_neighbors(const a2a_hnsw_t* index, const HeapItem* candidates, const int n,
+    const int max_links, int* selected) {
+
+    const int L = index->L;
+    int count = 0;
+    for (int i = 0; i < n && count < max_links; ++i) {
+        const DTYPE* x = index->C + (size_t)candidates[i].id * L;
+        int keep = 1;
+        for (int j = 0; j < count && keep; ++j) {
+            keep = a2a_squared_distance(x, index->C + (size_t)selected[j] * L, L) >= candidates[i].dist;
+        }
+        if (keep) selected[count++] = candidates[i].id;
+    }
+
+    return count;
+}
+
+
+// Adds u to the neighbor list of v, pruning the list with the heuristic when it is full
+static void add_link(const a2a_hnsw_t* index, HnswScratch* scratch, const int v, const int u,
+    const int level) {
+
+    const int L = index->L;
+    const int max_links = level == 0 ? index->M0 : index->M;
+    int* links = links_of(index, v, level);
+
+    lock_node(index, v);
+    const int count = links[0];
+    int present = 0;
+    for (int j = 0; j < count && !present; ++j) present = links[1 + j] == u;
+
+    if (!present && count < max_links) {
+        links[1 + count] = u;
+        links[0] = count + 1;
+    }
+    else if (!present) {
+        const DTYPE* x = index->C + (size_t)v * L;
+        for (int j = 0; j < count; ++j) {
+            scratch->pruned[j].id = links[1 + j];
+            scratch->pruned[j].dist = a2a_squared_distance(x, index->C + (size_t)links[1 + j] * L, L);
+        }
+        scratch->pruned[count].id = u;
+        scratch->pruned[count].dist = a2a_squared_distance(x, index->C + (size_t)u * L, L);
+        qsort(scratch->pruned, count + 1, sizeof(HeapItem), compare_items);
+        links[0] = select_neighbors(index, scratch->pruned, count + 1, max_links, links + 1);
+    }
+    unlock_node(index, v);
+}
+
+
+static int insert_point(a2a_hnsw_t* index, HnswScratch* scratch, const int v) {
+    const int L = index->L;
+    const DTYPE* q = index->C + (size_t)v * L;
+    const int level = index->levels[v];
+
+    while (atomic_flag_test_and_set_explicit(&index->entry_lock, memory_order_acquire)) sched_yield();
+    int cur = index->entry_point;
+    const int top = index->max_level;
+    atomic_flag_clear_explicit(&index->entry_lock, memory_order_release);
+
+    DTYPE cur_dist = a2a_squared_distance(q, index->C + (size_t)cur * L, L);
+    greedy_descend(index, scratch, q, &cur, &cur_dist, top, level, 1);
+
+    scratch->results.size = 0;
+    if (heap_push(&scratch->results, cur_dist, cur)) return EXIT_FAILURE;
+
+    for (int lc = level < top ? level : top; lc >= 0; --lc) {
+        if (search_level(index, scratch, q, lc, index->ef_construction, 1)) return EXIT_FAILURE;
+
+        // Another worker may already have linked v on this level, so the search can find it
+        int count = 0;
+        const int found = drain_results(scratch);
+        for (int i = 0; i < found; ++i) {
+            if (scratch->sorted[i].id != v) scratch->sorted[count++] = scratch->sorted[i];
+        }
+
+        const int nselected = select_neighbors(index, scratch->sorted, count, index->M, scratch->selected);
+
+        // Keep the links other workers added to v in the meantime
+        const int max_links = lc == 0 ? index->M0 : index->M;
+        int* links = links_of(index, v, lc);
+        lock_node(index, v);
+        for (int i = 0; i < nselected && links[0] < max_links; ++i) {
+            int present = 0;
+            for (int j = 0; j < links[0] && !present; ++j) present = links[1 + j] == scratch->selected[i];
+            if (!present) links[1 + links[0]++] = scratch->selected[i];
+        }
+        unlock_node(index, v);
+
+        for (int i = 0; i < nselected; ++i) add_link(index, scratch, scratch->selected[i], v, lc);
+
+        // The points found on this level are the starting points of the next one
+        for (int i = 0; i < count; ++i) {
+            if (heap_push(&scratch->results, scratch->sorted[i].dist, scratch->sorted[i].id)) return EXIT_FAILURE;
+        }
+    }
+
+    if (level > top) {
+        while (atomic_flag_test_and_set_explicit(&index->entry_lock, memory_order_acquire)) sched_yield();
+        if (level > index->max_level) {
+            index->max_level = level;
+            index->entry_point = v;
+        }
+        atomic_flag_clear_explicit(&index->entry_lock, memory_order_release);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int hnswBuildTaskExec(void* arg) {
+    hnswBuildTask* task = (hnswBuildTask *)arg;
+    const int N = task->index->N;
+
+    int first;
+    while ((first = atomic_fetch_add(task->next, NODES_PER_CHUNK)) < N) {
+        const int last = first + NODES_PER_CHUNK < N ? first + NODES_PER_CHUNK : N;
+        for (int v = first; v < last; ++v) {
+            if (insert_point(task->index, &task->scratch, v)) return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int search_point(hnswSearchTask* task, const int qi) {
+    const a2a_hnsw_t* index = task->index;
+    HnswScratch* scratch = &task->scratch;
+    const int K = task->K;
+    const DTYPE* q = task->Q ? task->Q + (size_t)qi * index->L : index->C + (size_t)qi * index->L;
+
+    int cur = index->entry_point;
+    DTYPE cur_dist = a2a_squared_distance(q, index->C + (size_t)cur * index->L, index->L);
+    greedy_descend(index, scratch, q, &cur, &cur_dist, index->max_level, 0, 0);
+
+    scratch->results.size = 0;
+    if (heap_push(&scratch->results, cur_dist, cur)) return EXIT_FAILURE;
+    if (search_level(index, scratch, q, 0, task->ef, 0)) return EXIT_FAILURE;
+    const int found = drain_results(scratch);
+
+    int* idx = task->IDX + (size_t)qi * K;
+    DTYPE* dist = task->D + (size_t)qi * K;
+    int k = 0;
+    for (int i = 0; i < found && k < K; ++i) {
+        if (!task->Q && scratch->sorted[i].id == qi) continue;
+        idx[k] = scratch->sorted[i].id;
+        dist[k] = SQRT(scratch->sorted[i].dist);
+        k++;
+    }
+    for (; k < K; ++k) {
+        idx[k] = -1;
+        dist[k] = INF;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int hnswSearchTaskExec(void* arg) {
+    hnswSearchTask* task = (hnswSearchTask *)arg;
+
+    int first;
+    while ((first = atomic_fetch_add(task->next, NODES_PER_CHUNK)) < task->M) {
+        const int last = first + NODES_PER_CHUNK < task->M ? first + NODES_PER_CHUNK : task->M;
+        for (int qi = first; qi < last; ++qi) {
+            if (search_point(task, qi)) return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int run_search(const a2a_hnsw_t* index, const DTYPE* Q, const int M, const int K,
+    const int ef, int* IDX, DTYPE* D, const int nthreads, parallelization_type_t par_type) {
+
+    // Every worker owns a visited array as large as the index, so idle workers are not started
+    const int nchunks = (M + NODES_PER_CHUNK - 1) / NODES_PER_CHUNK;
+    const int nworkers = nthreads < nchunks ? nthreads : nchunks;
+    atomic_int next = 0;
+    int status = EXIT_FAILURE;
+    int ntasks = 0;
+
+    hnswSearchTask* tasks = (hnswSearchTask *)a2a_Malloc(nworkers * sizeof(hnswSearchTask));
+    if (!tasks) {
+        fprintf(stderr, "Error allocating memory for the HNSW workers\n");
+        return EXIT_FAILURE;
+    }
+
+    for (; ntasks < nworkers; ++ntasks) {
+        hnswSearchTask* task = &tasks[ntasks];
+        task->index = index;
+        task->next = &next;
+        task->Q = Q;
+        task->M = M;
+        task->K = K;
+        task->ef = ef;
+        task->IDX = IDX;
+        task->D = D;
+        if (init_scratch(&task->scratch, index->N, index->M0, ef)) {
+            ntasks++;
+            goto cleanup;
+        }
+    }
+
+    status = a2a_ParallelRun(hnswSearchTaskExec, tasks, sizeof(hnswSearchTask), nworkers, par_type);
+
+cleanup:
+    for (int i = 0; i < ntasks; ++i) free_scratch(&tasks[i].scratch);
+    a2a_Free(tasks);
+
+    return status;
+}
+
+
+void a2a_hnsw_options_init(a2a_hnsw_options_t *opts) {
+    opts->M = 16;
+    opts->ef_construction = 200;
+    opts->seed = 0;
+}
+
+
+int a2a_hnsw_build(const DTYPE* C, const int N, const int L, const int nthreads,
+    parallelization_type_t par_type, const a2a_hnsw_options_t *opts, a2a_hnsw_t **index) {
+
+    a2a_hnsw_options_t options;
+    if (opts) options = *opts;
+    else a2a_hnsw_options_init(&options);
+
+    if (!C || N <= 0 || L <= 0 || !index) {
+        fprintf(stderr, "Invalid input parameters for the HNSW index\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (options.M < 2 || options.ef_construction < 1) {
+        fprintf(stderr, "Invalid HNSW options\n");
+        return EXIT_FAILURE;
+    }
+
+    *index = NULL;
+    a2a_hnsw_t* graph = (a2a_hnsw_t *)a2a_Calloc(1, sizeof(a2a_hnsw_t));
+    hnswBuildTask* tasks = NULL;
+    int ntasks = 0;
+    int status = EXIT_FAILURE;
+
+    if (!graph) {
+        fprintf(stderr, "Error allocating memory for the HNSW index\n");
+        return EXIT_FAILURE;
+    }
+
+    graph->C = C;
+    graph->N = N;
+    graph->L = L;
+    graph->M = options.M;
+    graph->M0 = 2 * options.M;
+    graph->ef_construction = options.ef_construction;
+    graph->levels = (int *)a2a_Malloc(N * sizeof(int));
+    graph->links0 = (int *)a2a_Calloc((size_t)N * (1 + graph->M0), sizeof(int));
+    graph->upper_offset = (size_t *)a2a_Malloc(N * sizeof(size_t));
+    graph->locks = (atomic_flag *)a2a_Malloc(N * sizeof(atomic_flag));
+
+    if (!graph->levels || !graph->links0 || !graph->upper_offset || !graph->locks) {
+        fprintf(stderr, "Error allocating memory for the HNSW index\n");
+        goto cleanup;
+    }
+
+    // Levels follow an exponential distribution, each level holding about 1/M of the points below
+    const double level_scale = 1.0 / log((double)options.M);
+    unsigned int seed = options.seed;
+    size_t upper_size = 0;
+    for (int v = 0; v < N; ++v) {
+        const double r = (rand_r(&seed) + 1.0) / ((double)RAND_MAX + 2.0);
+        const int level = (int)(-log(r) * level_scale);
+        graph->levels[v] = level < HNSW_MAX_LEVEL ? level : HNSW_MAX_LEVEL;
+        graph->upper_offset[v] = upper_size;
+        upper_size += (size_t)graph->levels[v] * (1 + graph->M);
+        atomic_flag_clear(&graph->locks[v]);
+    }
+
+    graph->links_upper = (int *)a2a_Calloc(upper_size > 0 ? upper_size : 1, sizeof(int));
+    tasks = (hnswBuildTask *)a2a_Malloc(nthreads * sizeof(hnswBuildTask));
+    if (!graph->links_upper || !tasks) {
+        fprintf(stderr, "Error allocating memory for the HNSW index\n");
+        goto cleanup;
+    }
+
+    atomic_flag_clear(&graph->entry_lock);
+    graph->entry_point = 0;
+    graph->max_level = graph->levels[0];
+    DEBUG_PRINT("HNSW: %zu upper level slots, top level %d\n", upper_size / (1 + graph->M), graph->max_level);
+
+    // The first point is the initial entry point, the others are inserted in parallel
+    atomic_int next = 1;
+    for (; ntasks < nthreads; ++ntasks) {
+        tasks[ntasks].index = graph;
+        tasks[ntasks].next = &next;
+        if (init_scratch(&tasks[ntasks].scratch, N, graph->M0, graph->ef_construction)) {
+            ntasks++;
+            goto cleanup;
+        }
+    }
+
+    if (a2a_ParallelRun(hnswBuildTaskExec, tasks, sizeof(hnswBuildTask), nthreads, par_type)) goto cleanup;
+
+    *index = graph;
+    status = EXIT_SUCCESS;
+
+cleanup:
+    for (int i = 0; i < ntasks; ++i) free_scratch(&tasks[i].scratch);
+    a2a_Free(tasks);
+    if (status != EXIT_SUCCESS) a2a_hnsw_free(graph);
+
+    return status;
+}
+
+
+int a2a_hnsw_search(const a2a_hnsw_t *index, const DTYPE* Q, const int M, const int K, const int ef,
+    int* IDX, DTYPE* D, const int nthreads, parallelization_type_t par_type) {
+
+    if (!index || !Q || M <= 0 || K <= 0 || !IDX || !D) {
+        fprintf(stderr, "Invalid input parameters for the HNSW search\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    return run_search(index, Q, M, K, ef > K ? ef : K, IDX, D, nthreads, par_type);
+}
+
+
+int a2a_hnsw_all_to_all(const a2a_hnsw_t *index, const int K, const int ef, int* IDX, DTYPE* D,
+    const int nthreads, parallelization_type_t par_type) {
+
+    if (!index || K <= 0 || !IDX || !D) {
+        fprintf(stderr, "Invalid input parameters for the HNSW search\n");
+        return EXIT_FAILURE;
+    }
+    if (K >= index->N) {
+        fprintf(stderr, "Number of neighbors must be smaller than the number of data points\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    // Each point finds itself, so the candidate list holds one more entry
+    return run_search(index, NULL, index->N, K, ef > K + 1 ? ef : K + 1, IDX, D, nthreads, par_type);
+}
+
+
+void a2a_hnsw_free(a2a_hnsw_t *index) {
+    if (!index) return;
+    a2a_Free(index->levels);
+    a2a_Free(index->links0);
+    a2a_Free(index->upper_offset);
+    a2a_Free(index->links_upper);
+    a2a_Free(index->locks);
+    a2a_Free(index);
+}
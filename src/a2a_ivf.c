@@ -0,0 +1,581 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "a2a_knn.h"
+#include "a2a_ivf.h"
+#include "a2a_parallel.h"
+#include "a2a_clustering.h"
+#include "a2a_alloc.h"
+#include "a2a_memory.h"
+
+
+#define IVF_ALIGNMENT 64                  // Alignment of every array of the image in bytes
+#define IVF_BYTE_ORDER_MARK 0x01020304u   // Reads differently on a machine with another byte order
+#define IVF_QUERY_BLOCK 256               // Queries taken by a search worker at a time
+
+static const char IVF_MAGIC[8] = { 'A', '2', 'A', 'I', 'V', 'F', '\0', '\0' };
+
+
+// Header at the start of the image. The arrays follow in the order of a2a_ivf_t,
+// each one starting at a multiple of IVF_ALIGNMENT bytes.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype_size;
+    uint32_t int_size;
+    uint32_t byte_order;
+    int64_t N;
+    int64_t L;
+    int64_t Kc;
+    uint64_t size;                       // Size of the image in bytes
+    uint8_t reserved[8];
+} IvfHeader;
+
+_Static_assert(sizeof(IvfHeader) == IVF_ALIGNMENT, "The IVF header must fill one alignment unit");
+
+
+// Byte offsets of the arrays in the image
+typedef struct {
+    size_t centroids;
+    size_t sqrmag_centroids;
+    size_t data;
+    size_t sqrmag;
+    size_t ids;
+    size_t offsets;
+    size_t size;
+} IvfLayout;
+
+
+static size_t align_up(const size_t bytes) {
+    return (bytes + IVF_ALIGNMENT - 1) / IVF_ALIGNMENT * IVF_ALIGNMENT;
+}
+
+
+static IvfLayout ivf_layout(const size_t N, const size_t L, const size_t Kc) {
+    IvfLayout layout;
+    size_t pos = align_up(sizeof(IvfHeader));
+    layout.centroids = pos;
+    pos = align_up(pos + Kc * L * sizeof(DTYPE));
+    layout.sqrmag_centroids = pos;
+    pos = align_up(pos + Kc * sizeof(DTYPE));
+    layout.data = pos;
+    pos = align_up(pos + N * L * sizeof(DTYPE));
+    layout.sqrmag = pos;
+    pos = align_up(pos + N * sizeof(DTYPE));
+    layout.ids = pos;
+    pos = align_up(pos + N * sizeof(int));
+    layout.offsets = pos;
+    pos = align_up(pos + (Kc + 1) * sizeof(int));
+    layout.size = pos;
+    return layout;
+}
+
+
+static void attach_image(a2a_ivf_t* index, void* image, const IvfLayout* layout, const int mapped) {
+    const IvfHeader* header = (const IvfHeader *)image;
+    const char* base = (const char *)image;
+
+    index->N = (int)header->N;
+    index->L = (int)header->L;
+    index->Kc = (int)header->Kc;
+    index->centroids = (const DTYPE *)(base + layout->centroids);
+    index->sqrmag_centroids = (const DTYPE *)(base + layout->sqrmag_centroids);
+    index->data = (const DTYPE *)(base + layout->data);
+    index->sqrmag = (const DTYPE *)(base + layout->sqrmag);
+    index->ids = (const int *)(base + layout->ids);
+    index->offsets = (const int *)(base + layout->offsets);
+    index->image = image;
+    index->size = layout->size;
+    index->mapped = mapped;
+}
+
+
+// Checks that a header describes an image of this library and returns its layout
+static int check_header(const IvfHeader* header, const size_t file_size, IvfLayout* layout) {
+
+    if (memcmp(header->magic, IVF_MAGIC, sizeof(IVF_MAGIC)) != 0) {
+        fprintf(stderr, "Not an IVF index file\n");
+        return EXIT_FAILURE;
+    }
+    if (header->byte_order != IVF_BYTE_ORDER_MARK) {
+        fprintf(stderr, "IVF index file written on a machine with a different byte order\n");
+        return EXIT_FAILURE;
+    }
+    if (header->version != A2A_IVF_VERSION) {
+        fprintf(stderr, "Unsupported IVF index version: %u\n", header->version);
+        return EXIT_FAILURE;
+    }
+    if (header->dtype_size != sizeof(DTYPE) || header->int_size != sizeof(int)) {
+        fprintf(stderr, "IVF index file built with a different precision\n");
+        return EXIT_FAILURE;
+    }
+    if (header->N <= 0 || header->N > INT32_MAX || header->L <= 0 || header->L > INT32_MAX ||
+        header->Kc <= 0 || header->Kc > header->N) {
+        fprintf(stderr, "Invalid dimensions in IVF index file\n");
+        return EXIT_FAILURE;
+    }
+
+    *layout = ivf_layout((size_t)header->N, (size_t)header->L, (size_t)header->Kc);
+    if (header->size != layout->size || file_size != layout->size) {
+        fprintf(stderr, "Truncated or corrupted IVF index file\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+int a2a_ivf_build(const DTYPE* C, const int N, const int L, const int Kc, const int nthreads,
+    const double max_memory_usage_ratio, parallelization_type_t par_type,
+    const a2a_ann_options_t *opts, a2a_ivf_t **index) {
+
+    if (!index || !C || N <= 0 || L <= 0 || Kc <= 0) {
+        fprintf(stderr, "Invalid input parameters for IVF build\n");
+        return EXIT_FAILURE;
+    }
+    *index = NULL;
+    if (Kc >= N) {
+        fprintf(stderr, "Number of clusters must be smaller than the number of data points\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (max_memory_usage_ratio <= 0.0 || max_memory_usage_ratio > 1.0) {
+        fprintf(stderr, "Invalid memory usage ratio: %f\n", max_memory_usage_ratio);
+        return EXIT_FAILURE;
+    }
+
+    a2a_ann_options_t options;
+    if (opts) options = *opts;
+    else a2a_ann_options_init(&options);
+
+    if (options.coarse_clusters > Kc || (options.coarse_clusters < 0 &&
+        options.coarse_clusters != A2A_COARSE_CLUSTERS_AUTO)) {
+        fprintf(stderr, "Invalid number of coarse clusters: %d\n", options.coarse_clusters);
+        return EXIT_FAILURE;
+    }
+    if (options.max_cluster_size < 0 && options.max_cluster_size != A2A_CLUSTER_SIZE_AUTO) {
+        fprintf(stderr, "Invalid maximum cluster size: %d\n", options.max_cluster_size);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    int *assignments = NULL, *counts = NULL;
+    a2a_ivf_t* ivf = NULL;
+    char* image = NULL;
+
+    // Cluster the points, only empty clusters are merged
+    int num_clusters = Kc;
+    if (a2a_cluster_points(C, N, L, 1, &num_clusters, &options, &assignments, &counts, nthreads,
+        max_memory_usage_ratio, par_type)) goto cleanup;
+
+    const IvfLayout layout = ivf_layout(N, L, num_clusters);
+    ivf = (a2a_ivf_t *)a2a_Malloc(sizeof(a2a_ivf_t));
+    image = (char *)a2a_AlignedAlloc(IVF_ALIGNMENT, layout.size);
+    if (!ivf || !image) {
+        fprintf(stderr, "Error allocating memory for the IVF index\n");
+        goto cleanup;
+    }
+    memset(image, 0, layout.size);  // Padding included, so that saved files are reproducible
+
+    IvfHeader* header = (IvfHeader *)image;
+    memcpy(header->magic, IVF_MAGIC, sizeof(IVF_MAGIC));
+    header->version = A2A_IVF_VERSION;
+    header->dtype_size = sizeof(DTYPE);
+    header->int_size = sizeof(int);
+    header->byte_order = IVF_BYTE_ORDER_MARK;
+    header->N = N;
+    header->L = L;
+    header->Kc = num_clusters;
+    header->size = layout.size;
+
+    DTYPE* centroids = (DTYPE *)(image + layout.centroids);
+    DTYPE* sqrmag_centroids = (DTYPE *)(image + layout.sqrmag_centroids);
+    DTYPE* data = (DTYPE *)(image + layout.data);
+    int* offsets = (int *)(image + layout.offsets);
+
+    // Store the points in cluster order
+    if (a2a_order_by_cluster(C, assignments, counts, N, L, num_clusters, nthreads, par_type,
+        (int *)(image + layout.ids), data, (DTYPE *)(image + layout.sqrmag))) goto cleanup;
+
+    offsets[0] = 0;
+    for (int k = 0; k < num_clusters; k++) offsets[k + 1] = offsets[k] + counts[k];
+
+    // The centroids are the means of the final clusters
+    for (int k = 0; k < num_clusters; k++) {
+        DTYPE* centroid = centroids + (size_t)k * L;
+        for (int i = offsets[k]; i < offsets[k + 1]; i++) {
+            const DTYPE* x = data + (size_t)i * L;
+            for (int j = 0; j < L; j++) centroid[j] += x[j];
+        }
+        for (int j = 0; j < L; j++) centroid[j] /= counts[k];
+        sqrmag_centroids[k] = DOT(L, centroid, 1, centroid, 1);
+    }
+
+    attach_image(ivf, image, &layout, 0);
+    *index = ivf;
+    ivf = NULL;
+    image = NULL;
+    DEBUG_PRINT("IVF: Built index with %d points in %d clusters\n", N, num_clusters);
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(assignments);
+    a2a_Free(counts);
+    a2a_Free(ivf);
+    a2a_Free(image);
+
+    return status;
+}
+
+
+int a2a_ivf_save(const a2a_ivf_t *index, const char *path) {
+
+    if (!index || !path) {
+        fprintf(stderr, "Invalid input parameters for IVF save\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Error opening file %s for writing\n", path);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    if (fwrite(index->image, 1, index->size, file) != index->size) {
+        fprintf(stderr, "Error writing IVF index to %s\n", path);
+        status = EXIT_FAILURE;
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error closing file %s\n", path);
+        status = EXIT_FAILURE;
+    }
+
+    return status;
+}
+
+
+int a2a_ivf_load(const char *path, a2a_ivf_t **index) {
+
+    if (!path || !index) {
+        fprintf(stderr, "Invalid input parameters for IVF load\n");
+        return EXIT_FAILURE;
+    }
+    *index = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening file %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IvfHeader)) {
+        fprintf(stderr, "Not an IVF index file: %s\n", path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    const size_t file_size = (size_t)st.st_size;
+    void* image = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping stays valid
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Error mapping file %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    a2a_ivf_t* ivf = NULL;
+    IvfLayout layout;
+
+    if (check_header((const IvfHeader *)image, file_size, &layout)) goto cleanup;
+
+    // The cluster offsets are small, check them so that a corrupted file cannot send the searches out of bounds
+    const IvfHeader* header = (const IvfHeader *)image;
+    const int* offsets = (const int *)((const char *)image + layout.offsets);
+    if (offsets[0] != 0 || offsets[header->Kc] != header->N) {
+        fprintf(stderr, "Corrupted cluster offsets in IVF index file\n");
+        goto cleanup;
+    }
+    for (int64_t k = 0; k < header->Kc; k++) {
+        if (offsets[k + 1] < offsets[k]) {
+            fprintf(stderr, "Corrupted cluster offsets in IVF index file\n");
+            goto cleanup;
+        }
+    }
+
+    ivf = (a2a_ivf_t *)a2a_Malloc(sizeof(a2a_ivf_t));
+    if (!ivf) {
+        fprintf(stderr, "Error allocating memory for the IVF index\n");
+        goto cleanup;
+    }
+    attach_image(ivf, image, &layout, 1);
+    *index = ivf;
+    DEBUG_PRINT("IVF: Loaded index with %d points in %d clusters\n", ivf->N, ivf->Kc);
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) munmap(image, file_size);
+
+    return status;
+}
+
+
+void a2a_ivf_free(a2a_ivf_t *index) {
+    if (!index) return;
+    if (index->mapped) munmap(index->image, index->size);
+    else a2a_Free(index->image);
+    a2a_Free(index);
+}
+
+
+// A probed cluster of a query of the current block
+typedef struct {
+    int cluster;
+    int query;
+} ProbeEntry;
+
+
+static int compare_probes(const void* a, const void* b) {
+    const ProbeEntry* pa = (const ProbeEntry *)a;
+    const ProbeEntry* pb = (const ProbeEntry *)b;
+    if (pa->cluster != pb->cluster) return (pa->cluster > pb->cluster) - (pa->cluster < pb->cluster);
+    return (pa->query > pb->query) - (pa->query < pb->query);
+}
+
+
+// Max-heap of the best K candidates of a query, ordered by distance
+static void heap_push(DTYPE* dist, int* idx, int* size, const int K, const DTYPE d, const int id) {
+    int i;
+    if (*size < K) {
+        // Sift up from the new leaf
+        i = (*size)++;
+        while (i > 0 && dist[(i - 1) / 2] < d) {
+            dist[i] = dist[(i - 1) / 2];
+            idx[i] = idx[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    else {
+        if (d >= dist[0]) return;
+        // Replace the root and sift down
+        i = 0;
+        while (1) {
+            int child = 2 * i + 1;
+            if (child >= K) break;
+            if (child + 1 < K && dist[child + 1] > dist[child]) child++;
+            if (dist[child] <= d) break;
+            dist[i] = dist[child];
+            idx[i] = idx[child];
+            i = child;
+        }
+    }
+    dist[i] = d;
+    idx[i] = id;
+}
+
+
+// Sorts the heap in place by ascending distance
+static void heap_sort(DTYPE* dist, int* idx, int size) {
+    while (size > 1) {
+        const DTYPE d = dist[size - 1];
+        const int id = idx[size - 1];
+        dist[size - 1] = dist[0];
+        idx[size - 1] = idx[0];
+        size--;
+        int i = 0;
+        while (1) {
+            int child = 2 * i + 1;
+            if (child >= size) break;
+            if (child + 1 < size && dist[child + 1] > dist[child]) child++;
+            if (dist[child] <= d) break;
+            dist[i] = dist[child];
+            idx[i] = idx[child];
+            i = child;
+        }
+        dist[i] = d;
+        idx[i] = id;
+    }
+}
+
+
+typedef struct {
+    const a2a_ivf_t* index;              // The index
+    const DTYPE* Q;                      // Query matrix
+    int M;                               // Number of queries
+    int K;                               // Number of neighbors per query
+    int nprobe;                          // Number of clusters searched per query
+    int* IDX;                            // Output indices
+    DTYPE* D;                            // Output distances
+    atomic_int* next;                    // First query of the next block
+    double max_memory_usage_ratio;       // Share of the available memory for this worker
+} ivfSearchTask;
+
+
+static int ivfSearchExec(void* arg) {
+
+    ivfSearchTask* task = (ivfSearchTask *)arg;
+    const a2a_ivf_t* index = task->index;
+    const int L = index->L;
+    const int K = task->K;
+    const int nprobe = task->nprobe;
+
+    a2a_KnnWorkspace ws;
+    int *probe_idx = NULL, *cand_idx = NULL, *heap_idx = NULL, *heap_size = NULL;
+    DTYPE *probe_dist = NULL, *cand_dist = NULL, *heap_dist = NULL, *Q_sub = NULL;
+    ProbeEntry* probes = NULL;
+    int status = EXIT_FAILURE;
+
+    if (a2a_KnnWorkspaceInit(&ws, task->max_memory_usage_ratio)) goto cleanup;
+
+    probe_idx = (int *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * nprobe * sizeof(int));
+    probe_dist = (DTYPE *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * nprobe * sizeof(DTYPE));
+    probes = (ProbeEntry *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * nprobe * sizeof(ProbeEntry));
+    Q_sub = (DTYPE *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * L * sizeof(DTYPE));
+    cand_idx = (int *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * K * sizeof(int));
+    cand_dist = (DTYPE *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * K * sizeof(DTYPE));
+    heap_idx = (int *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * K * sizeof(int));
+    heap_dist = (DTYPE *)a2a_Malloc((size_t)IVF_QUERY_BLOCK * K * sizeof(DTYPE));
+    heap_size = (int *)a2a_Malloc(IVF_QUERY_BLOCK * sizeof(int));
+    if (!probe_idx || !probe_dist || !probes || !Q_sub || !cand_idx || !cand_dist ||
+        !heap_idx || !heap_dist || !heap_size) {
+        fprintf(stderr, "Error allocating memory for IVF search\n");
+        goto cleanup;
+    }
+
+    int q0;
+    while ((q0 = atomic_fetch_add(task->next, IVF_QUERY_BLOCK)) < task->M) {
+        const int m = (task->M - q0) < IVF_QUERY_BLOCK ? (task->M - q0) : IVF_QUERY_BLOCK;
+        const DTYPE* Q = task->Q + (size_t)q0 * L;
+
+        // Find the clusters to probe for each query of the block
+        if (a2a_knnsearch_ws(Q, index->centroids, probe_idx, probe_dist, m, index->Kc, L, nprobe, 0,
+            NULL, index->sqrmag_centroids, &ws)) goto cleanup;
+
+        // Group the queries by probed cluster, so that each cluster is searched once per block
+        for (int i = 0; i < m; i++) {
+            heap_size[i] = 0;
+            for (int p = 0; p < nprobe; p++) {
+                probes[i * nprobe + p].cluster = probe_idx[i * nprobe + p];
+                probes[i * nprobe + p].query = i;
+            }
+        }
+        qsort(probes, (size_t)m * nprobe, sizeof(ProbeEntry), compare_probes);
+
+        int start = 0;
+        while (start < m * nprobe) {
+            const int c = probes[start].cluster;
+            int end = start;
+            while (end < m * nprobe && probes[end].cluster == c) end++;
+
+            const int offset = index->offsets[c];
+            const int count = index->offsets[c + 1] - offset;
+            const int q = end - start;
+            const int kk = K < count ? K : count;
+
+            if (count > 0) {
+                for (int j = 0; j < q; j++) {
+                    memcpy(Q_sub + (size_t)j * L, Q + (size_t)probes[start + j].query * L, L * sizeof(DTYPE));
+                }
+                if (a2a_knnsearch_ws(Q_sub, index->data + (size_t)offset * L, cand_idx, cand_dist, q, count,
+                    L, kk, 0, NULL, index->sqrmag + offset, &ws)) goto cleanup;
+
+                // Merge the candidates of the cluster into the results of its queries
+                for (int j = 0; j < q; j++) {
+                    const int i = probes[start + j].query;
+                    for (int t = 0; t < kk; t++) {
+                        heap_push(heap_dist + (size_t)i * K, heap_idx + (size_t)i * K, &heap_size[i], K,
+                            cand_dist[j * kk + t], index->ids[offset + cand_idx[j * kk + t]]);
+                    }
+                }
+            }
+            start = end;
+        }
+
+        for (int i = 0; i < m; i++) {
+            DTYPE* D = task->D + (size_t)(q0 + i) * K;
+            int* IDX = task->IDX + (size_t)(q0 + i) * K;
+            heap_sort(heap_dist + (size_t)i * K, heap_idx + (size_t)i * K, heap_size[i]);
+            memcpy(D, heap_dist + (size_t)i * K, heap_size[i] * sizeof(DTYPE));
+            memcpy(IDX, heap_idx + (size_t)i * K, heap_size[i] * sizeof(int));
+            for (int t = heap_size[i]; t < K; t++) {
+                D[t] = INF;
+                IDX[t] = -1;
+            }
+        }
+    }
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) atomic_store(task->next, task->M);  // Stop the other workers
+    a2a_KnnWorkspaceDestroy(&ws);
+    a2a_Free(probe_idx);
+    a2a_Free(probe_dist);
+    a2a_Free(probes);
+    a2a_Free(Q_sub);
+    a2a_Free(cand_idx);
+    a2a_Free(cand_dist);
+    a2a_Free(heap_idx);
+    a2a_Free(heap_dist);
+    a2a_Free(heap_size);
+
+    return status;
+}
+
+
+int a2a_ivf_search(const a2a_ivf_t *index, const DTYPE* Q, const int M, const int K,
+    const int nprobe, int* IDX, DTYPE* D, const int nthreads, const double max_memory_usage_ratio,
+    parallelization_type_t par_type) {
+
+    if (!index || !Q || M <= 0 || K <= 0 || nprobe <= 0 || !IDX || !D) {
+        fprintf(stderr, "Invalid input parameters for IVF search\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (max_memory_usage_ratio <= 0.0 || max_memory_usage_ratio > 1.0) {
+        fprintf(stderr, "Invalid memory usage ratio: %f\n", max_memory_usage_ratio);
+        return EXIT_FAILURE;
+    }
+
+    // No more workers than blocks of queries
+    int nworkers = (M + IVF_QUERY_BLOCK - 1) / IVF_QUERY_BLOCK;
+    if (nworkers > nthreads) nworkers = nthreads;
+
+    ivfSearchTask* tasks = (ivfSearchTask *)a2a_Malloc(sizeof(ivfSearchTask) * nworkers);
+    if (!tasks) {
+        fprintf(stderr, "Error allocating memory for IVF search\n");
+        return EXIT_FAILURE;
+    }
+
+    atomic_int next = 0;
+    for (int i = 0; i < nworkers; i++) {
+        tasks[i] = (ivfSearchTask){
+            .index = index, .Q = Q, .M = M, .K = K, .nprobe = nprobe < index->Kc ? nprobe : index->Kc,
+            .IDX = IDX, .D = D, .next = &next, .max_memory_usage_ratio = max_memory_usage_ratio / nworkers
+        };
+    }
+
+    int status = EXIT_FAILURE;
+    if (a2a_MemoryOpen(max_memory_usage_ratio) == EXIT_SUCCESS) {
+        status = a2a_ParallelRun(ivfSearchExec, tasks, sizeof(ivfSearchTask), nworkers, par_type);
+        a2a_MemoryClose();
+    }
+    a2a_Free(tasks);
+
+    return status;
+}
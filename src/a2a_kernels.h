@@ -0,0 +1,69 @@
+#ifndef A2A_KERNELS_H
+#define A2A_KERNELS_H
+
+#include "a2a_config.h"
+
+// Inner loops of the kNN and ANN searches, shared with the microbenchmarks so that they
+// can be timed in isolation. Not part of the public API.
+
+
+/**
+ * Moves the k smallest elements of arr[l..r] to arr[l..l+k-1], in no particular order,
+ * applying the same swaps to idx.
+ *
+ * @param arr the values
+ * @param idx the indices that follow the values
+ * @param l the first position
+ * @param r the last position
+ * @param k the number of elements to select, between 1 and r - l + 1
+ */
+void a2a_QuickSelect(DTYPE *arr, int *idx, int l, int r, int k);
+
+
+/**
+ * Sorts arr[l..r] in increasing order, applying the same swaps to idx.
+ *
+ * @param arr the values
+ * @param idx the indices that follow the values
+ * @param l the first position
+ * @param r the last position
+ */
+void a2a_QuickSort(DTYPE *arr, int *idx, int l, int r);
+
+
+/**
+ * Adds the squared magnitudes of the queries and of the points to a block of -2*Q*C',
+ * which gives the squared distances.
+ *
+ * @param D the block (rows x N), updated in place
+ * @param sqrmag_Q the squared magnitudes of the queries of the block (rows elements)
+ * @param sqrmag_C the squared magnitudes of the points (N elements)
+ * @param rows the number of queries of the block
+ * @param N the number of points
+ */
+void a2a_AddSquaredNorms(DTYPE *D, const DTYPE *sqrmag_Q, const DTYPE *sqrmag_C, const int rows, const int N);
+
+
+/**
+ * Copies the rows of C at the given indices to a contiguous matrix.
+ *
+ * @param C the data matrix
+ * @param L the dimension of the points
+ * @param indices the rows to copy
+ * @param count the number of rows
+ * @param C_sub output, the rows (count x L)
+ */
+void a2a_GatherRows(const DTYPE* C, const int L, const int* indices, const int count, DTYPE* C_sub);
+
+
+/**
+ * Returns the squared Euclidean distance of two points, with a plain scalar loop.
+ *
+ * @param a the first point
+ * @param b the second point
+ * @param L the dimension of the points
+ */
+DTYPE a2a_DistanceSquared(const DTYPE* a, const DTYPE* b, const int L);
+
+
+#endif
@@ -1,6 +1,9 @@
 #include "a2a_knn.h"
 #include "a2a_queue.h"
-#include <sys/sysinfo.h>
+#include "a2a_collector.h"
+#include "a2a_kernels.h"
+#include "a2a_alloc.h"
+#include "a2a_memory.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +15,8 @@ static pthread_cond_t condQueue;          // Condition variable for Queue
 static pthread_cond_t condTasksComplete;  // Condition variable to signal task completion for a block
 static int isActive;                      // Flag for threads to exit
 static int runningTasks;                  // Holds the number of running tasks
+static a2a_StatsCollector *poolCollector; // Collector of the caller of the pool, NULL without stats
+static atomic_int poolSlots;              // Thread slots of the pool in the collector
 
 
 /**
@@ -30,6 +35,7 @@ typedef struct knnTask {
     int QUERIES_NUM_THREAD;     // Number of queries for the task to proccess
     int q_index;                // Index of the first query to be proccessed
     int q_index_thread;         // Index of the query to be proccesed inside a thread
+    long long enqueued_ns;      // Time the task entered the queue of the pool
 } knnTask;
 
 
@@ -54,17 +60,6 @@ static int get_num_threads(int nthreads, const int MAX_QUERIES_MEMORY, const int
 }
 
 
-static size_t get_available_memory_bytes() {
-    size_t available_memory = 0UL;
-    struct sysinfo info;
-    if (sysinfo(&info) == 0) {
-        available_memory = info.freeram * info.mem_unit;  // Multiply by unit size
-    }
-    return available_memory;
-}
-
-
-
 static void swap(DTYPE *arr, int *idx, int i, int j) 
 {
     DTYPE dtemp = arr[i];
@@ -90,7 +85,7 @@ static int partition(DTYPE *arr, int *idx, int l, int r) {
 }
 
 
-static void qselect(DTYPE *arr, int *idx, int l, int r, int k) {
+void a2a_QuickSelect(DTYPE *arr, int *idx, int l, int r, int k) {
     // Partition the array around the last 
     // element and get the position of the pivot 
     // element in the sorted array
@@ -102,42 +97,91 @@ static void qselect(DTYPE *arr, int *idx, int l, int r, int k) {
 
     // If position is more, recur for the left subarray.
     if (index - l > k - 1) {
-        qselect(arr, idx, l, index - 1, k);
+        a2a_QuickSelect(arr, idx, l, index - 1, k);
         return;
     }
 
     // Else recur for the right subarray.
-    qselect(arr, idx, index + 1, r, k - index + l - 1);
+    a2a_QuickSelect(arr, idx, index + 1, r, k - index + l - 1);
 }
 
 
-static void qsort_(DTYPE *arr, int *idx, int l, int r) {
+void a2a_QuickSort(DTYPE *arr, int *idx, int l, int r) {
     if (l < r) {
         // call partition function to find Partition Index
         int index = partition(arr, idx, l, r);
 
         // Recursively call for left and right
         // half based on Partition Index
-        qsort_(arr, idx, l, index - 1);
-        qsort_(arr, idx, index + 1, r);
+        a2a_QuickSort(arr, idx, l, index - 1);
+        a2a_QuickSort(arr, idx, index + 1, r);
+    }
+}
+
+
+void a2a_AddSquaredNorms(DTYPE *D, const DTYPE *sqrmag_Q, const DTYPE *sqrmag_C, const int rows, const int N) {
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < N; j++) {
+            D[i * N + j] += sqrmag_Q[i] + sqrmag_C[j];
+        }
+    }
+}
+
+
+static void init_block_indices(int* IDX_all_block, const int QUERIES_NUM_BLOCK, const int N) {
+    for (int i = 0; i < QUERIES_NUM_BLOCK; i++) {
+        for (int j = 0; j < N; j++) {
+            IDX_all_block[i * N + j] = j;
+        }
     }
 }
 
 
+static void compute_block_sqrmag(const DTYPE* Q, DTYPE* sqrmag_Q_block, const int QUERIES_NUM_BLOCK, 
+    const int L, const int q_index) {
+    for (int i = 0; i < QUERIES_NUM_BLOCK; i++) {
+        sqrmag_Q_block[i] = DOT(L, Q + (i + q_index) * L, 1, Q + (i + q_index) * L, 1);
+    }
+}
+
+
+static void store_block_results(const DTYPE* D_all_block, const int* IDX_all_block, DTYPE* D, 
+    int* IDX, const int QUERIES_NUM_BLOCK, const int N, const int K, const int sorted, const int q_index) {
+
+    a2a_PhaseTimer timer;
+    a2a_PhaseBegin(&timer, A2A_PHASE_COPY_OUT);
+
+    // now copy the first K elements of each row of matrices
+    // D_all_block, IDX_all_block to D and IDX respectivelly
+    for (int i = 0; i < QUERIES_NUM_BLOCK; i++) {
+        for (int j = 0; j < K; j++) {
+            D[(q_index + i) * K + j] = SQRT(D_all_block[i * N + j]);
+            IDX[(q_index + i) * K + j] = IDX_all_block[i * N + j];  // zero-based indexing
+        }
+
+        // sort each row of the distance matrix
+        if (sorted) {
+            a2a_QuickSort(D + (q_index + i) * K, IDX + (q_index + i) * K, 0, K - 1);
+        }
+    }
+
+    a2a_PhaseEnd(&timer, A2A_PHASE_COPY_OUT);
+}
+
+
 static int alloc_memory(DTYPE **D_all_block, int **IDX_all_block, DTYPE **sqrmag_Q_block, DTYPE **sqrmag_C, 
-    const int M, const int N, int *MAX_QUERIES_MEMORY, const double max_memory_usage_ratio) {
-    size_t available_memory = get_available_memory_bytes();
+    const int M, const int N, int *MAX_QUERIES_MEMORY, size_t *reserved_memory, const double max_memory_usage_ratio) {
+    *reserved_memory = 0;
+    size_t available_memory = a2a_MemoryCapacityBytes();
     size_t max_allocable_memory = (size_t)(available_memory * max_memory_usage_ratio);
+    const size_t query_memory = (size_t)N * sizeof(int) + (size_t)N * sizeof(DTYPE) + sizeof(DTYPE);
 
     *MAX_QUERIES_MEMORY = M; 
-    size_t required_memory = (size_t)(*MAX_QUERIES_MEMORY) * (size_t)N * sizeof(int) +
-                                    (size_t)(*MAX_QUERIES_MEMORY) * (size_t)N * sizeof(DTYPE) +
-                                    (size_t)(*MAX_QUERIES_MEMORY) * sizeof(DTYPE) +
-                                    (size_t)N * sizeof(DTYPE);
+    size_t required_memory = (size_t)(*MAX_QUERIES_MEMORY) * query_memory + (size_t)N * sizeof(DTYPE);
     
     if (required_memory > max_allocable_memory) {
-        *MAX_QUERIES_MEMORY = (max_allocable_memory - (size_t)N * sizeof(DTYPE)) / 
-                            ((size_t)N * sizeof(int) + (size_t)N * sizeof(DTYPE) + sizeof(DTYPE));
+        *MAX_QUERIES_MEMORY = max_allocable_memory > (size_t)N * sizeof(DTYPE) ? 
+            (max_allocable_memory - (size_t)N * sizeof(DTYPE)) / query_memory : 0;
 
         DEBUG_PRINT("KNN: Too large distance matrix. Max queries per block: %d. Using %.2lf%% of available memory\n", *MAX_QUERIES_MEMORY, max_memory_usage_ratio * 100.0);
     }
@@ -147,20 +191,31 @@ static int alloc_memory(DTYPE **D_all_block, int **IDX_all_block, DTYPE **sqrmag
         return EXIT_FAILURE;
     }
 
+    // Reserve the blocks in the budget shared with the other threads of the process, 
+    // with fewer queries per block (at least one) if the budget is short
+    if (a2a_MemoryReserve(query_memory + (size_t)N * sizeof(DTYPE), 
+        (size_t)(*MAX_QUERIES_MEMORY) * query_memory + (size_t)N * sizeof(DTYPE), reserved_memory)) {
+        fprintf(stderr, "Error: Memory budget too small for minimum block size.\n");
+        return EXIT_FAILURE;
+    }
+    const size_t affordable_queries = (*reserved_memory - (size_t)N * sizeof(DTYPE)) / query_memory;
+    if (affordable_queries < (size_t)(*MAX_QUERIES_MEMORY)) {
+        *MAX_QUERIES_MEMORY = (int)affordable_queries;
+        DEBUG_PRINT("KNN: Memory budget short, max queries per block: %d\n", *MAX_QUERIES_MEMORY);
+    }
 
-    *IDX_all_block = (int *)malloc((size_t)(*MAX_QUERIES_MEMORY) * (size_t)N * sizeof(int));
-    *D_all_block = (DTYPE *)malloc((size_t)(*MAX_QUERIES_MEMORY) * (size_t)N * sizeof(DTYPE));
-    *sqrmag_Q_block = (DTYPE *)malloc((size_t)(*MAX_QUERIES_MEMORY) * sizeof(DTYPE));
-    *sqrmag_C = (DTYPE *)malloc((size_t)N * sizeof(DTYPE));
+    *IDX_all_block = (int *)a2a_Malloc((size_t)(*MAX_QUERIES_MEMORY) * (size_t)N * sizeof(int));
+    *D_all_block = (DTYPE *)a2a_Malloc((size_t)(*MAX_QUERIES_MEMORY) * (size_t)N * sizeof(DTYPE));
+    *sqrmag_Q_block = (DTYPE *)a2a_Malloc((size_t)(*MAX_QUERIES_MEMORY) * sizeof(DTYPE));
+    *sqrmag_C = (DTYPE *)a2a_Malloc((size_t)N * sizeof(DTYPE));
 
-    if ((*IDX_all_block) && (*D_all_block) && (*sqrmag_C) && (*sqrmag_Q_block)) {
-        return EXIT_SUCCESS;
-    }
+    if ((*IDX_all_block) && (*D_all_block) && (*sqrmag_C) && (*sqrmag_Q_block)) return EXIT_SUCCESS;
 
-    if (*sqrmag_C) free(*sqrmag_C);
-    if (*sqrmag_Q_block) free(*sqrmag_Q_block);
-    if (*D_all_block) free(*D_all_block);
-    if (*IDX_all_block) free(*IDX_all_block);
+    if (*sqrmag_C) a2a_Free(*sqrmag_C);
+    if (*sqrmag_Q_block) a2a_Free(*sqrmag_Q_block);
+    if (*D_all_block) a2a_Free(*D_all_block);
+    if (*IDX_all_block) a2a_Free(*IDX_all_block);
+    a2a_MemoryRelease(*reserved_memory);
 
     return EXIT_FAILURE;
 }
@@ -180,22 +235,29 @@ static void knnTaskExec(const knnTask *task) {
     const int L = task->L;
     const int q_index = task->q_index;
     const int q_index_thread = task->q_index_thread;
+    const long long trace_start = a2a_TraceBegin();
+    a2a_PhaseTimer timer;
+
+    a2a_PhaseBegin(&timer, A2A_PHASE_GEMM);
 
     // compute D = -2*Q*C'
     GEMM(CblasRowMajor, CblasNoTrans, CblasTrans, QUERIES_NUM_THREAD, N, L, SUFFIX(-2.0), Q + q_index * L, L, C, L, SUFFIX(0.0), D_all_block + q_index_thread * N, N);
 
     // compute the distance matrix D by applying the formula D = sqrt(C.^2 -2*Q*C' + (Q.^2)')
-    for (int i = 0; i < QUERIES_NUM_THREAD; i++) {
-        for (int j = 0; j < N; j++) {
-            D_all_block[(i + q_index_thread) * N + j] += sqrmag_Q_block[i + q_index_thread] + sqrmag_C[j];
-        }
-    }
+    a2a_AddSquaredNorms(D_all_block + q_index_thread * N, sqrmag_Q_block + q_index_thread, sqrmag_C,
+        QUERIES_NUM_THREAD, N);
+
+    a2a_PhaseEnd(&timer, A2A_PHASE_GEMM);
+    a2a_PhaseBegin(&timer, A2A_PHASE_SELECTION);
 
     // apply Quick Select algorithm for each row of distance matrix
     for (int i = 0; i < QUERIES_NUM_THREAD; i++) {
-        qselect(D_all_block + (i + q_index_thread) * N, IDX_all_block + (i + q_index_thread) * N, 0, N - 1, K);
+        a2a_QuickSelect(D_all_block + (i + q_index_thread) * N, IDX_all_block + (i + q_index_thread) * N, 0, N - 1, K);
     }
 
+    a2a_PhaseEnd(&timer, A2A_PHASE_SELECTION);
+    a2a_TraceEnd("knn_task", trace_start, q_index, QUERIES_NUM_THREAD);
+
     //DEBUG_PRINT("KNN: Thread %lu finished task with %d queries...\n", pthread_self(), task->QUERIES_NUM_THREAD);
 }
 
@@ -204,12 +266,19 @@ static void *knnThreadStart(void *pool) {
     a2a_Queue* queue = (a2a_Queue *)pool;
     knnTask task;
 
+    // The pool threads record into the collector of the caller, idle while waiting for tasks
+    a2a_collector = poolCollector;
+    const int slot = poolCollector ? atomic_fetch_add(&poolSlots, 1) : 0;
+    long long busy_ns = 0, idle_ns = 0;
+
     while (isActive) {
         pthread_mutex_lock(&mutexQueue);
+        const long long wait_start = poolCollector ? a2a_ClockNs(CLOCK_MONOTONIC) : 0;
         while (a2a_QueueIsEmpty(queue) && isActive) {
             //DEBUG_PRINT("KNN: Thread %lu waiting...\n", pthread_self());
             pthread_cond_wait(&condQueue, &mutexQueue);
         }
+        if (poolCollector) idle_ns += a2a_ClockNs(CLOCK_MONOTONIC) - wait_start;
         //DEBUG_PRINT("KNN: Thread %lu woke up...\n", pthread_self());
 
         if (!isActive)  // Check again after waiting to exit if flag has changed
@@ -223,7 +292,14 @@ static void *knnThreadStart(void *pool) {
                 
         pthread_mutex_unlock(&mutexQueue);
         
-        knnTaskExec(&task);
+        if (poolCollector) {
+            const long long start = a2a_ClockNs(CLOCK_MONOTONIC);
+            atomic_fetch_add_explicit(&poolCollector->queue_wait_ns, start - task.enqueued_ns, memory_order_relaxed);
+            atomic_fetch_add_explicit(&poolCollector->queue_tasks, 1, memory_order_relaxed);
+            knnTaskExec(&task);
+            busy_ns += a2a_ClockNs(CLOCK_MONOTONIC) - start;
+        }
+        else knnTaskExec(&task);
 
         pthread_mutex_lock(&mutexQueue);
         runningTasks--;
@@ -236,6 +312,7 @@ static void *knnThreadStart(void *pool) {
         pthread_mutex_unlock(&mutexQueue);
     }
 
+    if (poolCollector) a2a_StatsRecordThread(poolCollector, slot, busy_ns, idle_ns);
     return NULL;
 }
 
@@ -278,7 +355,7 @@ static int initialize_tasks(knnTask** tasks, int *num_tasks, const int NTHREADS,
 
     // Create the tasks and add them to the queue
     if (QUERIES_NUM_BLOCK < NTHREADS || NTHREADS == 1) { // create only one task
-        *tasks = (knnTask *)malloc(sizeof(knnTask));
+        *tasks = (knnTask *)a2a_Malloc(sizeof(knnTask));
         *num_tasks = 1;
         if (!(*tasks)) {
             fprintf(stderr, "Error allocating memory for knnTask\n");
@@ -303,7 +380,7 @@ static int initialize_tasks(knnTask** tasks, int *num_tasks, const int NTHREADS,
         int QUERIES_NUM_THREAD = 0;  // number of queries being proccesed on each thread
         int q_index_thread = 0;  // indexing of the queries in each block of queries
 
-        *tasks = (knnTask *)malloc(sizeof(knnTask) * NTHREADS);
+        *tasks = (knnTask *)a2a_Malloc(sizeof(knnTask) * NTHREADS);
         if (!(*tasks)) {
             fprintf(stderr, "Error allocating memory for knnTask array\n");
             return EXIT_FAILURE;
@@ -340,28 +417,68 @@ static int initialize_tasks(knnTask** tasks, int *num_tasks, const int NTHREADS,
 static void execute_tasks_pthreads(const knnTask* tasks, const int num_tasks, a2a_Queue* tasksQueue) {
     // Add tasks to the queue
     for (int i = 0; i < num_tasks; i++) {
-        a2a_QueueEnqueue(tasksQueue, (void *)&tasks[i]);
+        knnTask task = tasks[i];
+        task.enqueued_ns = poolCollector ? a2a_ClockNs(CLOCK_MONOTONIC) : 0;
+        a2a_QueueEnqueue(tasksQueue, (void *)&task);
         runningTasks++;
     }
 
     pthread_cond_broadcast(&condQueue);  // Wake up all threads to assign them the tasks
         
     // Wait for all tasks in the current block to finish
+    const long long trace_start = a2a_TraceBegin();
     pthread_mutex_lock(&mutexQueue);
     //DEBUG_PRINT("KNN: Waiting for %d tasks to complete...\n", runningTasks);
     while (runningTasks > 0) {
         pthread_cond_wait(&condTasksComplete, &mutexQueue);
     }
     pthread_mutex_unlock(&mutexQueue);
+    a2a_TraceEnd("knn_block_wait", trace_start, -1, 0);
+}
+
+
+// Runs a task of a parallel loop with the collector of the caller and measures its busy time
+static void run_task(const knnTask* task, a2a_StatsCollector* collector, long long* busy_ns) {
+    if (!collector) {
+        knnTaskExec(task);
+        return;
+    }
+
+    a2a_StatsCollector* previous = a2a_collector;
+    a2a_collector = collector;
+    const long long start = a2a_ClockNs(CLOCK_MONOTONIC);
+    knnTaskExec(task);
+    *busy_ns = a2a_ClockNs(CLOCK_MONOTONIC) - start;
+    a2a_collector = previous;
+}
+
+
+// Records the busy time of the tasks of a parallel loop, idle until the slowest task ends
+static void record_loop(a2a_StatsCollector* collector, long long* busy_ns, const int num_tasks, 
+    const long long start) {
+
+    if (!collector) return;
+    const long long loop_ns = a2a_ClockNs(CLOCK_MONOTONIC) - start;
+    for (int i = 0; i < num_tasks; i++) {
+        a2a_StatsRecordThread(collector, i, busy_ns[i], loop_ns - busy_ns[i]);
+    }
+    a2a_Free(busy_ns);
 }
 
 
 static int execute_tasks_openmp(const knnTask* tasks, const int num_tasks) {
     #ifndef USE_OPENCILK
+        a2a_StatsCollector* collector = a2a_collector;
+        long long* busy_ns = collector ? (long long *)a2a_Calloc(num_tasks, sizeof(long long)) : NULL;
+        if (!busy_ns) collector = NULL;
+        const long long start = collector ? a2a_ClockNs(CLOCK_MONOTONIC) : 0;
+
         #pragma omp parallel for num_threads(num_tasks)
         for (int i = 0; i < num_tasks; i++) {
-            knnTaskExec(&tasks[i]);
+            run_task(&tasks[i], collector, collector ? &busy_ns[i] : NULL);
         }
+
+        record_loop(collector, busy_ns, num_tasks, start);
         return EXIT_SUCCESS;
     #else
         fprintf(stderr, "OpenMP is not enabled in this build\n");
@@ -372,11 +489,20 @@ static int execute_tasks_openmp(const knnTask* tasks, const int num_tasks) {
 
 static int execute_tasks_opencilk(const knnTask* tasks, const int num_tasks) {
     #ifdef USE_OPENCILK
+        a2a_StatsCollector* collector = a2a_collector;
+        long long* busy_ns = collector ? (long long *)a2a_Calloc(num_tasks, sizeof(long long)) : NULL;
+        if (!busy_ns) collector = NULL;
+        const long long start = collector ? a2a_ClockNs(CLOCK_MONOTONIC) : 0;
+
         cilk_for (int i = 0; i < num_tasks; ++i) {
-            knnTaskExec(&tasks[i]);
+            run_task(&tasks[i], collector, collector ? &busy_ns[i] : NULL);
         }
+
+        record_loop(collector, busy_ns, num_tasks, start);
         return EXIT_SUCCESS;
     #else
+        (void)tasks;
+        (void)num_tasks;
         fprintf(stderr, "OpenCilk is not enabled in this build\n");
         return EXIT_FAILURE;
     #endif
@@ -392,8 +518,10 @@ static int create_thread_pool(pthread_t **threads, pthread_attr_t* attr,
     pthread_mutex_init(&mutexQueue, NULL);
     pthread_cond_init(&condQueue, NULL);
     pthread_cond_init(&condTasksComplete, NULL);
+    poolCollector = a2a_collector;
+    atomic_store(&poolSlots, 0);
 
-    *threads = (pthread_t *)malloc(sizeof(pthread_t) * NTHREADS);
+    *threads = (pthread_t *)a2a_Malloc(sizeof(pthread_t) * NTHREADS);
     if (!(*threads)) {
         fprintf(stderr, "Error allocating memory for threads\n");
         return EXIT_FAILURE;
@@ -433,33 +561,31 @@ static int destroy_thread_pool(pthread_t *threads, const int NTHREADS,
     pthread_cond_destroy(&condQueue);
     pthread_cond_destroy(&condTasksComplete);
     a2a_QueueDestroy(tasksQueue);
-    free(threads);
+    a2a_Free(threads);
 
     return EXIT_SUCCESS;
 }
 
 
-int a2a_knnsearch(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
+static int knnsearch(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
     const int N, const int L, const int K, const int sorted, const int nthreads,
     const int cblas_nthreads, const double max_memory_usage_ratio, 
     parallelization_type_t par_type) {
 
-    if (check_input_args_knn(Q, C, IDX, D, M, N, L, K, cblas_nthreads, max_memory_usage_ratio)) {
-        return EXIT_FAILURE;
-    }
     isActive = 1;
     runningTasks = 0;
     DTYPE *D_all_block = NULL, *sqrmag_Q_block = NULL, *sqrmag_C = NULL;
     int *IDX_all_block = NULL;
     pthread_t* threads = NULL;
     int MAX_QUERIES_MEMORY;    // The maximum number of queries that can be stored in memory
+    size_t reserved_memory;    // The bytes of the blocks in the memory budget
     int status = EXIT_FAILURE;
     pthread_attr_t attr;
     a2a_Queue tasksQueue;
 
     // Allocate the appropriate amount of memory for the matrices and compute the
     // maximum number of queries that can be proccessed
-    if (alloc_memory(&D_all_block, &IDX_all_block, &sqrmag_Q_block, &sqrmag_C, M, N, &MAX_QUERIES_MEMORY, max_memory_usage_ratio)) {
+    if (alloc_memory(&D_all_block, &IDX_all_block, &sqrmag_Q_block, &sqrmag_C, M, N, &MAX_QUERIES_MEMORY, &reserved_memory, max_memory_usage_ratio)) {
         fprintf(stderr, "knnsearch: Error allocating memory\n");
         return status;
     }
@@ -486,21 +612,16 @@ int a2a_knnsearch(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int
     while (q_index < M) {
 
         knnTask* tasks = NULL;
+        const long long trace_start = a2a_TraceBegin();
         
         // number of queries per block
         const int QUERIES_NUM_BLOCK = (M - q_index) > MAX_QUERIES_MEMORY ? MAX_QUERIES_MEMORY : (M - q_index);
 
         // initialize index matrix
-        for (int i = 0; i < QUERIES_NUM_BLOCK; i++) {
-            for (int j = 0; j < N; j++) {
-                IDX_all_block[i * N + j] = j;
-            }
-        }
+        init_block_indices(IDX_all_block, QUERIES_NUM_BLOCK, N);
 
         // Compute the square of magnitudes of the row vectors of matrix Q for this block
-        for (int i = 0; i < QUERIES_NUM_BLOCK; i++) {
-            sqrmag_Q_block[i] = DOT(L, Q + (i + q_index) * L, 1, Q + (i + q_index) * L, 1);
-        }
+        compute_block_sqrmag(Q, sqrmag_Q_block, QUERIES_NUM_BLOCK, L, q_index);
         
         DEBUG_PRINT("KNN: Processing block with %d queries (using %.2lf%% of available memory)\n", QUERIES_NUM_BLOCK, max_memory_usage_ratio * 100.0);
 
@@ -520,39 +641,28 @@ int a2a_knnsearch(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int
                 break;
                 case PAR_OPENMP:
                 if (execute_tasks_openmp(tasks, num_tasks)) {
-                    free(tasks);
+                    a2a_Free(tasks);
                     goto cleanup;
                 }
                 break;
                 case PAR_OPENCILK:
                 if (execute_tasks_opencilk(tasks, num_tasks)) {
-                    free(tasks);
+                    a2a_Free(tasks);
                     goto cleanup;
                 }
                 break;
                 default:
                 fprintf(stderr, "Unknown parallelization type\n");
-                free(tasks);
+                a2a_Free(tasks);
                 goto cleanup;
             }
         }
 
-        // now copy the first K elements of each row of matrices
-        // D_all_block, IDX_all_block to D and IDX respectivelly
-        for (int i = 0; i < QUERIES_NUM_BLOCK; i++) {
-            for (int j = 0; j < K; j++) {
-                D[(q_index + i) * K + j] = SQRT(D_all_block[i * N + j]);
-                IDX[(q_index + i) * K + j] = IDX_all_block[i * N + j];  // zero-based indexing
-            }
-
-            // sort each row of the distance matrix
-            if (sorted) {
-                qsort_(D + (q_index + i) * K, IDX + (q_index + i) * K, 0, K - 1);
-            }
-        }
+        store_block_results(D_all_block, IDX_all_block, D, IDX, QUERIES_NUM_BLOCK, N, K, sorted, q_index);
 
+        a2a_TraceEnd("knn_block", trace_start, q_index, QUERIES_NUM_BLOCK);
         q_index += QUERIES_NUM_BLOCK;  // move to the next block of queries
-        free(tasks);  // Free the tasks array after processing the block
+        a2a_Free(tasks);  // Free the tasks array after processing the block
     }
 
     status = EXIT_SUCCESS;
@@ -563,9 +673,194 @@ cleanup:
             status = EXIT_FAILURE;
         }
     }
-    free(sqrmag_C);
-    free(sqrmag_Q_block);
-    free(D_all_block);
-    free(IDX_all_block);
+    a2a_Free(sqrmag_C);
+    a2a_Free(sqrmag_Q_block);
+    a2a_Free(D_all_block);
+    a2a_Free(IDX_all_block);
+    a2a_MemoryRelease(reserved_memory);
+    return status;
+}
+
+
+int a2a_knnsearch(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
+    const int N, const int L, const int K, const int sorted, const int nthreads,
+    const int cblas_nthreads, const double max_memory_usage_ratio, 
+    parallelization_type_t par_type) {
+
+    return a2a_knnsearch_ex(Q, C, IDX, D, M, N, L, K, sorted, nthreads, cblas_nthreads, 
+        max_memory_usage_ratio, par_type, NULL);
+}
+
+
+int a2a_knnsearch_ex(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
+    const int N, const int L, const int K, const int sorted, const int nthreads,
+    const int cblas_nthreads, const double max_memory_usage_ratio, 
+    parallelization_type_t par_type, a2a_stats_t* stats) {
+
+    if (check_input_args_knn(Q, C, IDX, D, M, N, L, K, cblas_nthreads, max_memory_usage_ratio)) {
+        return EXIT_FAILURE;
+    }
+
+    a2a_StatsScope scope;
+    if (a2a_StatsOpen(&scope, stats)) return EXIT_FAILURE;
+    if (a2a_MemoryOpen(max_memory_usage_ratio)) {
+        a2a_StatsClose(&scope);
+        return EXIT_FAILURE;
+    }
+    a2a_StatsSetBudget(&scope, a2a_MemoryBudgetBytes());
+    const int status = knnsearch(Q, C, IDX, D, M, N, L, K, sorted, nthreads, cblas_nthreads, 
+        max_memory_usage_ratio, par_type);
+    a2a_MemoryClose();
+    a2a_StatsClose(&scope);
+
     return status;
 }
+
+
+int a2a_KnnWorkspaceInit(a2a_KnnWorkspace *ws, const double max_memory_usage_ratio) {
+    ws->D_block = NULL;
+    ws->IDX_block = NULL;
+    ws->sqrmag_Q_block = NULL;
+    ws->sqrmag_C = NULL;
+    ws->block_capacity = 0;
+    ws->queries_capacity = 0;
+    ws->corpus_capacity = 0;
+    ws->max_bytes = 0;
+    ws->reserved_bytes = 0;
+
+    if (max_memory_usage_ratio <= 0 || max_memory_usage_ratio > 1) {
+        fprintf(stderr, "Error: Invalid max memory usage ratio (%f). Must be in (0, 1].\n", max_memory_usage_ratio);
+        return EXIT_FAILURE;
+    }
+    ws->max_bytes = (size_t)(a2a_MemoryCapacityBytes() * max_memory_usage_ratio);
+
+    return EXIT_SUCCESS;
+}
+
+
+int a2a_KnnWorkspaceReserve(a2a_KnnWorkspace *ws, const int M, const int N, int *queries_per_block) {
+
+    // Same block sizing as alloc_memory, against the limit of the workspace
+    size_t block_queries = (size_t)M;
+    const size_t bytes_per_query = (size_t)N * sizeof(int) + (size_t)N * sizeof(DTYPE) + sizeof(DTYPE);
+    const size_t corpus_bytes = (size_t)N * sizeof(DTYPE);
+    if (block_queries * bytes_per_query + corpus_bytes > ws->max_bytes) {
+        block_queries = ws->max_bytes > corpus_bytes ? (ws->max_bytes - corpus_bytes) / bytes_per_query : 0;
+    }
+
+    if (block_queries < 1) {
+        fprintf(stderr, "Error: Insufficient memory for minimum block size.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Take the bytes the workspace lacks from the budget shared with the other threads, 
+    // settling for fewer queries per block (at least one) if the budget is short
+    const size_t wanted_bytes = block_queries * bytes_per_query + corpus_bytes;
+    if (wanted_bytes > ws->reserved_bytes) {
+        const size_t min_bytes = bytes_per_query + corpus_bytes;
+        size_t granted = 0;
+        if (a2a_MemoryReserve(min_bytes > ws->reserved_bytes ? min_bytes - ws->reserved_bytes : 0,
+            wanted_bytes - ws->reserved_bytes, &granted)) {
+            fprintf(stderr, "Error: Memory budget too small for minimum block size.\n");
+            return EXIT_FAILURE;
+        }
+        ws->reserved_bytes += granted;
+        const size_t affordable_queries = (ws->reserved_bytes - corpus_bytes) / bytes_per_query;
+        if (affordable_queries < block_queries) block_queries = affordable_queries;
+    }
+
+    const size_t block_elements = block_queries * (size_t)N;
+    if (block_elements > ws->block_capacity) {
+        DTYPE *D_block = (DTYPE *)a2a_Realloc(ws->D_block, block_elements * sizeof(DTYPE));
+        if (!D_block) return EXIT_FAILURE;
+        ws->D_block = D_block;
+        int *IDX_block = (int *)a2a_Realloc(ws->IDX_block, block_elements * sizeof(int));
+        if (!IDX_block) return EXIT_FAILURE;
+        ws->IDX_block = IDX_block;
+        ws->block_capacity = block_elements;
+    }
+    if ((int)block_queries > ws->queries_capacity) {
+        DTYPE *sqrmag_Q_block = (DTYPE *)a2a_Realloc(ws->sqrmag_Q_block, block_queries * sizeof(DTYPE));
+        if (!sqrmag_Q_block) return EXIT_FAILURE;
+        ws->sqrmag_Q_block = sqrmag_Q_block;
+        ws->queries_capacity = (int)block_queries;
+    }
+    if (N > ws->corpus_capacity) {
+        DTYPE *sqrmag_C = (DTYPE *)a2a_Realloc(ws->sqrmag_C, (size_t)N * sizeof(DTYPE));
+        if (!sqrmag_C) return EXIT_FAILURE;
+        ws->sqrmag_C = sqrmag_C;
+        ws->corpus_capacity = N;
+    }
+
+    if (queries_per_block) *queries_per_block = (int)block_queries;
+    return EXIT_SUCCESS;
+}
+
+
+void a2a_KnnWorkspaceDestroy(a2a_KnnWorkspace *ws) {
+    a2a_Free(ws->D_block);
+    a2a_Free(ws->IDX_block);
+    a2a_Free(ws->sqrmag_Q_block);
+    a2a_Free(ws->sqrmag_C);
+    ws->D_block = NULL;
+    ws->IDX_block = NULL;
+    ws->sqrmag_Q_block = NULL;
+    ws->sqrmag_C = NULL;
+    ws->block_capacity = 0;
+    ws->queries_capacity = 0;
+    ws->corpus_capacity = 0;
+    a2a_MemoryRelease(ws->reserved_bytes);
+    ws->reserved_bytes = 0;
+}
+
+
+int a2a_knnsearch_ws(const DTYPE* Q, const DTYPE* C, int* IDX, DTYPE* D, const int M, 
+    const int N, const int L, const int K, const int sorted, const DTYPE* sqrmag_Q, 
+    const DTYPE* sqrmag_C, a2a_KnnWorkspace *ws) {
+
+    // The memory limit is carried by the workspace
+    if (!ws || check_input_args_knn(Q, C, IDX, D, M, N, L, K, 1, 1.0)) {
+        return EXIT_FAILURE;
+    }
+
+    int MAX_QUERIES_MEMORY;
+    if (a2a_KnnWorkspaceReserve(ws, M, N, &MAX_QUERIES_MEMORY)) {
+        fprintf(stderr, "knnsearch: Error allocating memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sqrmag_C) {
+        for (int i = 0; i < N; i++) {
+            ws->sqrmag_C[i] = DOT(L, C + i * L, 1, C + i * L, 1);
+        }
+        sqrmag_C = ws->sqrmag_C;
+    }
+
+    // Iterate through each block of queries, each one solved by a single task
+    int q_index = 0;
+    while (q_index < M) {
+        const int QUERIES_NUM_BLOCK = (M - q_index) > MAX_QUERIES_MEMORY ? MAX_QUERIES_MEMORY : (M - q_index);
+
+        init_block_indices(ws->IDX_block, QUERIES_NUM_BLOCK, N);
+        const DTYPE* sqrmag_Q_block = ws->sqrmag_Q_block;
+        if (sqrmag_Q) {
+            sqrmag_Q_block = sqrmag_Q + q_index;
+        }
+        else {
+            compute_block_sqrmag(Q, ws->sqrmag_Q_block, QUERIES_NUM_BLOCK, L, q_index);
+        }
+
+        const knnTask task = {
+            .C = C, .Q = Q, .D_all_block = ws->D_block, .IDX_all_block = ws->IDX_block,
+            .sqrmag_C = sqrmag_C, .sqrmag_Q_block = sqrmag_Q_block, .K = K, .N = N, .L = L,
+            .QUERIES_NUM_THREAD = QUERIES_NUM_BLOCK, .q_index = q_index, .q_index_thread = 0
+        };
+        knnTaskExec(&task);
+
+        store_block_results(ws->D_block, ws->IDX_block, D, IDX, QUERIES_NUM_BLOCK, N, K, sorted, q_index);
+
+        q_index += QUERIES_NUM_BLOCK;
+    }
+
+    return EXIT_SUCCESS;
+}
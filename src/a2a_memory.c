@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+#include "a2a_memory.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+
+// Budget of the searches in progress, see a2a_MemoryOpen
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t released;             // Signaled when working buffers are released
+    int searches;                        // Number of searches in progress
+    double ratio;                        // max_memory_usage_ratio of the searches in progress
+    size_t capacity;                     // Memory available when the first search started
+    size_t budget;                       // Bytes the searches may use together
+    size_t reserved;                     // Bytes of the working buffers
+    size_t charged;                      // Bytes of the long-lived buffers
+    int holders;                         // Number of threads holding working buffers
+    int waiting_holders;                 // Number of them waiting in a2a_MemoryReserve
+} governor = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0.0, 0, 0, 0, 0, 0, 0 };
+
+// Bytes of working buffers held by the calling thread
+static _Thread_local size_t thread_held = 0;
+
+
+// Reads the number at the start of a file, 0 if the file is missing or holds "max"
+static size_t read_bytes(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    unsigned long long value = 0;
+    if (fscanf(file, "%llu", &value) != 1) value = 0;
+    fclose(file);
+    return value < SIZE_MAX ? (size_t)value : SIZE_MAX;
+}
+
+
+// Reads the value of a key of a file of "key value" lines (memory.stat), 0 if it is missing
+static size_t read_key(const char *path, const char *key, const size_t scale) {
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+    char line[256], name[128];
+    unsigned long long value = 0;
+    size_t bytes = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%127[^: ]%*[: ]%llu", name, &value) == 2 && strcmp(name, key) == 0) {
+            bytes = (size_t)value * scale;
+            break;
+        }
+    }
+    fclose(file);
+    return bytes;
+}
+
+
+// Writes dir/file into path, EXIT_FAILURE if it does not fit in PATH_MAX
+static int join_path(char *path, const char *dir, const char *file) {
+    const size_t dir_length = strlen(dir), file_length = strlen(file);
+    if (dir_length + 1 + file_length >= PATH_MAX) return EXIT_FAILURE;
+    memcpy(path, dir, dir_length);
+    path[dir_length] = '/';
+    memcpy(path + dir_length + 1, file, file_length + 1);
+    return EXIT_SUCCESS;
+}
+
+
+// Smallest room left under the limits of a cgroup and of its ancestors, SIZE_MAX without limit.
+// The inactive page cache of a group is reclaimed before it hits its limit, so it counts as room.
+static size_t cgroup_headroom(const char *root, const char *group, const char *limit_file,
+    const char *usage_file, const char *inactive_key) {
+
+    char dir[PATH_MAX], path[PATH_MAX];
+    size_t headroom = SIZE_MAX;
+    if (snprintf(dir, sizeof(dir), "%s%s", root, group) >= (int)sizeof(dir)) return headroom;
+    size_t length = strlen(dir);
+    while (length > strlen(root) && dir[length - 1] == '/') dir[--length] = '\0';
+
+    for (;;) {
+        if (join_path(path, dir, limit_file) == EXIT_SUCCESS) {
+            const size_t limit = read_bytes(path);
+            if (limit > 0) {
+                size_t usage = join_path(path, dir, usage_file) == EXIT_SUCCESS ? read_bytes(path) : 0;
+                const size_t inactive = join_path(path, dir, "memory.stat") == EXIT_SUCCESS ? 
+                    read_key(path, inactive_key, 1) : 0;
+                usage = usage > inactive ? usage - inactive : 0;
+                const size_t room = limit > usage ? limit - usage : 0;
+                if (room < headroom) headroom = room;
+            }
+        }
+
+        // Up to the parent group, the mount point being the last one
+        char *slash = strrchr(dir, '/');
+        if (strlen(dir) <= strlen(root) || !slash) break;
+        *slash = '\0';
+    }
+
+    return headroom;
+}
+
+
+// Room left under the memory limits of the cgroup of the process, SIZE_MAX outside of a container.
+// /proc/self/cgroup lists the group of cgroup v2 as "0::<path>" and that of the memory controller
+// of cgroup v1 as "<id>:memory:<path>".
+static size_t container_headroom(void) {
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (!file) return SIZE_MAX;
+    char line[PATH_MAX], unified[PATH_MAX] = "", memory[PATH_MAX] = "";
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        const char *controllers = strchr(line, ':');
+        if (!controllers) continue;
+        if (strncmp(line, "0::", 3) == 0) snprintf(unified, sizeof(unified), "%s", line + 3);
+        else if (strncmp(controllers + 1, "memory:", 7) == 0) snprintf(memory, sizeof(memory), "%s", controllers + 8);
+    }
+    fclose(file);
+
+    size_t headroom = SIZE_MAX;
+    if (unified[0]) headroom = cgroup_headroom(CGROUP_ROOT, unified, "memory.max", "memory.current", "inactive_file");
+    if (headroom == SIZE_MAX && memory[0]) {
+        headroom = cgroup_headroom(CGROUP_ROOT "/memory", memory, "memory.limit_in_bytes",
+            "memory.usage_in_bytes", "total_inactive_file");
+    }
+    return headroom;
+}
+
+
+size_t a2a_AvailableMemoryBytes(void) {
+    size_t available_memory = read_key("/proc/meminfo", "MemAvailable", 1024);  // Listed in kB
+    if (available_memory == 0) {
+        struct sysinfo info;
+        if (sysinfo(&info) == 0) {
+            available_memory = info.freeram * info.mem_unit;  // Multiply by unit size
+        }
+    }
+    const size_t headroom = container_headroom();
+    return headroom < available_memory ? headroom : available_memory;
+}
+
+
+// Bytes of the budget left, with the lock held
+static size_t unused_bytes(void) {
+    const size_t used = governor.reserved + governor.charged;
+    return governor.budget > used ? governor.budget - used : 0;
+}
+
+
+int a2a_MemoryOpen(const double max_memory_usage_ratio) {
+    pthread_mutex_lock(&governor.lock);
+    if (governor.searches > 0 && governor.ratio != max_memory_usage_ratio) {
+        const double ratio = governor.ratio;
+        pthread_mutex_unlock(&governor.lock);
+        fprintf(stderr, "Error: max_memory_usage_ratio %g differs from the ratio %g of the searches "
+            "in progress, which share its budget\n", max_memory_usage_ratio, ratio);
+        return EXIT_FAILURE;
+    }
+    if (governor.searches++ == 0) {
+        governor.ratio = max_memory_usage_ratio;
+        governor.capacity = a2a_AvailableMemoryBytes();
+        governor.budget = (size_t)(governor.capacity * max_memory_usage_ratio);
+        governor.reserved = 0;
+        governor.charged = 0;
+        governor.holders = 0;
+        governor.waiting_holders = 0;
+    }
+    pthread_mutex_unlock(&governor.lock);
+    return EXIT_SUCCESS;
+}
+
+
+void a2a_MemoryClose(void) {
+    pthread_mutex_lock(&governor.lock);
+    if (governor.searches > 0) governor.searches--;
+    pthread_mutex_unlock(&governor.lock);
+}
+
+
+size_t a2a_MemoryCapacityBytes(void) {
+    pthread_mutex_lock(&governor.lock);
+    const size_t capacity = governor.searches > 0 ? governor.capacity : 0;
+    pthread_mutex_unlock(&governor.lock);
+    return capacity > 0 ? capacity : a2a_AvailableMemoryBytes();
+}
+
+
+size_t a2a_MemoryBudgetBytes(void) {
+    pthread_mutex_lock(&governor.lock);
+    const size_t budget = governor.searches > 0 ? governor.budget : 0;
+    pthread_mutex_unlock(&governor.lock);
+    return budget;
+}
+
+
+int a2a_MemoryReserve(const size_t min_bytes, const size_t max_bytes, size_t *granted) {
+    const size_t wanted = max_bytes > min_bytes ? max_bytes : min_bytes;
+
+    pthread_mutex_lock(&governor.lock);
+    if (governor.searches == 0) {
+        pthread_mutex_unlock(&governor.lock);
+        *granted = wanted;
+        return EXIT_SUCCESS;
+    }
+
+    // Wait for the working buffers of the other threads as long as one of them that holds some
+    // is not waiting itself, and so will eventually release them. The last one fails instead.
+    const int holder = thread_held > 0;
+    while (unused_bytes() < min_bytes && governor.holders - governor.waiting_holders - holder > 0) {
+        governor.waiting_holders += holder;
+        pthread_cond_wait(&governor.released, &governor.lock);
+        governor.waiting_holders -= holder;
+    }
+
+    const size_t unused = unused_bytes();
+    if (unused < min_bytes) {
+        pthread_mutex_unlock(&governor.lock);
+        *granted = 0;
+        return EXIT_FAILURE;
+    }
+    *granted = unused < wanted ? unused : wanted;
+    governor.reserved += *granted;
+    if (thread_held == 0 && *granted > 0) governor.holders++;
+    thread_held += *granted;
+    pthread_mutex_unlock(&governor.lock);
+
+    return EXIT_SUCCESS;
+}
+
+
+void a2a_MemoryRelease(const size_t bytes) {
+    if (bytes == 0) return;
+    pthread_mutex_lock(&governor.lock);
+    if (governor.searches > 0) {
+        governor.reserved -= bytes < governor.reserved ? bytes : governor.reserved;
+        if (thread_held > 0 && bytes >= thread_held && governor.holders > 0) governor.holders--;
+        pthread_cond_broadcast(&governor.released);
+    }
+    thread_held -= bytes < thread_held ? bytes : thread_held;
+    pthread_mutex_unlock(&governor.lock);
+}
+
+
+int a2a_MemoryCharge(const size_t bytes) {
+    int status = EXIT_SUCCESS;
+    pthread_mutex_lock(&governor.lock);
+    if (governor.searches > 0) {
+        if (bytes > unused_bytes()) status = EXIT_FAILURE;
+        else governor.charged += bytes;
+    }
+    pthread_mutex_unlock(&governor.lock);
+    return status;
+}
+
+
+void a2a_MemoryUncharge(const size_t bytes) {
+    if (bytes == 0) return;
+    pthread_mutex_lock(&governor.lock);
+    if (governor.searches > 0) {
+        governor.charged -= bytes < governor.charged ? bytes : governor.charged;
+        pthread_cond_broadcast(&governor.released);
+    }
+    pthread_mutex_unlock(&governor.lock);
+}
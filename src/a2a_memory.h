@@ -0,0 +1,98 @@
+#ifndef A2A_MEMORY_H
+#define A2A_MEMORY_H
+
+#include <stddef.h>
+
+// Memory budget shared by the threads of the searches of the process. The first search to
+// start sets the budget to its max_memory_usage_ratio times the memory available at that
+// moment, and the searches that start while it runs must pass the same ratio. Every buffer
+// sized from the budget reserves its bytes before it is allocated, so that concurrent workers
+// never overshoot it together. Not part of the public API.
+//
+// Working buffers (a2a_MemoryReserve) shrink to what is left of the budget, down to a minimum,
+// and their thread may wait for the working buffers of the other threads to be released. Their
+// threads must therefore never wait for a thread that may be waiting for the budget while
+// holding them, nor release them from another thread. Long-lived buffers
+// (a2a_MemoryCharge) never wait and belong to no thread, so they may be held across a parallel
+// region and returned by another thread. Neither is ever granted beyond the budget.
+
+
+/**
+ * Returns the memory available to the process, in bytes, or 0 if it cannot be read: the
+ * MemAvailable estimate of the kernel (the free memory if it is missing), capped by the room
+ * left under the memory limits of the cgroup of the process and of its ancestors (memory.max
+ * of cgroup v2, or memory.limit_in_bytes of cgroup v1), without their reclaimable page cache.
+ */
+size_t a2a_AvailableMemoryBytes(void);
+
+
+/**
+ * Enters a search. The first search to enter sets the budget, the others share it.
+ *
+ * @param max_memory_usage_ratio the fraction of the available memory the searches may use
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the searches in progress use another ratio, in which
+ *         case the search is not entered
+ */
+int a2a_MemoryOpen(const double max_memory_usage_ratio);
+
+
+/**
+ * Leaves a search, the budget is dropped when the last search leaves.
+ */
+void a2a_MemoryClose(void);
+
+
+/**
+ * Returns the memory available when the budget was set, or the memory available now
+ * outside of a search. Fractions of it bound the buffers of each worker.
+ */
+size_t a2a_MemoryCapacityBytes(void);
+
+
+/**
+ * Returns the budget of the searches in progress, or 0 outside of a search.
+ */
+size_t a2a_MemoryBudgetBytes(void);
+
+
+/**
+ * Reserves bytes for working buffers: as many as the budget has left, up to max_bytes. If
+ * less than min_bytes are left, the thread waits for the other threads to release theirs,
+ * unless all the other threads holding working buffers wait as well, in which case the
+ * reservation fails. Outside of a search, max_bytes are granted.
+ *
+ * @param min_bytes the bytes without which the caller cannot proceed
+ * @param max_bytes the bytes the caller would use
+ * @param granted the bytes granted, between min_bytes and max_bytes, to release with
+ *                a2a_MemoryRelease (0 on failure)
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if min_bytes do not fit in the budget
+ */
+int a2a_MemoryReserve(const size_t min_bytes, const size_t max_bytes, size_t *granted);
+
+
+/**
+ * Returns bytes of a2a_MemoryReserve to the budget and wakes the threads waiting for them.
+ *
+ * @param bytes the bytes to return
+ */
+void a2a_MemoryRelease(const size_t bytes);
+
+
+/**
+ * Counts long-lived buffers in the budget, which leaves less to the working buffers.
+ *
+ * @param bytes the size of the buffers
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if they do not fit in the budget
+ */
+int a2a_MemoryCharge(const size_t bytes);
+
+
+/**
+ * Returns bytes of a2a_MemoryCharge to the budget.
+ *
+ * @param bytes the bytes to return
+ */
+void a2a_MemoryUncharge(const size_t bytes);
+
+
+#endif
@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "a2a_nndescent.h"
+#include "a2a_parallel.h"
+#include "a2a_distance.h"
+#include "a2a_alloc.h"
+
+
+#define NODES_PER_CHUNK 256               // Nodes taken by a worker at a time
+
+
+// Entry of the neighbor list of a node
+typedef struct {
+    int id;                              // Index of the neighbor, -1 for an empty slot
+    int is_new;                          // The neighbor has not taken part in a local join yet
+    DTYPE dist;                          // Squared distance to the neighbor
+} Neighbor;
+
+
+typedef struct {
+    const DTYPE* C;                      // Data matrix
+    int N;                               // Number of points
+    int L;                               // Dimension of the points
+    int K;                               // Number of neighbors per point
+    int S;                               // Number of new neighbors sampled per point and iteration
+    int R;                               // Number of random candidates joined per point and iteration
+    Neighbor* lists;                     // Neighbor lists, a max-heap by distance of K entries per point
+    atomic_flag* locks;                  // Lock of the neighbor list and reverse samples of each point
+    int* new_fwd;                        // Sampled new neighbors of each point (S per point)
+    int* old_fwd;                        // Old neighbors of each point (K per point)
+    int* new_fwd_count;
+    int* old_fwd_count;
+    int* new_rev;                        // Sampled new reverse neighbors of each point (S per point)
+    int* old_rev;                        // Sampled old reverse neighbors of each point (S per point)
+    int* new_rev_seen;                   // Reverse neighbors offered to the samples of each point
+    int* old_rev_seen;
+} NNGraph;
+
+
+enum { PHASE_RANDOM_INIT, PHASE_SAMPLE, PHASE_REVERSE, PHASE_JOIN, PHASE_SORT };
+
+
+typedef struct {
+    NNGraph* graph;
+    int phase;                           // Phase run by the worker
+    atomic_int* next;                    // First node of the next chunk
+    unsigned int seed;                   // State of the random generator of the worker
+    long long updates;                   // Neighbor lists improved by the worker in the last join
+    int* scratch;                        // Candidates of the local join (3 * S + R + K entries)
+    int* IDX;                            // Output indices of the sort phase
+    DTYPE* D;                            // Output distances of the sort phase
+} nnDescentTask;
+
+
+static void lock_node(NNGraph* graph, const int v) {
+    while (atomic_flag_test_and_set_explicit(&graph->locks[v], memory_order_acquire)) sched_yield();
+}
+
+
+static void unlock_node(NNGraph* graph, const int v) {
+    atomic_flag_clear_explicit(&graph->locks[v], memory_order_release);
+}
+
+
+// Restores the heap order of a list after its root was replaced
+static void sift_down(Neighbor* list, const int size, int i) {
+    const Neighbor entry = list[i];
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= size) break;
+        if (child + 1 < size && list[child + 1].dist > list[child].dist) child++;
+        if (list[child].dist <= entry.dist) break;
+        list[i] = list[child];
+        i = child;
+    }
+    list[i] = entry;
+}
+
+
+// Builds a max-heap from an unordered list
+static void heapify(Neighbor* list, const int size) {
+    for (int i = size / 2 - 1; i >= 0; --i) sift_down(list, size, i);
+}
+
+
+// Inserts u in the list of v if it is closer than the farthest neighbor and not already there.
+// Returns 1 if the list changed.
+static int try_insert(NNGraph* graph, const int v, const int u, const DTYPE dist) {
+    Neighbor* list = graph->lists + (size_t)v * graph->K;
+    int inserted = 0;
+
+    lock_node(graph, v);
+    if (dist < list[0].dist) {
+        int present = 0;
+        for (int k = 0; k < graph->K; ++k) {
+            if (list[k].id == u) {
+                present = 1;
+                break;
+            }
+        }
+        if (!present) {
+            list[0].id = u;
+            list[0].dist = dist;
+            list[0].is_new = 1;
+            sift_down(list, graph->K, 0);
+            inserted = 1;
+        }
+    }
+    unlock_node(graph, v);
+
+    return inserted;
+}
+
+
+// Offers u to a reservoir sample of S reverse neighbors
+static void offer_reverse(NNGraph* graph, int* sample, int* seen, const int v, const int u,
+    unsigned int* seed) {
+
+    const int S = graph->S;
+    lock_node(graph, v);
+    const int pos = seen[v] < S ? seen[v] : (int)(rand_r(seed) % (unsigned int)(seen[v] + 1));
+    if (pos < S) sample[(size_t)v * S + pos] = u;
+    seen[v]++;
+    unlock_node(graph, v);
+}
+
+
+static void random_init_node(NNGraph* graph, const int v, unsigned int* seed) {
+    Neighbor* list = graph->lists + (size_t)v * graph->K;
+    const int K = graph->K;
+
+    for (int k = 0; k < K; ++k) {
+        int u, duplicate;
+        do {
+            u = (int)(rand_r(seed) % (unsigned int)graph->N);
+            duplicate = u == v;
+            for (int j = 0; j < k && !duplicate; ++j) duplicate = list[j].id == u;
+        } while (duplicate);
+        list[k].id = u;
+        list[k].is_new = 1;
+        list[k].dist = a2a_squared_distance(graph->C + (size_t)v * graph->L, graph->C + (size_t)u * graph->L, graph->L);
+    }
+    heapify(list, K);
+}
+
+
+// Splits the neighbors of v into old ones and a sample of at most S new ones. Sampled
+// neighbors are marked old, so each pair is joined once.
+static void sample_node(NNGraph* graph, const int v, unsigned int* seed, int* slots) {
+    Neighbor* list = graph->lists + (size_t)v * graph->K;
+    const int K = graph->K;
+    const int S = graph->S;
+    int* new_fwd = graph->new_fwd + (size_t)v * S;
+    int* old_fwd = graph->old_fwd + (size_t)v * K;
+    int num_new = 0, num_old = 0, seen = 0;
+
+    // slots receives the position in the list of each sampled new neighbor
+    for (int k = 0; k < K; ++k) {
+        if (list[k].id < 0) continue;
+        if (!list[k].is_new) {
+            old_fwd[num_old++] = list[k].id;
+            continue;
+        }
+        const int pos = seen < S ? seen : (int)(rand_r(seed) % (unsigned int)(seen + 1));
+        if (pos < S) {
+            new_fwd[pos] = list[k].id;
+            slots[pos] = k;
+        }
+        seen++;
+    }
+    num_new = seen < S ? seen : S;
+    for (int s = 0; s < num_new; ++s) list[slots[s]].is_new = 0;
+
+    graph->new_fwd_count[v] = num_new;
+    graph->old_fwd_count[v] = num_old;
+    graph->new_rev_seen[v] = 0;
+    graph->old_rev_seen[v] = 0;
+}
+
+
+static void reverse_node(NNGraph* graph, const int v, unsigned int* seed) {
+    for (int s = 0; s < graph->new_fwd_count[v]; ++s) {
+        offer_reverse(graph, graph->new_rev, graph->new_rev_seen, graph->new_fwd[(size_t)v * graph->S + s], v, seed);
+    }
+    for (int s = 0; s < graph->old_fwd_count[v]; ++s) {
+        offer_reverse(graph, graph->old_rev, graph->old_rev_seen, graph->old_fwd[(size_t)v * graph->K + s], v, seed);
+    }
+}
+
+
+// Compares the new candidates of v with each other and with the old ones
+static long long join_node(NNGraph* graph, const int v, int* scratch, unsigned int* seed) {
+    const int S = graph->S;
+    const int K = graph->K;
+    const int L = graph->L;
+    int* cand_new = scratch;
+    int* cand_old = scratch + 2 * S + graph->R;
+    int num_new = 0, num_old = 0;
+
+    for (int s = 0; s < graph->new_fwd_count[v]; ++s) cand_new[num_new++] = graph->new_fwd[(size_t)v * S + s];
+    const int new_rev = graph->new_rev_seen[v] < S ? graph->new_rev_seen[v] : S;
+    for (int s = 0; s < new_rev; ++s) cand_new[num_new++] = graph->new_rev[(size_t)v * S + s];
+    for (int r = 0; r < graph->R; ++r) cand_new[num_new++] = (int)(rand_r(seed) % (unsigned int)graph->N);
+    for (int s = 0; s < graph->old_fwd_count[v]; ++s) cand_old[num_old++] = graph->old_fwd[(size_t)v * K + s];
+    const int old_rev = graph->old_rev_seen[v] < S ? graph->old_rev_seen[v] : S;
+    for (int s = 0; s < old_rev; ++s) cand_old[num_old++] = graph->old_rev[(size_t)v * S + s];
+
+    long long updates = 0;
+    for (int i = 0; i < num_new; ++i) {
+        const int a = cand_new[i];
+        const DTYPE* xa = graph->C + (size_t)a * L;
+        for (int j = i + 1; j < num_new; ++j) {
+            const int b = cand_new[j];
+            if (a == b) continue;
+            const DTYPE dist = a2a_squared_distance(xa, graph->C + (size_t)b * L, L);
+            updates += try_insert(graph, a, b, dist);
+            updates += try_insert(graph, b, a, dist);
+        }
+        for (int j = 0; j < num_old; ++j) {
+            const int b = cand_old[j];
+            if (a == b) continue;
+            const DTYPE dist = a2a_squared_distance(xa, graph->C + (size_t)b * L, L);
+            updates += try_insert(graph, a, b, dist);
+            updates += try_insert(graph, b, a, dist);
+        }
+    }
+
+    return updates;
+}
+
+
+// Writes the list of v sorted by distance
+static void sort_node(NNGraph* graph, const int v, int* IDX, DTYPE* D) {
+    const int K = graph->K;
+    Neighbor* list = graph->lists + (size_t)v * K;
+
+    // Heap sort: move the farthest neighbor to the end of the list
+    for (int size = K; size > 1; --size) {
+        const Neighbor last = list[size - 1];
+        list[size - 1] = list[0];
+        list[0] = last;
+        sift_down(list, size - 1, 0);
+    }
+    for (int k = 0; k < K; ++k) {
+        IDX[(size_t)v * K + k] = list[k].id;
+        D[(size_t)v * K + k] = list[k].id < 0 ? INF : SQRT(list[k].dist);
+    }
+}
+
+
+static int nnDescentTaskExec(void* arg) {
+    nnDescentTask* task = (nnDescentTask *)arg;
+    NNGraph* graph = task->graph;
+    task->updates = 0;
+
+    int first;
+    while ((first = atomic_fetch_add(task->next, NODES_PER_CHUNK)) < graph->N) {
+        const int last = first + NODES_PER_CHUNK < graph->N ? first + NODES_PER_CHUNK : graph->N;
+        for (int v = first; v < last; ++v) {
+            switch (task->phase) {
+                case PHASE_RANDOM_INIT: random_init_node(graph, v, &task->seed); break;
+                case PHASE_SAMPLE: sample_node(graph, v, &task->seed, task->scratch); break;
+                case PHASE_REVERSE: reverse_node(graph, v, &task->seed); break;
+                case PHASE_JOIN: task->updates += join_node(graph, v, task->scratch, &task->seed); break;
+                case PHASE_SORT: sort_node(graph, v, task->IDX, task->D); break;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int run_phase(nnDescentTask* tasks, const int nthreads, const int phase,
+    parallelization_type_t par_type) {
+
+    atomic_int next = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        tasks[i].phase = phase;
+        tasks[i].next = &next;
+    }
+    return a2a_ParallelRun(nnDescentTaskExec, tasks, sizeof(nnDescentTask), nthreads, par_type);
+}
+
+
+static int check_input_args_nndescent(const DTYPE* C, const int N, const int L, const int K,
+    int* IDX, DTYPE* D, const int nthreads, const a2a_nndescent_options_t* opts) {
+
+    if (!C || N <= 0 || L <= 0 || K <= 0 || !IDX || !D) {
+        fprintf(stderr, "Invalid input parameters for NN-descent\n");
+        return EXIT_FAILURE;
+    }
+    if (K >= N) {
+        fprintf(stderr, "Number of neighbors must be smaller than the number of data points\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (opts->max_iterations < 0 || opts->sample_rate <= 0.0 || opts->sample_rate > 1.0 ||
+        opts->delta < 0.0 || (opts->random_candidates < 0 && opts->random_candidates != A2A_NNDESCENT_AUTO)) {
+        fprintf(stderr, "Invalid NN-descent options\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static int nndescent_run(const DTYPE* C, const int N, const int L, const int K, int* IDX, DTYPE* D,
+    const int nthreads, parallelization_type_t par_type, const a2a_nndescent_options_t* opts,
+    const int random_init) {
+
+    a2a_nndescent_options_t options;
+    if (opts) options = *opts;
+    else a2a_nndescent_options_init(&options);
+
+    if (check_input_args_nndescent(C, N, L, K, IDX, D, nthreads, &options)) return EXIT_FAILURE;
+
+    int S = (int)(options.sample_rate * K + 0.5);
+    if (S < 1) S = 1;
+
+    int R = options.random_candidates;
+    if (R == A2A_NNDESCENT_AUTO) R = random_init ? 0 : S;
+    NNGraph graph = { .C = C, .N = N, .L = L, .K = K, .S = S, .R = R };
+    nnDescentTask* tasks = NULL;
+    int* scratch = NULL;
+    int status = EXIT_FAILURE;
+
+    graph.lists = (Neighbor *)a2a_Malloc((size_t)N * K * sizeof(Neighbor));
+    graph.locks = (atomic_flag *)a2a_Malloc(N * sizeof(atomic_flag));
+    graph.new_fwd = (int *)a2a_Malloc((size_t)N * S * sizeof(int));
+    graph.old_fwd = (int *)a2a_Malloc((size_t)N * K * sizeof(int));
+    graph.new_fwd_count = (int *)a2a_Malloc(N * sizeof(int));
+    graph.old_fwd_count = (int *)a2a_Malloc(N * sizeof(int));
+    graph.new_rev = (int *)a2a_Malloc((size_t)N * S * sizeof(int));
+    graph.old_rev = (int *)a2a_Malloc((size_t)N * S * sizeof(int));
+    graph.new_rev_seen = (int *)a2a_Malloc(N * sizeof(int));
+    graph.old_rev_seen = (int *)a2a_Malloc(N * sizeof(int));
+    tasks = (nnDescentTask *)a2a_Malloc(nthreads * sizeof(nnDescentTask));
+    scratch = (int *)a2a_Malloc((size_t)nthreads * (3 * S + R + K) * sizeof(int));
+
+    if (!graph.lists || !graph.locks || !graph.new_fwd || !graph.old_fwd || !graph.new_fwd_count ||
+        !graph.old_fwd_count || !graph.new_rev || !graph.old_rev || !graph.new_rev_seen ||
+        !graph.old_rev_seen || !tasks || !scratch) {
+        fprintf(stderr, "Error allocating memory for NN-descent\n");
+        goto cleanup;
+    }
+
+    for (int v = 0; v < N; ++v) atomic_flag_clear(&graph.locks[v]);
+    for (int i = 0; i < nthreads; ++i) {
+        tasks[i].graph = &graph;
+        tasks[i].seed = options.seed + 7919u * (unsigned int)i;
+        tasks[i].scratch = scratch + (size_t)i * (3 * S + R + K);
+        tasks[i].IDX = IDX;
+        tasks[i].D = D;
+    }
+
+    if (random_init) {
+        if (run_phase(tasks, nthreads, PHASE_RANDOM_INIT, par_type)) goto cleanup;
+    }
+    else {
+        // Start from the given graph, invalid entries become empty slots. The given neighbors
+        // are taken as already joined with each other, as in the output of a2a_annsearch where
+        // every cluster is solved exactly, so the first joins pair them with the random candidates.
+        for (int v = 0; v < N; ++v) {
+            Neighbor* list = graph.lists + (size_t)v * K;
+            for (int k = 0; k < K; ++k) {
+                const int u = IDX[(size_t)v * K + k];
+                const int valid = u >= 0 && u < N && u != v;
+                list[k].id = valid ? u : -1;
+                list[k].is_new = 0;
+                list[k].dist = valid ? D[(size_t)v * K + k] * D[(size_t)v * K + k] : INF;
+            }
+            heapify(list, K);
+        }
+    }
+
+    const long long threshold = (long long)(options.delta * N * K);
+    for (int iter = 0; iter < options.max_iterations; ++iter) {
+        if (run_phase(tasks, nthreads, PHASE_SAMPLE, par_type)) goto cleanup;
+        if (run_phase(tasks, nthreads, PHASE_REVERSE, par_type)) goto cleanup;
+        if (run_phase(tasks, nthreads, PHASE_JOIN, par_type)) goto cleanup;
+
+        long long updates = 0;
+        for (int i = 0; i < nthreads; ++i) updates += tasks[i].updates;
+        DEBUG_PRINT("NN-descent: Iteration %d updated %lld entries\n", iter, updates);
+        if (updates <= threshold) break;
+    }
+
+    if (run_phase(tasks, nthreads, PHASE_SORT, par_type)) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(graph.lists);
+    a2a_Free(graph.locks);
+    a2a_Free(graph.new_fwd);
+    a2a_Free(graph.old_fwd);
+    a2a_Free(graph.new_fwd_count);
+    a2a_Free(graph.old_fwd_count);
+    a2a_Free(graph.new_rev);
+    a2a_Free(graph.old_rev);
+    a2a_Free(graph.new_rev_seen);
+    a2a_Free(graph.old_rev_seen);
+    a2a_Free(tasks);
+    a2a_Free(scratch);
+
+    return status;
+}
+
+
+void a2a_nndescent_options_init(a2a_nndescent_options_t *opts) {
+    opts->max_iterations = 10;
+    opts->sample_rate = 0.5;
+    opts->delta = 0.001;
+    opts->random_candidates = A2A_NNDESCENT_AUTO;
+    opts->seed = 0;
+}
+
+
+int a2a_nndescent_refine(const DTYPE* C, const int N, const int L, const int K, int* IDX,
+    DTYPE* D, const int nthreads, parallelization_type_t par_type,
+    const a2a_nndescent_options_t *opts) {
+
+    return nndescent_run(C, N, L, K, IDX, D, nthreads, par_type, opts, 0);
+}
+
+
+int a2a_nndescent(const DTYPE* C, const int N, const int L, const int K, int* IDX, DTYPE* D,
+    const int nthreads, parallelization_type_t par_type, const a2a_nndescent_options_t *opts) {
+
+    return nndescent_run(C, N, L, K, IDX, D, nthreads, par_type, opts, 1);
+}
@@ -0,0 +1,196 @@
+#include "a2a_parallel.h"
+#include "a2a_collector.h"
+#include "a2a_alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+// Argument of a pthread running a worker
+typedef struct {
+    a2a_WorkerFunc func;
+    void *arg;
+    int worker;
+    int status;
+    a2a_StatsCollector *collector;
+    long long *busy_ns;
+} WorkerThread;
+
+
+// Runs a worker with the collector of the caller of the parallel region, measures its busy 
+// time and traces it
+static int run_worker(a2a_WorkerFunc func, void *arg, const int worker, a2a_StatsCollector *collector, 
+    long long *busy_ns) {
+
+    const long long trace_start = a2a_TraceBegin();
+    if (!collector) {
+        const int status = func(arg);
+        a2a_TraceEnd("worker", trace_start, worker, 0);
+        return status;
+    }
+
+    a2a_StatsCollector *previous = a2a_collector;
+    a2a_collector = collector;
+    const long long start = a2a_ClockNs(CLOCK_MONOTONIC);
+    const int status = func(arg);
+    const long long end = a2a_ClockNs(CLOCK_MONOTONIC);
+    *busy_ns = end - start;
+    a2a_collector = previous;
+    if (trace_start) a2a_TraceRecord("worker", trace_start, end, worker, 0);
+
+    return status;
+}
+
+
+static void *workerThreadStart(void *arg) {
+    WorkerThread *worker = (WorkerThread *)arg;
+    worker->status = run_worker(worker->func, worker->arg, worker->worker, worker->collector, worker->busy_ns);
+    return NULL;
+}
+
+
+static int pthreads_parallelization(a2a_WorkerFunc func, char *args, size_t arg_size, int nworkers,
+    a2a_StatsCollector *collector, long long *busy_ns) {
+
+    int status = EXIT_FAILURE;
+    int created = 0;
+    pthread_t *threads = (pthread_t *)a2a_Malloc(sizeof(pthread_t) * nworkers);
+    WorkerThread *workers = (WorkerThread *)a2a_Malloc(sizeof(WorkerThread) * nworkers);
+    if (!threads || !workers) goto cleanup;
+
+    for (int i = 0; i < nworkers; ++i) {
+        workers[i].func = func;
+        workers[i].arg = args + i * arg_size;
+        workers[i].worker = i;
+        workers[i].status = EXIT_FAILURE;
+        workers[i].collector = collector;
+        workers[i].busy_ns = collector ? &busy_ns[i] : NULL;
+        if (pthread_create(&threads[i], NULL, workerThreadStart, (void *)&workers[i])) {
+            fprintf(stderr, "Error creating thread %d\n", i);
+            break;
+        }
+        created++;
+    }
+
+    // The join shows how long the caller waits for the slowest worker
+    const long long trace_start = a2a_TraceBegin();
+    status = created == nworkers ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (int i = 0; i < created; ++i) {
+        if (pthread_join(threads[i], NULL)) {
+            fprintf(stderr, "Error joining thread %d\n", i);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (workers[i].status != EXIT_SUCCESS) {
+            fprintf(stderr, "Thread %d failed with status %d\n", i, workers[i].status);
+            status = EXIT_FAILURE;
+        }
+    }
+    a2a_TraceEnd("join", trace_start, -1, 0);
+
+cleanup:
+    a2a_Free(threads);
+    a2a_Free(workers);
+    return status;
+}
+
+
+static int openmp_parallelization(a2a_WorkerFunc func, char *args, size_t arg_size, int nworkers,
+    a2a_StatsCollector *collector, long long *busy_ns) {
+    #ifndef USE_OPENCILK
+        int status = EXIT_SUCCESS;
+        const long long trace_start = a2a_TraceBegin();
+        #pragma omp parallel for num_threads(nworkers) schedule(dynamic, 1)
+        for (int i = 0; i < nworkers; i++) {
+            int worker_status = run_worker(func, args + i * arg_size, i, collector, collector ? &busy_ns[i] : NULL);
+            if (worker_status != EXIT_SUCCESS) {
+                #pragma omp critical
+                {
+                    fprintf(stderr, "Worker %d failed in OpenMP thread %d with status %d\n", i, omp_get_thread_num(), worker_status);
+                    status = EXIT_FAILURE;
+                }
+            }
+        }
+        a2a_TraceEnd("parallel_region", trace_start, -1, 0);
+
+        return status;
+    #else
+        (void)func; (void)args; (void)arg_size; (void)nworkers; (void)collector; (void)busy_ns;
+        fprintf(stderr, "OpenMP is not enabled in this build\n");
+        return EXIT_FAILURE;
+    #endif
+}
+
+
+static int opencilk_parallelization(a2a_WorkerFunc func, char *args, size_t arg_size, int nworkers,
+    a2a_StatsCollector *collector, long long *busy_ns) {
+    #ifdef USE_OPENCILK
+        atomic_int status = ATOMIC_VAR_INIT(EXIT_SUCCESS);
+        const long long trace_start = a2a_TraceBegin();
+
+        cilk_for (int i = 0; i < nworkers; ++i) {
+            int worker_status = run_worker(func, args + i * arg_size, i, collector, collector ? &busy_ns[i] : NULL);
+            if (worker_status != EXIT_SUCCESS) {
+                fprintf(stderr, "Worker %d failed in OpenCilk with status %d\n", i, worker_status);
+                atomic_store(&status, EXIT_FAILURE);
+            }
+        }
+        a2a_TraceEnd("parallel_region", trace_start, -1, 0);
+
+        return atomic_load(&status);
+    #else
+        (void)func; (void)args; (void)arg_size; (void)nworkers; (void)collector; (void)busy_ns;
+        fprintf(stderr, "OpenCilk is not enabled in this build\n");
+        return EXIT_FAILURE;
+    #endif
+}
+
+
+int a2a_ParallelRun(a2a_WorkerFunc func, void *args, size_t arg_size, int nworkers, 
+    parallelization_type_t par_type) {
+
+    if (!func || !args || nworkers < 1) {
+        fprintf(stderr, "Error: Invalid arguments for a2a_ParallelRun\n");
+        return EXIT_FAILURE;
+    }
+
+    // The workers record into the collector of the caller. A region whose busy times cannot 
+    // be allocated runs without stats.
+    a2a_StatsCollector *collector = a2a_collector;
+    long long *busy_ns = collector ? (long long *)a2a_Calloc(nworkers, sizeof(long long)) : NULL;
+    if (!busy_ns) collector = NULL;
+    const long long start = collector ? a2a_ClockNs(CLOCK_MONOTONIC) : 0;
+
+    // The workers call BLAS (a2a_knnsearch_ws) from every thread, each call must stay on its thread
+    const int blas_nthreads = openblas_get_num_threads();
+    if (nworkers > 1) openblas_set_num_threads(1);
+
+    int status;
+    switch (par_type) {
+        case PAR_PTHREADS:
+            status = pthreads_parallelization(func, (char *)args, arg_size, nworkers, collector, busy_ns);
+            break;
+        case PAR_OPENMP:
+            status = openmp_parallelization(func, (char *)args, arg_size, nworkers, collector, busy_ns);
+            break;
+        case PAR_OPENCILK:
+            status = opencilk_parallelization(func, (char *)args, arg_size, nworkers, collector, busy_ns);
+            break;
+        default:
+            fprintf(stderr, "Unknown parallelization type\n");
+            status = EXIT_FAILURE;
+    }
+
+    // A worker is idle from its end to the end of the slowest worker
+    if (collector) {
+        const long long region_ns = a2a_ClockNs(CLOCK_MONOTONIC) - start;
+        for (int i = 0; i < nworkers; ++i) {
+            a2a_StatsRecordThread(collector, i, busy_ns[i], region_ns - busy_ns[i]);
+        }
+    }
+    a2a_Free(busy_ns);
+    if (nworkers > 1) openblas_set_num_threads(blas_nthreads);
+
+    return status;
+}
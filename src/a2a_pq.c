@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "a2a_pq.h"
+#include "a2a_pq_scan.h"
+#include "a2a_parallel.h"
+#include "a2a_distance.h"
+#include "a2a_clustering.h"
+#include "a2a_alloc.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define A2A_PQ_X86
+    #include <tmmintrin.h>
+#endif
+
+
+#define PQ_TRAIN_POINTS_PER_CENTROID 64   // Sample size of the subspace k-means per centroid
+#define PQ_ENCODE_CHUNK 1024              // Vectors encoded by a worker at a time
+
+
+typedef struct {
+    const a2a_pq_t* pq;
+    const DTYPE* X;                      // Vectors to encode
+    int n;                               // Number of vectors
+    unsigned char* codes;                // Output codes
+    atomic_int* next;                    // First vector of the next chunk
+} pqEncodeTask;
+
+
+static void encode_vector(const a2a_pq_t* pq, const DTYPE* x, unsigned char* code) {
+    memset(code, 0, pq->code_size);
+    for (int s = 0; s < pq->m; ++s) {
+        const DTYPE* sub = x + (size_t)s * pq->dsub;
+        const DTYPE* centroids = pq->centroids + (size_t)s * pq->ksub * pq->dsub;
+        int best = 0;
+        DTYPE best_dist = INF;
+        for (int c = 0; c < pq->ksub; ++c) {
+            const DTYPE dist = a2a_squared_distance(sub, centroids + (size_t)c * pq->dsub, pq->dsub);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = c;
+            }
+        }
+        if (pq->nbits == 8) code[s] = (unsigned char)best;
+        else code[s / 2] |= (unsigned char)(best << (4 * (s % 2)));
+    }
+}
+
+
+static int pqEncodeTaskExec(void* arg) {
+    pqEncodeTask* task = (pqEncodeTask *)arg;
+    const a2a_pq_t* pq = task->pq;
+
+    int first;
+    while ((first = atomic_fetch_add(task->next, PQ_ENCODE_CHUNK)) < task->n) {
+        const int last = first + PQ_ENCODE_CHUNK < task->n ? first + PQ_ENCODE_CHUNK : task->n;
+        for (int i = first; i < last; ++i) {
+            encode_vector(pq, task->X + (size_t)i * pq->L, task->codes + (size_t)i * pq->code_size);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+// Runs the k-means of the ANN search on the sampled subvectors of one subspace and stores
+// the means of the clusters as the centroids of the subspace
+static int train_subspace(a2a_pq_t* pq, const DTYPE* sub, const int n, const int s,
+    const int nthreads, const double max_memory_usage_ratio, const parallelization_type_t par_type) {
+
+    const int dsub = pq->dsub;
+    DTYPE* centroids = pq->centroids + (size_t)s * pq->ksub * dsub;
+    int *assignments = NULL, *counts = NULL;
+
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    int k = pq->ksub < n ? pq->ksub : n;
+    if (a2a_cluster_points(sub, n, dsub, 1, &k, &opts, &assignments, &counts, nthreads,
+        max_memory_usage_ratio, par_type)) return EXIT_FAILURE;
+
+    memset(centroids, 0, sizeof(DTYPE) * pq->ksub * dsub);
+    for (int i = 0; i < n; ++i) {
+        DTYPE* centroid = centroids + (size_t)assignments[i] * dsub;
+        for (int l = 0; l < dsub; ++l) centroid[l] += sub[(size_t)i * dsub + l];
+    }
+    for (int c = 0; c < k; ++c) {
+        for (int l = 0; l < dsub; ++l) centroids[(size_t)c * dsub + l] /= counts[c];
+    }
+    // Merged clusters leave unused codes, which repeat the first centroid
+    for (int c = k; c < pq->ksub; ++c) {
+        memcpy(centroids + (size_t)c * dsub, centroids, sizeof(DTYPE) * dsub);
+    }
+    DEBUG_PRINT("PQ: Subspace %d has %d centroids\n", s, k);
+
+    a2a_Free(assignments);
+    a2a_Free(counts);
+
+    return EXIT_SUCCESS;
+}
+
+
+int a2a_pq_train(const DTYPE* C, const int N, const int L, const int m, const int nbits,
+    const int nthreads, const double max_memory_usage_ratio, parallelization_type_t par_type,
+    a2a_pq_t **pq) {
+
+    if (!C || N <= 0 || L <= 0 || m <= 0 || !pq) {
+        fprintf(stderr, "Invalid input parameters for product quantization\n");
+        return EXIT_FAILURE;
+    }
+    if (L % m != 0 || m > 256) {
+        fprintf(stderr, "Number of subspaces must divide the dimension and be at most 256: %d\n", m);
+        return EXIT_FAILURE;
+    }
+    if (nbits != 4 && nbits != 8) {
+        fprintf(stderr, "Product quantization codes must have 4 or 8 bits: %d\n", nbits);
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    *pq = NULL;
+    int status = EXIT_FAILURE;
+    DTYPE* sub = NULL;
+    a2a_pq_t* quantizer = (a2a_pq_t *)a2a_Calloc(1, sizeof(a2a_pq_t));
+    if (!quantizer) {
+        fprintf(stderr, "Error allocating memory for product quantization\n");
+        return EXIT_FAILURE;
+    }
+
+    quantizer->L = L;
+    quantizer->m = m;
+    quantizer->nbits = nbits;
+    quantizer->ksub = 1 << nbits;
+    quantizer->dsub = L / m;
+    quantizer->code_size = (m * nbits + 7) / 8;
+    quantizer->centroids = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * (size_t)m * quantizer->ksub * quantizer->dsub);
+
+    const int dsub = quantizer->dsub;
+    int n_train = PQ_TRAIN_POINTS_PER_CENTROID * quantizer->ksub;
+    if (n_train > N) n_train = N;
+    sub = (DTYPE *)a2a_MallocCharged(sizeof(DTYPE) * (size_t)n_train * dsub);
+    if (!quantizer->centroids || !sub) {
+        fprintf(stderr, "Error allocating memory for product quantization\n");
+        goto cleanup;
+    }
+
+    for (int s = 0; s < m; ++s) {
+        for (int i = 0; i < n_train; ++i) {
+            const size_t row = (size_t)((long long)i * N / n_train);
+            memcpy(sub + (size_t)i * dsub, C + row * L + (size_t)s * dsub, sizeof(DTYPE) * dsub);
+        }
+        if (train_subspace(quantizer, sub, n_train, s, nthreads, max_memory_usage_ratio, par_type)) {
+            goto cleanup;
+        }
+    }
+
+    *pq = quantizer;
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(sub);
+    if (status != EXIT_SUCCESS) a2a_pq_free(quantizer);
+
+    return status;
+}
+
+
+int a2a_pq_encode(const a2a_pq_t *pq, const DTYPE* X, const int n, unsigned char* codes,
+    const int nthreads, parallelization_type_t par_type) {
+
+    if (!pq || !X || n < 0 || !codes) {
+        fprintf(stderr, "Invalid input parameters for product quantization\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    const int nchunks = (n + PQ_ENCODE_CHUNK - 1) / PQ_ENCODE_CHUNK;
+    const int nworkers = nthreads < nchunks ? nthreads : nchunks;
+    if (nworkers == 0) return EXIT_SUCCESS;
+
+    pqEncodeTask* tasks = (pqEncodeTask *)a2a_Malloc(sizeof(pqEncodeTask) * nworkers);
+    if (!tasks) {
+        fprintf(stderr, "Error allocating memory for product quantization\n");
+        return EXIT_FAILURE;
+    }
+
+    atomic_int next = 0;
+    for (int i = 0; i < nworkers; ++i) {
+        tasks[i].pq = pq;
+        tasks[i].X = X;
+        tasks[i].n = n;
+        tasks[i].codes = codes;
+        tasks[i].next = &next;
+    }
+
+    const int status = a2a_ParallelRun(pqEncodeTaskExec, tasks, sizeof(pqEncodeTask), nworkers, par_type);
+    a2a_Free(tasks);
+
+    return status;
+}
+
+
+void a2a_pq_free(a2a_pq_t *pq) {
+    if (!pq) return;
+    a2a_Free(pq->centroids);
+    a2a_Free(pq);
+}
+
+
+void a2a_pq_compute_lut(const a2a_pq_t* pq, const DTYPE* q, DTYPE* lut) {
+    const int dsub = pq->dsub;
+    for (int s = 0; s < pq->m; ++s) {
+        const DTYPE* sub = q + (size_t)s * dsub;
+        const DTYPE* centroids = pq->centroids + (size_t)s * pq->ksub * dsub;
+        for (int c = 0; c < pq->ksub; ++c) {
+            lut[s * pq->ksub + c] = a2a_squared_distance(sub, centroids + (size_t)c * dsub, dsub);
+        }
+    }
+}
+
+
+DTYPE a2a_pq_adc_distance(const a2a_pq_t* pq, const DTYPE* lut, const unsigned char* code) {
+    DTYPE dist = SUFFIX(0.0);
+    if (pq->nbits == 8) {
+        for (int s = 0; s < pq->m; ++s) dist += lut[s * 256 + code[s]];
+    }
+    else {
+        for (int s = 0; s < pq->m; ++s) {
+            const int c = s % 2 ? code[s / 2] >> 4 : code[s / 2] & 15;
+            dist += lut[s * 16 + c];
+        }
+    }
+    return dist;
+}
+
+
+void a2a_pq_adc_scan(const a2a_pq_t* pq, const DTYPE* lut, const unsigned char* codes, const int n,
+    DTYPE* dist) {
+
+    for (int i = 0; i < n; ++i) {
+        dist[i] = a2a_pq_adc_distance(pq, lut, codes + (size_t)i * pq->code_size);
+    }
+}
+
+
+size_t a2a_pq_blocks_size(const a2a_pq_t* pq, const int n) {
+    return (size_t)((n + A2A_PQ_BLOCK - 1) / A2A_PQ_BLOCK) * A2A_PQ_BLOCK * pq->code_size;
+}
+
+
+void a2a_pq_pack_blocks(const a2a_pq_t* pq, const unsigned char* codes, const int n,
+    unsigned char* blocks) {
+
+    const int code_size = pq->code_size;
+    memset(blocks, 0, a2a_pq_blocks_size(pq, n));
+    for (int i = 0; i < n; ++i) {
+        unsigned char* block = blocks + (size_t)(i / A2A_PQ_BLOCK) * A2A_PQ_BLOCK * code_size;
+        for (int j = 0; j < code_size; ++j) {
+            block[j * A2A_PQ_BLOCK + i % A2A_PQ_BLOCK] = codes[(size_t)i * code_size + j];
+        }
+    }
+}
+
+
+void a2a_pq_quantize_lut(const a2a_pq_t* pq, const DTYPE* lut, uint8_t* qlut, DTYPE* scale,
+    DTYPE* bias) {
+
+    // A common scale keeps the scores of the subspaces comparable, a bias per subspace
+    // spends the 8 bits on the spread of the table instead of its offset
+    DTYPE range = SUFFIX(0.0);
+    *bias = SUFFIX(0.0);
+    for (int s = 0; s < pq->m; ++s) {
+        DTYPE lo = lut[s * 16], hi = lut[s * 16];
+        for (int c = 1; c < 16; ++c) {
+            if (lut[s * 16 + c] < lo) lo = lut[s * 16 + c];
+            if (lut[s * 16 + c] > hi) hi = lut[s * 16 + c];
+        }
+        if (hi - lo > range) range = hi - lo;
+        *bias += lo;
+    }
+    *scale = range > SUFFIX(0.0) ? range / SUFFIX(255.0) : SUFFIX(1.0);
+
+    for (int s = 0; s < pq->m; ++s) {
+        DTYPE lo = lut[s * 16];
+        for (int c = 1; c < 16; ++c) if (lut[s * 16 + c] < lo) lo = lut[s * 16 + c];
+        for (int c = 0; c < 16; ++c) {
+            const int value = (int)((lut[s * 16 + c] - lo) / *scale + SUFFIX(0.5));
+            qlut[s * 16 + c] = (uint8_t)(value < 255 ? value : 255);
+        }
+    }
+}
+
+
+static void fast_scan_scalar(const a2a_pq_t* pq, const uint8_t* qlut, const unsigned char* blocks,
+    const int nblocks, uint16_t* scores) {
+
+    const int code_size = pq->code_size;
+    for (int b = 0; b < nblocks; ++b) {
+        const unsigned char* block = blocks + (size_t)b * A2A_PQ_BLOCK * code_size;
+        for (int i = 0; i < A2A_PQ_BLOCK; ++i) {
+            int score = 0;
+            for (int j = 0; j < code_size; ++j) {
+                const unsigned char byte = block[j * A2A_PQ_BLOCK + i];
+                score += qlut[(2 * j) * 16 + (byte & 15)];
+                if (2 * j + 1 < pq->m) score += qlut[(2 * j + 1) * 16 + (byte >> 4)];
+            }
+            scores[b * A2A_PQ_BLOCK + i] = (uint16_t)score;
+        }
+    }
+}
+
+
+#ifdef A2A_PQ_X86
+
+// The 16-entry table of a subspace fits a vector register, and a byte shuffle looks up the
+// codes of a whole block at once. The sums stay below 256 * 255 and fit 16-bit lanes.
+__attribute__((target("ssse3")))
+static void fast_scan_ssse3(const a2a_pq_t* pq, const uint8_t* qlut, const unsigned char* blocks,
+    const int nblocks, uint16_t* scores) {
+
+    const int code_size = pq->code_size;
+    const __m128i low_mask = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    for (int b = 0; b < nblocks; ++b) {
+        const unsigned char* block = blocks + (size_t)b * A2A_PQ_BLOCK * code_size;
+        __m128i acc_lo = _mm_setzero_si128(), acc_hi = _mm_setzero_si128();
+        for (int j = 0; j < code_size; ++j) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i *)(block + j * A2A_PQ_BLOCK));
+            const __m128i codes_lo = _mm_and_si128(bytes, low_mask);
+            const __m128i table_lo = _mm_loadu_si128((const __m128i *)(qlut + (2 * j) * 16));
+            const __m128i dist_lo = _mm_shuffle_epi8(table_lo, codes_lo);
+            acc_lo = _mm_add_epi16(acc_lo, _mm_unpacklo_epi8(dist_lo, zero));
+            acc_hi = _mm_add_epi16(acc_hi, _mm_unpackhi_epi8(dist_lo, zero));
+            if (2 * j + 1 < pq->m) {
+                const __m128i codes_hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask);
+                const __m128i table_hi = _mm_loadu_si128((const __m128i *)(qlut + (2 * j + 1) * 16));
+                const __m128i dist_hi = _mm_shuffle_epi8(table_hi, codes_hi);
+                acc_lo = _mm_add_epi16(acc_lo, _mm_unpacklo_epi8(dist_hi, zero));
+                acc_hi = _mm_add_epi16(acc_hi, _mm_unpackhi_epi8(dist_hi, zero));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(scores + b * A2A_PQ_BLOCK), acc_lo);
+        _mm_storeu_si128((__m128i *)(scores + b * A2A_PQ_BLOCK + 8), acc_hi);
+    }
+}
+
+#endif
+
+
+void a2a_pq_fast_scan(const a2a_pq_t* pq, const uint8_t* qlut, const unsigned char* blocks,
+    const int n, uint16_t* scores) {
+
+    const int nblocks = (n + A2A_PQ_BLOCK - 1) / A2A_PQ_BLOCK;
+#ifdef A2A_PQ_X86
+    if (__builtin_cpu_supports("ssse3")) {
+        fast_scan_ssse3(pq, qlut, blocks, nblocks, scores);
+        return;
+    }
+#endif
+    fast_scan_scalar(pq, qlut, blocks, nblocks, scores);
+}
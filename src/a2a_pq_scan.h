@@ -0,0 +1,101 @@
+#ifndef A2A_PQ_SCAN_H
+#define A2A_PQ_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "a2a_config.h"
+#include "a2a_pq.h"
+
+// Asymmetric distance computation (ADC) on product quantization codes: the distances from a
+// query to every centroid of every subspace go into a lookup table, and the distance to a
+// code is the sum of m table entries. Not part of the public API.
+
+#define A2A_PQ_BLOCK 16                   // Codes per block of the 4-bit fast scan
+
+
+/**
+ * Fills the lookup table of a query with its squared distances to the centroids.
+ *
+ * @param pq the quantizer
+ * @param q the query (pq->L elements)
+ * @param lut output, the table (pq->m x pq->ksub elements)
+ */
+void a2a_pq_compute_lut(const a2a_pq_t* pq, const DTYPE* q, DTYPE* lut);
+
+
+/**
+ * Returns the approximate squared distance from a query to an encoded vector.
+ *
+ * @param pq the quantizer
+ * @param lut the lookup table of the query
+ * @param code the code of the vector (pq->code_size bytes)
+ * @return the sum of the table entries of the subspace codes
+ */
+DTYPE a2a_pq_adc_distance(const a2a_pq_t* pq, const DTYPE* lut, const unsigned char* code);
+
+
+/**
+ * Computes the approximate squared distances from a query to n encoded vectors.
+ *
+ * @param pq the quantizer
+ * @param lut the lookup table of the query
+ * @param codes the codes of the vectors, one after the other
+ * @param n the number of vectors
+ * @param dist output, the distances (n elements)
+ */
+void a2a_pq_adc_scan(const a2a_pq_t* pq, const DTYPE* lut, const unsigned char* codes, const int n,
+    DTYPE* dist);
+
+
+/**
+ * Returns the size in bytes of n 4-bit codes stored in blocks for a2a_pq_fast_scan.
+ *
+ * @param pq the quantizer
+ * @param n the number of codes
+ * @return the size of the blocks, with the last block padded to A2A_PQ_BLOCK codes
+ */
+size_t a2a_pq_blocks_size(const a2a_pq_t* pq, const int n);
+
+
+/**
+ * Stores 4-bit codes in blocks of A2A_PQ_BLOCK codes, where byte j of the codes of a
+ * block are contiguous, so that a single vector register holds one byte of every code.
+ *
+ * @param pq the quantizer
+ * @param codes the codes, one after the other
+ * @param n the number of codes
+ * @param blocks output, the blocks (a2a_pq_blocks_size(pq, n) bytes)
+ */
+void a2a_pq_pack_blocks(const a2a_pq_t* pq, const unsigned char* codes, const int n,
+    unsigned char* blocks);
+
+
+/**
+ * Quantizes a lookup table to 8-bit entries for a2a_pq_fast_scan. The approximate squared
+ * distance of a code is scale times its score plus bias.
+ *
+ * @param pq the quantizer (4-bit codes)
+ * @param lut the lookup table of the query
+ * @param qlut output, the quantized table (pq->m x 16 bytes)
+ * @param scale output, the scale of the scores
+ * @param bias output, the distance of a zero score
+ */
+void a2a_pq_quantize_lut(const a2a_pq_t* pq, const DTYPE* lut, uint8_t* qlut, DTYPE* scale,
+    DTYPE* bias);
+
+
+/**
+ * Computes the scores of n 4-bit codes stored in blocks, with in-register table lookups
+ * (SSSE3 shuffles) when the processor supports them and a scalar loop otherwise. Both
+ * give the same scores.
+ *
+ * @param pq the quantizer (4-bit codes)
+ * @param qlut the quantized lookup table of the query
+ * @param blocks the codes in blocks
+ * @param n the number of codes
+ * @param scores output, the scores (n rounded up to a multiple of A2A_PQ_BLOCK elements)
+ */
+void a2a_pq_fast_scan(const a2a_pq_t* pq, const uint8_t* qlut, const unsigned char* blocks,
+    const int n, uint16_t* scores);
+
+#endif
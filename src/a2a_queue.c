@@ -1,4 +1,5 @@
 #include "a2a_queue.h"
+#include "a2a_alloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,17 +21,17 @@ int a2a_QueueIsEmpty(a2a_Queue *q)
 
 int a2a_QueueEnqueue(a2a_Queue *q, const void *element) 
 {
-    a2a_QueueNode *newNode = (a2a_QueueNode *)malloc(sizeof(a2a_QueueNode));
+    a2a_QueueNode *newNode = (a2a_QueueNode *)a2a_Malloc(sizeof(a2a_QueueNode));
     if (!newNode)
     {
         fprintf(stderr, "Cannot add element to the queue\n");
         return 0;
     }
-    newNode->data = malloc(q->dataSize);
+    newNode->data = a2a_Malloc(q->dataSize);
     if (!newNode->data)
     {
         fprintf(stderr, "Cannot add element to the queue\n");
-        free(newNode);
+        a2a_Free(newNode);
         return 0;
     }
     memcpy(newNode->data, element, q->dataSize);
@@ -65,8 +66,8 @@ int a2a_QueueDequeue(a2a_Queue *q, void *element)
         q->rear = NULL;
     }
 
-    free(temp->data);
-    free(temp);
+    a2a_Free(temp->data);
+    a2a_Free(temp);
     q->n_elements--;
     return 1;
 }
@@ -80,8 +81,8 @@ void a2a_QueueDestroy(a2a_Queue *q)
     {
         a2a_QueueNode *temp = current;
         current = current->next;
-        free(temp->data);
-        free(temp);
+        a2a_Free(temp->data);
+        a2a_Free(temp);
     }
     q->front = q->rear = NULL;
     q->dataSize = 0;
@@ -0,0 +1,700 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "a2a_shard.h"
+#include "a2a_knn.h"
+#include "a2a_parallel.h"
+#include "a2a_alloc.h"
+#include "a2a_memory.h"
+
+
+#define SHARD_ALIGNMENT 64                // Alignment of every array of the shared mapping in bytes
+#define SHARD_ROW_BLOCK 256               // Points taken by a worker at a time
+
+
+// A point routed to the owner of one of its probed clusters
+typedef struct {
+    int point;
+    int slot;                            // Position of the cluster in the probes of the point
+    int cluster;
+} ShardMessage;
+
+
+// Synchronization of the ranks, at the start of the shared mapping
+typedef struct {
+    pthread_barrier_t barrier;
+    atomic_int failed;                   // Set by a rank that failed, read by all after the next barrier
+    atomic_int changed[2];               // Points that changed cluster in the even and odd k-means iterations
+} ShardControl;
+
+
+// Byte offsets of the arrays in the shared mapping
+typedef struct {
+    size_t centroids;
+    size_t sums;
+    size_t counts;
+    size_t assignments;
+    size_t probes;
+    size_t owner;
+    size_t send_counts;
+    size_t messages;
+    size_t cand_idx;
+    size_t cand_dist;
+    size_t IDX;
+    size_t D;
+    size_t size;
+} ShardLayout;
+
+
+typedef struct {
+    const DTYPE* C;                      // Dataset, inherited by the ranks
+    int N;
+    int L;
+    int K;
+    int Kc;
+    int nprobe;
+    int nprocs;
+    int nthreads;
+    int max_iterations;
+    double max_memory_usage_ratio;       // Share of the available memory for each worker
+    parallelization_type_t par_type;     // Parallelization within a rank, which must survive fork
+    ShardControl* control;
+    DTYPE* centroids;                    // Centroids (Kc x L)
+    DTYPE* sums;                         // Sums of the points of each cluster per rank (nprocs x Kc x L)
+    int* counts;                         // Number of points of each cluster per rank (nprocs x Kc)
+    int* assignments;                    // Cluster of each point in the last k-means iteration
+    int* probes;                         // Probed clusters of each point, nearest first (N x nprobe)
+    int* owner;                          // Rank of each cluster
+    int* send_counts;                    // Messages from each rank to each rank (nprocs x nprocs)
+    ShardMessage* messages;              // Messages grouped by destination, then by source
+    int* cand_idx;                       // Neighbors of each point in each probe (N x nprobe x K)
+    DTYPE* cand_dist;
+    int* IDX;                            // Merged neighbors (N x K)
+    DTYPE* D;
+} ShardContext;
+
+
+typedef struct {
+    const ShardContext* ctx;
+    int first;                           // First point of the rank
+    int last;
+    int k;                               // Number of nearest centroids per point
+    int* nearest;                        // Output, the nearest centroids of the points of the rank
+    atomic_int* next;                    // First point of the next block, relative to first
+} nearestTask;
+
+
+typedef struct {
+    const ShardContext* ctx;
+    const ShardMessage* inbox;           // Messages of the rank sorted by cluster, members first
+    const int* groups;                   // Start of the messages of each cluster of the inbox
+    int ngroups;
+    atomic_int* next;                    // Next group
+} clusterSearchTask;
+
+
+static size_t align_up(const size_t bytes) {
+    return (bytes + SHARD_ALIGNMENT - 1) / SHARD_ALIGNMENT * SHARD_ALIGNMENT;
+}
+
+
+static ShardLayout shard_layout(const size_t N, const size_t L, const size_t K, const size_t Kc,
+    const size_t nprobe, const size_t nprocs) {
+
+    ShardLayout layout;
+    size_t pos = align_up(sizeof(ShardControl));
+    layout.centroids = pos;
+    pos = align_up(pos + Kc * L * sizeof(DTYPE));
+    layout.sums = pos;
+    pos = align_up(pos + nprocs * Kc * L * sizeof(DTYPE));
+    layout.counts = pos;
+    pos = align_up(pos + nprocs * Kc * sizeof(int));
+    layout.assignments = pos;
+    pos = align_up(pos + N * sizeof(int));
+    layout.probes = pos;
+    pos = align_up(pos + N * nprobe * sizeof(int));
+    layout.owner = pos;
+    pos = align_up(pos + Kc * sizeof(int));
+    layout.send_counts = pos;
+    pos = align_up(pos + nprocs * nprocs * sizeof(int));
+    layout.messages = pos;
+    pos = align_up(pos + N * nprobe * sizeof(ShardMessage));
+    layout.cand_idx = pos;
+    pos = align_up(pos + N * nprobe * K * sizeof(int));
+    layout.cand_dist = pos;
+    pos = align_up(pos + N * nprobe * K * sizeof(DTYPE));
+    layout.IDX = pos;
+    pos = align_up(pos + N * K * sizeof(int));
+    layout.D = pos;
+    pos = align_up(pos + N * K * sizeof(DTYPE));
+    layout.size = pos;
+    return layout;
+}
+
+
+static int nearestExec(void* arg) {
+    nearestTask* task = (nearestTask *)arg;
+    const ShardContext* ctx = task->ctx;
+    const int L = ctx->L, k = task->k;
+    const int total = task->last - task->first;
+
+    a2a_KnnWorkspace ws;
+    DTYPE* dist = NULL;
+    int status = EXIT_FAILURE;
+
+    if (a2a_KnnWorkspaceInit(&ws, ctx->max_memory_usage_ratio)) goto cleanup;
+    dist = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * SHARD_ROW_BLOCK * k);
+    if (!dist) goto cleanup;
+
+    int begin;
+    while ((begin = atomic_fetch_add(task->next, SHARD_ROW_BLOCK)) < total) {
+        const int m = total - begin < SHARD_ROW_BLOCK ? total - begin : SHARD_ROW_BLOCK;
+        if (a2a_knnsearch_ws(ctx->C + (size_t)(task->first + begin) * L, ctx->centroids,
+            task->nearest + (size_t)begin * k, dist, m, ctx->Kc, L, k, 1, NULL, NULL, &ws)) goto cleanup;
+    }
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) atomic_store(task->next, total);  // Stop the other workers
+    a2a_KnnWorkspaceDestroy(&ws);
+    a2a_Free(dist);
+
+    return status;
+}
+
+
+// Finds the k nearest centroids of the points [first, last) with the threads of the rank
+static int find_nearest(const ShardContext* ctx, const int first, const int last, const int k,
+    int* nearest) {
+
+    const int nblocks = (last - first + SHARD_ROW_BLOCK - 1) / SHARD_ROW_BLOCK;
+    const int nworkers = ctx->nthreads < nblocks ? ctx->nthreads : nblocks;
+    if (nworkers == 0) return EXIT_SUCCESS;
+
+    nearestTask* tasks = (nearestTask *)a2a_Malloc(sizeof(nearestTask) * nworkers);
+    if (!tasks) {
+        fprintf(stderr, "Error allocating memory for the sharded search\n");
+        return EXIT_FAILURE;
+    }
+
+    atomic_int next = 0;
+    for (int i = 0; i < nworkers; ++i) {
+        tasks[i] = (nearestTask){
+            .ctx = ctx, .first = first, .last = last, .k = k, .nearest = nearest, .next = &next
+        };
+    }
+
+    const int status = a2a_ParallelRun(nearestExec, tasks, sizeof(nearestTask), nworkers, ctx->par_type);
+    a2a_Free(tasks);
+
+    return status;
+}
+
+
+static int compare_messages(const void* a, const void* b) {
+    const ShardMessage* ma = (const ShardMessage *)a;
+    const ShardMessage* mb = (const ShardMessage *)b;
+    if (ma->cluster != mb->cluster) return (ma->cluster > mb->cluster) - (ma->cluster < mb->cluster);
+    // Members (slot 0) first
+    if ((ma->slot > 0) != (mb->slot > 0)) return (ma->slot > 0) - (mb->slot > 0);
+    return (ma->point > mb->point) - (ma->point < mb->point);
+}
+
+
+static int clusterSearchExec(void* arg) {
+    clusterSearchTask* task = (clusterSearchTask *)arg;
+    const ShardContext* ctx = task->ctx;
+    const int L = ctx->L, K = ctx->K, nprobe = ctx->nprobe;
+
+    a2a_KnnWorkspace ws;
+    DTYPE *Q = NULL, *dist = NULL;
+    int* idx = NULL;
+    int capacity = 0;
+    int status = EXIT_FAILURE;
+
+    if (a2a_KnnWorkspaceInit(&ws, ctx->max_memory_usage_ratio)) goto cleanup;
+
+    int g;
+    while ((g = atomic_fetch_add(task->next, 1)) < task->ngroups) {
+        const ShardMessage* msgs = task->inbox + task->groups[g];
+        const int q = task->groups[g + 1] - task->groups[g];
+        int members = 0;
+        while (members < q && msgs[members].slot == 0) members++;
+        const int kk = K + 1 < members ? K + 1 : members;
+
+        if (q > capacity) {
+            capacity = q;
+            a2a_Free(Q);
+            a2a_Free(dist);
+            a2a_Free(idx);
+            Q = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * (size_t)capacity * L);
+            dist = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * (size_t)capacity * (K + 1));
+            idx = (int *)a2a_Malloc(sizeof(int) * (size_t)capacity * (K + 1));
+            if (!Q || !dist || !idx) {
+                fprintf(stderr, "Error allocating memory for the sharded search\n");
+                goto cleanup;
+            }
+        }
+
+        // The members come first, so they are both the corpus and the first queries
+        for (int i = 0; i < q; ++i) {
+            memcpy(Q + (size_t)i * L, ctx->C + (size_t)msgs[i].point * L, sizeof(DTYPE) * L);
+        }
+        if (kk > 0 && a2a_knnsearch_ws(Q, Q, idx, dist, q, members, L, kk, 1, NULL, NULL, &ws)) goto cleanup;
+
+        for (int i = 0; i < q; ++i) {
+            const size_t row = ((size_t)msgs[i].point * nprobe + msgs[i].slot) * K;
+            int k = 0;
+            for (int j = 0; j < kk && k < K; ++j) {
+                const int local = idx[(size_t)i * kk + j];
+                if (local == i) continue;  // skip self
+                ctx->cand_idx[row + k] = msgs[local].point;
+                ctx->cand_dist[row + k] = dist[(size_t)i * kk + j];
+                k++;
+            }
+            for (; k < K; ++k) {
+                ctx->cand_idx[row + k] = -1;
+                ctx->cand_dist[row + k] = INF;
+            }
+        }
+    }
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (status != EXIT_SUCCESS) atomic_store(task->next, task->ngroups);  // Stop the other workers
+    a2a_KnnWorkspaceDestroy(&ws);
+    a2a_Free(Q);
+    a2a_Free(dist);
+    a2a_Free(idx);
+
+    return status;
+}
+
+
+// Waits for all the ranks, and returns EXIT_FAILURE on every rank if any of them failed
+static int shard_sync(ShardContext* ctx, const int status) {
+    if (status != EXIT_SUCCESS) atomic_store(&ctx->control->failed, 1);
+    pthread_barrier_wait(&ctx->control->barrier);
+    return atomic_load(&ctx->control->failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+// One k-means iteration: assign the points of the rank and reduce the sums of a range of clusters.
+// Returns the number of points that changed cluster on all ranks, or -1 on error.
+static int kmeans_iteration(ShardContext* ctx, const int rank, const int iteration, const int first,
+    const int last, int* nearest) {
+
+    const int L = ctx->L, Kc = ctx->Kc;
+    DTYPE* sums = ctx->sums + (size_t)rank * Kc * L;
+    int* counts = ctx->counts + (size_t)rank * Kc;
+
+    int status = find_nearest(ctx, first, last, 1, nearest);
+    if (status == EXIT_SUCCESS) {
+        int changed = 0;
+        memset(sums, 0, sizeof(DTYPE) * (size_t)Kc * L);
+        memset(counts, 0, sizeof(int) * Kc);
+        for (int i = first; i < last; ++i) {
+            const int c = nearest[i - first];
+            if (ctx->assignments[i] != c) changed++;
+            ctx->assignments[i] = c;
+            counts[c]++;
+            for (int l = 0; l < L; ++l) sums[(size_t)c * L + l] += ctx->C[(size_t)i * L + l];
+        }
+        atomic_fetch_add(&ctx->control->changed[iteration & 1], changed);
+    }
+    if (shard_sync(ctx, status)) return -1;
+
+    // Each rank reduces the sums of its range of clusters, empty clusters keep their centroid
+    const int c0 = (int)((long)Kc * rank / ctx->nprocs);
+    const int c1 = (int)((long)Kc * (rank + 1) / ctx->nprocs);
+    for (int c = c0; c < c1; ++c) {
+        long total = 0;
+        for (int r = 0; r < ctx->nprocs; ++r) total += ctx->counts[(size_t)r * Kc + c];
+        if (total == 0) continue;
+        DTYPE* centroid = ctx->centroids + (size_t)c * L;
+        for (int l = 0; l < L; ++l) {
+            DTYPE sum = 0;
+            for (int r = 0; r < ctx->nprocs; ++r) sum += ctx->sums[((size_t)r * Kc + c) * L + l];
+            centroid[l] = sum / total;
+        }
+    }
+    if (rank == 0) atomic_store(&ctx->control->changed[(iteration + 1) & 1], 0);
+    if (shard_sync(ctx, EXIT_SUCCESS)) return -1;
+
+    return atomic_load(&ctx->control->changed[iteration & 1]);
+}
+
+
+// Gives each cluster to the least loaded rank, the most expensive clusters first
+static void assign_owners(ShardContext* ctx) {
+    const int Kc = ctx->Kc;
+    long* cost = (long *)a2a_Calloc(Kc, sizeof(long));
+    long* load = (long *)a2a_Calloc(ctx->nprocs, sizeof(long));
+    int* order = (int *)a2a_Malloc(sizeof(int) * Kc);
+
+    if (!cost || !load || !order) {
+        // Round robin if the balancing cannot be afforded
+        for (int c = 0; c < Kc; ++c) ctx->owner[c] = c % ctx->nprocs;
+    }
+    else {
+        for (int c = 0; c < Kc; ++c) {
+            long members = 0;
+            for (int r = 0; r < ctx->nprocs; ++r) members += ctx->counts[(size_t)r * Kc + c];
+            cost[c] = members * members;
+            order[c] = c;
+        }
+        // Insertion of each cluster in decreasing order of cost
+        for (int i = 1; i < Kc; ++i) {
+            const int c = order[i];
+            int j = i;
+            while (j > 0 && cost[order[j - 1]] < cost[c]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = c;
+        }
+        for (int i = 0; i < Kc; ++i) {
+            int best = 0;
+            for (int r = 1; r < ctx->nprocs; ++r) {
+                if (load[r] < load[best]) best = r;
+            }
+            ctx->owner[order[i]] = best;
+            load[best] += cost[order[i]];
+        }
+    }
+
+    a2a_Free(cost);
+    a2a_Free(load);
+    a2a_Free(order);
+}
+
+
+// Searches the clusters of the rank for the points routed to it
+static int search_inbox(ShardContext* ctx, ShardMessage* inbox, const int count) {
+    qsort(inbox, count, sizeof(ShardMessage), compare_messages);
+
+    int ngroups = 0;
+    for (int i = 0; i < count; ++i) {
+        if (i == 0 || inbox[i].cluster != inbox[i - 1].cluster) ngroups++;
+    }
+    int* groups = (int *)a2a_Malloc(sizeof(int) * (ngroups + 1));
+    if (!groups) {
+        fprintf(stderr, "Error allocating memory for the sharded search\n");
+        return EXIT_FAILURE;
+    }
+    ngroups = 0;
+    for (int i = 0; i < count; ++i) {
+        if (i == 0 || inbox[i].cluster != inbox[i - 1].cluster) groups[ngroups++] = i;
+    }
+    groups[ngroups] = count;
+
+    int status = EXIT_SUCCESS;
+    const int nworkers = ctx->nthreads < ngroups ? ctx->nthreads : ngroups;
+    if (nworkers > 0) {
+        clusterSearchTask* tasks = (clusterSearchTask *)a2a_Malloc(sizeof(clusterSearchTask) * nworkers);
+        if (!tasks) {
+            fprintf(stderr, "Error allocating memory for the sharded search\n");
+            a2a_Free(groups);
+            return EXIT_FAILURE;
+        }
+        atomic_int next = 0;
+        for (int i = 0; i < nworkers; ++i) {
+            tasks[i] = (clusterSearchTask){
+                .ctx = ctx, .inbox = inbox, .groups = groups, .ngroups = ngroups, .next = &next
+            };
+        }
+        status = a2a_ParallelRun(clusterSearchExec, tasks, sizeof(clusterSearchTask), nworkers, ctx->par_type);
+        a2a_Free(tasks);
+    }
+    a2a_Free(groups);
+
+    return status;
+}
+
+
+// Merges the sorted lists of the probes of a point into its K nearest neighbors
+static void merge_probes(ShardContext* ctx, const int point, int* head) {
+    const int K = ctx->K, nprobe = ctx->nprobe;
+    const int* idx = ctx->cand_idx + (size_t)point * nprobe * K;
+    const DTYPE* dist = ctx->cand_dist + (size_t)point * nprobe * K;
+    int* out_idx = ctx->IDX + (size_t)point * K;
+    DTYPE* out_dist = ctx->D + (size_t)point * K;
+
+    for (int p = 0; p < nprobe; ++p) head[p] = 0;
+    for (int k = 0; k < K; ++k) {
+        int best = -1;
+        for (int p = 0; p < nprobe; ++p) {
+            if (head[p] < K && idx[p * K + head[p]] >= 0 &&
+                (best < 0 || dist[p * K + head[p]] < dist[best * K + head[best]])) best = p;
+        }
+        out_idx[k] = best >= 0 ? idx[best * K + head[best]] : -1;
+        out_dist[k] = best >= 0 ? dist[best * K + head[best]] : INF;
+        if (best >= 0) head[best]++;
+    }
+}
+
+
+// Waits for one of the ranks to exit and forgets its process. Polls, so that a rank that
+// dies is noticed while the others wait for it at a barrier.
+static pid_t wait_for_rank(pid_t* pids, const int nprocs, int* wstatus) {
+    for (;;) {
+        int alive = 0;
+        for (int r = 0; r < nprocs; ++r) {
+            if (pids[r] <= 0) continue;
+            alive = 1;
+            const pid_t pid = waitpid(pids[r], wstatus, WNOHANG);
+            if (pid == 0) continue;
+            pids[r] = 0;
+            if (pid < 0) perror("Error waiting for a rank of the sharded search");
+            return pid;
+        }
+        if (!alive) return -1;
+        usleep(1000);
+    }
+}
+
+
+// Work of a rank. Every rank goes through the same barriers, so that a failure stops all of them.
+static int shard_rank_main(ShardContext* ctx, const int rank) {
+    const int N = ctx->N, nprocs = ctx->nprocs, nprobe = ctx->nprobe;
+    const int first = (int)((long)N * rank / nprocs);
+    const int last = (int)((long)N * (rank + 1) / nprocs);
+    int* nearest = (int *)a2a_Malloc(sizeof(int) * ((size_t)(last - first) + 1));
+    size_t* offset = (size_t *)a2a_Malloc(sizeof(size_t) * nprocs);
+    int* head = (int *)a2a_Malloc(sizeof(int) * nprobe);
+    int status = nearest && offset && head ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (status != EXIT_SUCCESS) fprintf(stderr, "Error allocating memory for the sharded search\n");
+    if (shard_sync(ctx, status)) goto cleanup;
+
+    // Step 1: k-means, with the centroids reduced collectively
+    for (int it = 0; it < ctx->max_iterations; ++it) {
+        const int changed = kmeans_iteration(ctx, rank, it, first, last, nearest);
+        if (changed < 0) goto cleanup;
+        DEBUG_PRINT("Shard %d: k-means iteration %d, %d points changed cluster\n", rank, it, changed);
+        if (changed == 0) break;
+    }
+
+    // Step 2: the probes of the points, whose nearest centroid is their cluster
+    status = find_nearest(ctx, first, last, nprobe, ctx->probes + (size_t)first * nprobe);
+    if (status == EXIT_SUCCESS) {
+        int* counts = ctx->counts + (size_t)rank * ctx->Kc;
+        memset(counts, 0, sizeof(int) * ctx->Kc);
+        for (int i = first; i < last; ++i) counts[ctx->probes[(size_t)i * nprobe]]++;
+    }
+    if (shard_sync(ctx, status)) goto cleanup;
+    if (rank == 0) assign_owners(ctx);
+    if (shard_sync(ctx, EXIT_SUCCESS)) goto cleanup;
+
+    // Step 3: route each point to the owners of its probes
+    int* send = ctx->send_counts + (size_t)rank * nprocs;
+    memset(send, 0, sizeof(int) * nprocs);
+    for (size_t i = (size_t)first * nprobe; i < (size_t)last * nprobe; ++i) send[ctx->owner[ctx->probes[i]]]++;
+    if (shard_sync(ctx, EXIT_SUCCESS)) goto cleanup;
+
+    size_t inbox_begin = 0, inbox_count = 0, pos = 0;
+    for (int dst = 0; dst < nprocs; ++dst) {
+        for (int src = 0; src < nprocs; ++src) {
+            if (src == rank) offset[dst] = pos;
+            if (dst == rank && src == 0) inbox_begin = pos;
+            pos += ctx->send_counts[(size_t)src * nprocs + dst];
+        }
+        if (dst == rank) inbox_count = pos - inbox_begin;
+    }
+    for (int i = first; i < last; ++i) {
+        for (int p = 0; p < nprobe; ++p) {
+            const int c = ctx->probes[(size_t)i * nprobe + p];
+            ctx->messages[offset[ctx->owner[c]]++] = (ShardMessage){ .point = i, .slot = p, .cluster = c };
+        }
+    }
+    if (shard_sync(ctx, EXIT_SUCCESS)) goto cleanup;
+
+    // Step 4: search the clusters of the rank for the points routed to it
+    status = search_inbox(ctx, ctx->messages + inbox_begin, (int)inbox_count);
+    if (shard_sync(ctx, status)) goto cleanup;
+
+    // Step 5: merge the lists of the probes of the points of the rank
+    for (int i = first; i < last; ++i) merge_probes(ctx, i, head);
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(nearest);
+    a2a_Free(offset);
+    a2a_Free(head);
+    return status;
+}
+
+
+void a2a_shard_options_init(a2a_shard_options_t *opts) {
+    opts->nprocs = 2;
+    opts->nprobe = 1;
+    opts->max_iterations = 10;
+    opts->seed = 0;
+}
+
+
+int a2a_sharded_annsearch(const DTYPE* C, const int N, const int L, const int K, const int Kc,
+    int* IDX, DTYPE* D, const int nthreads, const double max_memory_usage_ratio,
+    const a2a_shard_options_t *opts) {
+
+    a2a_shard_options_t options;
+    if (opts) options = *opts;
+    else a2a_shard_options_init(&options);
+
+    if (!C || N <= 0 || L <= 0 || K <= 0 || Kc <= 0 || !IDX || !D) {
+        fprintf(stderr, "Invalid input parameters for the sharded search\n");
+        return EXIT_FAILURE;
+    }
+    if (Kc > N || N / Kc <= K) {
+        fprintf(stderr, "Number of clusters is too large for the given N and K\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (max_memory_usage_ratio <= 0.0 || max_memory_usage_ratio > 1.0) {
+        fprintf(stderr, "Invalid memory usage ratio: %f\n", max_memory_usage_ratio);
+        return EXIT_FAILURE;
+    }
+    if (options.nprocs < 1 || options.nprobe < 1 || options.max_iterations < 1) {
+        fprintf(stderr, "Invalid sharding options: %d processes, %d probes, %d iterations\n",
+            options.nprocs, options.nprobe, options.max_iterations);
+        return EXIT_FAILURE;
+    }
+
+    const int nprocs = options.nprocs;
+    const int nprobe = options.nprobe < Kc ? options.nprobe : Kc;
+    const ShardLayout layout = shard_layout(N, L, K, Kc, nprobe, nprocs);
+
+    // The mapping, mostly the candidates of every probe, comes out of the budget and the workers
+    // of the ranks share the rest
+    const size_t capacity = a2a_AvailableMemoryBytes();
+    const size_t budget = (size_t)(capacity * max_memory_usage_ratio);
+    if (layout.size >= budget) {
+        fprintf(stderr, "Error: Memory budget too small for the shared mapping of the sharded search "
+            "(%zu bytes)\n", layout.size);
+        return EXIT_FAILURE;
+    }
+    const double worker_ratio = (double)(budget - layout.size) / capacity / ((double)nprocs * nthreads);
+
+    char* shared = (char *)mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("Error mapping the shared memory of the sharded search");
+        return EXIT_FAILURE;
+    }
+
+    ShardContext ctx = {
+        .C = C, .N = N, .L = L, .K = K, .Kc = Kc, .nprobe = nprobe, .nprocs = nprocs,
+        .nthreads = nthreads, .max_iterations = options.max_iterations,
+        .max_memory_usage_ratio = worker_ratio,
+        .par_type = PAR_PTHREADS,
+        .control = (ShardControl *)shared,
+        .centroids = (DTYPE *)(shared + layout.centroids),
+        .sums = (DTYPE *)(shared + layout.sums),
+        .counts = (int *)(shared + layout.counts),
+        .assignments = (int *)(shared + layout.assignments),
+        .probes = (int *)(shared + layout.probes),
+        .owner = (int *)(shared + layout.owner),
+        .send_counts = (int *)(shared + layout.send_counts),
+        .messages = (ShardMessage *)(shared + layout.messages),
+        .cand_idx = (int *)(shared + layout.cand_idx),
+        .cand_dist = (DTYPE *)(shared + layout.cand_dist),
+        .IDX = (int *)(shared + layout.IDX),
+        .D = (DTYPE *)(shared + layout.D)
+    };
+
+    int status = EXIT_FAILURE;
+    int barrier_ready = 0, started = 0;
+    pid_t* pids = (pid_t *)a2a_Malloc(sizeof(pid_t) * nprocs);
+    int* order = (int *)a2a_Malloc(sizeof(int) * N);
+    if (!pids || !order) {
+        fprintf(stderr, "Error allocating memory for the sharded search\n");
+        goto cleanup;
+    }
+
+    pthread_barrierattr_t attr;
+    if (pthread_barrierattr_init(&attr) || pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+        pthread_barrier_init(&ctx.control->barrier, &attr, nprocs)) {
+        fprintf(stderr, "Error creating the barrier of the sharded search\n");
+        goto cleanup;
+    }
+    pthread_barrierattr_destroy(&attr);
+    barrier_ready = 1;
+    atomic_init(&ctx.control->failed, 0);
+    atomic_init(&ctx.control->changed[0], 0);
+    atomic_init(&ctx.control->changed[1], 0);
+
+    // Initial centroids from distinct random points (partial Fisher-Yates shuffle)
+    unsigned int seed = options.seed;
+    for (int i = 0; i < N; ++i) order[i] = i;
+    for (int c = 0; c < Kc; ++c) {
+        const int j = c + rand_r(&seed) % (N - c);
+        const int tmp = order[c];
+        order[c] = order[j];
+        order[j] = tmp;
+        memcpy(ctx.centroids + (size_t)c * L, C + (size_t)order[c] * L, sizeof(DTYPE) * L);
+    }
+    for (int i = 0; i < N; ++i) ctx.assignments[i] = -1;
+
+    // Start the ranks, which inherit the dataset and the mapping
+    fflush(NULL);
+    for (; started < nprocs; ++started) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error starting a rank of the sharded search");
+            break;
+        }
+        if (pid == 0) {
+            openblas_set_num_threads(1);
+            const int rank_status = shard_rank_main(&ctx, started);
+            fflush(NULL);
+            _exit(rank_status);
+        }
+        pids[started] = pid;
+    }
+
+    // A rank that cannot start or dies would leave the others waiting at a barrier
+    status = started == nprocs ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (status != EXIT_SUCCESS) {
+        for (int r = 0; r < started; ++r) kill(pids[r], SIGKILL);
+    }
+    for (int remaining = started; remaining > 0; --remaining) {
+        int wstatus;
+        const pid_t pid = wait_for_rank(pids, started, &wstatus);
+        if (pid < 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+            if (!WIFEXITED(wstatus)) {
+                fprintf(stderr, "A rank of the sharded search was terminated by signal %d\n", WTERMSIG(wstatus));
+                for (int r = 0; r < started; ++r) {
+                    if (pids[r] > 0) kill(pids[r], SIGKILL);
+                }
+            }
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (status == EXIT_SUCCESS) {
+        memcpy(IDX, ctx.IDX, sizeof(int) * (size_t)N * K);
+        memcpy(D, ctx.D, sizeof(DTYPE) * (size_t)N * K);
+    }
+
+cleanup:
+    if (barrier_ready) pthread_barrier_destroy(&ctx.control->barrier);
+    munmap(shared, layout.size);
+    a2a_Free(pids);
+    a2a_Free(order);
+
+    return status;
+}
@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "a2a_stats.h"
+#include "a2a_collector.h"
+
+
+_Thread_local a2a_StatsCollector *a2a_collector = NULL;
+static atomic_llong last_search_id = 0;
+a2a_phase_hook_t a2a_phase_hook = NULL;
+void *a2a_phase_hook_arg = NULL;
+
+
+static const char *phase_names[A2A_PHASE_COUNT] = {
+    "seeding", "assignment", "centroid_update", "merge", "cluster_index", "quantization",
+    "cluster_search", "gemm", "selection", "copy_out", "refine"
+};
+
+
+void a2a_stats_reset(a2a_stats_t *stats) {
+    memset(stats, 0, sizeof(a2a_stats_t));
+}
+
+
+const char *a2a_stats_phase_name(a2a_phase_t phase) {
+    if ((int)phase < 0 || phase >= A2A_PHASE_COUNT) return "unknown";
+    return phase_names[phase];
+}
+
+
+void a2a_stats_print(const a2a_stats_t *stats, FILE *stream) {
+    fprintf(stream, "wall %.6f s, cpu %.6f s, %lld bytes allocated\n", stats->wall_seconds,
+        stats->cpu_seconds, stats->bytes_allocated);
+    fprintf(stream, "  peak memory %lld bytes, budget %lld bytes (%.1f%%)\n", stats->peak_bytes,
+        stats->memory_budget_bytes, 100.0 * stats->budget_usage);
+    for (int p = 0; p < A2A_PHASE_COUNT; ++p) {
+        if (stats->phases[p].calls == 0) continue;
+        fprintf(stream, "  %-16s wall %.6f s, cpu %.6f s, %lld calls, peak %lld bytes\n", phase_names[p],
+            stats->phases[p].wall_seconds, stats->phases[p].cpu_seconds, stats->phases[p].calls,
+            stats->phase_peak_bytes[p]);
+    }
+    for (int t = 0; t < stats->nthreads; ++t) {
+        fprintf(stream, "  thread %-9d busy %.6f s, idle %.6f s\n", t, stats->busy_seconds[t],
+            stats->idle_seconds[t]);
+    }
+    for (int t = 0; t < stats->memory_threads; ++t) {
+        fprintf(stream, "  allocating thread %-2d peak %lld bytes\n", t, stats->thread_peak_bytes[t]);
+    }
+    if (stats->nthreads > 0) fprintf(stream, "  load imbalance %.3f\n", stats->load_imbalance);
+    if (stats->queue_tasks > 0) {
+        fprintf(stream, "  queue wait %.6f s over %lld tasks\n", stats->queue_wait_seconds, stats->queue_tasks);
+    }
+    if (stats->num_clusters > 0) {
+        fprintf(stream, "  %d clusters of %d to %d points\n", stats->num_clusters, stats->min_cluster_size,
+            stats->max_cluster_size);
+        for (int b = 0; b < A2A_STATS_HISTOGRAM_BINS; ++b) {
+            if (stats->cluster_size_histogram[b] == 0) continue;
+            fprintf(stream, "    [%lld, %lld) %lld\n", 1LL << b, 1LL << (b + 1), stats->cluster_size_histogram[b]);
+        }
+    }
+}
+
+
+void a2a_stats_set_phase_hook(a2a_phase_hook_t hook, void *arg) {
+    a2a_phase_hook_arg = arg;
+    a2a_phase_hook = hook;
+}
+
+
+int a2a_StatsOpen(a2a_StatsScope *scope, a2a_stats_t *stats) {
+    scope->stats = stats;
+    scope->collector = NULL;
+    scope->previous = a2a_collector;
+    if (!stats) return EXIT_SUCCESS;
+
+    a2a_stats_reset(stats);
+    scope->collector = (a2a_StatsCollector *)calloc(1, sizeof(a2a_StatsCollector));
+    if (!scope->collector) {
+        fprintf(stderr, "Error allocating memory for the stats\n");
+        return EXIT_FAILURE;
+    }
+    atomic_store(&scope->collector->min_cluster_size, INT_MAX);
+    scope->collector->id = atomic_fetch_add(&last_search_id, 1) + 1;
+
+    scope->wall_ns = a2a_ClockNs(CLOCK_MONOTONIC);
+    scope->cpu_ns = a2a_ClockNs(CLOCK_PROCESS_CPUTIME_ID);
+    a2a_collector = scope->collector;
+
+    return EXIT_SUCCESS;
+}
+
+
+void a2a_StatsClose(a2a_StatsScope *scope) {
+    a2a_StatsCollector *collector = scope->collector;
+    a2a_stats_t *stats = scope->stats;
+    a2a_collector = scope->previous;
+    if (!collector) return;
+
+    stats->wall_seconds = (a2a_ClockNs(CLOCK_MONOTONIC) - scope->wall_ns) * 1e-9;
+    stats->cpu_seconds = (a2a_ClockNs(CLOCK_PROCESS_CPUTIME_ID) - scope->cpu_ns) * 1e-9;
+    for (int p = 0; p < A2A_PHASE_COUNT; ++p) {
+        stats->phases[p].wall_seconds = atomic_load(&collector->wall_ns[p]) * 1e-9;
+        stats->phases[p].cpu_seconds = atomic_load(&collector->cpu_ns[p]) * 1e-9;
+        stats->phases[p].calls = atomic_load(&collector->calls[p]);
+    }
+    stats->bytes_allocated = atomic_load(&collector->bytes);
+    stats->peak_bytes = atomic_load(&collector->peak_bytes);
+    for (int p = 0; p < A2A_PHASE_COUNT; ++p) {
+        stats->phase_peak_bytes[p] = atomic_load(&collector->phase_peak_bytes[p]);
+    }
+    const int memory_threads = atomic_load(&collector->memory_threads);
+    stats->memory_threads = memory_threads < A2A_STATS_MAX_THREADS ? memory_threads : A2A_STATS_MAX_THREADS;
+    for (int t = 0; t < stats->memory_threads; ++t) {
+        stats->thread_peak_bytes[t] = atomic_load(&collector->thread_peak_bytes[t]);
+    }
+    stats->memory_budget_bytes = collector->budget_bytes;
+    stats->budget_usage = collector->budget_bytes > 0 ? (double)stats->peak_bytes / collector->budget_bytes : 0.0;
+
+    // Load imbalance of the threads that ran work
+    double max_busy = 0.0, sum_busy = 0.0;
+    stats->nthreads = atomic_load(&collector->nthreads);
+    for (int t = 0; t < stats->nthreads; ++t) {
+        stats->busy_seconds[t] = atomic_load(&collector->busy_ns[t]) * 1e-9;
+        stats->idle_seconds[t] = atomic_load(&collector->idle_ns[t]) * 1e-9;
+        if (stats->busy_seconds[t] > max_busy) max_busy = stats->busy_seconds[t];
+        sum_busy += stats->busy_seconds[t];
+    }
+    stats->load_imbalance = sum_busy > 0.0 ? max_busy * stats->nthreads / sum_busy : 0.0;
+
+    for (int b = 0; b < A2A_STATS_HISTOGRAM_BINS; ++b) {
+        stats->cluster_size_histogram[b] = atomic_load(&collector->histogram[b]);
+    }
+    stats->num_clusters = atomic_load(&collector->num_clusters);
+    stats->min_cluster_size = stats->num_clusters > 0 ? atomic_load(&collector->min_cluster_size) : 0;
+    stats->max_cluster_size = atomic_load(&collector->max_cluster_size);
+
+    stats->queue_wait_seconds = atomic_load(&collector->queue_wait_ns) * 1e-9;
+    stats->queue_tasks = atomic_load(&collector->queue_tasks);
+
+    free(collector);
+    scope->collector = NULL;
+}
+
+
+void a2a_StatsSetBudget(a2a_StatsScope *scope, const size_t budget_bytes) {
+    if (scope->collector) scope->collector->budget_bytes = (long long)budget_bytes;
+}
+
+
+void a2a_StatsRecordThread(a2a_StatsCollector *collector, const int slot, const long long busy_ns,
+    const long long idle_ns) {
+
+    // The threads past the last slot share it
+    const int s = slot < A2A_STATS_MAX_THREADS ? slot : A2A_STATS_MAX_THREADS - 1;
+    atomic_fetch_add_explicit(&collector->busy_ns[s], busy_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&collector->idle_ns[s], idle_ns > 0 ? idle_ns : 0, memory_order_relaxed);
+
+    int used = atomic_load_explicit(&collector->nthreads, memory_order_relaxed);
+    while (used < s + 1 && !atomic_compare_exchange_weak(&collector->nthreads, &used, s + 1));
+}
+
+
+void a2a_StatsRecordClusters(const int *counts, const int Kc) {
+    a2a_StatsCollector *collector = a2a_collector;
+    if (!collector) return;
+
+    int min_size = INT_MAX, max_size = 0;
+    for (int c = 0; c < Kc; ++c) {
+        if (counts[c] < 1) continue;
+        int bin = 0;
+        while (bin < A2A_STATS_HISTOGRAM_BINS - 1 && (counts[c] >> (bin + 1)) > 0) ++bin;
+        atomic_fetch_add_explicit(&collector->histogram[bin], 1, memory_order_relaxed);
+        if (counts[c] < min_size) min_size = counts[c];
+        if (counts[c] > max_size) max_size = counts[c];
+        atomic_fetch_add_explicit(&collector->num_clusters, 1, memory_order_relaxed);
+    }
+
+    int current = atomic_load(&collector->min_cluster_size);
+    while (min_size < current && !atomic_compare_exchange_weak(&collector->min_cluster_size, &current, min_size));
+    current = atomic_load(&collector->max_cluster_size);
+    while (max_size > current && !atomic_compare_exchange_weak(&collector->max_cluster_size, &current, max_size));
+}
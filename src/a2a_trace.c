@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "a2a_trace.h"
+#include "a2a_tracer.h"
+
+
+// A complete event, with its start and end
+typedef struct {
+    const char *name;
+    long long start_ns;
+    long long end_ns;
+    int id;
+    int count;
+} TraceEvent;
+
+
+// Ring buffer of the events of a thread. A buffer is written by the thread that holds it
+// only, and is handed over to another thread when its thread exits.
+typedef struct TraceBuffer {
+    TraceEvent *events;
+    long long capacity;
+    atomic_llong head;                   // Number of events recorded, the latest capacity are kept
+    atomic_int in_use;                   // Held by a live thread
+    int tid;                             // Track of the buffer in the trace
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+
+atomic_int a2a_tracing = 0;
+
+static _Atomic(TraceBuffer *) buffers = NULL;      // All buffers, never freed
+static atomic_int num_buffers = 0;
+static atomic_llong capacity = A2A_TRACE_DEFAULT_EVENTS;
+static long long origin_ns = 0;                    // Time of a2a_trace_start
+static _Thread_local TraceBuffer *local_buffer = NULL;
+static pthread_key_t release_key;
+static pthread_once_t release_once = PTHREAD_ONCE_INIT;
+
+
+// Hands the buffer of an exiting thread over to the next thread that records
+static void release_buffer(void *buffer) {
+    atomic_store(&((TraceBuffer *)buffer)->in_use, 0);
+}
+
+
+static void create_release_key(void) {
+    pthread_key_create(&release_key, release_buffer);
+}
+
+
+// Takes a buffer released by an exited thread, or creates one
+static TraceBuffer *acquire_buffer(void) {
+    pthread_once(&release_once, create_release_key);
+
+    TraceBuffer *buffer;
+    for (buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&buffer->in_use, &expected, 1)) break;
+    }
+
+    if (!buffer) {
+        buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+        if (!buffer) return NULL;
+        buffer->capacity = atomic_load(&capacity);
+        buffer->events = (TraceEvent *)malloc(sizeof(TraceEvent) * buffer->capacity);
+        if (!buffer->events) {
+            free(buffer);
+            return NULL;
+        }
+        atomic_store(&buffer->in_use, 1);
+        buffer->tid = atomic_fetch_add(&num_buffers, 1) + 1;
+        buffer->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer));
+    }
+
+    pthread_setspecific(release_key, buffer);
+    return buffer;
+}
+
+
+void a2a_TraceRecord(const char *name, const long long start_ns, const long long end_ns, const int id,
+    const int count) {
+
+    if (!start_ns) return;
+    if (!local_buffer && !(local_buffer = acquire_buffer())) return;
+
+    TraceBuffer *buffer = local_buffer;
+    const long long head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    TraceEvent *event = &buffer->events[head % buffer->capacity];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    event->id = id;
+    event->count = count;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+
+int a2a_trace_start(int events_per_thread) {
+    if (events_per_thread < 0) {
+        fprintf(stderr, "Invalid number of trace events per thread: %d\n", events_per_thread);
+        return EXIT_FAILURE;
+    }
+
+    // The buffers of the previous recordings are resized, no thread records into them meanwhile
+    const long long events = events_per_thread > 0 ? events_per_thread : A2A_TRACE_DEFAULT_EVENTS;
+    for (TraceBuffer *buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        if (buffer->capacity != events) {
+            TraceEvent *resized = (TraceEvent *)malloc(sizeof(TraceEvent) * events);
+            if (!resized) {
+                fprintf(stderr, "Error allocating memory for the trace events\n");
+                return EXIT_FAILURE;
+            }
+            free(buffer->events);
+            buffer->events = resized;
+            buffer->capacity = events;
+        }
+        atomic_store(&buffer->head, 0);
+    }
+    atomic_store(&capacity, events);
+    origin_ns = a2a_ClockNs(CLOCK_MONOTONIC);
+    atomic_store(&a2a_tracing, 1);
+
+    return EXIT_SUCCESS;
+}
+
+
+void a2a_trace_stop(void) {
+    atomic_store(&a2a_tracing, 0);
+}
+
+
+int a2a_trace_write(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error opening trace file %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    long long dropped = 0;
+    int first = 1;
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (TraceBuffer *buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        const long long head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        if (head == 0) continue;
+
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            first ? "" : ",\n", buffer->tid, buffer->tid);
+        first = 0;
+
+        // Oldest event first
+        const long long begin = head > buffer->capacity ? head - buffer->capacity : 0;
+        dropped += begin;
+        for (long long e = begin; e < head; e++) {
+            const TraceEvent *event = &buffer->events[e % buffer->capacity];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                event->name, buffer->tid, (event->start_ns - origin_ns) * 1e-3,
+                (event->end_ns - event->start_ns) * 1e-3);
+            if (event->id >= 0) fprintf(file, ",\"args\":{\"id\":%d,\"count\":%d}", event->id, event->count);
+            fprintf(file, "}");
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%lld}}\n", dropped);
+
+    if (fclose(file)) {
+        fprintf(stderr, "Error writing trace file %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#ifndef A2A_TRACER_H
+#define A2A_TRACER_H
+
+#include <stdatomic.h>
+#include <time.h>
+#include "a2a_trace.h"
+
+
+// Non-zero between a2a_trace_start and a2a_trace_stop
+extern atomic_int a2a_tracing;
+
+
+static inline long long a2a_ClockNs(const clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * Returns the start time of an event, or 0 when tracing is disabled.
+ */
+static inline long long a2a_TraceBegin(void) {
+    return atomic_load_explicit(&a2a_tracing, memory_order_relaxed) ? a2a_ClockNs(CLOCK_MONOTONIC) : 0;
+}
+
+
+/**
+ * Records an event of the calling thread. No-op when start_ns is 0.
+ *
+ * @param name the name of the event, a string literal
+ * @param start_ns the start time returned by a2a_TraceBegin
+ * @param end_ns the end time
+ * @param id the cluster, block or worker of the event, -1 if none
+ * @param count the number of rows or queries of the event, 0 if none
+ */
+void a2a_TraceRecord(const char *name, const long long start_ns, const long long end_ns, const int id,
+    const int count);
+
+
+/**
+ * Records an event that ends now. No-op when start_ns is 0.
+ */
+static inline void a2a_TraceEnd(const char *name, const long long start_ns, const int id, const int count) {
+    if (start_ns) a2a_TraceRecord(name, start_ns, a2a_ClockNs(CLOCK_MONOTONIC), id, count);
+}
+
+
+#endif
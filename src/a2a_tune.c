@@ -0,0 +1,461 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "a2a_tune.h"
+#include "a2a_knn.h"
+#include "a2a_clustering.h"
+#include "a2a_alloc.h"
+
+
+// Searches run so far, sorted by number of clusters
+typedef struct {
+    int count;
+    int* Kc;
+    double* recall;
+    double* seconds;
+} ProbeSet;
+
+
+// Time model a * Kc / Kc_max + b * Kc_min / Kc + c, fitted on the probes
+typedef struct {
+    double coef[3];
+    int Kc_min;
+    int Kc_max;
+} CostModel;
+
+
+typedef struct {
+    const DTYPE* C;
+    int N;
+    int L;
+    int K;
+    int nthreads;
+    double max_memory_usage_ratio;
+    parallelization_type_t par_type;
+    a2a_ann_options_t options;
+    int sample_size;
+    const int* sample;                   // Sampled points
+    const int* exact;                    // Exact neighbors of the sampled points, self excluded (sample_size x K)
+    int* IDX;                            // Result of a probe (N x K)
+    DTYPE* D;
+} TuneContext;
+
+
+static double elapsed_seconds(const struct timeval* start, const struct timeval* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+
+// Runs the search with Kc clusters and records its recall on the sample and its time
+static int run_probe(TuneContext* ctx, ProbeSet* probes, const int Kc) {
+    struct timeval tstart, tend;
+    const int K = ctx->K;
+
+    gettimeofday(&tstart, NULL);
+    if (a2a_annsearch_ex(ctx->C, ctx->N, ctx->L, K, Kc, ctx->IDX, ctx->D, ctx->nthreads,
+        ctx->max_memory_usage_ratio, ctx->par_type, &ctx->options)) return EXIT_FAILURE;
+    gettimeofday(&tend, NULL);
+
+    long found = 0;
+    for (int s = 0; s < ctx->sample_size; ++s) {
+        const int* row = ctx->IDX + (size_t)ctx->sample[s] * K;
+        const int* expected = ctx->exact + (size_t)s * K;
+        for (int j = 0; j < K; ++j) {
+            for (int k = 0; k < K; ++k) {
+                if (row[k] == expected[j]) {
+                    found++;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Insert in Kc order
+    int i = probes->count++;
+    while (i > 0 && probes->Kc[i - 1] > Kc) {
+        probes->Kc[i] = probes->Kc[i - 1];
+        probes->recall[i] = probes->recall[i - 1];
+        probes->seconds[i] = probes->seconds[i - 1];
+        i--;
+    }
+    probes->Kc[i] = Kc;
+    probes->recall[i] = (double)found / ((double)ctx->sample_size * K);
+    probes->seconds[i] = elapsed_seconds(&tstart, &tend);
+    DEBUG_PRINT("Tune: Kc = %d, recall = %.4f, time = %.4f s\n", Kc, probes->recall[i], probes->seconds[i]);
+
+    return EXIT_SUCCESS;
+}
+
+
+static int find_probe(const ProbeSet* probes, const int Kc) {
+    for (int i = 0; i < probes->count; ++i) {
+        if (probes->Kc[i] == Kc) return i;
+    }
+    return -1;
+}
+
+
+// Recall interpolated in log(Kc) between the probes. The recall need not fall as Kc grows,
+// since a few clusters may cut through groups of points that more clusters keep whole.
+static double predict_recall(const ProbeSet* probes, const int Kc) {
+    if (Kc <= probes->Kc[0]) return probes->recall[0];
+
+    for (int i = 1; i < probes->count; ++i) {
+        if (Kc <= probes->Kc[i]) {
+            const double t = (log((double)Kc) - log((double)probes->Kc[i - 1])) /
+                (log((double)probes->Kc[i]) - log((double)probes->Kc[i - 1]));
+            return probes->recall[i - 1] + t * (probes->recall[i] - probes->recall[i - 1]);
+        }
+    }
+
+    return probes->recall[probes->count - 1];
+}
+
+
+// Returns the unprobed candidate closest to the middle, in log(Kc), of the adjacent probes
+// lo and hi, or -1 if no candidate lies between them
+static int bisect_probes(const ProbeSet* probes, const int* candidates, const int num_candidates,
+    const int lo, const int hi) {
+
+    const double middle = 0.5 * (log((double)probes->Kc[lo]) + log((double)probes->Kc[hi]));
+    int best = -1;
+    for (int i = 0; i < num_candidates; ++i) {
+        if (candidates[i] <= probes->Kc[lo] || candidates[i] >= probes->Kc[hi]) continue;
+        if (best < 0 || fabs(log((double)candidates[i]) - middle) < fabs(log((double)candidates[best]) - middle)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+// Returns the candidate to probe when the models settle on the probe p without meeting the
+// goals: the middle of the gap next to p whose far end has the higher recall, where a better
+// configuration is most likely, else the middle of the widest gap left. -1 if all were probed.
+static int next_candidate(const ProbeSet* probes, const int* candidates, const int num_candidates,
+    const int p) {
+
+    const int left = p > 0 ? bisect_probes(probes, candidates, num_candidates, p - 1, p) : -1;
+    const int right = p + 1 < probes->count ? bisect_probes(probes, candidates, num_candidates, p, p + 1) : -1;
+    if (left >= 0 && (right < 0 || probes->recall[p - 1] >= probes->recall[p + 1])) return left;
+    if (right >= 0) return right;
+
+    int best = -1;
+    double widest = 0.0;
+    for (int i = 1; i < probes->count; ++i) {
+        const int c = bisect_probes(probes, candidates, num_candidates, i - 1, i);
+        const double width = log((double)probes->Kc[i]) - log((double)probes->Kc[i - 1]);
+        if (c >= 0 && width > widest) {
+            best = c;
+            widest = width;
+        }
+    }
+    return best;
+}
+
+
+static void cost_features(const CostModel* model, const int Kc, double* f) {
+    f[0] = (double)Kc / model->Kc_max;
+    f[1] = (double)model->Kc_min / Kc;
+    f[2] = 1.0;
+}
+
+
+// Solves the n x n system A x = b by Gaussian elimination, returns non-zero if it is singular
+static int solve_linear(double A[3][3], double* b, const int n) {
+    for (int c = 0; c < n; ++c) {
+        int pivot = c;
+        for (int r = c + 1; r < n; ++r) {
+            if (fabs(A[r][c]) > fabs(A[pivot][c])) pivot = r;
+        }
+        if (fabs(A[pivot][c]) < 1e-12) return 1;
+        for (int k = 0; k < n; ++k) {
+            const double tmp = A[c][k];
+            A[c][k] = A[pivot][k];
+            A[pivot][k] = tmp;
+        }
+        const double tmp = b[c];
+        b[c] = b[pivot];
+        b[pivot] = tmp;
+
+        for (int r = c + 1; r < n; ++r) {
+            const double factor = A[r][c] / A[c][c];
+            for (int k = c; k < n; ++k) A[r][k] -= factor * A[c][k];
+            b[r] -= factor * b[c];
+        }
+    }
+    for (int c = n - 1; c >= 0; --c) {
+        for (int k = c + 1; k < n; ++k) b[c] -= A[c][k] * b[k];
+        b[c] /= A[c][c];
+    }
+    return 0;
+}
+
+
+// Least squares fit of the non-negative coefficients of the time model, trying every
+// subset of the terms and keeping the best fit with no negative coefficient
+static void fit_cost_model(const ProbeSet* probes, CostModel* model) {
+    double best_residual = INFINITY;
+    memset(model->coef, 0, sizeof(model->coef));
+
+    for (int mask = 1; mask < 8; ++mask) {
+        int terms[3], n = 0;
+        for (int t = 0; t < 3; ++t) {
+            if (mask & (1 << t)) terms[n++] = t;
+        }
+        if (n > probes->count) continue;
+
+        double A[3][3] = {{0}}, b[3] = {0};
+        for (int i = 0; i < probes->count; ++i) {
+            double f[3];
+            cost_features(model, probes->Kc[i], f);
+            for (int r = 0; r < n; ++r) {
+                for (int c = 0; c < n; ++c) A[r][c] += f[terms[r]] * f[terms[c]];
+                b[r] += f[terms[r]] * probes->seconds[i];
+            }
+        }
+        if (solve_linear(A, b, n)) continue;
+
+        int negative = 0;
+        for (int r = 0; r < n; ++r) negative |= b[r] < 0.0;
+        if (negative) continue;
+
+        double residual = 0.0;
+        for (int i = 0; i < probes->count; ++i) {
+            double f[3], predicted = 0.0;
+            cost_features(model, probes->Kc[i], f);
+            for (int r = 0; r < n; ++r) predicted += b[r] * f[terms[r]];
+            residual += (predicted - probes->seconds[i]) * (predicted - probes->seconds[i]);
+        }
+        if (residual < best_residual) {
+            best_residual = residual;
+            memset(model->coef, 0, sizeof(model->coef));
+            for (int r = 0; r < n; ++r) model->coef[terms[r]] = b[r];
+        }
+    }
+}
+
+
+static double predict_seconds(const CostModel* model, const int Kc) {
+    double f[3];
+    cost_features(model, Kc, f);
+    return model->coef[0] * f[0] + model->coef[1] * f[1] + model->coef[2] * f[2];
+}
+
+
+// Predicts the recall and time of Kc clusters, the measurements if Kc was probed
+static void predict(const ProbeSet* probes, const CostModel* model, const int Kc, double* recall,
+    double* seconds) {
+
+    const int p = find_probe(probes, Kc);
+    *recall = p >= 0 ? probes->recall[p] : predict_recall(probes, Kc);
+    *seconds = p >= 0 ? probes->seconds[p] : predict_seconds(model, Kc);
+}
+
+
+// Returns the candidate that best meets the goals, and whether it meets them
+static int choose_candidate(const ProbeSet* probes, const CostModel* model, const int* candidates,
+    const int num_candidates, const a2a_tune_options_t* opts, int* goal_met) {
+
+    int best = -1, fallback = -1;
+    double best_recall = 0.0, best_seconds = 0.0, fallback_recall = 0.0, fallback_seconds = 0.0;
+
+    for (int i = 0; i < num_candidates; ++i) {
+        double recall, seconds;
+        predict(probes, model, candidates[i], &recall, &seconds);
+        const int in_budget = opts->time_budget <= 0.0 || seconds <= opts->time_budget;
+        const int accurate = opts->target_recall <= 0.0 || recall >= opts->target_recall;
+
+        if (in_budget && accurate) {
+            // Fastest configuration reaching the target, or most accurate one within the budget
+            const int better = opts->target_recall > 0.0 ? seconds < best_seconds : recall > best_recall;
+            if (best < 0 || better) {
+                best = i;
+                best_recall = recall;
+                best_seconds = seconds;
+            }
+        }
+        else {
+            // Most accurate configuration within the budget, or fastest one if none is
+            const int fallback_in_budget = opts->time_budget <= 0.0 || fallback_seconds <= opts->time_budget;
+            const int better = in_budget ? !fallback_in_budget || recall > fallback_recall :
+                !fallback_in_budget && seconds < fallback_seconds;
+            if (fallback < 0 || better) {
+                fallback = i;
+                fallback_recall = recall;
+                fallback_seconds = seconds;
+            }
+        }
+    }
+
+    *goal_met = best >= 0;
+    return best >= 0 ? best : fallback;
+}
+
+
+void a2a_tune_options_init(a2a_tune_options_t *opts) {
+    opts->target_recall = 0.9;
+    opts->time_budget = 0.0;
+    opts->sample_size = 1000;
+    opts->max_probes = 6;
+    opts->cache_multiple = 1;
+    opts->seed = 0;
+}
+
+
+int a2a_tune_annsearch(const DTYPE* C, const int N, const int L, const int K, const int nthreads,
+    const double max_memory_usage_ratio, parallelization_type_t par_type, const a2a_ann_options_t *base,
+    const a2a_tune_options_t *opts, a2a_tune_result_t *result) {
+
+    a2a_tune_options_t tune;
+    if (opts) tune = *opts;
+    else a2a_tune_options_init(&tune);
+
+    if (!C || N <= 0 || L <= 0 || K <= 0 || !result) {
+        fprintf(stderr, "Invalid input parameters for the ANN tuning\n");
+        return EXIT_FAILURE;
+    }
+    if (N / (K + 1) < 1) {
+        fprintf(stderr, "Number of data points is too small for the given K\n");
+        return EXIT_FAILURE;
+    }
+    if (tune.target_recall < 0.0 || tune.target_recall > 1.0 || tune.time_budget < 0.0 ||
+        (tune.target_recall == 0.0 && tune.time_budget == 0.0)) {
+        fprintf(stderr, "Invalid tuning goals: recall %f, time budget %f\n", tune.target_recall, tune.time_budget);
+        return EXIT_FAILURE;
+    }
+    if (tune.sample_size < 1 || tune.max_probes < 2 || tune.cache_multiple < 1) {
+        fprintf(stderr, "Invalid tuning budget: %d sample points, %d probes, cache multiple %d\n",
+            tune.sample_size, tune.max_probes, tune.cache_multiple);
+        return EXIT_FAILURE;
+    }
+
+    TuneContext ctx;
+    ctx.C = C;
+    ctx.N = N;
+    ctx.L = L;
+    ctx.K = K;
+    ctx.nthreads = nthreads;
+    ctx.max_memory_usage_ratio = max_memory_usage_ratio;
+    ctx.par_type = par_type;
+    if (base) ctx.options = *base;
+    else a2a_ann_options_init(&ctx.options);
+    if (ctx.options.max_cluster_size == 0 || ctx.options.max_cluster_size == A2A_CLUSTER_SIZE_AUTO) {
+        const long max_size = (long)tune.cache_multiple * a2a_cluster_size_from_cache(L);
+        ctx.options.max_cluster_size = max_size < N ? (int)max_size : N;
+    }
+    ctx.sample_size = tune.sample_size < N ? tune.sample_size : N;
+
+    // Fewer clusters than this would be split by the maximum cluster size anyway
+    const int max_cluster_size = ctx.options.max_cluster_size;
+    CostModel model;
+    model.Kc_max = N / (K + 1);
+    model.Kc_min = (int)(((long)N + max_cluster_size - 1) / max_cluster_size);
+    if (model.Kc_min > model.Kc_max) model.Kc_min = model.Kc_max;
+    memset(model.coef, 0, sizeof(model.coef));
+
+    int status = EXIT_FAILURE;
+    int *order = NULL, *sample = NULL, *exact = NULL, *exact_idx = NULL, *candidates = NULL;
+    DTYPE *queries = NULL, *exact_dist = NULL;
+    ProbeSet probes = { 0, NULL, NULL, NULL };
+    ctx.IDX = NULL;
+    ctx.D = NULL;
+
+    order = (int *)a2a_Malloc(sizeof(int) * N);
+    sample = (int *)a2a_Malloc(sizeof(int) * ctx.sample_size);
+    exact = (int *)a2a_Malloc(sizeof(int) * ctx.sample_size * K);
+    exact_idx = (int *)a2a_Malloc(sizeof(int) * ctx.sample_size * (K + 1));
+    exact_dist = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * ctx.sample_size * (K + 1));
+    queries = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * (size_t)ctx.sample_size * L);
+    candidates = (int *)a2a_Malloc(sizeof(int) * A2A_TUNE_CANDIDATES);
+    probes.Kc = (int *)a2a_Malloc(sizeof(int) * tune.max_probes);
+    probes.recall = (double *)a2a_Malloc(sizeof(double) * tune.max_probes);
+    probes.seconds = (double *)a2a_Malloc(sizeof(double) * tune.max_probes);
+    ctx.IDX = (int *)a2a_Malloc(sizeof(int) * (size_t)N * K);
+    ctx.D = (DTYPE *)a2a_Malloc(sizeof(DTYPE) * (size_t)N * K);
+    if (!order || !sample || !exact || !exact_idx || !exact_dist || !queries || !candidates ||
+        !probes.Kc || !probes.recall || !probes.seconds || !ctx.IDX || !ctx.D) {
+        fprintf(stderr, "Error allocating memory for the ANN tuning\n");
+        goto cleanup;
+    }
+
+    // Sample distinct points (partial Fisher-Yates shuffle) and find their exact neighbors
+    unsigned int seed = tune.seed;
+    for (int i = 0; i < N; ++i) order[i] = i;
+    for (int s = 0; s < ctx.sample_size; ++s) {
+        const int j = s + rand_r(&seed) % (N - s);
+        const int tmp = order[s];
+        order[s] = order[j];
+        order[j] = tmp;
+        sample[s] = order[s];
+        memcpy(queries + (size_t)s * L, C + (size_t)sample[s] * L, sizeof(DTYPE) * L);
+    }
+    const int exact_K = K + 1 < N ? K + 1 : N;
+    if (a2a_knnsearch(queries, C, exact_idx, exact_dist, ctx.sample_size, N, L, exact_K, 1, nthreads, 1,
+        max_memory_usage_ratio, par_type)) goto cleanup;
+    for (int s = 0; s < ctx.sample_size; ++s) {
+        int k = 0;
+        for (int j = 0; j < exact_K && k < K; ++j) {
+            if (exact_idx[s * exact_K + j] != sample[s]) exact[s * K + k++] = exact_idx[s * exact_K + j];
+        }
+        while (k < K) exact[s * K + k++] = -1;
+    }
+    ctx.sample = sample;
+    ctx.exact = exact;
+
+    // Candidates evenly spaced in log(Kc)
+    int num_candidates = 0;
+    for (int i = 0; i < A2A_TUNE_CANDIDATES; ++i) {
+        const double t = A2A_TUNE_CANDIDATES > 1 ? (double)i / (A2A_TUNE_CANDIDATES - 1) : 0.0;
+        const int Kc = (int)(exp(log((double)model.Kc_min) + t * (log((double)model.Kc_max) -
+            log((double)model.Kc_min))) + 0.5);
+        if (num_candidates == 0 || Kc > candidates[num_candidates - 1]) candidates[num_candidates++] = Kc;
+    }
+
+    // Probe both ends of the range, then where the models place the best configuration. Once
+    // they settle on a probe that misses the goals, the remaining probes search between probes.
+    if (run_probe(&ctx, &probes, model.Kc_min)) goto cleanup;
+    if (model.Kc_max != model.Kc_min && run_probe(&ctx, &probes, model.Kc_max)) goto cleanup;
+    int chosen, goal_met;
+    for (;;) {
+        fit_cost_model(&probes, &model);
+        chosen = choose_candidate(&probes, &model, candidates, num_candidates, &tune, &goal_met);
+        if (probes.count == tune.max_probes) break;
+
+        int next = chosen;
+        const int p = find_probe(&probes, candidates[chosen]);
+        if (p >= 0) {
+            if (goal_met) break;
+            next = next_candidate(&probes, candidates, num_candidates, p);
+            if (next < 0) break;
+        }
+        if (run_probe(&ctx, &probes, candidates[next])) goto cleanup;
+    }
+
+    result->Kc = candidates[chosen];
+    result->options = ctx.options;
+    predict(&probes, &model, result->Kc, &result->recall, &result->seconds);
+    result->throughput = result->seconds > 0.0 ? N / result->seconds : INFINITY;
+    result->goal_met = goal_met;
+    result->probes = probes.count;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_Free(order);
+    a2a_Free(sample);
+    a2a_Free(exact);
+    a2a_Free(exact_idx);
+    a2a_Free(exact_dist);
+    a2a_Free(queries);
+    a2a_Free(candidates);
+    a2a_Free(probes.Kc);
+    a2a_Free(probes.recall);
+    a2a_Free(probes.seconds);
+    a2a_Free(ctx.IDX);
+    a2a_Free(ctx.D);
+
+    return status;
+}
@@ -1,8 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "ioutil.h"
 #include "a2a_knn.h"
+#include "a2a_ivf.h"
+#include "a2a_nndescent.h"
+#include "a2a_hnsw.h"
+#include "a2a_pq.h"
+#include "a2a_graph.h"
+#include "a2a_tune.h"
+#include "a2a_shard.h"
+#include "a2a_eval.h"
+#include "a2a_trace.h"
 
 
 // Function to set terminal color
@@ -19,6 +30,14 @@ void setColor(const char *colorCode)
 
 #define TOLERANCE 1e-6
 #define MAX_MEMORY_USAGE_RATIO 0.01
+#define BUDGET_SLACK 16384          // Bytes of per-search bookkeeping left out of the memory budget
+
+// Synthetic dataset of the engine tests
+#define ENGINE_N 2000
+#define ENGINE_L 8
+#define ENGINE_K 10
+#define ENGINE_BLOBS 16
+#define ENGINE_THREADS 2
 
 
 int test_case(const char *filename, double tolerance)
@@ -107,6 +126,1385 @@ cleanup:
 }
 
 
+int check(int condition, const char *assertion)
+{
+    if (!condition) printf("Assertion %s ", assertion);
+    return condition;
+}
+
+
+double gaussian(unsigned int *seed)
+{
+    double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+
+// Gaussian blobs around random centers, so that the clusters found by the engines mean something
+double *make_dataset(int N, int L, unsigned int seed)
+{
+    double *centers = (double *)malloc(ENGINE_BLOBS * L * sizeof(double));
+    double *data = (double *)malloc((size_t)N * L * sizeof(double));
+    if (!centers || !data)
+    {
+        free(centers);
+        free(data);
+        return NULL;
+    }
+
+    for (int i = 0; i < ENGINE_BLOBS * L; i++) centers[i] = 4.0 * gaussian(&seed);
+    for (int i = 0; i < N; i++)
+    {
+        int blob = rand_r(&seed) % ENGINE_BLOBS;
+        for (int l = 0; l < L; l++) data[(size_t)i * L + l] = centers[blob * L + l] + gaussian(&seed);
+    }
+
+    free(centers);
+    return data;
+}
+
+
+// Exact neighbors of the first M points of C found by a2a_knnsearch, without the point itself if skip_self
+int *exact_neighbors(const double *C, int M, int N, int L, int K, int skip_self)
+{
+    int K_search = skip_self ? K + 1 : K;
+    int *IDX = (int *)malloc((size_t)M * K_search * sizeof(int));
+    double *D = (double *)malloc((size_t)M * K_search * sizeof(double));
+    int *truth = (int *)malloc((size_t)M * K * sizeof(int));
+
+    if (!IDX || !D || !truth || a2a_knnsearch(C, C, IDX, D, M, N, L, K_search, 1, ENGINE_THREADS, 1, 
+        MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS))
+    {
+        free(truth);
+        truth = NULL;
+    }
+    else
+    {
+        for (int i = 0; i < M; i++)
+        {
+            int k = 0;
+            for (int j = 0; j < K_search && k < K; j++)
+            {
+                if (!skip_self || IDX[i * K_search + j] != i) truth[i * K + k++] = IDX[i * K_search + j];
+            }
+        }
+    }
+
+    free(IDX);
+    free(D);
+    return truth;
+}
+
+
+// Share of the exact neighbors found
+double recall(const int *IDX, const int *truth, int M, int K)
+{
+    long found = 0;
+    for (int i = 0; i < M; i++)
+    {
+        for (int j = 0; j < K; j++)
+        {
+            for (int k = 0; k < K; k++)
+            {
+                if (IDX[i * K + j] == truth[i * K + k])
+                {
+                    found++;
+                    break;
+                }
+            }
+        }
+    }
+    return (double)found / ((double)M * K);
+}
+
+
+// Whether every row of an all-to-all result lists K other points sorted by distance
+int valid_rows(const int *IDX, const double *D, int N, int K)
+{
+    for (int i = 0; i < N; i++)
+    {
+        for (int k = 0; k < K; k++)
+        {
+            int j = IDX[i * K + k];
+            if (j < 0 || j >= N || j == i) return 0;
+            if (k > 0 && D[i * K + k] < D[i * K + k - 1]) return 0;
+        }
+    }
+    return 1;
+}
+
+
+int test_ivf(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, M = 200, Kc = 20, nprobe = 3;
+    const char *path = "test_ivf.ivf";
+    double *C = NULL, *D = NULL, *D_loaded = NULL;
+    int *truth = NULL, *IDX = NULL, *IDX_loaded = NULL;
+    a2a_ivf_t *index = NULL, *loaded = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 1); if (!C) goto cleanup;
+    truth = exact_neighbors(C, M, N, L, K, 0); if (!truth) goto cleanup;
+    IDX = (int *)malloc(M * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(M * K * sizeof(double)); if (!D) goto cleanup;
+    IDX_loaded = (int *)malloc(M * K * sizeof(int)); if (!IDX_loaded) goto cleanup;
+    D_loaded = (double *)malloc(M * K * sizeof(double)); if (!D_loaded) goto cleanup;
+
+    if (a2a_ivf_build(C, N, L, Kc, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, NULL, &index)) goto cleanup;
+
+    // Probing every cluster is an exact search
+    if (a2a_ivf_search(index, C, M, K, index->Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS)) goto cleanup;
+    if (!check(recall(IDX, truth, M, K) == 1.0, "IVF recall with all the clusters probed == 1")) goto cleanup;
+
+    // The loaded index answers as the one that was saved
+    if (a2a_ivf_save(index, path)) goto cleanup;
+    if (a2a_ivf_load(path, &loaded)) goto cleanup;
+    if (!check(loaded->N == index->N && loaded->L == index->L && loaded->Kc == index->Kc, 
+        "IVF loaded dimensions == saved dimensions")) goto cleanup;
+    if (a2a_ivf_search(index, C, M, K, nprobe, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS)) goto cleanup;
+    if (a2a_ivf_search(loaded, C, M, K, nprobe, IDX_loaded, D_loaded, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_OPENMP)) goto cleanup;
+    for (int i = 0; i < M * K; i++)
+    {
+        if (!check(IDX[i] == IDX_loaded[i] && D[i] == D_loaded[i], "IVF loaded result == saved result")) goto cleanup;
+    }
+    if (!check(recall(IDX, truth, M, K) > 0.9, "IVF recall with 3 probes > 0.9")) goto cleanup;
+
+    // Error paths
+    if (!check(a2a_ivf_load("missing.ivf", &loaded) == EXIT_FAILURE, "IVF load of a missing file fails")) goto cleanup;
+    if (!check(a2a_ivf_search(index, C, M, 0, nprobe, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS) == EXIT_FAILURE, "IVF search with K = 0 fails")) goto cleanup;
+    if (!check(a2a_ivf_save(index, "missing/test_ivf.ivf") == EXIT_FAILURE, 
+        "IVF save to a missing directory fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_ivf_free(index);
+    a2a_ivf_free(loaded);
+    remove(path);
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+    free(IDX_loaded);
+    free(D_loaded);
+
+    return status;
+}
+
+
+int test_nndescent(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 40;
+    double *C = NULL, *D = NULL;
+    int *truth = NULL, *IDX = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 2); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+
+    // From a random graph
+    if (a2a_nndescent(C, N, L, K, IDX, D, ENGINE_THREADS, PAR_PTHREADS, NULL)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "NN-descent rows are valid")) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) > 0.95, "NN-descent recall > 0.95")) goto cleanup;
+
+    // Refining a result of a2a_annsearch never loses recall
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    double ann_recall = recall(IDX, truth, N, K);
+    if (a2a_nndescent_refine(C, N, L, K, IDX, D, ENGINE_THREADS, PAR_OPENMP, NULL)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "NN-descent refined rows are valid")) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) >= ann_recall, "NN-descent refined recall >= ANN recall")) goto cleanup;
+
+    // Error paths
+    a2a_nndescent_options_t opts;
+    a2a_nndescent_options_init(&opts);
+    opts.sample_rate = 0.0;
+    if (!check(a2a_nndescent(C, N, L, K, IDX, D, ENGINE_THREADS, PAR_PTHREADS, &opts) == EXIT_FAILURE, 
+        "NN-descent with sample_rate = 0 fails")) goto cleanup;
+    if (!check(a2a_nndescent(C, K, L, K, IDX, D, ENGINE_THREADS, PAR_PTHREADS, NULL) == EXIT_FAILURE, 
+        "NN-descent with K = N fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+int test_hnsw(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, M = 200, ef = 100;
+    double *C = NULL, *D = NULL;
+    int *truth = NULL, *truth_self = NULL, *IDX = NULL;
+    a2a_hnsw_t *index = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 3); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    truth_self = exact_neighbors(C, M, N, L, K, 0); if (!truth_self) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+
+    if (a2a_hnsw_build(C, N, L, ENGINE_THREADS, PAR_PTHREADS, NULL, &index)) goto cleanup;
+
+    // Queries taken from the dataset find themselves
+    if (a2a_hnsw_search(index, C, M, K, ef, IDX, D, ENGINE_THREADS, PAR_PTHREADS)) goto cleanup;
+    if (!check(recall(IDX, truth_self, M, K) > 0.95, "HNSW search recall > 0.95")) goto cleanup;
+    for (int i = 0; i < M; i++)
+    {
+        if (!check(IDX[i * K] == i && D[i * K] == 0.0, "HNSW query from the dataset finds itself first")) goto cleanup;
+    }
+
+    if (a2a_hnsw_all_to_all(index, K, ef, IDX, D, ENGINE_THREADS, PAR_OPENMP)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "HNSW all-to-all rows are valid")) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) > 0.95, "HNSW all-to-all recall > 0.95")) goto cleanup;
+
+    // Error paths
+    a2a_hnsw_options_t opts;
+    a2a_hnsw_options_init(&opts);
+    opts.M = 1;
+    a2a_hnsw_t *invalid = NULL;
+    if (!check(a2a_hnsw_build(C, N, L, ENGINE_THREADS, PAR_PTHREADS, &opts, &invalid) == EXIT_FAILURE, 
+        "HNSW build with M = 1 fails")) goto cleanup;
+    if (!check(a2a_hnsw_search(index, C, M, 0, ef, IDX, D, ENGINE_THREADS, PAR_PTHREADS) == EXIT_FAILURE, 
+        "HNSW search with K = 0 fails")) goto cleanup;
+    if (!check(a2a_hnsw_all_to_all(index, N, ef, IDX, D, ENGINE_THREADS, PAR_PTHREADS) == EXIT_FAILURE, 
+        "HNSW all-to-all with K = N fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_hnsw_free(index);
+    free(C);
+    free(truth);
+    free(truth_self);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+// Whether the codes of the first n points of X pick the nearest centroid of every subspace
+int nearest_codes(const a2a_pq_t *pq, const double *X, int n, const unsigned char *codes)
+{
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < pq->m; j++)
+        {
+            const unsigned char *code = codes + (size_t)i * pq->code_size;
+            int c = pq->nbits == 8 ? code[j] : (j % 2 ? code[j / 2] >> 4 : code[j / 2] & 0xF);
+            const double *sub = X + (size_t)i * pq->L + j * pq->dsub;
+            double best = INFINITY, chosen = 0.0;
+            for (int k = 0; k < pq->ksub; k++)
+            {
+                const double *centroid = pq->centroids + ((size_t)j * pq->ksub + k) * pq->dsub;
+                double dist = 0.0;
+                for (int l = 0; l < pq->dsub; l++) dist += (sub[l] - centroid[l]) * (sub[l] - centroid[l]);
+                if (dist < best) best = dist;
+                if (k == c) chosen = dist;
+            }
+            if (chosen > best + TOLERANCE) return 0;
+        }
+    }
+    return 1;
+}
+
+
+int test_pq(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20, m = 4, n = 100;
+    double *C = NULL, *D = NULL;
+    int *truth = NULL, *IDX = NULL;
+    unsigned char *codes = NULL;
+    a2a_pq_t *pq = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 4); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    codes = (unsigned char *)malloc(n * m); if (!codes) goto cleanup;
+
+    // Codes of 8 and 4 bits
+    for (int nbits = 8; nbits >= 4; nbits -= 4)
+    {
+        if (a2a_pq_train(C, N, L, m, nbits, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &pq)) goto cleanup;
+        if (!check(pq->code_size == m * nbits / 8, "PQ code size == m * nbits / 8")) goto cleanup;
+        if (a2a_pq_encode(pq, C, n, codes, ENGINE_THREADS, PAR_PTHREADS)) goto cleanup;
+        if (!check(nearest_codes(pq, C, n, codes), "PQ codes pick the nearest centroids")) goto cleanup;
+        a2a_pq_free(pq);
+        pq = NULL;
+    }
+
+    // Re-ranked scan of the codes against the search of the gathered clusters
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    double exact_recall = recall(IDX, truth, N, K);
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.pq_subspaces = m;
+    opts.pq_rerank = 4 * K;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "PQ rows are valid")) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) > exact_recall - 0.05, "PQ recall > ANN recall - 0.05")) goto cleanup;
+    for (int i = 0; i < N * K; i++)
+    {
+        const double *x = C + (size_t)(i / K) * L, *y = C + (size_t)IDX[i] * L;
+        double dist = 0.0;
+        for (int l = 0; l < L; l++) dist += (x[l] - y[l]) * (x[l] - y[l]);
+        if (!check(fabs(sqrt(dist) - D[i]) < TOLERANCE, "PQ re-ranked distance == exact distance")) goto cleanup;
+    }
+
+    // The 4-bit fast scan re-ranks by default
+    a2a_ann_options_init(&opts);
+    opts.pq_subspaces = m;
+    opts.pq_bits = 4;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) > exact_recall - 0.05, "4-bit PQ recall > ANN recall - 0.05")) goto cleanup;
+
+    // Error paths
+    if (!check(a2a_pq_train(C, N, L, 3, 8, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &pq) == EXIT_FAILURE, 
+        "PQ with m not dividing L fails")) goto cleanup;
+    if (!check(a2a_pq_train(C, N, L, m, 5, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &pq) == EXIT_FAILURE, 
+        "PQ with 5 bits fails")) goto cleanup;
+    opts.pq_subspaces = 3;
+    if (!check(a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts) == EXIT_FAILURE, "ANN search with m not dividing L fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_pq_free(pq);
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+    free(codes);
+
+    return status;
+}
+
+
+int test_graph(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20, nprobe = 3, n = 100, deleted_cnt = 300;
+    const int total = N + n;
+    double *C = NULL, *X = NULL, *live = NULL;
+    int *ids = NULL, *deleted = NULL, *live_index = NULL, *truth = NULL, *found = NULL;
+    a2a_graph_t *graph = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 5); if (!C) goto cleanup;
+    X = make_dataset(n, L, 6); if (!X) goto cleanup;
+    ids = (int *)malloc(n * sizeof(int)); if (!ids) goto cleanup;
+    deleted = (int *)malloc(deleted_cnt * sizeof(int)); if (!deleted) goto cleanup;
+    live_index = (int *)malloc(total * sizeof(int)); if (!live_index) goto cleanup;
+    live = (double *)malloc((size_t)total * L * sizeof(double)); if (!live) goto cleanup;
+    found = (int *)malloc(total * K * sizeof(int)); if (!found) goto cleanup;
+
+    if (a2a_graph_build(C, N, L, K, Kc, nprobe, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        NULL, &graph)) goto cleanup;
+    if (a2a_graph_insert(graph, X, n, ids, ENGINE_THREADS, PAR_PTHREADS)) goto cleanup;
+    for (int i = 0; i < n; i++)
+    {
+        if (!check(ids[i] == N + i, "graph identifiers of inserted points follow the built ones")) goto cleanup;
+    }
+
+    // Delete old and new points, twice to check that it has no effect the second time
+    for (int i = 0; i < deleted_cnt; i++) deleted[i] = i * 7;
+    if (a2a_graph_delete(graph, deleted, deleted_cnt, ENGINE_THREADS, PAR_OPENMP)) goto cleanup;
+    if (a2a_graph_delete(graph, deleted, deleted_cnt, ENGINE_THREADS, PAR_PTHREADS)) goto cleanup;
+    if (!check(a2a_graph_size(graph) == total, "graph size == built and inserted points")) goto cleanup;
+
+    // No row refers to a deleted point, and the rows of deleted points are empty
+    const int *IDX;
+    const double *D;
+    a2a_graph_rows(graph, &IDX, &D);
+    for (int i = 0; i < total; i++)
+    {
+        if (!check(a2a_graph_is_deleted(graph, i) == (i % 7 == 0 && i / 7 < deleted_cnt), 
+            "graph deleted flags match the deletions")) goto cleanup;
+        for (int k = 0; k < K; k++)
+        {
+            int j = IDX[i * K + k];
+            if (a2a_graph_is_deleted(graph, i))
+            {
+                if (!check(j == -1 && D[i * K + k] == INF, "graph rows of deleted points are empty")) goto cleanup;
+                continue;
+            }
+            if (!check(j >= 0 && j < total && j != i && !a2a_graph_is_deleted(graph, j), 
+                "graph neighbors are other live points")) goto cleanup;
+            if (!check(k == 0 || D[i * K + k] >= D[i * K + k - 1], "graph rows are sorted")) goto cleanup;
+        }
+    }
+
+    // Recall of the live points against their exact neighbors among the live points
+    int live_cnt = 0;
+    for (int i = 0; i < total; i++)
+    {
+        live_index[i] = a2a_graph_is_deleted(graph, i) ? -1 : live_cnt;
+        if (live_index[i] < 0) continue;
+        const double *point = i < N ? C + (size_t)i * L : X + (size_t)(i - N) * L;
+        for (int l = 0; l < L; l++) live[(size_t)live_cnt * L + l] = point[l];
+        for (int k = 0; k < K; k++) found[live_cnt * K + k] = IDX[i * K + k];
+        live_cnt++;
+    }
+    for (int i = 0; i < live_cnt * K; i++) found[i] = live_index[found[i]];
+    truth = exact_neighbors(live, live_cnt, live_cnt, L, K, 1); if (!truth) goto cleanup;
+    if (!check(recall(found, truth, live_cnt, K) > 0.9, "graph recall after updates > 0.9")) goto cleanup;
+
+    // Copies of live points find their originals, which list them in return
+    int copies[5];
+    if (a2a_graph_insert(graph, C + L, 5, copies, ENGINE_THREADS, PAR_PTHREADS)) goto cleanup;
+    a2a_graph_rows(graph, &IDX, &D);
+    for (int i = 0; i < 5; i++)
+    {
+        int listed = 0;
+        for (int k = 0; k < K; k++) listed |= IDX[(1 + i) * K + k] == copies[i];
+        if (!check(D[copies[i] * K] == 0.0 && listed, "graph inserted points are found by their neighbors")) 
+            goto cleanup;
+    }
+
+    // Error paths
+    int invalid = total + 5;
+    if (!check(a2a_graph_delete(graph, &invalid, 1, ENGINE_THREADS, PAR_PTHREADS) == EXIT_FAILURE, 
+        "graph deletion of an unknown identifier fails")) goto cleanup;
+    if (!check(a2a_graph_insert(graph, X, -1, ids, ENGINE_THREADS, PAR_PTHREADS) == EXIT_FAILURE, 
+        "graph insertion of -1 points fails")) goto cleanup;
+    a2a_graph_t *too_fine = NULL;
+    if (!check(a2a_graph_build(C, N, L, K, N / K, nprobe, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        NULL, &too_fine) == EXIT_FAILURE, "graph with clusters of K points fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_graph_free(graph);
+    free(C);
+    free(X);
+    free(ids);
+    free(deleted);
+    free(live_index);
+    free(live);
+    free(truth);
+    free(found);
+
+    return status;
+}
+
+
+int test_tune(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K;
+    double *C = NULL, *D = NULL;
+    int *truth = NULL, *IDX = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 1); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+
+    // The 3 clusters of at most 700 points cut through the blobs and the 181 clusters of 11 points
+    // split them, so the recall peaks in between
+    a2a_ann_options_t base;
+    a2a_ann_options_init(&base);
+    base.max_cluster_size = 700;
+    a2a_tune_options_t opts;
+    a2a_tune_options_init(&opts);
+    opts.target_recall = 0.92;
+    opts.sample_size = 500;
+    a2a_tune_result_t result;
+    if (a2a_tune_annsearch(C, N, L, K, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &base, &opts, 
+        &result)) goto cleanup;
+    if (!check(result.goal_met, "tuner meets a recall target reached inside the range")) goto cleanup;
+    if (!check(result.Kc > 3 && result.Kc < N / (K + 1), "tuner Kc lies inside the range")) goto cleanup;
+    if (!check(result.probes <= opts.max_probes, "tuner probes <= max_probes")) goto cleanup;
+    if (!check(result.options.max_cluster_size == base.max_cluster_size, "tuner keeps the maximum cluster size"))
+        goto cleanup;
+    if (a2a_annsearch_ex(C, N, L, K, result.Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &result.options)) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) > 0.9, "tuned ANN recall > 0.9")) goto cleanup;
+
+    // Without a maximum cluster size, the tuner derives it from the cache and the chosen Kc respects it
+    base.max_cluster_size = 0;
+    opts.cache_multiple = 1;
+    if (a2a_tune_annsearch(C, N, L, K, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &base, &opts, 
+        &result)) goto cleanup;
+    if (!check(result.options.max_cluster_size > 0 && result.options.max_cluster_size <= N, 
+        "tuner derives the maximum cluster size from the cache")) goto cleanup;
+    if (!check((long)result.Kc * result.options.max_cluster_size >= N, "tuner Kc honours the cache bound"))
+        goto cleanup;
+    base.max_cluster_size = 700;
+
+    // Error paths
+    opts.target_recall = 0.0;
+    if (!check(a2a_tune_annsearch(C, N, L, K, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &base, &opts, 
+        &result) == EXIT_FAILURE, "tuner without a goal fails")) goto cleanup;
+    a2a_tune_options_init(&opts);
+    opts.max_probes = 1;
+    if (!check(a2a_tune_annsearch(C, N, L, K, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, &base, &opts, 
+        &result) == EXIT_FAILURE, "tuner with one probe fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+int test_shard(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20;
+    double *C = NULL, *D = NULL, *D_single = NULL;
+    int *truth = NULL, *IDX = NULL, *IDX_single = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 7); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    IDX_single = (int *)malloc(N * K * sizeof(int)); if (!IDX_single) goto cleanup;
+    D_single = (double *)malloc(N * K * sizeof(double)); if (!D_single) goto cleanup;
+
+    // Probing every cluster is an exact search, whatever the ranks owning the points and clusters
+    a2a_shard_options_t opts;
+    a2a_shard_options_init(&opts);
+    opts.nprocs = 3;
+    opts.nprobe = Kc;
+    if (a2a_sharded_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, &opts)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "sharded rows are valid")) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) == 1.0, "sharded recall with all the clusters probed == 1")) goto cleanup;
+
+    // A few probes find most neighbors
+    opts.nprobe = 3;
+    if (a2a_sharded_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, &opts)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "sharded rows are valid")) goto cleanup;
+    if (!check(recall(IDX, truth, N, K) > 0.9, "sharded recall with 3 probes > 0.9")) goto cleanup;
+
+    // The ranks split the work only, so one process finds the same neighbors at the same distances
+    opts.nprocs = 1;
+    if (a2a_sharded_annsearch(C, N, L, K, Kc, IDX_single, D_single, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        &opts)) goto cleanup;
+    if (!check(memcmp(IDX, IDX_single, N * K * sizeof(int)) == 0 && memcmp(D, D_single, N * K * sizeof(double)) == 0, 
+        "sharded result equals the single process result")) goto cleanup;
+
+    // Error paths
+    opts.nprocs = 0;
+    if (!check(a2a_sharded_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        &opts) == EXIT_FAILURE, "sharded search without processes fails")) goto cleanup;
+    if (!check(a2a_sharded_annsearch(C, N, L, K, N / K, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        NULL) == EXIT_FAILURE, "sharded search with clusters of K points fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+    free(IDX_single);
+    free(D_single);
+
+    return status;
+}
+
+
+int test_eval(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 40;
+    double *C = NULL, *D = NULL;
+    int *truth = NULL, *IDX = NULL;
+    int status = EXIT_FAILURE;
+
+    // Queries with all, half and none of their exact neighbors, in any order
+    const int small_truth[3 * 4] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    const int small_IDX[3 * 4] = { 3, 2, 1, 0, 4, 5, 20, 21, 30, 31, 32, 33 };
+    double per_query[3];
+    a2a_eval_options_t opts;
+    a2a_eval_options_init(&opts);
+    opts.per_query = per_query;
+    a2a_eval_result_t result;
+    if (a2a_eval_recall(small_IDX, 4, small_truth, 4, 3, &opts, &result)) goto cleanup;
+    if (!check(result.k == 4 && result.recall == 0.5 && result.min_recall == 0.0 && result.median_recall == 0.5, 
+        "eval recall statistics == 0.5, 0, 0.5")) goto cleanup;
+    if (!check(result.perfect == 1 && result.histogram[0] == 1 && result.histogram[A2A_EVAL_BINS / 2] == 1 && 
+        result.histogram[A2A_EVAL_BINS - 1] == 1, "eval histogram holds recalls 0, 0.5 and 1")) goto cleanup;
+    if (!check(per_query[0] == 1.0 && per_query[1] == 0.5 && per_query[2] == 0.0, "eval per query recall")) goto cleanup;
+
+    // Recall@2 only looks at the first 2 columns of both
+    opts.k = 2;
+    if (a2a_eval_recall(small_IDX, 4, small_truth, 4, 3, &opts, &result)) goto cleanup;
+    if (!check(result.k == 2 && per_query[0] == 0.0 && per_query[1] == 1.0, "eval recall@2")) goto cleanup;
+
+    // A missing neighbor never matches a missing exact neighbor, and a result missing more
+    // neighbors than the ground truth is incomplete
+    const int short_truth[2 * 4] = { 0, 1, 2, -1, 4, 5, 6, 7 };
+    const int short_IDX[2 * 4] = { 2, -1, 0, 1, 4, 5, -1, -1 };
+    opts.k = 0;
+    if (a2a_eval_recall(short_IDX, 4, short_truth, 4, 2, &opts, &result)) goto cleanup;
+    if (!check(per_query[0] == 0.75 && per_query[1] == 0.5 && result.incomplete == 1, 
+        "eval skips missing neighbors")) goto cleanup;
+
+    // Against a search on data, with the distance ratio
+    C = make_dataset(N, L, 8); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    a2a_eval_options_init(&opts);
+    opts.Q = C;
+    opts.C = C;
+    opts.N = N;
+    opts.L = L;
+    opts.nthreads = ENGINE_THREADS;
+    if (a2a_eval_recall(truth, K, truth, K, N, &opts, &result)) goto cleanup;
+    if (!check(result.recall == 1.0 && result.perfect == N && fabs(result.distance_ratio - 1.0) < TOLERANCE, 
+        "eval of the exact neighbors == 1")) goto cleanup;
+
+    // Rows partly or fully emptied by a degraded search lower the recall, never the distance ratio
+    memcpy(IDX, truth, N * K * sizeof(int));
+    IDX[K - 1] = -1;
+    for (int k = 0; k < K; k++) IDX[K + k] = -1;
+    if (a2a_eval_recall(IDX, K, truth, K, N, &opts, &result)) goto cleanup;
+    if (!check(result.incomplete == 2 && result.recall < 1.0 && fabs(result.distance_ratio - 1.0) < TOLERANCE, 
+        "eval leaves incomplete rows out of the distance ratio")) goto cleanup;
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    if (a2a_eval_recall(IDX, K, truth, K, N, &opts, &result)) goto cleanup;
+    if (!check(fabs(result.recall - recall(IDX, truth, N, K)) < TOLERANCE, "eval recall == recall")) goto cleanup;
+    if (!check(result.distance_ratio >= 1.0, "eval distance ratio >= 1")) goto cleanup;
+
+    // Error paths
+    if (!check(a2a_eval_recall(IDX, K, truth, K, 0, &opts, &result) == EXIT_FAILURE, 
+        "eval without queries fails")) goto cleanup;
+    opts.k = K + 1;
+    if (!check(a2a_eval_recall(IDX, K, truth, K, N, &opts, &result) == EXIT_FAILURE, 
+        "eval with k above the columns fails")) goto cleanup;
+    opts.k = 0;
+    opts.N = 0;
+    if (!check(a2a_eval_recall(IDX, K, truth, K, N, &opts, &result) == EXIT_FAILURE, 
+        "eval distance ratio without N fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+// Search of test_memory_budget run by a thread of its own
+typedef struct
+{
+    const double *C;
+    int *IDX;
+    double *D;
+    double ratio;
+    int status;
+} budgetSearch;
+
+
+void *budget_search_thread(void *arg)
+{
+    budgetSearch *search = (budgetSearch *)arg;
+    search->status = a2a_annsearch(search->C, ENGINE_N, ENGINE_L, ENGINE_K, 20, search->IDX, search->D, 
+        ENGINE_THREADS, search->ratio, PAR_OPENMP);
+    return NULL;
+}
+
+
+int test_memory_budget(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20;
+    const double budget = 1000000.0, tight_budget = 200000.0;
+    double *C = NULL, *D = NULL, *D_other = NULL;
+    int *IDX = NULL, *IDX_ref = NULL, *IDX_other = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 9); if (!C) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    IDX_ref = (int *)malloc(N * K * sizeof(int)); if (!IDX_ref) goto cleanup;
+    IDX_other = (int *)malloc(N * K * sizeof(int)); if (!IDX_other) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    D_other = (double *)malloc(N * K * sizeof(double)); if (!D_other) goto cleanup;
+
+    // The stats of a search with a large budget give the memory available
+    a2a_stats_t stats;
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.stats = &stats;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX_ref, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    double ratio = budget / (stats.memory_budget_bytes / MAX_MEMORY_USAGE_RATIO);
+    const double tight_ratio = tight_budget / (stats.memory_budget_bytes / MAX_MEMORY_USAGE_RATIO);
+
+    // A small budget gives smaller blocks, not other neighbors. Only the task arrays and other
+    // per-search bookkeeping of constant size come on top of it.
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, tight_ratio, PAR_PTHREADS, &opts)) goto cleanup;
+    if (!check(memcmp(IDX, IDX_ref, N * K * sizeof(int)) == 0, "ANN result with a small budget == reference")) goto cleanup;
+    if (!check(stats.peak_bytes <= stats.memory_budget_bytes + BUDGET_SLACK, "ANN peak memory <= budget")) goto cleanup;
+
+    // The same holds for the trees and the merge arrays of the workers, and for the PQ buffers
+    opts.engine = A2A_ENGINE_RP_FOREST;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, 2 * ENGINE_THREADS, tight_ratio, PAR_OPENMP, &opts)) goto cleanup;
+    if (!check(stats.peak_bytes <= stats.memory_budget_bytes + BUDGET_SLACK, "RP forest peak memory <= budget")) goto cleanup;
+    opts.engine = A2A_ENGINE_KMEANS;
+    opts.pq_subspaces = 4;
+    opts.pq_rerank = 4 * K;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, 2 * ENGINE_THREADS, tight_ratio, PAR_OPENMP, &opts)) goto cleanup;
+    if (!check(stats.peak_bytes <= stats.memory_budget_bytes + BUDGET_SLACK, "PQ peak memory <= budget")) goto cleanup;
+
+    // Concurrent searches share the budget. They run with OpenMP, the pthread pool of a2a_knnsearch
+    // serves one caller at a time.
+    budgetSearch searches[2] = { { C, IDX, D, ratio, EXIT_FAILURE }, { C, IDX_other, D_other, ratio, EXIT_FAILURE } };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++)
+    {
+        if (pthread_create(&threads[i], NULL, budget_search_thread, &searches[i])) goto cleanup;
+    }
+    for (int i = 0; i < 2; i++) pthread_join(threads[i], NULL);
+    if (!check(searches[0].status == EXIT_SUCCESS && searches[1].status == EXIT_SUCCESS, 
+        "concurrent searches within a shared budget succeed")) goto cleanup;
+    if (!check(memcmp(IDX, IDX_ref, N * K * sizeof(int)) == 0 && memcmp(IDX_other, IDX_ref, N * K * sizeof(int)) == 0, 
+        "concurrent results == reference")) goto cleanup;
+
+    // A budget too small for the smallest blocks fails rather than overshoots
+    if (!check(a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, ratio / 100.0, PAR_PTHREADS) == EXIT_FAILURE, 
+        "ANN search with a tiny budget fails")) goto cleanup;
+    if (!check(a2a_knnsearch(C, C, IDX, D, N, N, L, K, 1, ENGINE_THREADS, 1, ratio / 100.0, 
+        PAR_PTHREADS) == EXIT_FAILURE, "kNN search with a tiny budget fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(IDX);
+    free(IDX_ref);
+    free(IDX_other);
+    free(D);
+    free(D_other);
+
+    return status;
+}
+
+
+int test_permute_data(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20;
+    const size_t copy_bytes = (size_t)N * L * sizeof(double);
+    double *C = NULL, *D = NULL, *D_permuted = NULL;
+    int *IDX = NULL, *IDX_permuted = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 10); if (!C) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    IDX_permuted = (int *)malloc(N * K * sizeof(int)); if (!IDX_permuted) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    D_permuted = (double *)malloc(N * K * sizeof(double)); if (!D_permuted) goto cleanup;
+
+    // Searching the clusters in place finds the same neighbors at the same distances
+    a2a_stats_t stats;
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.stats = &stats;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    opts.permute_data = 1;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX_permuted, D_permuted, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS, &opts)) goto cleanup;
+    if (!check(stats.peak_bytes >= (long long)copy_bytes, "permuted search holds a copy of the data")) goto cleanup;
+    if (!check(memcmp(IDX, IDX_permuted, N * K * sizeof(int)) == 0 && memcmp(D, D_permuted, N * K * sizeof(double)) == 0, 
+        "permuted result == gathered result")) goto cleanup;
+
+    // A budget smaller than the copy gathers the clusters instead, and so does a budget that the
+    // copy would leave too small to search the clusters
+    const double capacity = stats.memory_budget_bytes / MAX_MEMORY_USAGE_RATIO;
+    const double ratios[2] = { copy_bytes * 0.75 / capacity, copy_bytes * 1.25 / capacity };
+    for (int r = 0; r < 2; r++)
+    {
+        opts.permute_data = 0;
+        if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, ratios[r], PAR_PTHREADS, &opts)) goto cleanup;
+        opts.permute_data = 1;
+        if (!check(a2a_annsearch_ex(C, N, L, K, Kc, IDX_permuted, D_permuted, ENGINE_THREADS, ratios[r], 
+            PAR_PTHREADS, &opts) == EXIT_SUCCESS, "permuted search within a small budget succeeds")) goto cleanup;
+        if (r == 0 && !check(stats.peak_bytes < (long long)copy_bytes, 
+            "permuted search over budget gathers the clusters")) goto cleanup;
+        if (!check(memcmp(IDX, IDX_permuted, N * K * sizeof(int)) == 0 && 
+            memcmp(D, D_permuted, N * K * sizeof(double)) == 0, "result without the copy == gathered result")) goto cleanup;
+    }
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(IDX);
+    free(IDX_permuted);
+    free(D);
+    free(D_permuted);
+
+    return status;
+}
+
+
+int test_coarse_clusters(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20;
+    double *C = NULL, *D = NULL;
+    int *truth = NULL, *IDX = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 11); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+
+    // Assigning the points within their coarse cluster only costs a little recall
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    double flat_recall = recall(IDX, truth, N, K);
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.coarse_clusters = A2A_COARSE_CLUSTERS_AUTO;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    double coarse_recall = recall(IDX, truth, N, K);
+    if (!check(coarse_recall > 0.7, "two-level k-means recall > 0.7")) goto cleanup;
+    if (!check(coarse_recall > flat_recall - 0.1, "two-level k-means recall > flat recall - 0.1")) goto cleanup;
+
+    // Error paths
+    opts.coarse_clusters = Kc + 1;
+    if (!check(a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts) == EXIT_FAILURE, "more coarse clusters than clusters fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+int test_rp_forest(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20;
+    double *C = NULL, *D = NULL, *D_other = NULL;
+    int *truth = NULL, *IDX = NULL, *IDX_other = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 12); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    IDX_other = (int *)malloc(N * K * sizeof(int)); if (!IDX_other) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    D_other = (double *)malloc(N * K * sizeof(double)); if (!D_other) goto cleanup;
+
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.engine = A2A_ENGINE_RP_FOREST;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    if (!check(valid_rows(IDX, D, N, K), "RP forest rows are valid")) goto cleanup;
+    double forest_recall = recall(IDX, truth, N, K);
+    if (!check(forest_recall > 0.9, "RP forest recall with 4 trees > 0.9")) goto cleanup;
+
+    // The trees are seeded by their index, so the result depends neither on the threads nor on the
+    // parallelization
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX_other, D_other, 1, MAX_MEMORY_USAGE_RATIO, PAR_OPENMP, 
+        &opts)) goto cleanup;
+    if (!check(memcmp(IDX, IDX_other, N * K * sizeof(int)) == 0 && memcmp(D, D_other, N * K * sizeof(double)) == 0, 
+        "RP forest result is reproducible")) goto cleanup;
+
+    // The first trees of a larger forest are the same, so more trees never lose neighbors
+    opts.num_trees = 8;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX_other, D_other, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS, &opts)) goto cleanup;
+    if (!check(recall(IDX_other, truth, N, K) >= forest_recall, "RP forest recall with 8 trees >= 4 trees")) goto cleanup;
+
+    // Error paths
+    opts.num_trees = 0;
+    if (!check(a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts) == EXIT_FAILURE, "RP forest without trees fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(IDX_other);
+    free(D);
+    free(D_other);
+
+    return status;
+}
+
+
+int test_refine(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20;
+    double *C = NULL, *D = NULL, *D_refined = NULL;
+    int *truth = NULL, *IDX = NULL, *IDX_refined = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 13); if (!C) goto cleanup;
+    truth = exact_neighbors(C, N, N, L, K, 1); if (!truth) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    IDX_refined = (int *)malloc(N * K * sizeof(int)); if (!IDX_refined) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+    D_refined = (double *)malloc(N * K * sizeof(double)); if (!D_refined) goto cleanup;
+
+    // No iteration leaves the result of the cluster search as it is
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.refine_iterations = 0;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX_refined, D_refined, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS, &opts)) goto cleanup;
+    if (!check(memcmp(IDX, IDX_refined, N * K * sizeof(int)) == 0 && memcmp(D, D_refined, N * K * sizeof(double)) == 0, 
+        "result with 0 refine iterations == unrefined result")) goto cleanup;
+
+    // The refinement only swaps neighbors for closer ones
+    double unrefined_recall = recall(IDX, truth, N, K);
+    opts.refine_iterations = 4;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX_refined, D_refined, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, 
+        PAR_PTHREADS, &opts)) goto cleanup;
+    if (!check(valid_rows(IDX_refined, D_refined, N, K), "refined rows are valid")) goto cleanup;
+    for (int i = 0; i < N; i++)
+    {
+        double farthest = 0.0;
+        for (int k = 0; k < K; k++) farthest = fmax(farthest, D[i * K + k]);
+        if (!check(D_refined[i * K + K - 1] <= farthest + TOLERANCE, "refined neighbors are no farther")) goto cleanup;
+    }
+    double refined_recall = recall(IDX_refined, truth, N, K);
+    if (!check(refined_recall >= unrefined_recall, "refined recall >= unrefined recall")) goto cleanup;
+    if (!check(refined_recall > 0.9, "refined recall > 0.9")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    free(C);
+    free(truth);
+    free(IDX);
+    free(IDX_refined);
+    free(D);
+    free(D_refined);
+
+    return status;
+}
+
+
+// Complete event of a trace, in microseconds
+typedef struct
+{
+    int tid;
+    double ts;
+    double dur;
+} traceSpan;
+
+
+// Strict reader of the JSON written by a2a_trace_write, which collects the complete events
+// ("ph":"X") and the number of dropped events on the way
+typedef struct
+{
+    const char *p;
+    traceSpan *spans;
+    int num_spans;
+    int max_spans;
+    double number;                      // Last number read
+    char string[64];                    // Start of the last string read
+    long long dropped;
+} traceReader;
+
+
+int json_value(traceReader *reader);
+
+
+void json_space(traceReader *reader)
+{
+    while (*reader->p == ' ' || *reader->p == '\n' || *reader->p == '\r' || *reader->p == '\t') reader->p++;
+}
+
+
+int json_string(traceReader *reader)
+{
+    if (*reader->p++ != '"') return 0;
+    size_t length = 0;
+    while (*reader->p != '"')
+    {
+        if ((unsigned char)*reader->p < 0x20) return 0;
+        if (*reader->p == '\\' && (*++reader->p == '\0' || !strchr("\"\\/bfnrtu", *reader->p))) return 0;
+        if (length < sizeof(reader->string) - 1) reader->string[length++] = *reader->p;
+        reader->p++;
+    }
+    reader->string[length] = '\0';
+    reader->p++;
+    return 1;
+}
+
+
+int json_number(traceReader *reader)
+{
+    if (*reader->p != '-' && (*reader->p < '0' || *reader->p > '9')) return 0;
+    char *end;
+    reader->number = strtod(reader->p, &end);
+    reader->p = end;
+    return 1;
+}
+
+
+int json_array(traceReader *reader)
+{
+    reader->p++;
+    json_space(reader);
+    if (*reader->p == ']')
+    {
+        reader->p++;
+        return 1;
+    }
+    for (;;)
+    {
+        json_space(reader);
+        if (!json_value(reader)) return 0;
+        json_space(reader);
+        if (*reader->p == ']') break;
+        if (*reader->p++ != ',') return 0;
+    }
+    reader->p++;
+    return 1;
+}
+
+
+int json_object(traceReader *reader)
+{
+    traceSpan span = { -1, -1.0, -1.0 };
+    int complete = 0;
+    reader->p++;
+    json_space(reader);
+    if (*reader->p == '}')
+    {
+        reader->p++;
+        return 1;
+    }
+    for (;;)
+    {
+        char key[sizeof(reader->string)];
+        json_space(reader);
+        if (!json_string(reader)) return 0;
+        strcpy(key, reader->string);
+        json_space(reader);
+        if (*reader->p++ != ':') return 0;
+        json_space(reader);
+        const int is_number = *reader->p != '"' && *reader->p != '{' && *reader->p != '[';
+        if (!json_value(reader)) return 0;
+        if (strcmp(key, "ph") == 0) complete = !is_number && strcmp(reader->string, "X") == 0;
+        else if (is_number && strcmp(key, "tid") == 0) span.tid = (int)reader->number;
+        else if (is_number && strcmp(key, "ts") == 0) span.ts = reader->number;
+        else if (is_number && strcmp(key, "dur") == 0) span.dur = reader->number;
+        else if (is_number && strcmp(key, "dropped_events") == 0) reader->dropped = (long long)reader->number;
+        json_space(reader);
+        if (*reader->p == '}') break;
+        if (*reader->p++ != ',') return 0;
+    }
+    reader->p++;
+    if (!complete) return 1;
+
+    // A complete event has its track, start and duration
+    if (span.tid < 0 || span.ts < 0.0 || span.dur < 0.0) return 0;
+    if (reader->num_spans == reader->max_spans)
+    {
+        reader->max_spans = reader->max_spans ? 2 * reader->max_spans : 256;
+        traceSpan *spans = (traceSpan *)realloc(reader->spans, reader->max_spans * sizeof(traceSpan));
+        if (!spans) return 0;
+        reader->spans = spans;
+    }
+    reader->spans[reader->num_spans++] = span;
+    return 1;
+}
+
+
+int json_literal(traceReader *reader, const char *literal)
+{
+    const size_t length = strlen(literal);
+    if (strncmp(reader->p, literal, length) != 0) return 0;
+    reader->p += length;
+    return 1;
+}
+
+
+int json_value(traceReader *reader)
+{
+    switch (*reader->p)
+    {
+        case '{': return json_object(reader);
+        case '[': return json_array(reader);
+        case '"': return json_string(reader);
+        case 't': return json_literal(reader, "true");
+        case 'f': return json_literal(reader, "false");
+        case 'n': return json_literal(reader, "null");
+        default: return json_number(reader);
+    }
+}
+
+
+// Reads a trace file, EXIT_FAILURE if it is not a single valid JSON value
+int read_trace(const char *path, traceReader *reader)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return EXIT_FAILURE;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = (char *)malloc(size + 1);
+    int status = EXIT_FAILURE;
+    if (text && fread(text, 1, size, file) == (size_t)size)
+    {
+        text[size] = '\0';
+        reader->p = text;
+        json_space(reader);
+        if (json_value(reader))
+        {
+            json_space(reader);
+            if (*reader->p == '\0') status = EXIT_SUCCESS;
+        }
+    }
+    free(text);
+    fclose(file);
+    return status;
+}
+
+
+int compare_spans(const void *a, const void *b)
+{
+    const traceSpan *x = (const traceSpan *)a, *y = (const traceSpan *)b;
+    if (x->tid != y->tid) return x->tid < y->tid ? -1 : 1;
+    if (x->ts != y->ts) return x->ts < y->ts ? -1 : 1;
+    return (x->dur < y->dur) - (x->dur > y->dur);   // The enclosing event first
+}
+
+
+// Whether the events of each track end in the reverse order they begin, as Perfetto nests them.
+// Times are written with 3 decimals, so ends may be off by 2 nanoseconds.
+int spans_nest(traceSpan *spans, int n)
+{
+    const double slack = 0.002;
+    double *ends = (double *)malloc((n > 0 ? n : 1) * sizeof(double));
+    if (!ends) return 0;
+    qsort(spans, n, sizeof(traceSpan), compare_spans);
+    int depth = 0, nested = 1;
+    for (int i = 0; i < n && nested; i++)
+    {
+        if (i > 0 && spans[i].tid != spans[i - 1].tid) depth = 0;
+        while (depth > 0 && ends[depth - 1] <= spans[i].ts + slack) depth--;
+        nested = depth == 0 || spans[i].ts + spans[i].dur <= ends[depth - 1] + slack;
+        ends[depth++] = spans[i].ts + spans[i].dur;
+    }
+    free(ends);
+    return nested;
+}
+
+
+int test_trace(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20, capacity = 4;
+    const char *path = "test_trace.json";
+    double *C = NULL, *D = NULL;
+    int *IDX = NULL;
+    traceReader reader = { NULL, NULL, 0, 0, 0.0, "", -1 };
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 14); if (!C) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+
+    // The trace of a search is valid JSON whose events nest on every track
+    if (a2a_trace_start(0)) goto cleanup;
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    a2a_trace_stop();
+    if (a2a_trace_write(path)) goto cleanup;
+    if (!check(read_trace(path, &reader) == EXIT_SUCCESS, "trace is valid JSON")) goto cleanup;
+    if (!check(reader.num_spans > Kc && reader.dropped == 0, "trace holds every event")) goto cleanup;
+    if (!check(spans_nest(reader.spans, reader.num_spans), "trace events nest")) goto cleanup;
+
+    // A smaller capacity applies to the buffers of the previous trace as well
+    if (a2a_trace_start(capacity)) goto cleanup;
+    if (a2a_annsearch(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS)) goto cleanup;
+    a2a_trace_stop();
+    if (a2a_trace_write(path)) goto cleanup;
+    reader.num_spans = 0;
+    reader.dropped = -1;
+    if (!check(read_trace(path, &reader) == EXIT_SUCCESS, "trace of a small capacity is valid JSON")) goto cleanup;
+    if (!check(reader.dropped > 0, "trace of a small capacity drops events")) goto cleanup;
+    qsort(reader.spans, reader.num_spans, sizeof(traceSpan), compare_spans);
+    for (int i = 0, run = 0; i < reader.num_spans; i++)
+    {
+        run = i > 0 && reader.spans[i].tid == reader.spans[i - 1].tid ? run + 1 : 1;
+        if (!check(run <= capacity, "trace keeps at most the capacity per thread")) goto cleanup;
+    }
+
+    // Error paths
+    if (!check(a2a_trace_start(-1) == EXIT_FAILURE, "trace with a negative capacity fails")) goto cleanup;
+    if (!check(a2a_trace_write("missing/test_trace.json") == EXIT_FAILURE, 
+        "trace written to a missing directory fails")) goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    a2a_trace_stop();
+    remove(path);
+    free(reader.spans);
+    free(C);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+int test_stats(void)
+{
+    const int N = ENGINE_N, L = ENGINE_L, K = ENGINE_K, Kc = 20, M = 300;
+    double *C = NULL, *D = NULL;
+    int *IDX = NULL;
+    FILE *stream = NULL;
+    int status = EXIT_FAILURE;
+
+    C = make_dataset(N, L, 15); if (!C) goto cleanup;
+    IDX = (int *)malloc(N * K * sizeof(int)); if (!IDX) goto cleanup;
+    D = (double *)malloc(N * K * sizeof(double)); if (!D) goto cleanup;
+
+    // Every cluster is searched, with at least one block of the kernel each
+    a2a_stats_t stats;
+    a2a_ann_options_t opts;
+    a2a_ann_options_init(&opts);
+    opts.stats = &stats;
+    if (a2a_annsearch_ex(C, N, L, K, Kc, IDX, D, ENGINE_THREADS, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &opts)) goto cleanup;
+    for (int p = 0; p < A2A_PHASE_COUNT; p++)
+    {
+        const a2a_phase_stats_t *phase = &stats.phases[p];
+        if (!check(phase->wall_seconds >= 0.0 && phase->cpu_seconds >= 0.0 && phase->calls >= 0, 
+            "stats phase times are non-negative")) goto cleanup;
+        if (!check(phase->calls > 0 || phase->wall_seconds == 0.0, "stats phases that did not run take no time")) 
+            goto cleanup;
+    }
+    long long histogram_clusters = 0;
+    for (int b = 0; b < A2A_STATS_HISTOGRAM_BINS; b++) histogram_clusters += stats.cluster_size_histogram[b];
+    if (!check(stats.num_clusters > 0 && histogram_clusters == stats.num_clusters, 
+        "stats histogram counts every cluster")) goto cleanup;
+    if (!check((long)stats.min_cluster_size * stats.num_clusters <= N && 
+        (long)stats.max_cluster_size * stats.num_clusters >= N, "stats cluster sizes add up to N")) goto cleanup;
+    if (!check(stats.phases[A2A_PHASE_CLUSTER_SEARCH].calls == 1 && 
+        stats.phases[A2A_PHASE_GEMM].calls >= stats.num_clusters, "stats count a GEMM per cluster")) goto cleanup;
+    if (!check(stats.nthreads >= 1 && stats.nthreads <= ENGINE_THREADS, "stats threads <= threads of the search")) 
+        goto cleanup;
+    for (int t = 0; t < stats.nthreads; t++)
+    {
+        if (!check(stats.busy_seconds[t] >= 0.0 && stats.idle_seconds[t] >= 0.0, 
+            "stats thread times are non-negative")) goto cleanup;
+    }
+    if (!check(stats.peak_bytes > 0 && stats.peak_bytes <= stats.bytes_allocated, 
+        "stats peak memory <= allocated memory")) goto cleanup;
+
+    // The printed stats name the phases
+    stream = tmpfile(); if (!stream) goto cleanup;
+    a2a_stats_print(&stats, stream);
+    char line[256];
+    int named = 0;
+    rewind(stream);
+    while (fgets(line, sizeof(line), stream))
+    {
+        named |= strstr(line, a2a_stats_phase_name(A2A_PHASE_CLUSTER_SEARCH)) != NULL;
+    }
+    if (!check(named, "stats print the phases")) goto cleanup;
+    if (!check(strcmp(a2a_stats_phase_name(A2A_PHASE_COUNT), "unknown") == 0, "stats name an unknown phase")) 
+        goto cleanup;
+
+    // The blocks of the kNN search are computed and selected once each, and go through the queue
+    if (a2a_knnsearch_ex(C, C, IDX, D, M, N, L, K, 0, ENGINE_THREADS, 1, MAX_MEMORY_USAGE_RATIO, PAR_PTHREADS, 
+        &stats)) goto cleanup;
+    if (!check(stats.phases[A2A_PHASE_GEMM].calls >= 1 && 
+        stats.phases[A2A_PHASE_SELECTION].calls == stats.phases[A2A_PHASE_GEMM].calls, 
+        "stats select every GEMM block once")) goto cleanup;
+    if (!check(stats.num_clusters == 0 && stats.phases[A2A_PHASE_CLUSTER_SEARCH].calls == 0, 
+        "stats are reset by the next search")) goto cleanup;
+    if (!check(stats.queue_tasks >= 1 && stats.queue_wait_seconds >= 0.0, "stats count the queued tasks")) 
+        goto cleanup;
+
+    status = EXIT_SUCCESS;
+
+cleanup:
+    if (stream) fclose(stream);
+    free(C);
+    free(IDX);
+    free(D);
+
+    return status;
+}
+
+
+// Tests of the engines on synthetic data, run after the test files
+struct
+{
+    const char *name;
+    int (*run)(void);
+} engine_tests[] = {
+    { "IVF index", test_ivf },
+    { "NN-descent", test_nndescent },
+    { "HNSW index", test_hnsw },
+    { "Product quantization", test_pq },
+    { "Updatable kNN graph", test_graph },
+    { "Kc tuner", test_tune },
+    { "Sharded search", test_shard },
+    { "Recall evaluation", test_eval },
+    { "Memory budget", test_memory_budget },
+    { "Permuted data", test_permute_data },
+    { "Two-level k-means", test_coarse_clusters },
+    { "Random projection forest", test_rp_forest },
+    { "NN-descent refinement", test_refine },
+    { "Trace", test_trace },
+    { "Search stats", test_stats },
+};
+
+
+void print_result(int status, size_t *cnt_passed)
+{
+    if (status == EXIT_SUCCESS) {
+        setColor(BOLD_GREEN);
+        printf("Passed\n");
+        (*cnt_passed)++;
+        setColor(DEFAULT);
+    }
+    else {
+        setColor(BOLD_RED);
+        printf("Failed\n");
+        setColor(DEFAULT);
+    }
+}
+
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) 
@@ -126,30 +1524,27 @@ int main(int argc, char *argv[])
     }
 
     for (size_t i = 0; i < test_cnt; i++) {
+        print_result(test_case(file_paths[i], TOLERANCE), &cnt_passed);
+    }
 
-        if (test_case(file_paths[i], TOLERANCE) == EXIT_SUCCESS) {
-            setColor(BOLD_GREEN);
-            printf("Passed\n");
-            cnt_passed++;
-            setColor(DEFAULT);
-        }
-        else {
-            setColor(BOLD_RED);
-            printf("Failed\n");
-            setColor(DEFAULT);
-        }
+    size_t engine_cnt = sizeof(engine_tests) / sizeof(engine_tests[0]);
+    for (size_t i = 0; i < engine_cnt; i++) {
+        setColor(BOLD_BLUE);
+        printf("Running test %s ...\n", engine_tests[i].name);
+        setColor(DEFAULT);
+        print_result(engine_tests[i].run(), &cnt_passed);
     }
 
-    if (cnt_passed == test_cnt) {
+    if (cnt_passed == test_cnt + engine_cnt) {
         setColor(BOLD_GREEN);
         printf("\n==========================\n");
-        printf("All tests passed (%zu/%zu)\n", cnt_passed, test_cnt);
+        printf("All tests passed (%zu/%zu)\n", cnt_passed, test_cnt + engine_cnt);
         setColor(DEFAULT);
         status = EXIT_SUCCESS;
     }
     else {
         printf("\n==========================\n");
-        printf("Tests passed: %zu/%zu\n", cnt_passed, test_cnt);
+        printf("Tests passed: %zu/%zu\n", cnt_passed, test_cnt + engine_cnt);
     }
 
 
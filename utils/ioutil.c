@@ -214,6 +214,116 @@ int store_hdf5(const void* mat, const char* matname, int rows, int cols, const c
 }
 
 
+static hid_t native_type(MATRIX_TYPE type) {
+    switch (type) {
+        case DOUBLE_TYPE: return H5T_NATIVE_DOUBLE;
+        case FLOAT_TYPE: return H5T_NATIVE_FLOAT;
+        case INT_TYPE: return H5T_NATIVE_INT;
+        default: return -1;
+    }
+}
+
+
+int exists_hdf5(const char *filename, const char *matname) {
+    // Silence the errors of a missing file
+    H5E_auto2_t handler;
+    void *handler_data;
+    H5Eget_auto2(H5E_DEFAULT, &handler, &handler_data);
+    H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+
+    int exists = 0;
+    hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id >= 0) {
+        exists = H5Lexists(file_id, matname, H5P_DEFAULT) > 0;
+        H5Fclose(file_id);
+    }
+
+    H5Eset_auto2(H5E_DEFAULT, handler, handler_data);
+    return exists;
+}
+
+
+int create_hdf5(const char* matname, int rows, int cols, int chunk_rows, const char *filename, MATRIX_TYPE type) {
+    const hid_t dtype = native_type(type);
+    if (dtype < 0 || rows < 1 || cols < 1 || chunk_rows < 1) {
+        fprintf(stderr, "Error: Invalid matrix '%s' (%d x %d, chunks of %d rows).\n", matname, rows, cols, chunk_rows);
+        return EXIT_FAILURE;
+    }
+
+    hid_t file_id = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+    if (file_id < 0) file_id = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file_id < 0) {
+        fprintf(stderr, "Error opening or creating HDF5 file '%s'.\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    if (H5Lexists(file_id, matname, H5P_DEFAULT) > 0) {
+        fprintf(stderr, "Dataset '%s' already exists. Deleting it.\n", matname);
+        H5Ldelete(file_id, matname, H5P_DEFAULT);
+    }
+
+    hsize_t dims[2] = { rows, cols };
+    hsize_t chunk[2] = { MIN(chunk_rows, rows), cols };
+    hid_t dataspace_id = H5Screate_simple(2, dims, NULL);
+    hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
+    hid_t dset_id = -1;
+    if (dataspace_id >= 0 && plist_id >= 0 && H5Pset_chunk(plist_id, 2, chunk) >= 0) {
+        if (H5Zfilter_avail(H5Z_FILTER_DEFLATE) > 0) H5Pset_deflate(plist_id, 5);
+        dset_id = H5Dcreate(file_id, matname, dtype, dataspace_id, H5P_DEFAULT, plist_id, H5P_DEFAULT);
+    }
+    if (dset_id < 0) fprintf(stderr, "Error creating dataset '%s'.\n", matname);
+
+    // Cleanup
+    if (dset_id >= 0) H5Dclose(dset_id);
+    if (plist_id >= 0) H5Pclose(plist_id);
+    if (dataspace_id >= 0) H5Sclose(dataspace_id);
+    H5Fclose(file_id);
+
+    return dset_id >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+int write_hdf5_rows(const void* mat, const char* matname, int row_offset, int rows, int cols, const char *filename,
+    MATRIX_TYPE type) {
+
+    const hid_t dtype = native_type(type);
+    if (!mat || dtype < 0) {
+        fprintf(stderr, "Error: Invalid block of dataset '%s'.\n", matname);
+        return EXIT_FAILURE;
+    }
+
+    hid_t file_id = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+    if (file_id < 0) {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    hid_t dset_id = H5Dopen(file_id, matname, H5P_DEFAULT);
+    hid_t filespace_id = dset_id >= 0 ? H5Dget_space(dset_id) : -1;
+    hsize_t offset[2] = { row_offset, 0 };
+    hsize_t count[2] = { rows, cols };
+    hid_t memspace_id = H5Screate_simple(2, count, NULL);
+
+    if (filespace_id >= 0 && memspace_id >= 0 &&
+        H5Sselect_hyperslab(filespace_id, H5S_SELECT_SET, offset, NULL, count, NULL) >= 0 &&
+        H5Dwrite(dset_id, dtype, memspace_id, filespace_id, H5P_DEFAULT, mat) >= 0) {
+        status = EXIT_SUCCESS;
+    }
+    else {
+        fprintf(stderr, "Error writing rows %d to %d of dataset '%s'.\n", row_offset, row_offset + rows - 1, matname);
+    }
+
+    // Cleanup
+    if (memspace_id >= 0) H5Sclose(memspace_id);
+    if (filespace_id >= 0) H5Sclose(filespace_id);
+    if (dset_id >= 0) H5Dclose(dset_id);
+    H5Fclose(file_id);
+
+    return status;
+}
+
+
 void print_matrix(const void* mat, const char* name, int rows, int cols, MATRIX_TYPE type)
 {
     printf("\n%s:\n", name);
@@ -39,6 +39,48 @@ void* load_hdf5(const char *filename, const char* matname, int* rows, int* cols)
 int store_hdf5(const void* mat, const char* matname, int rows, int cols, const char *filename, MATRIX_TYPE type, const char mode);
 
 
+/**
+ * Checks if a matrix exists in a .hdf5 file.
+ *
+ * @param filename the name of the file
+ * @param matname the name of the matrix
+ * @return 1 if the file holds the matrix and 0 otherwise, also if the file does not exist
+ */
+int exists_hdf5(const char *filename, const char *matname);
+
+
+/**
+ * Creates an empty 2D matrix in a .hdf5 file, stored in chunks of chunk_rows rows compressed
+ * with gzip when the library supports it, to be filled block by block with write_hdf5_rows.
+ * The file is created if it does not exist and a matrix with the same name is replaced.
+ *
+ * @param matname the name of the matrix
+ * @param rows the number of rows of the matrix
+ * @param cols the number of columns of the matrix
+ * @param chunk_rows the number of rows of each chunk
+ * @param filename the name of the file
+ * @param type the data type of the matrix
+ * @return EXIT_SUCCESS if successful, otherwise EXIT_FAILURE.
+ */
+int create_hdf5(const char* matname, int rows, int cols, int chunk_rows, const char *filename, MATRIX_TYPE type);
+
+
+/**
+ * Writes a block of consecutive rows of a matrix created with create_hdf5.
+ *
+ * @param mat the rows (rows x cols)
+ * @param matname the name of the matrix
+ * @param row_offset the index of the first row of the block in the matrix
+ * @param rows the number of rows of the block
+ * @param cols the number of columns of the matrix
+ * @param filename the name of the file
+ * @param type the data type of the matrix
+ * @return EXIT_SUCCESS if successful, otherwise EXIT_FAILURE.
+ */
+int write_hdf5_rows(const void* mat, const char* matname, int row_offset, int rows, int cols, const char *filename,
+    MATRIX_TYPE type);
+
+
 /**
  * Prints the matrix to standard output. Supports double and int data types.
  * 
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "memory_usage.h"
+
+
+int peak_rss_reset(void) {
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (!file) return -1;
+
+    // "5" resets the peak resident set size
+    const int written = fputs("5", file) >= 0;
+    return fclose(file) == 0 && written ? 0 : -1;
+}
+
+
+long long peak_rss_bytes(void) {
+    char line[256];
+    long long kb = -1;
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file) {
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "VmHWM:", 6) == 0 && sscanf(line + 6, "%lld", &kb) == 1) break;
+        }
+        fclose(file);
+    }
+    if (kb >= 0) return kb * 1024;
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    return (long long)usage.ru_maxrss * 1024;  // Kilobytes on Linux
+}
@@ -0,0 +1,24 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+
+/**
+ * Resets the peak resident set size of the process to its current size, so that
+ * peak_rss_bytes measures the next search alone. Needs Linux 4.0 or later; on failure the
+ * peak keeps covering the whole run.
+ *
+ * @return 0 if the peak was reset and -1 otherwise
+ */
+int peak_rss_reset(void);
+
+
+/**
+ * Returns the peak resident set size of the process since the start or the last
+ * peak_rss_reset, in bytes (VmHWM of /proc/self/status, or ru_maxrss if unavailable).
+ *
+ * @return the peak, or -1 if it cannot be read
+ */
+long long peak_rss_bytes(void);
+
+
+#endif
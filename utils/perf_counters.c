@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "ioutil.h"
+#include "perf_counters.h"
+
+
+// Counters of a thread and their values at the start of each phase
+typedef struct {
+    int fds[PERF_NUM_COUNTERS];
+    long long begin[A2A_PHASE_COUNT][PERF_NUM_COUNTERS];
+    int running[A2A_PHASE_COUNT];
+} ThreadCounters;
+
+
+static const char *counter_names[PERF_NUM_COUNTERS] = { "cycles", "instructions", "llc_misses", "dtlb_misses" };
+
+static int available[PERF_NUM_COUNTERS];
+static int enabled = 0;
+static atomic_llong totals[A2A_PHASE_COUNT][PERF_NUM_COUNTERS];
+static _Thread_local ThreadCounters *local = NULL;
+static pthread_key_t close_key;
+static pthread_once_t close_once = PTHREAD_ONCE_INIT;
+
+// Elapsed time of each phase: the time during which at least one thread ran it
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+static int span_threads[A2A_PHASE_COUNT];
+static long long span_begin_ns[A2A_PHASE_COUNT];
+static long long span_ns[A2A_PHASE_COUNT];
+
+// Results of the stored searches: the counters, the phase times and the bandwidth
+static double results[PERF_NUM_COUNTERS + 2][PERF_MAX_ROWS * A2A_PHASE_COUNT];
+
+
+static int open_counter(int counter) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    switch (counter) {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        default:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+    }
+
+    // Count the calling thread on any CPU
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static void close_counters(void *arg) {
+    ThreadCounters *counters = (ThreadCounters *)arg;
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        if (counters->fds[c] >= 0) close(counters->fds[c]);
+    }
+    free(counters);
+}
+
+
+static void create_close_key(void) {
+    pthread_key_create(&close_key, close_counters);
+}
+
+
+// Opens the counters of the calling thread on its first phase
+static ThreadCounters *thread_counters(void) {
+    if (local) return local;
+
+    pthread_once(&close_once, create_close_key);
+    local = (ThreadCounters *)calloc(1, sizeof(ThreadCounters));
+    if (!local) return NULL;
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        local->fds[c] = available[c] ? open_counter(c) : -1;
+    }
+    pthread_setspecific(close_key, local);
+
+    return local;
+}
+
+
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// Counts a thread in or out of a phase, the phase elapsing while any thread runs it
+static void track_span(a2a_phase_t phase, int begin) {
+    const long long now = monotonic_ns();
+    pthread_mutex_lock(&span_lock);
+    if (begin) {
+        if (span_threads[phase]++ == 0) span_begin_ns[phase] = now;
+    }
+    else if (--span_threads[phase] == 0) {
+        span_ns[phase] += now - span_begin_ns[phase];
+    }
+    pthread_mutex_unlock(&span_lock);
+}
+
+
+static void phase_hook(a2a_phase_t phase, int begin, void *arg) {
+    (void)arg;
+    ThreadCounters *counters = thread_counters();
+    if (!counters) return;
+
+    long long values[PERF_NUM_COUNTERS];
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        values[c] = -1;
+        if (counters->fds[c] >= 0 && read(counters->fds[c], &values[c], sizeof(long long)) != sizeof(long long)) {
+            values[c] = -1;
+        }
+    }
+
+    if (begin) {
+        memcpy(counters->begin[phase], values, sizeof(values));
+        counters->running[phase] = 1;
+        track_span(phase, 1);
+        return;
+    }
+    if (!counters->running[phase]) return;
+    counters->running[phase] = 0;
+    track_span(phase, 0);
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        if (values[c] >= 0 && counters->begin[phase][c] >= 0) {
+            atomic_fetch_add_explicit(&totals[phase][c], values[c] - counters->begin[phase][c], memory_order_relaxed);
+        }
+    }
+}
+
+
+int perf_counters_start(void) {
+    int num_available = 0;
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        const int fd = open_counter(c);
+        available[c] = fd >= 0;
+        if (fd >= 0) {
+            close(fd);
+            num_available++;
+        }
+        else fprintf(stderr, "Hardware counter %s is not available\n", counter_names[c]);
+    }
+    if (num_available == 0) {
+        fprintf(stderr, "No hardware counter is available, running without counters\n");
+        return 0;
+    }
+
+    for (int p = 0; p < A2A_PHASE_COUNT; p++) {
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) atomic_store(&totals[p][c], 0);
+    }
+    pthread_mutex_lock(&span_lock);
+    memset(span_ns, 0, sizeof(span_ns));
+    pthread_mutex_unlock(&span_lock);
+    enabled = 1;
+    a2a_stats_set_phase_hook(phase_hook, NULL);
+
+    return 1;
+}
+
+
+void perf_counters_stop(void) {
+    a2a_stats_set_phase_hook(NULL, NULL);
+    enabled = 0;
+}
+
+
+int perf_counters_enabled(void) {
+    return enabled;
+}
+
+
+void perf_counters_collect(double *values) {
+    for (int p = 0; p < A2A_PHASE_COUNT; p++) {
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+            const long long count = atomic_exchange(&totals[p][c], 0);
+            values[p * PERF_NUM_COUNTERS + c] = available[c] ? (double)count : -1.0;
+        }
+    }
+}
+
+
+int perf_counters_store(int row, const char *suffix, const char *output_file) {
+    if (row < 0 || row >= PERF_MAX_ROWS) {
+        fprintf(stderr, "Error: Too many searches to store their hardware counters (%d).\n", row + 1);
+        return EXIT_FAILURE;
+    }
+
+    double values[A2A_PHASE_COUNT * PERF_NUM_COUNTERS];
+    perf_counters_collect(values);
+
+    // The misses of all the threads of a phase are divided by its elapsed time, not by the time
+    // of its threads added up
+    long long elapsed_ns[A2A_PHASE_COUNT];
+    pthread_mutex_lock(&span_lock);
+    memcpy(elapsed_ns, span_ns, sizeof(span_ns));
+    memset(span_ns, 0, sizeof(span_ns));
+    pthread_mutex_unlock(&span_lock);
+
+    for (int p = 0; p < A2A_PHASE_COUNT; p++) {
+        const double seconds = elapsed_ns[p] * 1e-9;
+        const double misses = values[p * PERF_NUM_COUNTERS + PERF_LLC_MISSES];
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+            results[c][row * A2A_PHASE_COUNT + p] = values[p * PERF_NUM_COUNTERS + c];
+        }
+        results[PERF_NUM_COUNTERS][row * A2A_PHASE_COUNT + p] = seconds;
+        results[PERF_NUM_COUNTERS + 1][row * A2A_PHASE_COUNT + p] = misses >= 0 && seconds > 0 ?
+            misses * PERF_CACHE_LINE_BYTES / seconds / 1e9 : -1.0;
+    }
+
+    char name[64];
+    for (int m = 0; m < PERF_NUM_COUNTERS + 2; m++) {
+        const char *metric = m < PERF_NUM_COUNTERS ? counter_names[m] :
+            (m == PERF_NUM_COUNTERS ? "phase_seconds" : "llc_bandwidth_gbps");
+        snprintf(name, sizeof(name), suffix[0] ? "%s_%s" : "%s%s", metric, suffix);
+        if (store_hdf5(results[m], name, row + 1, A2A_PHASE_COUNT, output_file, DOUBLE_TYPE, 'a')) {
+            fprintf(stderr, "Error storing %s data.\n", name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
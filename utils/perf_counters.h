@@ -0,0 +1,64 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include "a2a_stats.h"
+
+#define PERF_NUM_COUNTERS 4        // Number of hardware counters per phase
+#define PERF_MAX_ROWS 64           // Maximum number of searches stored by perf_counters_store
+#define PERF_CACHE_LINE_BYTES 64   // Bytes moved from memory per last level cache miss
+
+typedef enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_DTLB_MISSES } PERF_COUNTER;
+
+
+/**
+ * Starts counting cycles, instructions, last level cache misses and data TLB misses
+ * in user space for every phase of the searches (see a2a_phase_t), with perf_event_open
+ * on each thread that runs a phase. Counters the kernel refuses, e.g. in containers
+ * or with a strict perf_event_paranoid, are reported as unavailable and the others
+ * are still counted. Threads that already exist when counting starts and run no phase, such
+ * as those of OpenBLAS, are not counted: use one BLAS thread for complete counts.
+ *
+ * @return 1 if at least one counter is available and 0 otherwise
+ */
+int perf_counters_start(void);
+
+
+/**
+ * Stops counting.
+ */
+void perf_counters_stop(void);
+
+
+/**
+ * Returns non-zero between a successful perf_counters_start and perf_counters_stop.
+ */
+int perf_counters_enabled(void);
+
+
+/**
+ * Returns the counts since the previous call and clears them.
+ *
+ * @param values stores the count of counter c in phase p at values[p * PERF_NUM_COUNTERS + c],
+ * or -1 if the counter is unavailable
+ */
+void perf_counters_collect(double *values);
+
+
+/**
+ * Collects the counters of the last search and stores them in row `row` of one matrix
+ * per counter in the output file, next to the other results of the benchmark. The matrices
+ * have one column per phase and are named <counter>_<suffix>, or <counter> if the suffix
+ * is empty: cycles, instructions, llc_misses and dtlb_misses. Two more matrices hold the
+ * elapsed time of each phase, during which at least one thread ran it (phase_seconds_<suffix>),
+ * and the memory bandwidth estimated from the cache misses over that time
+ * (llc_bandwidth_gbps_<suffix>). Rows 0 to row are written.
+ *
+ * @param row the index of the search, below PERF_MAX_ROWS
+ * @param suffix the suffix of the matrix names
+ * @param output_file the name of the output file
+ * @return EXIT_SUCCESS if successful, otherwise EXIT_FAILURE
+ */
+int perf_counters_store(int row, const char *suffix, const char *output_file);
+
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "a2a_parallel.h"
+#include "synthetic.h"
+
+
+typedef struct {
+    DTYPE *C;
+    long begin;
+    long end;
+    const synthetic_params_t *params;
+    const DTYPE *centers;
+} SyntheticTask;
+
+
+static const char *type_names[] = { "gaussian", "uniform", "duplicates" };
+
+
+// Seed of the generator of a point, so that the points do not depend on the number of workers
+static unsigned int point_seed(const unsigned int seed, const long i) {
+    unsigned long long x = (unsigned long long)i + 0x9E3779B97F4A7C15ULL * (seed + 1);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (unsigned int)(x ^ (x >> 31));
+}
+
+
+static double uniform(unsigned int *seed) {
+    return (rand_r(seed) + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+
+static double gaussian(unsigned int *seed) {
+    return sqrt(-2.0 * log(uniform(seed))) * cos(2.0 * M_PI * uniform(seed));
+}
+
+
+static int syntheticTaskExec(void *arg) {
+    const SyntheticTask *task = (const SyntheticTask *)arg;
+    const synthetic_params_t *params = task->params;
+    const int L = params->L;
+
+    for (long i = task->begin; i < task->end; i++) {
+        DTYPE *point = task->C + (size_t)i * L;
+        unsigned int seed = point_seed(params->seed, i);
+        switch (params->type) {
+            case SYNTHETIC_GAUSSIAN: {
+                const DTYPE *center = task->centers + (size_t)(rand_r(&seed) % params->centers) * L;
+                for (int l = 0; l < L; l++) point[l] = center[l] + (DTYPE)(params->spread * gaussian(&seed));
+                break;
+            }
+            case SYNTHETIC_UNIFORM:
+                for (int l = 0; l < L; l++) point[l] = (DTYPE)uniform(&seed);
+                break;
+            case SYNTHETIC_DUPLICATES: {
+                // Copy of one of the first i / duplicates + 1 distinct points, so that every prefix
+                // of the data has about the same number of copies per point
+                const long distinct = i / params->duplicates + 1;
+                unsigned int base_seed = point_seed(params->seed, rand_r(&seed) % distinct);
+                for (int l = 0; l < L; l++) point[l] = (DTYPE)uniform(&base_seed);
+                break;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void synthetic_params_init(synthetic_params_t *params) {
+    params->type = SYNTHETIC_GAUSSIAN;
+    params->L = 32;
+    params->centers = 100;
+    params->spread = 0.05;
+    params->duplicates = 10;
+    params->seed = 1;
+}
+
+
+const char *synthetic_type_name(SYNTHETIC_TYPE type) {
+    if ((int)type < 0 || type > SYNTHETIC_DUPLICATES) return "unknown";
+    return type_names[type];
+}
+
+
+DTYPE *generate_synthetic(const synthetic_params_t *params, const long N) {
+    DTYPE *C = NULL, *centers = NULL;
+    SyntheticTask tasks[SYNTHETIC_WORKERS];
+    if (N < 1 || params->L < 1 || params->centers < 1 || params->duplicates < 1) goto fail;
+
+    C = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)N * params->L);
+    if (!C) goto fail;
+
+    if (params->type == SYNTHETIC_GAUSSIAN) {
+        centers = (DTYPE *)malloc(sizeof(DTYPE) * (size_t)params->centers * params->L);
+        if (!centers) goto fail;
+        unsigned int seed = point_seed(~params->seed, 0);
+        for (long i = 0; i < (long)params->centers * params->L; i++) centers[i] = (DTYPE)uniform(&seed);
+    }
+
+    const int nworkers = N < SYNTHETIC_WORKERS ? (int)N : SYNTHETIC_WORKERS;
+    for (int w = 0; w < nworkers; w++) {
+        tasks[w].C = C;
+        tasks[w].begin = N * w / nworkers;
+        tasks[w].end = N * (w + 1) / nworkers;
+        tasks[w].params = params;
+        tasks[w].centers = centers;
+    }
+    if (a2a_ParallelRun(syntheticTaskExec, tasks, sizeof(SyntheticTask), nworkers, PAR_PTHREADS)) goto fail;
+
+    free(centers);
+    return C;
+
+fail:
+    fprintf(stderr, "Error generating %ld %s points of dimension %d\n", N, synthetic_type_name(params->type), params->L);
+    free(centers);
+    free(C);
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "a2a_config.h"
+
+#define SYNTHETIC_WORKERS 64           // Workers that generate the points
+
+typedef enum { SYNTHETIC_GAUSSIAN, SYNTHETIC_UNIFORM, SYNTHETIC_DUPLICATES } SYNTHETIC_TYPE;
+
+
+/**
+ * Parameters of a synthetic dataset
+ */
+typedef struct {
+    SYNTHETIC_TYPE type;
+    int L;                             // Dimension of the points
+    int centers;                       // Centers of the Gaussian mixture, uniform in [0, 1)^L
+    double spread;                     // Standard deviation of the Gaussian clusters
+    int duplicates;                    // Average number of copies of each point of the duplicate-heavy data
+    unsigned int seed;
+} synthetic_params_t;
+
+
+/**
+ * Fills the parameters with their defaults: 100 Gaussian clusters of standard deviation 0.05
+ * in dimension 32, 10 copies per point for the duplicate-heavy data and seed 1.
+ *
+ * @param params the parameters to initialize
+ */
+void synthetic_params_init(synthetic_params_t *params);
+
+
+/**
+ * Returns the name of a type of data: gaussian, uniform or duplicates.
+ *
+ * @param type the type of data
+ * @return the name, or "unknown"
+ */
+const char *synthetic_type_name(SYNTHETIC_TYPE type);
+
+
+/**
+ * Generates N points in parallel. Each point depends only on the seed and its index, so the
+ * points of a smaller N are a prefix of those of a larger one. Duplicate-heavy points copy one
+ * of the distinct uniform points before them.
+ *
+ * @param params the parameters of the data
+ * @param N the number of points
+ * @return the points (N x L), to be freed by the caller, or NULL if an error occured
+ */
+DTYPE *generate_synthetic(const synthetic_params_t *params, const long N);
+
+
+#endif